@@ -3,6 +3,7 @@
 #include "memory.h"
 #include "logging.h"
 #include "alloc.h"
+#include "stream.h"
 #include "ppu.h"
 
 #include <string.h>
@@ -796,6 +797,7 @@ uint64_t cpu_step(Cpu* cpu)
 {
     if (cpu->stall > 0) {
         cpu->stall--;
+        cpu->ticks++;
         return 1;
     }
 
@@ -890,7 +892,20 @@ uint64_t cpu_step(Cpu* cpu)
 
     HandlerData hd = {.addr = addr, .PC = cpu->PC, .mode = amode};
     opcode_handlers[opcode](cpu, &hd);
-    return cpu->cycles - prev_cycles;
+
+    uint64_t elapsed = cpu->cycles - prev_cycles;
+    cpu->ticks += elapsed;
+    return elapsed;
+}
+
+uint64_t cpu_run(Cpu* cpu)
+{
+    // at least one instruction (or stall cycle) is always executed
+    uint64_t start = cpu->ticks;
+    do {
+        cpu_step(cpu);
+    } while (cpu->ticks < cpu->deadline);
+    return cpu->ticks - start;
 }
 
 uint16_t cpu_next_instr_address(Cpu* cpu, uint16_t addr)
@@ -1027,25 +1042,29 @@ const char* cpu_tostring(Cpu* cpu)
     return res;
 }
 
-void cpu_serialize(Cpu* cpu, FILE* ofile)
+void cpu_serialize(Cpu* cpu, Writer* w)
 {
     // NOTE: memory is not serialized.. It is fine for NES, but it does not work
     // for standalone CPU builds
-    Buffer res = {.buffer = (uint8_t*)cpu, .size = sizeof(Cpu)};
-    dump_buffer(&res, ofile);
-}
-
-void cpu_deserialize(Cpu* cpu, FILE* ifile)
-{
-    Buffer buf = read_buffer(ifile);
-    if (buf.size != sizeof(Cpu))
-        panic("cpu_deserialize(): invalid buffer");
-
-    void* tmp_sys = cpu->sys;
-    void* tmp_mem = cpu->mem;
-
-    memcpy(cpu, buf.buffer, buf.size);
-    cpu->sys = tmp_sys;
-    cpu->mem = tmp_mem;
-    free_or_fail(buf.buffer);
+    //
+    // The pointers and the deadline (it belongs to the scheduler) are written
+    // as zeros: the state does not leak the addresses of the host, and it is
+    // the same on every machine
+    Cpu tmp      = *cpu;
+    tmp.sys      = NULL;
+    tmp.mem      = NULL;
+    tmp.deadline = 0;
+    write_section(w, &tmp, sizeof(Cpu));
+}
+
+void cpu_deserialize(Cpu* cpu, Reader* r)
+{
+    void*    tmp_sys      = cpu->sys;
+    void*    tmp_mem      = cpu->mem;
+    uint64_t tmp_deadline = cpu->deadline;
+
+    read_section(r, cpu, sizeof(Cpu), "cpu_deserialize()");
+    cpu->sys      = tmp_sys;
+    cpu->mem      = tmp_mem;
+    cpu->deadline = tmp_deadline;
 }
@@ -7,6 +7,8 @@
 struct Memory;
 struct System;
 struct Buffer;
+struct Writer;
+struct Reader;
 
 typedef struct Cpu {
     struct System* sys;
@@ -36,6 +38,13 @@ typedef struct Cpu {
     uint64_t cycles;
     uint8_t  interrupt;
     uint32_t stall;
+
+    // master clock: elapsed CPU cycles, stall cycles included. While an
+    // instruction is being executed it holds the cycle at which it started
+    uint64_t ticks;
+    // cpu_run() and cpu_run_threaded() stop at the first instruction boundary
+    // where ticks >= deadline. It can be lowered while they are running
+    uint64_t deadline;
 } Cpu;
 
 Cpu* cpu_build(struct System* sys);
@@ -44,9 +53,16 @@ void cpu_destroy(Cpu* cpu);
 
 void     cpu_reset(Cpu* cpu);
 uint64_t cpu_step(Cpu* cpu);
+uint64_t cpu_run(Cpu* cpu);
 void     cpu_trigger_nmi(Cpu* cpu);
 void     cpu_trigger_irq(Cpu* cpu);
 
+// Threaded-dispatch core (6502_cpu_threaded.c). cpu_step_threaded() executes
+// exactly what cpu_step() would, cpu_run_threaded() is the equivalent of
+// cpu_run(). All of them return the number of elapsed cycles
+uint64_t cpu_step_threaded(Cpu* cpu);
+uint64_t cpu_run_threaded(Cpu* cpu);
+
 uint16_t cpu_next_instr_address(Cpu* cpu, uint16_t addr);
 
 // NB: the following functions will return a temporary buffer, every new call to
@@ -55,7 +71,7 @@ const char* cpu_disassemble(Cpu* cpu, uint16_t addr);
 const char* cpu_tostring(Cpu* cpu);
 const char* cpu_tostring_short(Cpu* cpu);
 
-void cpu_serialize(Cpu* cpu, FILE* ofile);
-void cpu_deserialize(Cpu* cpu, FILE* ifile);
+void cpu_serialize(Cpu* cpu, struct Writer* w);
+void cpu_deserialize(Cpu* cpu, struct Reader* r);
 
 #endif
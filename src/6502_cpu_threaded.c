@@ -0,0 +1,472 @@
+#include "6502_cpu.h"
+#include "6502_opcodes.h"
+#include "memory.h"
+#include "logging.h"
+
+// Threaded-dispatch CPU core.
+//
+// Every opcode of CPU_OPCODES gets its own fused handler: the addressing mode,
+// the instruction size and the cycle counts are compile-time constants of the
+// handler, so there are no table lookups, no switch on the addressing mode and
+// no indirect call per instruction. At the end of every handler the next
+// opcode is fetched and we jump directly to its handler (computed goto).
+//
+// The table-driven cpu_step() is the reference implementation: after every
+// instruction both cores must leave the Cpu in exactly the same state (see
+// tools/cpu_bench.c, that diffs them).
+
+#define NMI_VECTOR_ADDR     0xFFFAu
+#define IRQ_BRK_VECTOR_ADDR 0xFFFEu
+
+#define INT_NMI 1
+#define INT_IRQ 2
+
+// The registers, the flags, the cycle counters and the deadline live in
+// locals of cpu_run_threaded() while it runs, and are written back to the Cpu
+// when it returns. An access that goes through the slow path of the bus first
+// stores what the devices read (Cpu::ticks to catch up, Cpu::cycles for the
+// OAM DMA, the I flag to accept an IRQ), and reloads the deadline after it: a
+// device can move it, raise an interrupt or stall the CPU
+#define GET_FLAGS()                                                            \
+    ((uint8_t)(C | (Z << 1) | (I << 2) | (D << 3) | BU | (V << 6) | (N << 7)))
+#define SET_FLAGS(f)                                                           \
+    do {                                                                       \
+        uint8_t f_ = (f);                                                      \
+        C          = f_ & 1;                                                   \
+        Z          = (f_ >> 1) & 1;                                            \
+        I          = (f_ >> 2) & 1;                                            \
+        D          = (f_ >> 3) & 1;                                            \
+        BU         = f_ & 0x30;                                                \
+        V          = (f_ >> 6) & 1;                                            \
+        N          = f_ >> 7;                                                  \
+    } while (0)
+
+#define SAVE_STATE()                                                           \
+    do {                                                                       \
+        cpu->PC       = PC;                                                    \
+        cpu->SP       = SP;                                                    \
+        cpu->A        = A;                                                     \
+        cpu->X        = X;                                                     \
+        cpu->Y        = Y;                                                     \
+        cpu->flags    = GET_FLAGS();                                           \
+        cpu->cycles   = cycles;                                                \
+        cpu->ticks    = ticks;                                                 \
+        cpu->deadline = deadline;                                              \
+    } while (0)
+
+#define SAVE_BUS_STATE()                                                       \
+    do {                                                                       \
+        cpu->cycles = cycles;                                                  \
+        cpu->ticks  = ticks;                                                   \
+        cpu->I      = I;                                                       \
+    } while (0)
+
+#define RELOAD_EVENTS()                                                        \
+    do {                                                                       \
+        deadline = cpu->deadline;                                              \
+        pending  = cpu->stall || cpu->interrupt;                               \
+    } while (0)
+
+#define READ(a)                                                                \
+    ({                                                                         \
+        uint16_t ra_   = (a);                                                  \
+        uint8_t* page_ = mem->read_pages[ra_ >> 8];                            \
+        uint8_t  rv_;                                                          \
+        if (page_) {                                                           \
+            rv_ = page_[ra_ & 0xFF];                                           \
+        } else {                                                               \
+            SAVE_BUS_STATE();                                                  \
+            rv_ = mem->read(mem->obj, ra_);                                    \
+            RELOAD_EVENTS();                                                   \
+        }                                                                      \
+        rv_;                                                                   \
+    })
+
+#define WRITE(a, v)                                                            \
+    do {                                                                       \
+        uint16_t wa_   = (a);                                                  \
+        uint8_t  wv_   = (v);                                                  \
+        uint8_t* page_ = mem->write_pages[wa_ >> 8];                           \
+        if (page_) {                                                           \
+            page_[wa_ & 0xFF] = wv_;                                           \
+        } else {                                                               \
+            SAVE_BUS_STATE();                                                  \
+            mem->write(mem->obj, wa_, wv_);                                    \
+            RELOAD_EVENTS();                                                   \
+        }                                                                      \
+    } while (0)
+
+#define READ16(a)                                                              \
+    ((uint16_t)READ(a) | ((uint16_t)READ((uint16_t)((a) + 1)) << 8))
+
+// emulates the 6502 bug that makes the low byte wrap without incrementing the
+// high byte
+#define READ16_BUG(a)                                                          \
+    ((uint16_t)READ(a) |                                                       \
+     ((uint16_t)READ(((a) & 0xff00u) | (((a) + 1) & 0x00ffu)) << 8))
+
+#define DIFFERENT_PAGE(a1, a2) (((a1) >> 8) != ((a2) >> 8))
+
+#define PUSH(v)                                                                \
+    do {                                                                       \
+        WRITE(0x100u | (uint16_t)SP, (v));                                     \
+        SP--;                                                                  \
+    } while (0)
+
+#define PUSH16(v)                                                              \
+    do {                                                                       \
+        uint16_t v16_ = (v);                                                   \
+        PUSH(v16_ >> 8);                                                       \
+        PUSH(v16_ & 0xff);                                                     \
+    } while (0)
+
+#define POP() (SP++, READ(0x100u | (uint16_t)SP))
+
+#define SET_ZN(v)                                                              \
+    do {                                                                       \
+        uint8_t zn_ = (v);                                                     \
+        Z      = zn_ == 0;                                                     \
+        N      = zn_ >> 7;                                                     \
+    } while (0)
+
+#define COMPARE(a, b)                                                          \
+    do {                                                                       \
+        uint8_t a_ = (a), b_ = (b);                                            \
+        SET_ZN(a_ - b_);                                                       \
+        C = a_ >= b_;                                                          \
+    } while (0)
+
+// Addressing modes. They compute "addr" (and "page_crossed") with PC still
+// pointing to the opcode, like cpu_step() does
+#define AMODE_IMPLIED()
+#define AMODE_ACCUMULATOR()
+#define AMODE_IMMEDIATE() addr = PC + 1;
+#define AMODE_ABSOLUTE()  addr = READ16(PC + 1);
+#define AMODE_ABSOLUTEX()                                                      \
+    {                                                                          \
+        uint16_t op  = READ16(PC + 1);                                         \
+        addr         = op + X;                                                 \
+        page_crossed = DIFFERENT_PAGE(addr, op);                               \
+    }
+#define AMODE_ABSOLUTEY()                                                      \
+    {                                                                          \
+        uint16_t op  = READ16(PC + 1);                                         \
+        addr         = op + Y;                                                 \
+        page_crossed = DIFFERENT_PAGE(addr, op);                               \
+    }
+#define AMODE_INDIRECT()                                                       \
+    {                                                                          \
+        uint16_t op = READ16(PC + 1);                                          \
+        addr        = READ16_BUG(op);                                          \
+    }
+#define AMODE_XINDIRECT()                                                      \
+    {                                                                          \
+        uint16_t op = (uint8_t)(READ(PC + 1) + X);                             \
+        addr        = READ16_BUG(op);                                          \
+    }
+#define AMODE_INDIRECTY()                                                      \
+    {                                                                          \
+        uint16_t op  = READ(PC + 1);                                           \
+        addr         = READ16_BUG(op) + Y;                                     \
+        page_crossed = DIFFERENT_PAGE((uint16_t)(addr - Y), addr);             \
+    }
+#define AMODE_RELATIVE()                                                       \
+    addr = PC + 2 + (uint16_t)(int8_t)READ(PC + 1);
+#define AMODE_ZEROPAGE()  addr = READ(PC + 1);
+#define AMODE_ZEROPAGEX() addr = (uint8_t)(READ(PC + 1) + X);
+#define AMODE_ZEROPAGEY() addr = (uint8_t)(READ(PC + 1) + Y);
+
+#define IS_ACC(mode)         IS_ACC_##mode
+#define IS_ACC_IMPLIED       0
+#define IS_ACC_ACCUMULATOR   1
+#define IS_ACC_IMMEDIATE     0
+#define IS_ACC_ABSOLUTE      0
+#define IS_ACC_ABSOLUTEX     0
+#define IS_ACC_ABSOLUTEY     0
+#define IS_ACC_INDIRECT      0
+#define IS_ACC_XINDIRECT     0
+#define IS_ACC_INDIRECTY     0
+#define IS_ACC_RELATIVE      0
+#define IS_ACC_ZEROPAGE      0
+#define IS_ACC_ZEROPAGEX     0
+#define IS_ACC_ZEROPAGEY     0
+
+// Instructions. When they run, PC already points to the next instruction
+#define BRANCH(cond)                                                           \
+    if (cond) {                                                                \
+        cycles += DIFFERENT_PAGE(PC, addr) ? 2 : 1;                            \
+        PC = addr;                                                             \
+    }
+
+#define LOAD(reg)                                                              \
+    reg = READ(addr);                                                          \
+    SET_ZN(reg);
+
+#define TRANSFER(dst, src)                                                     \
+    dst = src;                                                                 \
+    SET_ZN(dst);
+
+#define INCREMENT(reg, delta)                                                  \
+    reg += (delta);                                                            \
+    SET_ZN(reg);
+
+#define READ_MODIFY_WRITE(mode, expr)                                          \
+    if (IS_ACC(mode)) {                                                        \
+        uint8_t v = A;                                                         \
+        A    = (expr);                                                         \
+        SET_ZN(A);                                                             \
+    } else {                                                                   \
+        uint8_t v = READ(addr);                                                \
+        v         = (expr);                                                    \
+        WRITE(addr, v);                                                        \
+        SET_ZN(v);                                                             \
+    }
+
+#define EXEC_ADC(mode)                                                         \
+    {                                                                          \
+        uint8_t  a = A, b = READ(addr);                                        \
+        uint16_t r = (uint16_t)a + b + C;                                      \
+        A     = r;                                                             \
+        SET_ZN(A);                                                             \
+        C = r > 0xFF;                                                          \
+        V = (~(a ^ b) & (a ^ A) & 0x80) != 0;                                  \
+    }
+#define EXEC_SBC(mode)                                                         \
+    {                                                                          \
+        uint8_t a = A, b = READ(addr), c = C;                                  \
+        A    = a - b - (1 - c);                                                \
+        SET_ZN(A);                                                             \
+        C = (int32_t)a - (int32_t)b - (int32_t)(1 - c) >= 0;                   \
+        V = ((a ^ b) & (a ^ A) & 0x80) != 0;                                   \
+    }
+#define EXEC_AND(mode)                                                         \
+    A &= READ(addr);                                                           \
+    SET_ZN(A);
+#define EXEC_ORA(mode)                                                         \
+    A |= READ(addr);                                                           \
+    SET_ZN(A);
+#define EXEC_EOR(mode)                                                         \
+    A ^= READ(addr);                                                           \
+    SET_ZN(A);
+#define EXEC_BIT(mode)                                                         \
+    {                                                                          \
+        uint8_t v = READ(addr);                                                \
+        V    = (v >> 6) & 1;                                                   \
+        Z    = (v & A) == 0;                                                   \
+        N    = v >> 7;                                                         \
+    }
+#define EXEC_CMP(mode) COMPARE(A, READ(addr));
+#define EXEC_CPX(mode) COMPARE(X, READ(addr));
+#define EXEC_CPY(mode) COMPARE(Y, READ(addr));
+#define EXEC_LDA(mode) LOAD(A)
+#define EXEC_LDX(mode) LOAD(X)
+#define EXEC_LDY(mode) LOAD(Y)
+#define EXEC_STA(mode) WRITE(addr, A);
+#define EXEC_STX(mode) WRITE(addr, X);
+#define EXEC_STY(mode) WRITE(addr, Y);
+#define EXEC_TAX(mode) TRANSFER(X, A)
+#define EXEC_TAY(mode) TRANSFER(Y, A)
+#define EXEC_TXA(mode) TRANSFER(A, X)
+#define EXEC_TYA(mode) TRANSFER(A, Y)
+#define EXEC_TSX(mode) TRANSFER(X, SP)
+#define EXEC_TXS(mode) SP = X;
+#define EXEC_INX(mode) INCREMENT(X, 1)
+#define EXEC_INY(mode) INCREMENT(Y, 1)
+#define EXEC_DEX(mode) INCREMENT(X, -1)
+#define EXEC_DEY(mode) INCREMENT(Y, -1)
+#define EXEC_INC(mode)                                                         \
+    {                                                                          \
+        uint8_t v = READ(addr) + 1;                                            \
+        WRITE(addr, v);                                                        \
+        SET_ZN(v);                                                             \
+    }
+#define EXEC_DEC(mode)                                                         \
+    {                                                                          \
+        uint8_t v = READ(addr) - 1;                                            \
+        WRITE(addr, v);                                                        \
+        SET_ZN(v);                                                             \
+    }
+#define EXEC_ASL(mode)                                                         \
+    READ_MODIFY_WRITE(mode, (C = v >> 7, (uint8_t)(v << 1)))
+#define EXEC_LSR(mode) READ_MODIFY_WRITE(mode, (C = v & 1, v >> 1))
+#define EXEC_ROL(mode)                                                         \
+    {                                                                          \
+        uint8_t c = C;                                                         \
+        READ_MODIFY_WRITE(mode, (C = v >> 7, (uint8_t)((v << 1) | c)))         \
+    }
+#define EXEC_ROR(mode)                                                         \
+    {                                                                          \
+        uint8_t c = C;                                                         \
+        READ_MODIFY_WRITE(mode, (C = v & 1, (v >> 1) | (c << 7)))              \
+    }
+#define EXEC_BCC(mode) BRANCH(!C)
+#define EXEC_BCS(mode) BRANCH(C)
+#define EXEC_BNE(mode) BRANCH(!Z)
+#define EXEC_BEQ(mode) BRANCH(Z)
+#define EXEC_BPL(mode) BRANCH(!N)
+#define EXEC_BMI(mode) BRANCH(N)
+#define EXEC_BVC(mode) BRANCH(!V)
+#define EXEC_BVS(mode) BRANCH(V)
+#define EXEC_CLC(mode) C = 0;
+#define EXEC_SEC(mode) C = 1;
+#define EXEC_CLI(mode) I = 0;
+#define EXEC_SEI(mode) I = 1;
+#define EXEC_CLD(mode) D = 0;
+#define EXEC_SED(mode) D = 1;
+#define EXEC_CLV(mode) V = 0;
+#define EXEC_NOP(mode)
+#define EXEC_PHA(mode) PUSH(A);
+#define EXEC_PHP(mode) PUSH(GET_FLAGS() | 0x10 /* break flag */);
+#define EXEC_PLA(mode)                                                         \
+    A = POP();                                                                 \
+    SET_ZN(A);
+#define EXEC_PLP(mode) SET_FLAGS((POP() & 0xEF) | 0x20 /* unused */);
+#define EXEC_JMP(mode) PC = addr;
+#define EXEC_JSR(mode)                                                         \
+    PUSH16(PC - 1);                                                            \
+    PC = addr;
+#define EXEC_RTS(mode)                                                         \
+    {                                                                          \
+        uint16_t l = POP();                                                    \
+        uint16_t h = POP();                                                    \
+        PC    = ((h << 8) | l) + 1;                                            \
+    }
+#define EXEC_RTI(mode)                                                         \
+    {                                                                          \
+        EXEC_PLP(mode)                                                         \
+        uint16_t l = POP();                                                    \
+        uint16_t h = POP();                                                    \
+        PC    = (h << 8) | l;                                                  \
+    }
+#define EXEC_BRK(mode)                                                         \
+    PUSH16(PC);                                                                \
+    EXEC_PHP(mode)                                                             \
+    I  = 1;                                                                    \
+    PC = READ16(IRQ_BRK_VECTOR_ADDR);
+
+// Unofficial opcodes are not emulated. All of them have size 0 in the opcode
+// table, so their handlers never reach this point
+#define EXEC_ILLEGAL(name) panic("illegal opcode " #name);
+#define EXEC_KIL(mode)     EXEC_ILLEGAL(kil)
+#define EXEC_SLO(mode)     EXEC_ILLEGAL(slo)
+#define EXEC_RLA(mode)     EXEC_ILLEGAL(rla)
+#define EXEC_SRE(mode)     EXEC_ILLEGAL(sre)
+#define EXEC_RRA(mode)     EXEC_ILLEGAL(rra)
+#define EXEC_SAX(mode)     EXEC_ILLEGAL(sax)
+#define EXEC_LAX(mode)     EXEC_ILLEGAL(lax)
+#define EXEC_DCP(mode)     EXEC_ILLEGAL(dcp)
+#define EXEC_ISC(mode)     EXEC_ILLEGAL(isc)
+#define EXEC_ANC(mode)     EXEC_ILLEGAL(anc)
+#define EXEC_ALR(mode)     EXEC_ILLEGAL(alr)
+#define EXEC_ARR(mode)     EXEC_ILLEGAL(arr)
+#define EXEC_XAA(mode)     EXEC_ILLEGAL(xaa)
+#define EXEC_AXS(mode)     EXEC_ILLEGAL(axs)
+#define EXEC_AHX(mode)     EXEC_ILLEGAL(ahx)
+#define EXEC_SHY(mode)     EXEC_ILLEGAL(shy)
+#define EXEC_SHX(mode)     EXEC_ILLEGAL(shx)
+#define EXEC_TAS(mode)     EXEC_ILLEGAL(tas)
+#define EXEC_LAS(mode)     EXEC_ILLEGAL(las)
+
+#define INTERRUPT(vector)                                                      \
+    do {                                                                       \
+        PUSH16(PC);                                                            \
+        EXEC_PHP(IMPLIED)                                                      \
+        PC = READ16(vector);                                                   \
+        I  = 1;                                                                \
+        cycles += 7;                                                           \
+    } while (0)
+
+// Fetch the next opcode and jump to its handler. Everything that is not an
+// ordinary instruction (deadline reached, stall cycles, pending interrupts)
+// goes through the "dispatch" label
+#define NEXT()                                                                 \
+    do {                                                                       \
+        ticks += cycles - start;                                               \
+        if (ticks >= deadline || pending)                                      \
+            goto dispatch;                                                     \
+        start = cycles;                                                        \
+        goto* handlers[READ(PC)];                                              \
+    } while (0)
+
+#define HANDLER_ADDRESS(opcode, name, mode, size, cyc, page_cyc)               \
+    [opcode] = &&op_##opcode,
+
+#define HANDLER(opcode, name, mode, size, cyc, page_cyc)                       \
+    op_##opcode : {                                                            \
+        if ((size) == 0)                                                       \
+            panic("cpu_run_threaded: invalid opcode 0x%0x", opcode);           \
+                                                                               \
+        uint16_t addr         = 0;                                             \
+        int      page_crossed = 0;                                             \
+        AMODE_##mode()                                                         \
+                                                                               \
+        PC += (size);                                                          \
+        cycles += (cyc);                                                       \
+        if ((page_cyc) && page_crossed)                                        \
+            cycles += (page_cyc);                                              \
+                                                                               \
+        EXEC_##name(mode)                                                      \
+        (void)addr;                                                            \
+        (void)page_crossed;                                                    \
+        NEXT();                                                                \
+    }
+
+uint64_t cpu_run_threaded(Cpu* cpu)
+{
+    static const void* const handlers[256] = {
+        CPU_OPCODES(HANDLER_ADDRESS)};
+
+    Memory*  mem = cpu->mem;
+    uint16_t PC  = cpu->PC;
+    uint8_t  SP = cpu->SP, A = cpu->A, X = cpu->X, Y = cpu->Y;
+    uint8_t  C, Z, I, D, BU, V, N;
+    SET_FLAGS(cpu->flags);
+    uint64_t cycles   = cpu->cycles;
+    uint64_t ticks    = cpu->ticks;
+    uint64_t deadline = cpu->deadline;
+    uint64_t begin    = ticks;
+    uint64_t start    = cycles;
+    int      pending  = 0;
+
+    // at least one instruction (or stall cycle) is always executed
+    if (deadline <= begin)
+        deadline = begin + 1;
+
+dispatch:
+    if (ticks >= deadline) {
+        SAVE_STATE();
+        return ticks - begin;
+    }
+
+    if (cpu->stall > 0) {
+        // the CPU does nothing while stalled, consume the stall cycles in one
+        // go
+        uint64_t n = deadline - ticks;
+        if (n > cpu->stall)
+            n = cpu->stall;
+        cpu->stall -= n;
+        ticks += n;
+        goto dispatch;
+    }
+
+    start = cycles;
+    if (cpu->interrupt == INT_NMI)
+        INTERRUPT(NMI_VECTOR_ADDR);
+    else if (cpu->interrupt == INT_IRQ)
+        INTERRUPT(IRQ_BRK_VECTOR_ADDR);
+    cpu->interrupt = 0;
+    pending        = cpu->stall != 0;
+
+    goto* handlers[READ(PC)];
+
+    CPU_OPCODES(HANDLER)
+
+    // unreachable
+    return ticks - begin;
+}
+
+uint64_t cpu_step_threaded(Cpu* cpu)
+{
+    cpu->deadline = cpu->ticks + 1;
+    return cpu_run_threaded(cpu);
+}
@@ -132,28 +132,3 @@ Buffer buf_calloc(size_t n)
     Buffer res = {.buffer = calloc_or_fail(n), .size = n};
     return res;
 }
-
-void dump_buffer(const Buffer* buf, FILE* ofile)
-{
-    if (fwrite(&buf->size, 1, sizeof(buf->size), ofile) != sizeof(buf->size))
-        panic("unable to dump the buffer (size)");
-
-    if (fwrite(buf->buffer, 1, buf->size, ofile) != buf->size)
-        panic("unable to dump the buffer");
-}
-
-Buffer read_buffer(FILE* ifile)
-{
-    uint64_t size;
-    if (fread(&size, 1, sizeof(size), ifile) != sizeof(size))
-        panic("unable to read buffer (size)");
-
-    if (size > 10000000u)
-        panic("trying to read a buffer > 10 MB");
-
-    Buffer res = buf_malloc(size);
-    if (fread(res.buffer, 1, res.size, ifile) != res.size)
-        panic("unable to read buffer");
-
-    return res;
-}
@@ -19,9 +19,6 @@ void  free_or_fail(void* b);
 Buffer buf_malloc(size_t n);
 Buffer buf_calloc(size_t n);
 
-void   dump_buffer(const Buffer* buf, FILE* ofile);
-Buffer read_buffer(FILE* ifile);
-
 // This API is implemented only if the macro NOLEAK is set.
 // It is used to allow persistent_mode fuzzing without leaking memory.
 void free_all();
@@ -4,14 +4,28 @@
 #include "system.h"
 #include "6502_cpu.h"
 #include "memory.h"
+#include "audio_sink.h"
+#include "stream.h"
+#include "blip.h"
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #define ENABLE_HIGH_FILTER_1 1
 #define ENABLE_HIGH_FILTER_2 1
 #define ENABLE_LOW_FILTER    1
 
+// In silence the output of the filters decays towards zero and becomes
+// denormal, the arithmetic on denormals is very slow: it is flushed to zero
+// below this level, far below the resolution of a 16 bit sample
+#define FILTER_FLUSH_LEVEL 1e-20f
+
+// samples read from the blip buffer at a time, a frame is about 735
+#define SOUND_BUFFER_SIZE 1024
+// the blip buffer holds this many samples, a frame must fit in it
+#define BLIP_CAPACITY 8192
+
 #define ENABLE_PULSE1 1
 #define ENABLE_PULSE2 1
 #define ENABLE_TRIANG 1
@@ -68,54 +82,78 @@ __attribute__((constructor)) static void init_tabs()
         tnd_tab[i] = 163.67 / (24329.0 / (float)i + 100);
 }
 
-static float calc_filter(FilterState* state, float B0, float B1, float A1,
-                         float x)
+static void high_pass(FilterState* state, int sample_rate, float cutoff)
+{
+    static const float pi = 3.14159265359;
+
+    float c   = sample_rate / pi / cutoff;
+    float a0i = 1.0 / (1.0 + c);
+    state->b0 = c * a0i;
+    state->b1 = -c * a0i;
+    state->a1 = (1 - c) * a0i;
+}
+
+static void low_pass(FilterState* state, int sample_rate, float cutoff)
+{
+    static const float pi = 3.14159265359;
+
+    float c   = sample_rate / pi / cutoff;
+    float a0i = 1.0 / (1.0 + c);
+    state->b0 = a0i;
+    state->b1 = a0i;
+    state->a1 = (1 - c) * a0i;
+}
+
+static void filter_set_rate(SoundFilter* sf, int sample_rate)
 {
-    float y       = B0 * x + B1 * state->prev_x - A1 * state->prev_y;
+    sf->sample_rate = sample_rate;
+    high_pass(&sf->high_90, sample_rate, 90.0);
+    high_pass(&sf->high_440, sample_rate, 440.0);
+    low_pass(&sf->low_14000, sample_rate, 14000.0);
+}
+
+static inline float calc_filter(FilterState* state, float x)
+{
+    float y =
+        state->b0 * x + state->b1 * state->prev_x - state->a1 * state->prev_y;
+    if (y < FILTER_FLUSH_LEVEL && y > -FILTER_FLUSH_LEVEL)
+        y = 0;
     state->prev_x = x;
     state->prev_y = y;
     return y;
 }
 
-static float apply_filter(SoundFilter* sf, float x)
+// The filters are recursive (a sample depends on the previous output), the
+// block cannot be vectorized: the three filters run in a single pass with
+// their state in registers, and the CPU overlaps the chains of consecutive
+// samples
+static void apply_filter(SoundFilter* sf, float* samples, uint32_t count)
 {
-    static const float pi   = 3.14159265359;
-    static const float gain = 1.0;
-
-    float cutoff, c, a0i;
+    FilterState high_90   = sf->high_90;
+    FilterState high_440  = sf->high_440;
+    FilterState low_14000 = sf->low_14000;
 
+    for (uint32_t i = 0; i < count; ++i) {
+        float x = samples[i];
 #if ENABLE_HIGH_FILTER_1
-    // high pass filter
-    cutoff = 90.0;
-    c      = sf->sample_rate / pi / cutoff;
-    a0i    = 1.0 / (1.0 + c);
-    x      = calc_filter(&sf->high_90, c * a0i, -c * a0i, (1 - c) * a0i, x);
+        x = calc_filter(&high_90, x);
 #endif
-
 #if ENABLE_HIGH_FILTER_2
-    // high pass filter
-    cutoff = 440.0;
-    c      = sf->sample_rate / pi / cutoff;
-    a0i    = 1.0 / (1.0 + c);
-    x      = calc_filter(&sf->high_440, c * a0i, -c * a0i, (1 - c) * a0i, x);
+        x = calc_filter(&high_440, x);
 #endif
-
 #if ENABLE_LOW_FILTER
-    // low pass filter
-    cutoff = 14000.0;
-    c      = sf->sample_rate / pi / cutoff;
-    a0i    = 1.0 / (1.0 + c);
-    x      = calc_filter(&sf->low_14000, a0i, a0i, (1 - c) * a0i, x);
+        x = calc_filter(&low_14000, x);
 #endif
+        samples[i] = x;
+    }
 
-    return x * gain;
+    sf->high_90   = high_90;
+    sf->high_440  = high_440;
+    sf->low_14000 = low_14000;
 }
 
 Apu* apu_build(struct System* sys)
 {
-    if (!SDL_WasInit(SDL_INIT_AUDIO))
-        panic("you must init SDL Audio first");
-
     Apu* apu = calloc_or_fail(sizeof(Apu));
     apu->sys = sys;
 
@@ -124,31 +162,43 @@ Apu* apu_build(struct System* sys)
     apu->noise.shift_reg = 1;
     apu->dmc.sys         = sys;
 
-    SDL_AudioSpec want;
-    SDL_zero(want);
-    want.freq     = 44100;
-    want.format   = AUDIO_F32;
-    want.channels = 1;
-    want.samples  = 2048;
-
-    apu->dev = SDL_OpenAudioDevice(NULL, 0, &want, &apu->spec, 0);
-
-    apu->filter.sample_rate   = apu->spec.freq;
-    apu->sound_buffer_num_els = apu->spec.samples / 4;
+    apu->sink                 = NULL;
+    apu->sample_rate          = AUDIO_SAMPLE_RATE;
+    apu->sound_buffer_num_els = SOUND_BUFFER_SIZE;
     apu->sound_buffer =
         malloc_or_fail(apu->sound_buffer_num_els * sizeof(float));
-    apu->sound_buffer_i = 0;
-    apu->is_paused      = 1;
+    // large enough for any format
+    apu->sink_buffer =
+        malloc_or_fail(apu->sound_buffer_num_els * 2 * sizeof(float));
+    filter_set_rate(&apu->filter, apu->sample_rate);
+    apu->blip        = blip_build(BLIP_CAPACITY);
+    apu->is_paused   = 1;
+    apu->rate_adjust = 1.0;
     return apu;
 }
 
 void apu_destroy(Apu* apu)
 {
-    SDL_CloseAudioDevice(apu->dev);
+    blip_destroy(apu->blip);
     free_or_fail(apu->sound_buffer);
+    free_or_fail(apu->sink_buffer);
     free_or_fail(apu);
 }
 
+void apu_set_audio_sink(Apu* apu, struct AudioSink* sink)
+{
+    apu->sink      = sink;
+    apu->blip_time = 0;
+    blip_clear(apu->blip);
+    if (sink == NULL)
+        return;
+
+    apu->sample_rate = sink->sample_rate;
+    apu->blip_freq   = 0;
+    filter_set_rate(&apu->filter, sink->sample_rate);
+    audio_sink_pause(sink, apu->is_paused);
+}
+
 static void pulse_write_control(Pulse* pulse, uint8_t value)
 {
     pulse->duty_cycle                    = (value >> 6) & 3;
@@ -237,13 +287,15 @@ static void pulse_step_length(Pulse* pulse)
         pulse->length_value--;
 }
 
-static void pulse_step_timer(Pulse* pulse)
+static int pulse_step_timer(Pulse* pulse)
 {
     if (pulse->timer_value == 0) {
         pulse->timer_value = pulse->timer_period;
         pulse->duty_value  = (pulse->duty_value + 1) % 8;
-    } else
-        pulse->timer_value--;
+        return 1;
+    }
+    pulse->timer_value--;
+    return 0;
 }
 
 static uint8_t pulse_output(Pulse* pulse)
@@ -284,15 +336,18 @@ static void triangular_write_timer_high(Triangular* t, uint8_t value)
     t->counter_reload = 1;
 }
 
-static void triangular_step_timer(Triangular* t)
+static int triangular_step_timer(Triangular* t)
 {
     if (t->timer_value == 0) {
         t->timer_value = t->timer_period;
-        if (t->length_value > 0 && t->counter_value > 0)
+        if (t->length_value > 0 && t->counter_value > 0) {
             t->duty_value = (t->duty_value + 1) % 32;
+            return 1;
+        }
     } else {
         t->timer_value--;
     }
+    return 0;
 }
 
 static void triangular_step_length(Triangular* t)
@@ -349,7 +404,7 @@ static void noise_write_length(Noise* n, uint8_t value)
     n->envelope_start = 1;
 }
 
-static void noise_step_timer(Noise* n)
+static int noise_step_timer(Noise* n)
 {
     if (n->timer_value == 0) {
         n->timer_value = n->timer_period;
@@ -358,9 +413,10 @@ static void noise_step_timer(Noise* n)
         uint8_t b2     = (n->shift_reg >> shift) & 1;
         n->shift_reg >>= 1;
         n->shift_reg |= (b1 ^ b2) << 14;
-    } else {
-        n->timer_value--;
+        return 1;
     }
+    n->timer_value--;
+    return 0;
 }
 
 static void noise_step_envelope(Noise* n)
@@ -465,18 +521,19 @@ static void dmc_step_shifter(DMC* dmc)
     dmc->bit_count--;
 }
 
-static void dmc_step_timer(DMC* dmc)
+static int dmc_step_timer(DMC* dmc)
 {
     if (!dmc->enabled)
-        return;
+        return 0;
 
     dmc_step_reader(dmc);
     if (dmc->tick_value == 0) {
         dmc->tick_value = dmc->tick_period;
         dmc_step_shifter(dmc);
-    } else {
-        dmc->tick_value--;
+        return 1;
     }
+    dmc->tick_value--;
+    return 0;
 }
 
 static uint8_t dmc_output(DMC* dmc) { return dmc->value; }
@@ -539,6 +596,7 @@ static void apu_write_frame_counter(Apu* apu, uint8_t value)
 
 void apu_write_register(Apu* apu, uint16_t addr, uint8_t value)
 {
+    apu->output_changed = 1;
     switch (addr) {
         case 0x4000:
             pulse_write_control(&apu->pulse1, value);
@@ -658,20 +716,65 @@ static float apu_sample(Apu* apu)
     return pulse_out + tnd_out;
 }
 
-static void gen_sample(Apu* apu)
+static void update_rates(Apu* apu)
 {
-    float sample = apply_filter(&apu->filter, apu_sample(apu));
+    // the deltas of the frame so far were placed with the old rates
+    blip_end_frame(apu->blip, apu->blip_time);
+    apu->blip_time = 0;
+    blip_set_rates(apu->blip, (double)apu->sys->cpu_freq,
+                   apu->sample_rate * apu->rate_adjust);
+    apu->blip_freq = apu->sys->cpu_freq;
+}
 
-    apu->sound_buffer[apu->sound_buffer_i++] = sample;
-    if (apu->sound_buffer_i >= apu->sound_buffer_num_els) {
-        SDL_QueueAudio(apu->dev, apu->sound_buffer,
-                       apu->sound_buffer_num_els * sizeof(float));
-        apu->sound_buffer_i = 0;
+static void record_output(Apu* apu)
+{
+    if (apu->blip_freq != apu->sys->cpu_freq)
+        update_rates(apu);
+    if (apu->blip_time >= apu->blip->max_clocks)
+        // no apu_end_frame() for a while (e.g. single stepping)
+        apu_end_frame(apu);
+
+    if (apu->output_changed) {
+        apu->output_changed = 0;
+        float output        = apu_sample(apu);
+        if (output != apu->output) {
+            blip_add_delta(apu->blip, apu->blip_time, output - apu->output);
+            apu->output = output;
+        }
+    }
+    apu->blip_time++;
+}
+
+void apu_end_frame(Apu* apu)
+{
+    if (apu->is_paused || apu->sink == NULL)
+        return;
+
+    blip_end_frame(apu->blip, apu->blip_time);
+    apu->blip_time = 0;
+
+    // a frame (about 735 samples) is read in a single block: the filters and
+    // the conversion run on the whole of it
+    AudioSinkFormat format = apu->sink->format;
+    uint32_t        n;
+    while ((n = blip_read_samples(apu->blip, apu->sound_buffer,
+                                  apu->sound_buffer_num_els)) > 0) {
+        apply_filter(&apu->filter, apu->sound_buffer, n);
+        if (format == AUDIO_SINK_MONO_F32) {
+            audio_sink_queue(apu->sink, apu->sound_buffer, n);
+        } else {
+            audio_sink_convert(format, apu->sound_buffer, apu->sink_buffer, n);
+            audio_sink_queue(apu->sink, apu->sink_buffer, n);
+        }
+        apu->samples += n;
     }
 }
 
 static void step_frame_counter(Apu* apu)
 {
+    // the envelopes and the length counters change the volume
+    apu->output_changed = 1;
+
     // mode 0:    mode 1:       function
     // ---------  -----------  -----------------------------
     //  - - - f    - - - - -    IRQ (if bit 6 is clear)
@@ -704,46 +807,305 @@ static void step_frame_counter(Apu* apu)
     }
 }
 
-void apu_step(Apu* apu)
+// One cycle, "frame_clock" if it clocks the frame counter
+static inline void step_cycle(Apu* apu, int frame_clock)
 {
-    uint64_t prev_cycle = apu->cycles++;
+    apu->cycles++;
+    int changed = 0;
     if (apu->cycles % 2 == 0) {
-        pulse_step_timer(&apu->pulse1);
-        pulse_step_timer(&apu->pulse2);
-        noise_step_timer(&apu->noise);
-        dmc_step_timer(&apu->dmc);
+        changed |= pulse_step_timer(&apu->pulse1);
+        changed |= pulse_step_timer(&apu->pulse2);
+        changed |= noise_step_timer(&apu->noise);
+        changed |= dmc_step_timer(&apu->dmc);
     }
-    triangular_step_timer(&apu->triangular);
+    changed |= triangular_step_timer(&apu->triangular);
+    apu->output_changed |= changed;
 
-    uint64_t frame_counter_rate = apu->sys->cpu_freq / 240;
-    if (prev_cycle % frame_counter_rate == 0)
+    if (frame_clock)
         step_frame_counter(apu);
 
-    if (apu->is_paused)
+    if (apu->is_paused || apu->sink == NULL)
+        return;
+    record_output(apu);
+}
+
+void apu_step(Apu* apu)
+{
+    // the frame counter is clocked when the cycle counter (before the
+    // increment) is a multiple of the rate
+    uint64_t rate = apu->sys->cpu_freq / 240;
+    step_cycle(apu, apu->cycles % rate == 0);
+}
+
+// A channel is audible if its next timer reload can change the output. The
+// reloads of the silent ones are skipped in bulk by apu_run()
+static int pulse_audible(Pulse* pulse)
+{
+    if (!pulse->enabled || pulse->length_value == 0 ||
+        pulse->timer_period < 8 || pulse->timer_period > 0x7FF)
+        return 0;
+    if (pulse->constant_volume_envelope_flag)
+        return pulse->volume_driver_period > 0;
+    return pulse->envelope_volume > 0;
+}
+
+static int triangular_audible(Triangular* t)
+{
+    return t->enabled && t->timer_period >= 3 && t->length_value > 0 &&
+           t->counter_value > 0;
+}
+
+static int noise_audible(Noise* n)
+{
+    if (!n->enabled || n->length_value == 0)
+        return 0;
+    if (n->constant_volume_envelope_flag)
+        return n->volume_driver_period > 0;
+    return n->envelope_volume > 0;
+}
+
+// Clocks a timer "clocks" times, it returns how many times it is reloaded
+static uint64_t skip_timer(uint16_t* value, uint16_t period, uint64_t clocks)
+{
+    if (clocks <= *value) {
+        *value -= clocks;
+        return 0;
+    }
+    clocks -= *value + 1u;
+    *value = period - clocks % (period + 1u);
+    return 1 + clocks / (period + 1u);
+}
+
+static void skip_timer8(uint8_t* value, uint8_t period, uint64_t clocks)
+{
+    uint16_t v = *value;
+    skip_timer(&v, period, clocks);
+    *value = (uint8_t)v;
+}
+
+// Advances "cycles" cycles in which no audible channel is reloaded, the frame
+// counter is not clocked and the DMC neither reads nor shifts: the state is
+// the same that many apu_step() calls would leave, but the output does not
+// change
+static void skip_cycles(Apu* apu, uint64_t cycles)
+{
+    if (cycles == 0)
         return;
 
-    static const float gap   = 1.0;
-    uint64_t sample_gen_freq = apu->sys->cpu_freq / apu->spec.freq * gap;
-    if (prev_cycle % sample_gen_freq == 0)
-        gen_sample(apu);
+    // the timers clocked every other cycle see the even values of
+    // Apu::cycles after the increment
+    uint64_t half = (apu->cycles + cycles) / 2 - apu->cycles / 2;
+
+    uint64_t reloads;
+    reloads = skip_timer(&apu->pulse1.timer_value, apu->pulse1.timer_period,
+                         half);
+    apu->pulse1.duty_value = (apu->pulse1.duty_value + reloads) % 8;
+    reloads = skip_timer(&apu->pulse2.timer_value, apu->pulse2.timer_period,
+                         half);
+    apu->pulse2.duty_value = (apu->pulse2.duty_value + reloads) % 8;
+
+    Triangular* t = &apu->triangular;
+    reloads       = skip_timer(&t->timer_value, t->timer_period, cycles);
+    if (t->length_value > 0 && t->counter_value > 0)
+        t->duty_value = (t->duty_value + reloads) % 32;
+
+    Noise* n = &apu->noise;
+    reloads  = skip_timer(&n->timer_value, n->timer_period, half);
+    for (uint64_t i = 0; i < reloads; ++i) {
+        uint8_t shift = n->mode ? 6 : 1;
+        uint8_t b1    = n->shift_reg & 1;
+        uint8_t b2    = (n->shift_reg >> shift) & 1;
+        n->shift_reg >>= 1;
+        n->shift_reg |= (b1 ^ b2) << 14;
+    }
+
+    if (apu->dmc.enabled)
+        skip_timer8(&apu->dmc.tick_value, apu->dmc.tick_period, half);
+
+    apu->cycles += cycles;
+    if (!apu->is_paused && apu->sink != NULL)
+        apu->blip_time += cycles;
+}
+
+static inline uint64_t min_u64(uint64_t a, uint64_t b) { return a < b ? a : b; }
+
+// apu_step() calls, including the one that clocks it, until a timer clocked
+// every other cycle is clocked for the "clocks"-th time
+static inline uint64_t half_rate_steps(Apu* apu, uint64_t clocks)
+{
+    return (apu->cycles & 1 ? 0 : 1) + 2 * (clocks - 1) + 1;
+}
+
+// The apu_step() calls until the next one that can change the output or
+// affect the rest of the system, including it. "steps" is the number of
+// calls up to the next clock of the frame counter (included)
+static uint64_t steps_to_next_event(Apu* apu, uint64_t steps)
+{
+    DMC* dmc = &apu->dmc;
+    if (dmc->enabled) {
+        if (dmc->bit_count == 0 && dmc->current_length > 0)
+            // the next clock reads a byte
+            steps = min_u64(steps, half_rate_steps(apu, 1));
+        else if (dmc->bit_count > 0)
+            steps =
+                min_u64(steps, half_rate_steps(apu, dmc->tick_value + 1ull));
+    }
+
+    // without a sink only the frame counter and the DMC reads matter
+    if (apu->is_paused || apu->sink == NULL)
+        return steps;
+
+    // a register has been written or a state loaded, or the frame of blip is
+    // over
+    if (apu->output_changed || apu->blip_freq != apu->sys->cpu_freq ||
+        apu->blip_time >= apu->blip->max_clocks)
+        return 1;
+    steps = min_u64(steps, apu->blip->max_clocks - apu->blip_time);
+
+    if (pulse_audible(&apu->pulse1))
+        steps = min_u64(steps,
+                        half_rate_steps(apu, apu->pulse1.timer_value + 1ull));
+    if (pulse_audible(&apu->pulse2))
+        steps = min_u64(steps,
+                        half_rate_steps(apu, apu->pulse2.timer_value + 1ull));
+    if (triangular_audible(&apu->triangular))
+        steps = min_u64(steps, apu->triangular.timer_value + 1ull);
+    if (noise_audible(&apu->noise))
+        steps =
+            min_u64(steps, half_rate_steps(apu, apu->noise.timer_value + 1ull));
+    return steps;
+}
+
+void apu_run(Apu* apu, uint64_t cycles)
+{
+    // the division and the modulo of apu_step() are done once per call: the
+    // cycle (before the increment) of the next clock of the frame counter is
+    // moved forward by the rate
+    uint64_t rate       = apu->sys->cpu_freq / 240;
+    uint64_t next_clock = apu->cycles + (rate - apu->cycles % rate) % rate;
+
+    while (cycles > 0) {
+        uint64_t steps = min_u64(
+            steps_to_next_event(apu, next_clock - apu->cycles + 1), cycles);
+        skip_cycles(apu, steps - 1);
+
+        int frame_clock = apu->cycles == next_clock;
+        if (frame_clock)
+            next_clock += rate;
+        step_cycle(apu, frame_clock);
+        cycles -= steps;
+    }
 }
 
-void apu_queue_samples(Apu* apu, void* samples, uint32_t samples_size)
+uint64_t apu_frame_irq_cycles(Apu* apu)
 {
-    SDL_QueueAudio(apu->dev, samples, samples_size);
+    if (apu->frame_period_mode != 0 || !apu->frame_irq)
+        return NO_EVENT;
+
+    // apu_step() clocks the frame counter when the cycle counter (before the
+    // increment) is a multiple of the rate, the IRQ is triggered when the
+    // frame value becomes 3
+    uint64_t rate   = apu->sys->cpu_freq / 240;
+    uint64_t first  = (rate - apu->cycles % rate) % rate + 1;
+    uint64_t clocks = (7 - apu->frame_value % 4) % 4;
+    if (clocks == 0)
+        clocks = 4;
+    return first + (clocks - 1) * rate;
+}
+
+uint64_t apu_dmc_cycles(Apu* apu)
+{
+    DMC* dmc = &apu->dmc;
+    if (!dmc->enabled || dmc->current_length == 0)
+        return NO_EVENT;
+    if (dmc->bit_count == 0)
+        return 1;
+
+    // the timer is clocked every other cycle, the shifter once every
+    // tick_period + 1 timer clocks. The next byte is read by the timer clock
+    // that follows the shift of the last bit
+    uint64_t timer_clocks = (uint64_t)dmc->tick_value + 1 +
+                            (uint64_t)(dmc->bit_count - 1) *
+                                (dmc->tick_period + 1);
+    return 2 * timer_clocks - 1;
 }
 
 void apu_unpause(Apu* apu)
 {
     apu->is_paused = 0;
-    SDL_PauseAudioDevice(apu->dev, 0);
+    apu->blip_time = 0;
+    blip_clear(apu->blip);
+    if (apu->sink)
+        audio_sink_pause(apu->sink, 0);
 }
 
 void apu_pause(Apu* apu)
 {
     apu->is_paused = 1;
-    SDL_PauseAudioDevice(apu->dev, 1);
-    SDL_ClearQueuedAudio(apu->dev);
+    if (apu->sink)
+        audio_sink_pause(apu->sink, 1);
 }
 
-uint32_t apu_get_queued(Apu* apu) { return SDL_GetQueuedAudioSize(apu->dev); }
+uint32_t apu_get_queued(Apu* apu)
+{
+    if (apu->sink == NULL)
+        return 0;
+    return audio_sink_queued(apu->sink);
+}
+
+void apu_set_rate_adjust(Apu* apu, double ratio)
+{
+    if (ratio == apu->rate_adjust)
+        return;
+    apu->rate_adjust = ratio;
+    apu->blip_freq   = 0;
+}
+
+void apu_serialize(Apu* apu, Writer* w)
+{
+    // The pointers and the fields of the frontend (the ones apu_deserialize()
+    // keeps) are written as zeros, see cpu_serialize()
+    Apu tmp                  = *apu;
+    tmp.sys                  = NULL;
+    tmp.sink                 = NULL;
+    tmp.sample_rate          = 0;
+    tmp.is_paused            = 0;
+    tmp.sound_buffer         = NULL;
+    tmp.sink_buffer          = NULL;
+    tmp.sound_buffer_num_els = 0;
+    tmp.samples              = 0;
+    tmp.rate_adjust          = 0;
+    tmp.blip                 = NULL;
+    tmp.blip_time            = 0;
+    tmp.blip_freq            = 0;
+    tmp.output               = 0;
+    tmp.output_changed       = 0;
+    tmp.dmc.sys              = NULL;
+    memset(&tmp.filter, 0, sizeof(tmp.filter));
+    write_section(w, &tmp, sizeof(Apu));
+}
+
+void apu_deserialize(Apu* apu, Reader* r)
+{
+    Apu tmp = *apu;
+
+    read_section(r, apu, sizeof(Apu), "apu_deserialize()");
+    apu->sys                  = tmp.sys;
+    apu->sink                 = tmp.sink;
+    apu->sample_rate          = tmp.sample_rate;
+    apu->is_paused            = tmp.is_paused;
+    apu->filter               = tmp.filter;
+    apu->sound_buffer         = tmp.sound_buffer;
+    apu->sink_buffer          = tmp.sink_buffer;
+    apu->sound_buffer_num_els = tmp.sound_buffer_num_els;
+    apu->samples              = tmp.samples;
+    apu->rate_adjust          = tmp.rate_adjust;
+    apu->blip                 = tmp.blip;
+    apu->blip_time            = tmp.blip_time;
+    apu->blip_freq            = tmp.blip_freq;
+    apu->output               = tmp.output;
+    apu->dmc.sys              = tmp.sys;
+
+    // the output of the new state is recorded as a step
+    apu->output_changed = 1;
+}
@@ -1,13 +1,18 @@
 #ifndef APU_H
 #define APU_H
 
-#include <SDL2/SDL.h>
 #include <stdint.h>
 
 struct System;
 struct Cpu;
+struct AudioSink;
+struct Writer;
+struct Reader;
+struct Blip;
 
+// First order filter: y = b0 * x + b1 * prev_x - a1 * prev_y
 typedef struct {
+    float b0, b1, a1; // computed once for the sample rate
     float prev_x;
     float prev_y;
 } FilterState;
@@ -122,8 +127,8 @@ typedef struct DMC {
 
 typedef struct Apu {
     struct System*    sys;
-    SDL_AudioDeviceID dev;
-    SDL_AudioSpec     spec;
+    struct AudioSink* sink; // NULL if the samples are not needed
+    uint32_t          sample_rate;
 
     union {
         struct {
@@ -143,22 +148,63 @@ typedef struct Apu {
     DMC        dmc;
 
     uint8_t  frame_value;
-    float*   sound_buffer;
+    float*   sound_buffer; // filtered samples, mono
+    void*    sink_buffer;  // the same in the format of the sink
     uint32_t sound_buffer_num_els;
-    uint32_t sound_buffer_i;
     uint64_t cycles;
+    uint64_t samples; // generated samples
+    uint64_t clock;   // master clock (see Cpu::ticks) it has been stepped to
+
+    // The output of the mixer is not sampled: its changes are recorded in
+    // blip at the cycle they happen at (since the start of the frame), and
+    // resampled to the sample rate of the sink at the end of the frame
+    struct Blip* blip;
+    uint64_t     blip_time;
+    int64_t      blip_freq; // cpu_freq the rates of blip are for, 0 if stale
+    double       rate_adjust;
+    float        output;         // recorded in blip so far
+    uint8_t      output_changed; // a channel has been clocked or written
 } Apu;
 
 Apu* apu_build(struct System* sys);
 void apu_destroy(Apu* apu);
 
+// One CPU cycle: every timer is stepped, it is the reference for apu_run()
 void    apu_step(Apu* apu);
+// Same as "cycles" apu_step() calls, but the cycles in which nothing audible
+// happens are skipped at once: the cost depends on the transitions of the
+// waveforms, not on the cycles
+void    apu_run(Apu* apu, uint64_t cycles);
+// Resamples the output since the last call and sends it to the sink, call it
+// at the end of every frame (with the APU stepped up to it)
+void    apu_end_frame(Apu* apu);
 void    apu_write_register(Apu* apu, uint16_t addr, uint8_t value);
 uint8_t apu_read_register(Apu* apu, uint16_t addr);
 
+// The sink is owned by the caller, the APU does not generate samples until
+// it has one
+void apu_set_audio_sink(Apu* apu, struct AudioSink* sink);
+
 void apu_pause(Apu* apu);
 void apu_unpause(Apu* apu);
 
+// number of samples generated and not played yet
 uint32_t apu_get_queued(Apu* apu);
+// Generates "ratio" times the samples of the sink's sample rate per emulated
+// second (1.0 by default). The frontend moves it slightly around 1.0 to keep
+// the audio queue at the same depth when the audio device and the clock the
+// frames are paced with drift apart
+void     apu_set_rate_adjust(Apu* apu, double ratio);
+
+// Scheduling helpers, both return a lower bound of the number of apu_step()
+// calls before the frame counter can trigger an IRQ, and before the DMC reads
+// the next sample byte (stalling the CPU). NO_EVENT if it cannot happen
+uint64_t apu_frame_irq_cycles(Apu* apu);
+uint64_t apu_dmc_cycles(Apu* apu);
+
+// The sink, the output filter, the blip buffer and the pause flag belong to
+// the frontend, they are not part of the state
+void apu_serialize(Apu* apu, struct Writer* w);
+void apu_deserialize(Apu* apu, struct Reader* r);
 
 #endif
@@ -11,68 +11,211 @@
 #else
 #include <netinet/tcp.h>
 #include <sys/socket.h>
+#include <sys/select.h>
 #include <arpa/inet.h>
+#include <unistd.h>
 #include <time.h>
 #endif
 
-static void* thread_fun(void* _arg)
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
+
+// a broken connection is reported by send(), not by SIGPIPE
+#ifdef MSG_NOSIGNAL
+#define SEND_FLAGS MSG_NOSIGNAL
+#else
+#define SEND_FLAGS 0
+#endif
+
+static void wake_up(AsyncContext* ac)
+{
+#ifdef __linux__
+    uint64_t one = 1;
+    if (write(ac->wake_fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+        panic("async: unable to wake up the sender thread [%s]",
+              strerror(errno));
+#else
+    pthread_mutex_lock(&ac->wake_mutex);
+    pthread_cond_signal(&ac->wake_cond);
+    pthread_mutex_unlock(&ac->wake_mutex);
+#endif
+}
+
+// Called by the sender thread when the ring is empty. The producer publishes
+// head before it looks at sleeping, we set sleeping before looking at head
+// (both sequentially consistent): either it sees us sleeping and wakes us up,
+// or we see the new data
+static void wait_for_data(AsyncContext* ac)
+{
+    atomic_store(&ac->sleeping, 1);
+    if (atomic_load(&ac->head) != atomic_load(&ac->tail) ||
+        !atomic_load(&ac->should_run)) {
+        // if the producer has just cleared it, the next wait returns at once
+        atomic_store(&ac->sleeping, 0);
+        return;
+    }
+
+#ifdef __linux__
+    uint64_t count;
+    if (read(ac->wake_fd, &count, sizeof(count)) < 0 && errno != EINTR)
+        panic("async: unable to wait for data [%s]", strerror(errno));
+#else
+    pthread_mutex_lock(&ac->wake_mutex);
+    while (atomic_load(&ac->sleeping))
+        pthread_cond_wait(&ac->wake_cond, &ac->wake_mutex);
+    pthread_mutex_unlock(&ac->wake_mutex);
+#endif
+    atomic_fetch_add_explicit(&ac->wakeups, 1, memory_order_relaxed);
+}
+
+static int wait_writable(int fd)
 {
-    AsyncContext* arg = (AsyncContext*)_arg;
-    if (pthread_mutex_lock(&arg->mutex_1) != 0)
-        panic("thread_fun(): unable to lock mutex_1");
-
-    while (arg->should_run) {
-        sync_send(arg->fd, &arg->buf, arg->buf_size);
-        if (pthread_mutex_unlock(&arg->mutex_2) != 0)
-            panic("thread_fun(): unable to unlock mutex_2");
-        if (pthread_mutex_lock(&arg->mutex_1) != 0)
-            panic("thread_fun(): unable to lock mutex_1");
+    fd_set fds;
+    FD_ZERO(&fds);
+    FD_SET(fd, &fds);
+    return select(fd + 1, NULL, &fds, NULL, NULL) >= 0 || errno == EINTR;
+}
+
+// Unlike sync_send() it does not panic, and it waits if the socket is
+// non-blocking. -1 if the socket is broken
+static int send_all(int fd, const uint8_t* buf, uint32_t len)
+{
+    while (len > 0) {
+        int64_t r = send(fd, (const char*)buf, len, SEND_FLAGS);
+        if (r > 0) {
+            buf += r;
+            len -= r;
+        } else if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            if (!wait_writable(fd))
+                return -1;
+        } else if (r == 0 || errno != EINTR) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static void* sender_thread(void* _ac)
+{
+    AsyncContext* ac   = (AsyncContext*)_ac;
+    uint32_t      mask = ac->capacity - 1;
+
+    for (;;) {
+        uint64_t tail = atomic_load_explicit(&ac->tail, memory_order_relaxed);
+        uint64_t head = atomic_load_explicit(&ac->head, memory_order_acquire);
+        if (head == tail) {
+            if (!atomic_load(&ac->should_run))
+                break;
+            wait_for_data(ac);
+            continue;
+        }
+
+        // everything up to the end of the ring, without copies
+        uint64_t size = head - tail;
+        if (size > ac->capacity - (tail & mask))
+            size = ac->capacity - (tail & mask);
+        if (size > ASYNC_BATCH)
+            size = ASYNC_BATCH;
+
+        // after a failure the data is dropped, async_send() refuses new data
+        if (!atomic_load_explicit(&ac->failed, memory_order_relaxed) &&
+            send_all(ac->fd, ac->ring + (tail & mask), size) < 0)
+            atomic_store(&ac->failed, 1);
+
+        atomic_store_explicit(&ac->tail, tail + size, memory_order_release);
+        atomic_fetch_add_explicit(&ac->sends, 1, memory_order_relaxed);
     }
     return NULL;
 }
 
-AsyncContext* async_init()
+AsyncContext* async_init(int fd, uint32_t capacity)
 {
-    AsyncContext* ac = (AsyncContext*)malloc_or_fail(sizeof(AsyncContext));
-    ac->should_run   = 1;
-
-    if (pthread_mutex_init(&ac->mutex_1, NULL) != 0)
-        panic("async_init(): unable to initialize mutex_1");
-    if (pthread_mutex_init(&ac->mutex_2, NULL) != 0)
-        panic("async_init(): unable to initialize mutex_2");
-    if (pthread_mutex_lock(&ac->mutex_1) != 0)
-        panic("async_init(): unable to lock mutex_1");
-    if (pthread_create(&ac->thread, NULL, &thread_fun, ac) != 0)
-        panic("pthread_create failed");
+    if (capacity == 0)
+        capacity = ASYNC_CAPACITY;
+    uint32_t size = 1;
+    while (size < capacity)
+        size <<= 1;
 
+    AsyncContext* ac = (AsyncContext*)calloc_or_fail(sizeof(AsyncContext));
+    ac->fd           = fd;
+    ac->ring         = malloc_or_fail(size);
+    ac->capacity     = size;
+    atomic_init(&ac->head, 0);
+    atomic_init(&ac->tail, 0);
+    atomic_init(&ac->sleeping, 0);
+    atomic_init(&ac->should_run, 1);
+    atomic_init(&ac->failed, 0);
+    atomic_init(&ac->sends, 0);
+    atomic_init(&ac->wakeups, 0);
+
+#ifdef __linux__
+    ac->wake_fd = eventfd(0, EFD_CLOEXEC);
+    if (ac->wake_fd < 0)
+        panic("async_init(): unable to create the eventfd [%s]",
+              strerror(errno));
+#else
+    if (pthread_mutex_init(&ac->wake_mutex, NULL) != 0 ||
+        pthread_cond_init(&ac->wake_cond, NULL) != 0)
+        panic("async_init(): unable to initialize the condition variable");
+#endif
+
+    if (pthread_create(&ac->thread, NULL, &sender_thread, ac) != 0)
+        panic("pthread_create failed");
     return ac;
 }
 
 void async_destroy(AsyncContext* ac)
 {
-    ac->should_run = 0;
-    if (pthread_mutex_unlock(&ac->mutex_1) != 0)
-        panic("async_destroy(): unable to unlock mutex_1");
+    atomic_store(&ac->should_run, 0);
+    if (atomic_exchange(&ac->sleeping, 0))
+        wake_up(ac);
     if (pthread_join(ac->thread, NULL) != 0)
         panic("async_destroy(): pthread_join failed");
-    if (pthread_mutex_destroy(&ac->mutex_1) != 0)
-        warning("async_destroy(): unable to destroy mutex_1");
-    if (pthread_mutex_destroy(&ac->mutex_2) != 0)
-        warning("async_destroy(): unable to destroy mutex_2");
+
+#ifdef __linux__
+    close(ac->wake_fd);
+#else
+    pthread_cond_destroy(&ac->wake_cond);
+    pthread_mutex_destroy(&ac->wake_mutex);
+#endif
+    free_or_fail(ac->ring);
     free_or_fail(ac);
 }
 
-void async_send(AsyncContext* ac, int fd, const void* i_buf, int64_t size)
+int async_send(AsyncContext* ac, const void* i_buf, uint32_t size)
+{
+    if (atomic_load_explicit(&ac->failed, memory_order_relaxed))
+        return 0;
+
+    uint32_t mask = ac->capacity - 1;
+    uint64_t head = atomic_load_explicit(&ac->head, memory_order_relaxed);
+    uint64_t tail = atomic_load_explicit(&ac->tail, memory_order_acquire);
+    if (size > ac->capacity - (head - tail))
+        return 0;
+
+    uint32_t offset = head & mask;
+    uint32_t first  = ac->capacity - offset;
+    if (first > size)
+        first = size;
+    memcpy(ac->ring + offset, i_buf, first);
+    memcpy(ac->ring, (const uint8_t*)i_buf + first, size - first);
+
+    atomic_store(&ac->head, head + size);
+    // only one of us clears it, the thread is woken up once
+    if (atomic_load(&ac->sleeping) && atomic_exchange(&ac->sleeping, 0))
+        wake_up(ac);
+    return 1;
+}
+
+uint64_t async_queued(AsyncContext* ac)
+{
+    return atomic_load(&ac->head) - atomic_load(&ac->tail);
+}
+
+int async_failed(AsyncContext* ac)
 {
-    if (size > sizeof(ac->buf))
-        panic("Unable to send more than %u bytes", sizeof(ac->buf));
-    if (pthread_mutex_lock(&ac->mutex_2) != 0)
-        panic("async_send(): unable to lock mutex_2");
-    ac->fd       = fd;
-    ac->buf_size = size;
-    memcpy(ac->buf, i_buf, size);
-    if (pthread_mutex_unlock(&ac->mutex_1) != 0)
-        panic("async_send(): unable to unlock mutex_1");
+    return atomic_load(&ac->failed);
 }
 
 int64_t sync_send(int fd, const void* i_buf, int64_t len)
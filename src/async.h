@@ -2,21 +2,59 @@
 #define ASYNC_H
 
 #include <stdint.h>
+#include <stdatomic.h>
 #include <pthread.h>
 
+// default size of the queue of an AsyncContext
+#define ASYNC_CAPACITY (256 * 1024)
+// biggest single send of the sender thread
+#define ASYNC_BATCH (64 * 1024)
+
+// Sends data on a stream socket from a dedicated thread, so that the caller
+// never waits for the network. The messages are copied in a lock-free
+// single-producer/single-consumer ring of bytes: the producer (the caller of
+// async_send()) only writes head, the sender thread only writes tail. The
+// sender thread sleeps when the ring is empty and the producer wakes it up
+// (eventfd on Linux, a condition variable elsewhere) only if it is sleeping.
+// All the messages that are queued when the thread wakes up are sent with a
+// single send()
 typedef struct AsyncContext {
-    int             should_run;
-    int             fd;
-    char            buf[8];
-    int64_t         buf_size;
-    pthread_t       thread;
-    pthread_mutex_t mutex_1, mutex_2;
+    int       fd;
+    uint8_t*  ring;
+    uint32_t  capacity; // power of two
+    pthread_t thread;
+
+    _Alignas(64) _Atomic uint64_t head; // bytes queued so far
+    _Alignas(64) _Atomic uint64_t tail; // bytes sent so far
+    _Atomic int sleeping;
+    _Atomic int should_run;
+    _Atomic int failed; // the socket is broken, nothing is queued anymore
+
+#ifdef __linux__
+    int wake_fd;
+#else
+    pthread_mutex_t wake_mutex;
+    pthread_cond_t  wake_cond;
+#endif
+
+    // written by the sender thread
+    _Atomic uint64_t sends;
+    _Atomic uint64_t wakeups;
 } AsyncContext;
 
-AsyncContext* async_init();
+// "capacity" is rounded up to a power of two, 0 is ASYNC_CAPACITY
+AsyncContext* async_init(int fd, uint32_t capacity);
+// The data that has been queued is sent before returning, unless the socket
+// is broken
 void          async_destroy(AsyncContext* ac);
 
-void async_send(AsyncContext* ac, int fd, const void* i_buf, int64_t size);
+// Queues "size" bytes, it never blocks. It returns 0 if they do not fit in the
+// ring (the peer is too slow) or the socket is broken, in that case nothing
+// is queued
+int      async_send(AsyncContext* ac, const void* i_buf, uint32_t size);
+// Bytes queued and not sent yet
+uint64_t async_queued(AsyncContext* ac);
+int      async_failed(AsyncContext* ac);
 
 int64_t sync_send(int fd, const void* i_buf, int64_t size);
 int64_t sync_recv(int fd, void* o_buf, int64_t size);
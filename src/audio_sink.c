@@ -0,0 +1,179 @@
+#include "audio_sink.h"
+#include "alloc.h"
+
+#include <string.h>
+
+// RingAudioSink
+typedef struct RingAudioSink {
+    float*   samples;
+    uint32_t capacity;
+    uint32_t head; // next sample to read
+    uint32_t size;
+    int      paused;
+    uint64_t overruns;
+} RingAudioSink;
+
+static void ring_queue(void* _sink, const void* frames, uint32_t count)
+{
+    RingAudioSink* sink    = (RingAudioSink*)_sink;
+    const float*   samples = (const float*)frames;
+    if (sink->paused)
+        return;
+
+    for (uint32_t i = 0; i < count; ++i) {
+        sink->samples[(sink->head + sink->size) % sink->capacity] = samples[i];
+        if (sink->size < sink->capacity) {
+            sink->size++;
+        } else {
+            sink->head = (sink->head + 1) % sink->capacity;
+            sink->overruns++;
+        }
+    }
+}
+
+static uint32_t ring_queued(void* _sink)
+{
+    RingAudioSink* sink = (RingAudioSink*)_sink;
+    return sink->size;
+}
+
+static void ring_pause(void* _sink, int paused)
+{
+    RingAudioSink* sink = (RingAudioSink*)_sink;
+
+    sink->paused = paused;
+    if (paused) {
+        sink->head = 0;
+        sink->size = 0;
+    }
+}
+
+static void ring_stats(void* _sink, AudioSinkStats* stats)
+{
+    RingAudioSink* sink = (RingAudioSink*)_sink;
+
+    stats->underruns = 0;
+    stats->overruns  = sink->overruns;
+}
+
+static void ring_destroy(void* _sink)
+{
+    RingAudioSink* sink = (RingAudioSink*)_sink;
+
+    free_or_fail(sink->samples);
+    free_or_fail(sink);
+}
+
+AudioSink* ring_audio_sink_build(uint32_t sample_rate, uint32_t capacity)
+{
+    RingAudioSink* sink = calloc_or_fail(sizeof(RingAudioSink));
+    sink->samples       = malloc_or_fail(capacity * sizeof(float));
+    sink->capacity      = capacity;
+
+    AudioSink* res   = malloc_or_fail(sizeof(AudioSink));
+    res->obj         = sink;
+    res->sample_rate = sample_rate;
+    res->format      = AUDIO_SINK_MONO_F32;
+    res->queue       = &ring_queue;
+    res->queued      = &ring_queued;
+    res->pause       = &ring_pause;
+    res->destroy     = &ring_destroy;
+    res->stats       = &ring_stats;
+    return res;
+}
+
+uint32_t ring_audio_sink_read(AudioSink* _sink, float* samples, uint32_t count)
+{
+    RingAudioSink* sink = (RingAudioSink*)_sink->obj;
+
+    if (count > sink->size)
+        count = sink->size;
+    for (uint32_t i = 0; i < count; ++i) {
+        samples[i] = sink->samples[sink->head];
+        sink->head = (sink->head + 1) % sink->capacity;
+    }
+    sink->size -= count;
+    return count;
+}
+
+// Polymorphic AudioSink
+void audio_sink_destroy(AudioSink* sink)
+{
+    sink->destroy(sink->obj);
+    free_or_fail(sink);
+}
+
+void audio_sink_queue(AudioSink* sink, const void* frames, uint32_t count)
+{
+    sink->queue(sink->obj, frames, count);
+}
+
+uint32_t audio_sink_queued(AudioSink* sink) { return sink->queued(sink->obj); }
+
+void audio_sink_pause(AudioSink* sink, int paused)
+{
+    sink->pause(sink->obj, paused);
+}
+
+void audio_sink_stats(AudioSink* sink, AudioSinkStats* stats)
+{
+    memset(stats, 0, sizeof(AudioSinkStats));
+    if (sink->stats)
+        sink->stats(sink->obj, stats);
+}
+
+uint32_t audio_sink_frame_size(AudioSinkFormat format)
+{
+    switch (format) {
+        case AUDIO_SINK_MONO_F32:
+            return sizeof(float);
+        case AUDIO_SINK_STEREO_F32:
+            return 2 * sizeof(float);
+        case AUDIO_SINK_MONO_S16:
+            return sizeof(int16_t);
+        case AUDIO_SINK_STEREO_S16:
+            return 2 * sizeof(int16_t);
+    }
+    return 0;
+}
+
+static inline int16_t to_s16(float x)
+{
+    x *= 32767.0f;
+    x = x > 32767.0f ? 32767.0f : x;
+    x = x < -32767.0f ? -32767.0f : x;
+    return (int16_t)x;
+}
+
+// Plain loops without dependencies between the iterations, the compiler
+// vectorizes them
+void audio_sink_convert(AudioSinkFormat format, const float* samples,
+                        void* out, uint32_t count)
+{
+    float*   f = (float*)out;
+    int16_t* s = (int16_t*)out;
+
+    switch (format) {
+        case AUDIO_SINK_MONO_F32:
+            if (out != samples)
+                memcpy(out, samples, count * sizeof(float));
+            break;
+        case AUDIO_SINK_STEREO_F32:
+            for (uint32_t i = 0; i < count; ++i) {
+                f[2 * i]     = samples[i];
+                f[2 * i + 1] = samples[i];
+            }
+            break;
+        case AUDIO_SINK_MONO_S16:
+            for (uint32_t i = 0; i < count; ++i)
+                s[i] = to_s16(samples[i]);
+            break;
+        case AUDIO_SINK_STEREO_S16:
+            for (uint32_t i = 0; i < count; ++i) {
+                int16_t v    = to_s16(samples[i]);
+                s[2 * i]     = v;
+                s[2 * i + 1] = v;
+            }
+            break;
+    }
+}
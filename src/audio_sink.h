@@ -0,0 +1,58 @@
+#ifndef AUDIO_SINK_H
+#define AUDIO_SINK_H
+
+#include <stdint.h>
+
+#define AUDIO_SAMPLE_RATE 44100
+
+// Layout of the frames a sink takes, the stereo ones are interleaved (left
+// first) and both channels are the same
+typedef enum AudioSinkFormat {
+    AUDIO_SINK_MONO_F32 = 0, // the default
+    AUDIO_SINK_STEREO_F32,
+    AUDIO_SINK_MONO_S16,
+    AUDIO_SINK_STEREO_S16,
+} AudioSinkFormat;
+
+typedef struct AudioSinkStats {
+    uint64_t underruns; // times the device found the queue empty
+    uint64_t overruns;  // frames dropped, the queue was full
+} AudioSinkStats;
+
+// Where the APU sends its samples, in "format" (a frame is a sample of every
+// channel, the counts are in frames). The emulator core does not play them, a
+// frontend provides the sink
+typedef struct AudioSink {
+    void*           obj;
+    uint32_t        sample_rate;
+    AudioSinkFormat format;
+    void (*queue)(void* obj, const void* frames, uint32_t count);
+    // number of frames queued and not played yet
+    uint32_t (*queued)(void* obj);
+    void (*pause)(void* obj, int paused);
+    void (*destroy)(void* obj);
+    // optional
+    void (*stats)(void* obj, AudioSinkStats* stats);
+} AudioSink;
+
+void     audio_sink_destroy(AudioSink* sink);
+void     audio_sink_queue(AudioSink* sink, const void* frames, uint32_t count);
+uint32_t audio_sink_queued(AudioSink* sink);
+void     audio_sink_pause(AudioSink* sink, int paused);
+// All zeros if the sink does not keep them
+void     audio_sink_stats(AudioSink* sink, AudioSinkStats* stats);
+
+uint32_t audio_sink_frame_size(AudioSinkFormat format);
+// Writes "count" mono float samples to "out" in "format", the samples are
+// clamped to [-1, 1] for the int16 ones. "out" can be "samples" only for
+// AUDIO_SINK_MONO_F32
+void     audio_sink_convert(AudioSinkFormat format, const float* samples,
+                            void* out, uint32_t count);
+
+// Headless sink (mono, float): the samples are kept in a ring buffer of
+// "capacity" samples until they are read, the oldest ones are overwritten
+// when it is full
+AudioSink* ring_audio_sink_build(uint32_t sample_rate, uint32_t capacity);
+uint32_t   ring_audio_sink_read(AudioSink* sink, float* samples, uint32_t count);
+
+#endif
@@ -0,0 +1,119 @@
+#include "blip.h"
+#include "alloc.h"
+
+#include <math.h>
+#include <string.h>
+
+// bits of the position of a step between two samples that select the phase,
+// the ones below them interpolate between two phases
+#define FRAC_BITS   32
+#define PHASE_BITS  6 // log2(BLIP_PHASES)
+#define INTERP_BITS (FRAC_BITS - PHASE_BITS)
+#define INTERP_MASK ((1u << INTERP_BITS) - 1)
+
+// the kernel cuts at this fraction of the Nyquist frequency
+#define CUTOFF 0.9
+
+// kernel[p]: the impulse of a step that happens p / BLIP_PHASES samples after
+// the sample it is added to, centered BLIP_TAPS / 2 - 1 samples later. Every
+// phase sums to one, the integrated step is exactly as high as the delta
+static float kernel[BLIP_PHASES + 1][BLIP_TAPS];
+
+__attribute__((constructor)) static void init_kernel()
+{
+    static const double pi = 3.14159265358979323846;
+
+    for (int p = 0; p <= BLIP_PHASES; ++p) {
+        double center = BLIP_TAPS / 2 - 1 + (double)p / BLIP_PHASES;
+        double taps[BLIP_TAPS], sum = 0;
+        for (int i = 0; i < BLIP_TAPS; ++i) {
+            double t    = i - center;
+            double x    = pi * CUTOFF * t;
+            double sinc = x == 0 ? 1.0 : sin(x) / x;
+            // Blackman window, zero at +-BLIP_TAPS / 2
+            double w = 0.42 + 0.5 * cos(2 * pi * t / BLIP_TAPS) +
+                       0.08 * cos(4 * pi * t / BLIP_TAPS);
+            taps[i] = sinc * w;
+            sum += taps[i];
+        }
+        for (int i = 0; i < BLIP_TAPS; ++i)
+            kernel[p][i] = (float)(taps[i] / sum);
+    }
+}
+
+Blip* blip_build(uint32_t capacity)
+{
+    Blip* b     = calloc_or_fail(sizeof(Blip));
+    b->capacity = capacity;
+    b->buf      = calloc_or_fail((capacity + BLIP_TAPS) * sizeof(float));
+    blip_set_rates(b, 1.0, 1.0);
+    return b;
+}
+
+void blip_destroy(Blip* b)
+{
+    free_or_fail(b->buf);
+    free_or_fail(b);
+}
+
+void blip_set_rates(Blip* b, double clock_rate, double sample_rate)
+{
+    b->factor     = (uint64_t)(sample_rate / clock_rate * 4294967296.0 + 0.5);
+    b->max_clocks = (((uint64_t)b->capacity - 1) << FRAC_BITS) / b->factor;
+}
+
+void blip_clear(Blip* b)
+{
+    b->offset     = 0;
+    b->integrator = 0;
+    memset(b->buf, 0, (b->capacity + BLIP_TAPS) * sizeof(float));
+}
+
+void blip_add_delta(Blip* b, uint64_t clock, float delta)
+{
+    uint64_t pos = b->offset + clock * b->factor;
+    uint64_t i   = pos >> FRAC_BITS;
+    if (i >= b->capacity)
+        // the frame is longer than max_clocks
+        return;
+
+    uint32_t     frac   = (uint32_t)pos;
+    const float* k0     = kernel[frac >> INTERP_BITS];
+    const float* k1     = k0 + BLIP_TAPS;
+    float        interp = (frac & INTERP_MASK) * (1.0f / (INTERP_MASK + 1));
+    float        d1     = delta * interp;
+    float        d0     = delta - d1;
+    float*       out    = b->buf + i;
+    for (int j = 0; j < BLIP_TAPS; ++j)
+        out[j] += k0[j] * d0 + k1[j] * d1;
+}
+
+void blip_end_frame(Blip* b, uint64_t clocks)
+{
+    b->offset += clocks * b->factor;
+    if ((b->offset >> FRAC_BITS) > b->capacity)
+        b->offset = (uint64_t)b->capacity << FRAC_BITS;
+}
+
+uint32_t blip_samples_avail(Blip* b) { return b->offset >> FRAC_BITS; }
+
+uint32_t blip_read_samples(Blip* b, float* out, uint32_t count)
+{
+    uint32_t avail = blip_samples_avail(b);
+    if (count > avail)
+        count = avail;
+
+    float acc = b->integrator;
+    for (uint32_t i = 0; i < count; ++i) {
+        acc += b->buf[i];
+        out[i] = acc;
+    }
+    b->integrator = acc;
+
+    // the tails of the last steps are still to be read
+    uint32_t left = avail - count + BLIP_TAPS;
+    memmove(b->buf, b->buf + count, left * sizeof(float));
+    memset(b->buf + left, 0, count * sizeof(float));
+    b->offset -= (uint64_t)count << FRAC_BITS;
+    return count;
+}
@@ -0,0 +1,43 @@
+#ifndef BLIP_H
+#define BLIP_H
+
+#include <stdint.h>
+
+// length of the band-limited step, in output samples (its delay is half of it)
+#define BLIP_TAPS 16
+// positions of a step between two output samples the kernel is computed for,
+// the ones in between are interpolated
+#define BLIP_PHASES 64
+
+// Band-limited synthesis of a signal made of steps (the output of the APU
+// only changes when a channel is clocked or written). Instead of sampling the
+// signal, the changes are recorded at the exact clock they happen at: every
+// change adds a band-limited impulse (a windowed sinc) to a buffer of deltas,
+// that is integrated when the samples are read. The result has no aliasing
+// and any ratio between the clock rate and the sample rate works.
+//
+// The time is counted in clocks from the start of the current frame, a frame
+// ends with blip_end_frame() and makes its samples available
+typedef struct Blip {
+    uint64_t factor;     // output samples per clock, 32.32 fixed point
+    uint64_t offset;     // position of the start of the frame, 32.32
+    uint64_t max_clocks; // longest frame that fits in an empty buffer
+    uint32_t capacity;   // samples
+    float    integrator;
+    float*   buf; // capacity + BLIP_TAPS deltas
+} Blip;
+
+Blip* blip_build(uint32_t capacity);
+void  blip_destroy(Blip* b);
+
+// The new rates apply to the deltas added from now on: end the frame first,
+// or the ones already added are misplaced
+void     blip_set_rates(Blip* b, double clock_rate, double sample_rate);
+void     blip_clear(Blip* b);
+void     blip_add_delta(Blip* b, uint64_t clock, float delta);
+void     blip_end_frame(Blip* b, uint64_t clocks);
+uint32_t blip_samples_avail(Blip* b);
+// It returns the number of samples read, at most "count"
+uint32_t blip_read_samples(Blip* b, float* out, uint32_t count);
+
+#endif
@@ -1,6 +1,7 @@
 #include "cartridge.h"
 #include "logging.h"
 #include "alloc.h"
+#include "stream.h"
 
 #include <unistd.h>
 #include <string.h>
@@ -105,7 +106,8 @@ Cartridge* cartridge_load_from_buffer(Buffer raw)
 
     if (cart->SRAM_size > 10000000)
         panic("Invalid SRAM_size (> 10 MB)");
-    cart->SRAM = malloc_or_fail(cart->SRAM_size);
+    // zeroed, the game must find the same RAM on every machine (e.g. netplay)
+    cart->SRAM = calloc_or_fail(cart->SRAM_size);
 
     uint32_t file_off = HEADER_SIZE;
     if (flag_6 & TRAINER_MASK) {
@@ -131,7 +133,9 @@ Cartridge* cartridge_load_from_buffer(Buffer raw)
         // allocate CHR-RAM
         cart->CHR      = calloc_or_fail(1 << 13);
         cart->CHR_size = 1 << 13;
+        cart->CHR_RAM  = 1;
     } else {
+        cart->CHR_RAM = 0;
         if (file_off + cart->CHR_size > raw.size)
             panic("not a valid cartridge (CHR truncated)");
 
@@ -198,6 +202,12 @@ void cartridge_save_sav(Cartridge* cart)
     write_file_raw(cart->sav_path, &buf);
 }
 
+void cartridge_detach_sav(Cartridge* cart)
+{
+    free_or_fail(cart->sav_path);
+    cart->sav_path = NULL;
+}
+
 static const char* mirror_to_string(Mirroring m)
 {
     switch (m) {
@@ -227,39 +237,18 @@ void cartridge_print(Cartridge* cart)
     printf("}\n");
 }
 
-void cartridge_serialize(Cartridge* cart, FILE* ofile)
+void cartridge_serialize(Cartridge* cart, Writer* w)
 {
-    Buffer buf;
-    buf.buffer = cart->SRAM;
-    buf.size   = cart->SRAM_size;
-    dump_buffer(&buf, ofile);
-
-    buf.buffer = cart->CHR;
-    buf.size   = cart->CHR_size;
-    dump_buffer(&buf, ofile);
-
-    buf.buffer = (uint8_t*)&cart->mirror;
-    buf.size   = sizeof(cart->mirror);
-    dump_buffer(&buf, ofile);
+    write_section(w, cart->SRAM, cart->SRAM_size);
+    write_section(w, cart->CHR, cart->CHR_size);
+    write_section(w, &cart->mirror, sizeof(cart->mirror));
 }
 
-void cartridge_deserialize(Cartridge* cart, FILE* ifile)
+void cartridge_deserialize(Cartridge* cart, Reader* r)
 {
-    Buffer buf = read_buffer(ifile);
-    if (buf.size != cart->SRAM_size)
-        panic("cartridge_deserialize(): invalid buffer SRAM");
-    memcpy(cart->SRAM, buf.buffer, buf.size);
-    free_or_fail(buf.buffer);
-
-    buf = read_buffer(ifile);
-    if (buf.size != cart->CHR_size)
-        panic("cartridge_deserialize(): invalid buffer CHR");
-    memcpy(cart->CHR, buf.buffer, buf.size);
-    free_or_fail(buf.buffer);
-
-    buf = read_buffer(ifile);
-    if (buf.size != sizeof(cart->mirror))
-        panic("cartridge_deserialize(): invalid buffer Mirror");
-    cart->mirror = *(Mirroring*)buf.buffer;
-    free_or_fail(buf.buffer);
+    read_section(r, cart->SRAM, cart->SRAM_size,
+                 "cartridge_deserialize(): SRAM");
+    read_section(r, cart->CHR, cart->CHR_size, "cartridge_deserialize(): CHR");
+    read_section(r, &cart->mirror, sizeof(cart->mirror),
+                 "cartridge_deserialize(): Mirror");
 }
@@ -5,6 +5,8 @@
 #include <stdio.h>
 
 struct Buffer;
+struct Writer;
+struct Reader;
 
 typedef enum {
     MIRROR_HORIZONTAL = 0,
@@ -27,6 +29,7 @@ typedef struct Cartridge {
     uint16_t  mapper;
     Mirroring mirror;
     uint8_t   battery;
+    uint8_t   CHR_RAM; // CHR is writable
 } Cartridge;
 
 Cartridge* cartridge_load_from_buffer(struct Buffer raw);
@@ -36,10 +39,13 @@ void       cartridge_unload(Cartridge* cart);
 
 void cartridge_load_sav(Cartridge* cart);
 void cartridge_save_sav(Cartridge* cart);
+// The SRAM is not saved anymore, e.g. it has been replaced by the one of
+// another machine
+void cartridge_detach_sav(Cartridge* cart);
 
 void cartridge_print(Cartridge* cart);
 
-void cartridge_serialize(Cartridge* cart, FILE* ofile);
-void cartridge_deserialize(Cartridge* cart, FILE* ifile);
+void cartridge_serialize(Cartridge* cart, struct Writer* w);
+void cartridge_deserialize(Cartridge* cart, struct Reader* r);
 
 #endif
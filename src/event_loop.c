@@ -0,0 +1,238 @@
+#include "event_loop.h"
+#include "alloc.h"
+#include "logging.h"
+
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#ifdef __MINGW32__
+#include <winsock2.h>
+#else
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/select.h>
+#endif
+
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#endif
+
+uint64_t event_loop_now_us()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000ull + ts.tv_nsec / 1000;
+}
+
+EventLoop* event_loop_build()
+{
+    EventLoop* loop     = calloc_or_fail(sizeof(EventLoop));
+    loop->notify_fds[0] = -1;
+    loop->notify_fds[1] = -1;
+
+#ifdef __linux__
+    loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    loop->timer_fd =
+        timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    int notify_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (loop->epoll_fd < 0 || loop->timer_fd < 0 || notify_fd < 0)
+        panic("event_loop_build(): cannot create the event loop [%s]",
+              strerror(errno));
+    loop->notify_fds[0] = notify_fd;
+    loop->notify_fds[1] = notify_fd;
+
+    struct epoll_event ev = {.events = EPOLLIN, .data.fd = loop->timer_fd};
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, loop->timer_fd, &ev) < 0)
+        panic("event_loop_build(): epoll_ctl failed [%s]", strerror(errno));
+    ev.data.fd = notify_fd;
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, notify_fd, &ev) < 0)
+        panic("event_loop_build(): epoll_ctl failed [%s]", strerror(errno));
+#elif !defined(__MINGW32__)
+    // a full pipe already has a notification pending, the writes never block
+    if (pipe(loop->notify_fds) < 0 ||
+        fcntl(loop->notify_fds[0], F_SETFL, O_NONBLOCK) < 0 ||
+        fcntl(loop->notify_fds[1], F_SETFL, O_NONBLOCK) < 0)
+        panic("event_loop_build(): cannot create the event loop [%s]",
+              strerror(errno));
+#endif
+    return loop;
+}
+
+void event_loop_destroy(EventLoop* loop)
+{
+#ifdef __linux__
+    close(loop->notify_fds[0]);
+    close(loop->timer_fd);
+    close(loop->epoll_fd);
+#elif !defined(__MINGW32__)
+    close(loop->notify_fds[0]);
+    close(loop->notify_fds[1]);
+#endif
+    free_or_fail(loop);
+}
+
+void event_loop_add_fd(EventLoop* loop, int fd)
+{
+    if (loop->fd_count == EVENT_LOOP_MAX_FDS)
+        panic("event_loop_add_fd(): too many file descriptors");
+    loop->fds[loop->fd_count++] = fd;
+
+#ifdef __linux__
+    struct epoll_event ev = {.events = EPOLLIN, .data.fd = fd};
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0)
+        panic("event_loop_add_fd(): epoll_ctl failed [%s]", strerror(errno));
+#endif
+}
+
+int event_loop_can_notify(EventLoop* loop) { return loop->notify_fds[1] >= 0; }
+
+void event_loop_notify(EventLoop* loop)
+{
+#ifndef __MINGW32__
+    // EAGAIN: a notification is already pending
+#ifdef __linux__
+    uint64_t one = 1;
+#else
+    uint8_t one = 1;
+#endif
+    if (write(loop->notify_fds[1], &one, sizeof(one)) < 0 && errno != EAGAIN)
+        panic("event_loop_notify(): write failed [%s]", strerror(errno));
+#else
+    (void)loop;
+#endif
+}
+
+#ifndef __MINGW32__
+// Consumes the pending notifications
+static void drain_notifications(EventLoop* loop)
+{
+    uint64_t buf[8];
+    while (read(loop->notify_fds[0], buf, sizeof(buf)) > 0)
+        ;
+}
+#endif
+
+void event_loop_set_deadline(EventLoop* loop, uint64_t deadline_us)
+{
+    loop->deadline_us = deadline_us;
+
+#ifdef __linux__
+    // an absolute time: the frames do not drift with the time it takes to
+    // arm the timer. A zero it_value disarms it, a deadline in the past
+    // expires at once
+    struct itimerspec spec;
+    memset(&spec, 0, sizeof(spec));
+    if (deadline_us != 0) {
+        spec.it_value.tv_sec  = deadline_us / 1000000;
+        spec.it_value.tv_nsec = (deadline_us % 1000000) * 1000;
+    }
+    if (timerfd_settime(loop->timer_fd, TFD_TIMER_ABSTIME, &spec, NULL) < 0)
+        panic("event_loop_set_deadline(): timerfd_settime failed [%s]",
+              strerror(errno));
+#endif
+}
+
+#ifdef __linux__
+static int wait_events(EventLoop* loop, uint64_t max_wait_us)
+{
+    // epoll_wait() has a resolution of milliseconds, the deadline is kept by
+    // the timer. Round up, or it would spin for the last millisecond
+    int timeout_ms = -1;
+    if (max_wait_us != EVENT_LOOP_FOREVER)
+        timeout_ms = (int)((max_wait_us + 999) / 1000);
+
+    struct epoll_event events[EVENT_LOOP_MAX_FDS + 2];
+    int n = epoll_wait(loop->epoll_fd, events, EVENT_LOOP_MAX_FDS + 2,
+                       timeout_ms);
+    if (n < 0) {
+        if (errno == EINTR)
+            return 0;
+        panic("event_loop_wait(): epoll_wait failed [%s]", strerror(errno));
+    }
+
+    int res = 0;
+    for (int i = 0; i < n; ++i) {
+        if (events[i].data.fd == loop->notify_fds[0]) {
+            drain_notifications(loop);
+            res |= EVENT_NOTIFIED;
+            continue;
+        }
+        if (events[i].data.fd != loop->timer_fd) {
+            res |= EVENT_READABLE;
+            continue;
+        }
+        uint64_t expirations;
+        if (read(loop->timer_fd, &expirations, sizeof(expirations)) > 0) {
+            res |= EVENT_DEADLINE;
+            loop->deadline_us = 0;
+        }
+    }
+    return res;
+}
+#else
+static int wait_events(EventLoop* loop, uint64_t max_wait_us)
+{
+    uint64_t now = event_loop_now_us();
+    if (loop->deadline_us != 0) {
+        if (loop->deadline_us <= now) {
+            loop->deadline_us = 0;
+            return EVENT_DEADLINE;
+        }
+        if (loop->deadline_us - now < max_wait_us)
+            max_wait_us = loop->deadline_us - now;
+    }
+    int notify_fd = loop->notify_fds[0];
+
+    fd_set fds;
+    FD_ZERO(&fds);
+    int max_fd = -1;
+    for (uint32_t i = 0; i < loop->fd_count; ++i) {
+        FD_SET(loop->fds[i], &fds);
+        if (loop->fds[i] > max_fd)
+            max_fd = loop->fds[i];
+    }
+    if (notify_fd >= 0) {
+        FD_SET(notify_fd, &fds);
+        if (notify_fd > max_fd)
+            max_fd = notify_fd;
+    }
+    struct timeval timeout = {.tv_sec  = max_wait_us / 1000000,
+                              .tv_usec = max_wait_us % 1000000};
+
+    int ready = select(max_fd + 1, &fds, NULL, NULL,
+                       max_wait_us == EVENT_LOOP_FOREVER ? NULL : &timeout);
+
+    int res = 0;
+    if (ready > 0 && notify_fd >= 0 && FD_ISSET(notify_fd, &fds)) {
+#ifndef __MINGW32__
+        drain_notifications(loop);
+#endif
+        res |= EVENT_NOTIFIED;
+        ready--;
+    }
+    if (ready > 0)
+        res |= EVENT_READABLE;
+    if (loop->deadline_us != 0 && loop->deadline_us <= event_loop_now_us()) {
+        res |= EVENT_DEADLINE;
+        loop->deadline_us = 0;
+    }
+    return res;
+}
+#endif
+
+int event_loop_wait(EventLoop* loop, uint64_t max_wait_us)
+{
+    int res = wait_events(loop, max_wait_us);
+
+    loop->wakeups++;
+    if (res & EVENT_DEADLINE)
+        loop->deadline_wakeups++;
+    if (res & EVENT_READABLE)
+        loop->readable_wakeups++;
+    if (res & EVENT_NOTIFIED)
+        loop->notified_wakeups++;
+    return res;
+}
@@ -0,0 +1,58 @@
+#ifndef EVENT_LOOP_H
+#define EVENT_LOOP_H
+
+#include <stdint.h>
+
+// file descriptors an EventLoop can wait on
+#define EVENT_LOOP_MAX_FDS 8
+
+// what woke up event_loop_wait()
+#define EVENT_DEADLINE 1
+#define EVENT_READABLE 2
+#define EVENT_NOTIFIED 4
+
+// for event_loop_wait(): no timeout, only the events wake it up
+#define EVENT_LOOP_FOREVER UINT64_MAX
+
+// Waits for the next frame and for the sockets at the same time, without
+// spinning: epoll and a timerfd armed with the absolute deadline on Linux,
+// select() with a timeout elsewhere. The times are microseconds of
+// CLOCK_MONOTONIC (see event_loop_now_us()).
+// Another thread can wake it up with event_loop_notify() (e.g. from the event
+// watch of SDL): an eventfd on Linux, a pipe on the other POSIX systems.
+// There is none on Windows, where select() takes sockets only
+typedef struct EventLoop {
+#ifdef __linux__
+    int epoll_fd;
+    int timer_fd;
+#endif
+    int notify_fds[2]; // read, write end. -1 if notifications are not supported
+    int      fds[EVENT_LOOP_MAX_FDS];
+    uint32_t fd_count;
+    uint64_t deadline_us; // 0 if there is none
+
+    uint64_t wakeups;
+    uint64_t deadline_wakeups;
+    uint64_t readable_wakeups;
+    uint64_t notified_wakeups;
+} EventLoop;
+
+EventLoop* event_loop_build();
+void       event_loop_destroy(EventLoop* loop);
+
+void     event_loop_add_fd(EventLoop* loop, int fd);
+// Wakes up event_loop_wait(), it can be called from any thread
+void     event_loop_notify(EventLoop* loop);
+int      event_loop_can_notify(EventLoop* loop);
+// The deadline is absolute, it replaces the previous one. 0 removes it
+void     event_loop_set_deadline(EventLoop* loop, uint64_t deadline_us);
+// Sleeps until one of the file descriptors is readable, the deadline has
+// passed or "max_wait_us" have elapsed (e.g. to poll the events of the
+// window, where they cannot be notified), or until event_loop_notify() is
+// called. It returns a mask of EVENT_DEADLINE, EVENT_READABLE and
+// EVENT_NOTIFIED, 0 on timeout. An expired deadline is reported once, and so
+// are the notifications sent before the call
+int      event_loop_wait(EventLoop* loop, uint64_t max_wait_us);
+uint64_t event_loop_now_us();
+
+#endif
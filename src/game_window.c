@@ -13,6 +13,7 @@
 #define SHOW_FPS 1
 
 long latency = 0;
+char title_info[128];
 
 static long get_timestamp_milliseconds()
 {
@@ -33,7 +34,7 @@ long get_timestamp_microseconds()
 static void calculate_and_show_fps(SDL_Window* win)
 {
     static const int fps_counter_max = 60;
-    static char      fps_str[128];
+    static char      fps_str[256];
     static int       show_fps_counter = 0;
     static long      prev_timestamp   = 0;
 
@@ -43,13 +44,54 @@ static void calculate_and_show_fps(SDL_Window* win)
 
         long   dt  = get_timestamp_milliseconds() - prev_timestamp;
         double fps = 1000.0l * fps_counter_max / dt;
-        sprintf(fps_str, "borzNES - latency: %ld ms - fps: %.03lf", latency,
-                fps);
+
+        int n = sprintf(fps_str, "borzNES - latency: %ld ms - fps: %.03lf",
+                        latency, fps);
+        if (title_info[0])
+            snprintf(fps_str + n, sizeof(fps_str) - n, " - %s", title_info);
         SDL_SetWindowTitle(win, fps_str);
         prev_timestamp = get_timestamp_milliseconds();
     }
 }
 
+// The textures are created once and updated in place. PACK_RGBA() is the
+// ARGB8888 format, native for the renderers of SDL: the framebuffers of the
+// PPU are uploaded as they are, without a conversion
+static SDL_Texture* create_streaming_texture(Window* win, int w, int h)
+{
+    SDL_Texture* texture =
+        SDL_CreateTexture(win->sdl_renderer, SDL_PIXELFORMAT_ARGB8888,
+                          SDL_TEXTUREACCESS_STREAMING, w, h);
+    if (texture == NULL)
+        panic("unable to create a %dx%d texture", w, h);
+    return texture;
+}
+
+static void update_texture_from_surface(SDL_Texture* texture,
+                                        SDL_Surface* surface)
+{
+    SDL_UpdateTexture(texture, NULL, surface->pixels, surface->pitch);
+}
+
+static void update_texture_from_framebuffer(SDL_Texture*    texture,
+                                            const uint32_t* framebuffer)
+{
+    SDL_UpdateTexture(texture, NULL, framebuffer,
+                      FRAME_WIDTH * sizeof(uint32_t));
+}
+
+static void gamewindow_frame_ready(void* _gw, const uint32_t* framebuffer)
+{
+    gamewindow_draw((GameWindow*)_gw);
+}
+
+static void init_video_sink(GameWindow* gw, uint32_t* framebuffer)
+{
+    gw->video.obj         = gw;
+    gw->video.framebuffer = framebuffer;
+    gw->video.frame_ready = &gamewindow_frame_ready;
+}
+
 // RichGameWindow
 typedef struct RichGameWindow {
     struct Window* win;
@@ -70,18 +112,29 @@ typedef struct RichGameWindow {
 
     int patterntab_palette_idx;
 
-    SDL_Surface* gamewin_surface;
+    uint32_t*    gamewin_framebuffer;
+    SDL_Texture* gamewin_texture;
+
+    // the debug views are drawn in the surfaces and uploaded in the textures
+    // when they change
     SDL_Surface* palettes_surface;
     SDL_Surface* patterntab1_surface;
     SDL_Surface* patterntab2_surface;
+    SDL_Texture* palettes_texture;
+    SDL_Texture* patterntab1_texture;
+    SDL_Texture* patterntab2_texture;
 } RichGameWindow;
 
 void rich_gw_destroy(void* _gw)
 {
     RichGameWindow* gw = (RichGameWindow*)_gw;
 
+    SDL_DestroyTexture(gw->gamewin_texture);
+    SDL_DestroyTexture(gw->palettes_texture);
+    SDL_DestroyTexture(gw->patterntab1_texture);
+    SDL_DestroyTexture(gw->patterntab2_texture);
     window_destroy(gw->win);
-    SDL_FreeSurface(gw->gamewin_surface);
+    free_or_fail(gw->gamewin_framebuffer);
     SDL_FreeSurface(gw->palettes_surface);
     SDL_FreeSurface(gw->patterntab1_surface);
     SDL_FreeSurface(gw->patterntab2_surface);
@@ -89,18 +142,6 @@ void rich_gw_destroy(void* _gw)
     free_or_fail(gw);
 }
 
-void rich_gw_set_pixel(void* _gw, int x, int y, uint32_t rgba)
-{
-    RichGameWindow* gw = (RichGameWindow*)_gw;
-    if (x < 0 || x > 256 || y < 0 || y > 240)
-        panic("rich_gw_set_pixel: invalid pixel %d, %d", x, y);
-
-    uint32_t* p = (uint32_t*)((uint8_t*)gw->gamewin_surface->pixels +
-                              y * gw->gamewin_surface->pitch +
-                              x * gw->gamewin_surface->format->BytesPerPixel);
-    *p          = rgba;
-}
-
 static void set_patterntab1_pixel(RichGameWindow* gw, int x, int y,
                                   uint32_t rgba)
 {
@@ -203,6 +244,15 @@ static void draw_patterntables(RichGameWindow* gw, uint8_t palette)
     }
 }
 
+static void update_debug_textures(RichGameWindow* gw)
+{
+    update_texture_from_surface(gw->palettes_texture, gw->palettes_surface);
+    update_texture_from_surface(gw->patterntab1_texture,
+                                gw->patterntab1_surface);
+    update_texture_from_surface(gw->patterntab2_texture,
+                                gw->patterntab2_surface);
+}
+
 static void rich_gw_draw(void* _gw)
 {
     RichGameWindow* gw = (RichGameWindow*)_gw;
@@ -214,6 +264,7 @@ static void rich_gw_draw(void* _gw)
         draw_context_counter = 0;
         draw_palettes(gw);
         draw_patterntables(gw, gw->patterntab_palette_idx);
+        update_debug_textures(gw);
     }
 
     calculate_and_show_fps(gw->win->sdl_window);
@@ -242,44 +293,35 @@ static void rich_gw_draw(void* _gw)
     window_draw_text(gw->win, 15 + gw->text_top_padding, gw->text_col_off, 0,
                      color_white, ppu_tostring(gw->sys->ppu));
 
-    SDL_Texture* gamewin_texture = SDL_CreateTextureFromSurface(
-        gw->win->sdl_renderer, gw->gamewin_surface);
+    update_texture_from_framebuffer(gw->gamewin_texture,
+                                    gw->gamewin_framebuffer);
     SDL_Rect gamewin_rect = {.x = gw->gamewin_x,
                              .y = gw->gamewin_y,
                              .w = gw->gamewin_width * gw->gamewin_scale,
                              .h = gw->gamewin_height * gw->gamewin_scale};
-    SDL_RenderCopy(gw->win->sdl_renderer, gamewin_texture, NULL, &gamewin_rect);
-    SDL_DestroyTexture(gamewin_texture);
+    SDL_RenderCopy(gw->win->sdl_renderer, gw->gamewin_texture, NULL,
+                   &gamewin_rect);
 
-    SDL_Texture* palettes_texture = SDL_CreateTextureFromSurface(
-        gw->win->sdl_renderer, gw->palettes_surface);
     SDL_Rect palettes_rect = {.x = gw->palettes_x,
                               .y = gw->palettes_y,
                               .w = gw->palettes_w,
                               .h = gw->palettes_h};
-    SDL_RenderCopy(gw->win->sdl_renderer, palettes_texture, NULL,
+    SDL_RenderCopy(gw->win->sdl_renderer, gw->palettes_texture, NULL,
                    &palettes_rect);
-    SDL_DestroyTexture(palettes_texture);
 
-    SDL_Texture* patterntab1_texture = SDL_CreateTextureFromSurface(
-        gw->win->sdl_renderer, gw->patterntab1_surface);
     SDL_Rect patterntab1_rect = {.x = gw->patterntab1_x,
                                  .y = gw->patterntab1_y,
                                  .w = 128 * 2,
                                  .h = 128 * 2};
-    SDL_RenderCopy(gw->win->sdl_renderer, patterntab1_texture, NULL,
+    SDL_RenderCopy(gw->win->sdl_renderer, gw->patterntab1_texture, NULL,
                    &patterntab1_rect);
-    SDL_DestroyTexture(patterntab1_texture);
 
-    SDL_Texture* patterntab2_texture = SDL_CreateTextureFromSurface(
-        gw->win->sdl_renderer, gw->patterntab2_surface);
     SDL_Rect patterntab2_rect = {.x = gw->patterntab2_x,
                                  .y = gw->patterntab2_y,
                                  .w = 128 * 2,
                                  .h = 128 * 2};
-    SDL_RenderCopy(gw->win->sdl_renderer, patterntab2_texture, NULL,
+    SDL_RenderCopy(gw->win->sdl_renderer, gw->patterntab2_texture, NULL,
                    &patterntab2_rect);
-    SDL_DestroyTexture(patterntab2_texture);
 
     window_present(gw->win);
 }
@@ -317,24 +359,31 @@ GameWindow* rich_gw_build(System* sys)
     gw->text_col_off =
         gw->gamewin_width * gw->gamewin_scale / gw->win->text_char_width + 3;
 
-    gw->gamewin_surface =
-        SDL_CreateRGBSurface(0, gw->gamewin_width, gw->gamewin_height, 32,
-                             0xFF000000, 0x00FF0000, 0x0000FF00, 0x000000FF);
+    gw->gamewin_framebuffer = calloc_or_fail(
+        gw->gamewin_width * gw->gamewin_height * sizeof(uint32_t));
+    gw->gamewin_texture = create_streaming_texture(
+        gw->win, gw->gamewin_width, gw->gamewin_height);
+
     gw->palettes_surface =
-        SDL_CreateRGBSurface(0, gw->palettes_w, gw->palettes_h, 32, 0xFF000000,
-                             0x00FF0000, 0x0000FF00, 0x000000FF);
+        SDL_CreateRGBSurface(0, gw->palettes_w, gw->palettes_h, 32, 0x00FF0000,
+                             0x0000FF00, 0x000000FF, 0xFF000000);
     gw->patterntab1_surface = SDL_CreateRGBSurface(
-        0, 128, 128, 32, 0xFF000000, 0x00FF0000, 0x0000FF00, 0x000000FF);
+        0, 128, 128, 32, 0x00FF0000, 0x0000FF00, 0x000000FF, 0xFF000000);
     gw->patterntab2_surface = SDL_CreateRGBSurface(
-        0, 128, 128, 32, 0xFF000000, 0x00FF0000, 0x0000FF00, 0x000000FF);
+        0, 128, 128, 32, 0x00FF0000, 0x0000FF00, 0x000000FF, 0xFF000000);
+    gw->palettes_texture =
+        create_streaming_texture(gw->win, gw->palettes_w, gw->palettes_h);
+    gw->patterntab1_texture = create_streaming_texture(gw->win, 128, 128);
+    gw->patterntab2_texture = create_streaming_texture(gw->win, 128, 128);
+    update_debug_textures(gw);
 
     GameWindow* res = malloc_or_fail(sizeof(GameWindow));
     res->obj        = gw;
     res->draw       = &rich_gw_draw;
-    res->set_pixel  = &rich_gw_set_pixel;
     res->destroy    = &rich_gw_destroy;
     res->show_popup = NULL;
-    ppu_set_game_window(sys->ppu, res);
+    init_video_sink(res, gw->gamewin_framebuffer);
+    ppu_set_video_sink(sys->ppu, &res->video);
     return res;
 }
 
@@ -350,30 +399,20 @@ typedef struct SimpleGameWindow {
     const char* popup_txt;
     int         popup_count;
 
-    SDL_Surface* gamewin_surface;
+    uint32_t*    gamewin_framebuffer;
+    SDL_Texture* gamewin_texture;
 } SimpleGameWindow;
 
 static void simple_gw_destroy(void* _gw)
 {
     SimpleGameWindow* gw = (SimpleGameWindow*)_gw;
 
+    SDL_DestroyTexture(gw->gamewin_texture);
     window_destroy(gw->win);
-    SDL_FreeSurface(gw->gamewin_surface);
+    free_or_fail(gw->gamewin_framebuffer);
     free_or_fail(gw);
 }
 
-static void simple_gw_set_pixel(void* _gw, int x, int y, uint32_t rgba)
-{
-    SimpleGameWindow* gw = (SimpleGameWindow*)_gw;
-    if (x < 0 || x > 256 || y < 0 || y > 240)
-        panic("simple_gw_set_pixel: invalid pixel %d, %d", x, y);
-
-    uint32_t* p = (uint32_t*)((uint8_t*)gw->gamewin_surface->pixels +
-                              y * gw->gamewin_surface->pitch +
-                              x * gw->gamewin_surface->format->BytesPerPixel);
-    *p          = rgba;
-}
-
 static void simple_gw_draw(void* _gw)
 {
     SimpleGameWindow* gw = (SimpleGameWindow*)_gw;
@@ -382,14 +421,14 @@ static void simple_gw_draw(void* _gw)
 
     calculate_and_show_fps(gw->win->sdl_window);
 
-    SDL_Texture* gamewin_texture = SDL_CreateTextureFromSurface(
-        gw->win->sdl_renderer, gw->gamewin_surface);
+    update_texture_from_framebuffer(gw->gamewin_texture,
+                                    gw->gamewin_framebuffer);
     SDL_Rect gamewin_rect = {.x = 0,
                              .y = 0,
                              .w = gw->gamewin_width * gw->gamewin_scale,
                              .h = gw->gamewin_height * gw->gamewin_scale};
-    SDL_RenderCopy(gw->win->sdl_renderer, gamewin_texture, NULL, &gamewin_rect);
-    SDL_DestroyTexture(gamewin_texture);
+    SDL_RenderCopy(gw->win->sdl_renderer, gw->gamewin_texture, NULL,
+                   &gamewin_rect);
 
     if (gw->popup_count > 0) {
         window_draw_text(gw->win, 1, 1, 1, color_white, gw->popup_txt);
@@ -422,17 +461,18 @@ GameWindow* simple_gw_build(struct System* sys)
     gw->win = window_build(gw->gamewin_width * gw->gamewin_scale,
                            gw->gamewin_height * gw->gamewin_scale);
 
-    gw->gamewin_surface =
-        SDL_CreateRGBSurface(0, gw->gamewin_width, gw->gamewin_height, 32,
-                             0xFF000000, 0x00FF0000, 0x0000FF00, 0x000000FF);
+    gw->gamewin_framebuffer = calloc_or_fail(
+        gw->gamewin_width * gw->gamewin_height * sizeof(uint32_t));
+    gw->gamewin_texture = create_streaming_texture(
+        gw->win, gw->gamewin_width, gw->gamewin_height);
 
     GameWindow* res = malloc_or_fail(sizeof(GameWindow));
     res->obj        = gw;
     res->draw       = &simple_gw_draw;
-    res->set_pixel  = &simple_gw_set_pixel;
     res->destroy    = &simple_gw_destroy;
     res->show_popup = &simple_gw_show_popup;
-    ppu_set_game_window(sys->ppu, res);
+    init_video_sink(res, gw->gamewin_framebuffer);
+    ppu_set_video_sink(sys->ppu, &res->video);
     return res;
 }
 
@@ -443,11 +483,6 @@ void gamewindow_destroy(GameWindow* gw)
     free_or_fail(gw);
 }
 
-void gamewindow_set_pixel(GameWindow* gw, int x, int y, uint32_t rgba)
-{
-    gw->set_pixel(gw->obj, x, y, rgba);
-}
-
 void gamewindow_draw(GameWindow* gw) { gw->draw(gw->obj); }
 
 void gamewindow_show_popup(GameWindow* gw, const char* txt)
@@ -4,19 +4,20 @@
 #include <stdint.h>
 #include <SDL2/SDL.h>
 
-#define PACK_RGBA(r, g, b, a)                                                  \
-    (((uint32_t)r << 24) | ((uint32_t)g << 16) | ((uint32_t)b << 8) | a)
-#define PACK_RGB(r, g, b)                                                      \
-    (((uint32_t)r << 24) | ((uint32_t)g << 16) | ((uint32_t)b << 8) | 0xFFu)
+#include "video_sink.h"
 
 extern long latency;
+// appended to the title, e.g. the netplay stats. Empty by default
+extern char title_info[128];
 
 struct System;
 struct Window;
 
 typedef struct GameWindow {
     void* obj;
-    void (*set_pixel)(void* obj, int x, int y, uint32_t rgba);
+    // the PPU renders in the framebuffer of the window, which is uploaded in
+    // a streaming texture and drawn once the frame is ready
+    VideoSink video;
     void (*draw)(void* obj);
     void (*destroy)(void* obj);
     void (*show_popup)(void* obj, const char* txt);
@@ -26,7 +27,6 @@ GameWindow* rich_gw_build(struct System* sys);
 GameWindow* simple_gw_build(struct System* sys);
 
 void gamewindow_destroy(GameWindow* gw);
-void gamewindow_set_pixel(GameWindow* gw, int x, int y, uint32_t rgba);
 void gamewindow_draw(GameWindow* gw);
 
 // TXT must live for some frames. Ideally, use it only with global strings
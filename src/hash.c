@@ -0,0 +1,151 @@
+#include "hash.h"
+
+#include <string.h>
+
+#define PRIME_1 0x9E3779B185EBCA87ull
+#define PRIME_2 0xC2B2AE3D27D4EB4Full
+#define PRIME_3 0x165667B19E3779F9ull
+#define PRIME_4 0x85EBCA77C2B2AE63ull
+#define PRIME_5 0x27D4EB2F165667C5ull
+
+static inline uint64_t rotl(uint64_t x, int r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t read64(const uint8_t* p)
+{
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint32_t read32(const uint8_t* p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint64_t round64(uint64_t acc, uint64_t input)
+{
+    acc += input * PRIME_2;
+    acc = rotl(acc, 31);
+    return acc * PRIME_1;
+}
+
+static inline uint64_t merge_round(uint64_t acc, uint64_t lane)
+{
+    acc ^= round64(0, lane);
+    return acc * PRIME_1 + PRIME_4;
+}
+
+// The stripes of p, it returns the bytes consumed
+static uint64_t consume_stripes(uint64_t* lanes, const uint8_t* p,
+                                uint64_t size)
+{
+    uint64_t a = lanes[0], b = lanes[1], c = lanes[2], d = lanes[3];
+    uint64_t i = 0;
+    for (; i + 32 <= size; i += 32) {
+        a = round64(a, read64(p + i));
+        b = round64(b, read64(p + i + 8));
+        c = round64(c, read64(p + i + 16));
+        d = round64(d, read64(p + i + 24));
+    }
+    lanes[0] = a;
+    lanes[1] = b;
+    lanes[2] = c;
+    lanes[3] = d;
+    return i;
+}
+
+void hasher_init(Hasher* h, uint64_t seed)
+{
+    h->lanes[0]    = seed + PRIME_1 + PRIME_2;
+    h->lanes[1]    = seed + PRIME_2;
+    h->lanes[2]    = seed;
+    h->lanes[3]    = seed - PRIME_1;
+    h->stripe_size = 0;
+    h->total       = 0;
+    h->seed        = seed;
+}
+
+void hasher_update(Hasher* h, const void* data, uint64_t size)
+{
+    const uint8_t* p = (const uint8_t*)data;
+    h->total += size;
+
+    if (h->stripe_size > 0) {
+        uint64_t fill = 32 - h->stripe_size;
+        if (fill > size)
+            fill = size;
+        memcpy(h->stripe + h->stripe_size, p, fill);
+        h->stripe_size += fill;
+        p += fill;
+        size -= fill;
+        if (h->stripe_size < 32)
+            return;
+        consume_stripes(h->lanes, h->stripe, 32);
+        h->stripe_size = 0;
+    }
+
+    uint64_t consumed = consume_stripes(h->lanes, p, size);
+    memcpy(h->stripe, p + consumed, size - consumed);
+    h->stripe_size = size - consumed;
+}
+
+uint64_t hasher_final(const Hasher* h)
+{
+    uint64_t acc;
+    if (h->total >= 32) {
+        acc = rotl(h->lanes[0], 1) + rotl(h->lanes[1], 7) +
+              rotl(h->lanes[2], 12) + rotl(h->lanes[3], 18);
+        for (int i = 0; i < 4; ++i)
+            acc = merge_round(acc, h->lanes[i]);
+    } else {
+        acc = h->seed + PRIME_5;
+    }
+    acc += h->total;
+
+    const uint8_t* p    = h->stripe;
+    uint32_t       left = h->stripe_size;
+    for (; left >= 8; p += 8, left -= 8)
+        acc = rotl(acc ^ round64(0, read64(p)), 27) * PRIME_1 + PRIME_4;
+    if (left >= 4) {
+        acc = rotl(acc ^ (read32(p) * PRIME_1), 23) * PRIME_2 + PRIME_3;
+        p += 4;
+        left -= 4;
+    }
+    for (; left > 0; p++, left--)
+        acc = rotl(acc ^ (*p * PRIME_5), 11) * PRIME_1;
+
+    acc ^= acc >> 33;
+    acc *= PRIME_2;
+    acc ^= acc >> 29;
+    acc *= PRIME_3;
+    acc ^= acc >> 32;
+    return acc;
+}
+
+static void hasher_write(Writer* w, const void* data, uint64_t size)
+{
+    hasher_update((Hasher*)w->obj, data, size);
+    w->size += size;
+}
+
+Writer writer_to_hasher(Hasher* h)
+{
+    Writer w;
+    memset(&w, 0, sizeof(w));
+    w.obj   = h;
+    w.write = hasher_write;
+    return w;
+}
+
+uint64_t hash64(const void* data, uint64_t size, uint64_t seed)
+{
+    Hasher h;
+    hasher_init(&h, seed);
+    hasher_update(&h, data, size);
+    return hasher_final(&h);
+}
@@ -0,0 +1,29 @@
+#ifndef HASH_H
+#define HASH_H
+
+#include <stdint.h>
+
+#include "stream.h"
+
+// Fast non-cryptographic 64-bit hash (the xxHash64 algorithm). The input is
+// consumed in stripes of 32 bytes by four independent lanes, the compiler can
+// keep them in flight at the same time. It is meant to compare states, e.g.
+// two netplay peers or two runs of the same game (see system_hash())
+typedef struct Hasher {
+    uint64_t lanes[4];
+    uint8_t  stripe[32]; // the bytes that do not fill a stripe yet
+    uint32_t stripe_size;
+    uint64_t total;
+    uint64_t seed;
+} Hasher;
+
+void     hasher_init(Hasher* h, uint64_t seed);
+void     hasher_update(Hasher* h, const void* data, uint64_t size);
+uint64_t hasher_final(const Hasher* h);
+
+// A writer that feeds h, to hash anything that can be serialized
+Writer writer_to_hasher(Hasher* h);
+
+uint64_t hash64(const void* data, uint64_t size, uint64_t seed);
+
+#endif
@@ -2,6 +2,7 @@
 #include "alloc.h"
 #include "cartridge.h"
 #include "logging.h"
+#include "stream.h"
 #include "system.h"
 #include "ppu.h"
 
@@ -52,52 +53,64 @@ Mapper* mapper_build(Cartridge* cart)
 {
     Mapper* map          = malloc_or_fail(sizeof(Mapper));
     map->step            = NULL;
+    map->step_cycle      = 0;
     map->nametable_read  = NULL;
     map->nametable_write = NULL;
     map->notify_fetching = NULL;
+    map->map_cpu_pages   = NULL;
+    map->map_ppu_pages   = NULL;
+    map->irq_dots        = NULL;
     map->destroy         = &generic_destroy;
 
     switch (cart->mapper) {
         case 0:
         case 2: {
-            NROM* nrom       = NROM_build(cart);
-            map->obj         = nrom;
-            map->name        = "NROM";
-            map->read        = &NROM_read;
-            map->write       = &NROM_write;
-            map->serialize   = &NROM_serialize;
-            map->deserialize = &NROM_deserialize;
+            NROM* nrom         = NROM_build(cart);
+            map->obj           = nrom;
+            map->name          = "NROM";
+            map->read          = &NROM_read;
+            map->write         = &NROM_write;
+            map->map_cpu_pages = &NROM_map_cpu_pages;
+            map->map_ppu_pages = &NROM_map_ppu_pages;
+            map->serialize     = &NROM_serialize;
+            map->deserialize   = &NROM_deserialize;
             break;
         }
         case 1: {
-            MMC1* mmc1       = MMC1_build(cart);
-            map->obj         = mmc1;
-            map->name        = "MMC1";
-            map->read        = &MMC1_read;
-            map->write       = &MMC1_write;
-            map->serialize   = &MMC1_serialize;
-            map->deserialize = &MMC1_deserialize;
+            MMC1* mmc1         = MMC1_build(cart);
+            map->obj           = mmc1;
+            map->name          = "MMC1";
+            map->read          = &MMC1_read;
+            map->write         = &MMC1_write;
+            map->map_cpu_pages = &MMC1_map_cpu_pages;
+            map->serialize     = &MMC1_serialize;
+            map->deserialize   = &MMC1_deserialize;
             break;
         }
         case 3: {
-            CNROM* cnrom     = CNROM_build(cart);
-            map->obj         = cnrom;
-            map->name        = "CNROM";
-            map->read        = &CNROM_read;
-            map->write       = &CNROM_write;
-            map->serialize   = &CNROM_serialize;
-            map->deserialize = &CNROM_deserialize;
+            CNROM* cnrom       = CNROM_build(cart);
+            map->obj           = cnrom;
+            map->name          = "CNROM";
+            map->read          = &CNROM_read;
+            map->write         = &CNROM_write;
+            map->map_cpu_pages = &CNROM_map_cpu_pages;
+            map->serialize     = &CNROM_serialize;
+            map->deserialize   = &CNROM_deserialize;
             break;
         }
         case 4: {
-            MMC3* mmc3       = MMC3_build(cart);
-            map->obj         = mmc3;
-            map->name        = "MMC3";
-            map->step        = &MMC3_step;
-            map->read        = &MMC3_read;
-            map->write       = &MMC3_write;
-            map->serialize   = &MMC3_serialize;
-            map->deserialize = &MMC3_deserialize;
+            MMC3* mmc3         = MMC3_build(cart);
+            map->obj           = mmc3;
+            map->name          = "MMC3";
+            map->step          = &MMC3_step;
+            map->step_cycle    = MMC3_STEP_CYCLE;
+            map->irq_dots      = &MMC3_irq_dots;
+            map->read          = &MMC3_read;
+            map->write         = &MMC3_write;
+            map->map_cpu_pages = &MMC3_map_cpu_pages;
+            map->map_ppu_pages = &MMC3_map_ppu_pages;
+            map->serialize     = &MMC3_serialize;
+            map->deserialize   = &MMC3_deserialize;
             break;
         }
         case 5: {
@@ -105,6 +118,7 @@ Mapper* mapper_build(Cartridge* cart)
             map->obj             = mmc5;
             map->name            = "MMC5";
             map->step            = &MMC5_step;
+            map->irq_dots        = &MMC5_irq_dots;
             map->notify_fetching = &MMC5_notify_fetching;
             map->nametable_read  = &MMC5_nametable_read;
             map->nametable_write = &MMC5_nametable_write;
@@ -115,54 +129,60 @@ Mapper* mapper_build(Cartridge* cart)
             break;
         }
         case 7: {
-            AxROM* axrom     = AxROM_build(cart);
-            map->obj         = axrom;
-            map->name        = "AxROM";
-            map->read        = &AxROM_read;
-            map->write       = &AxROM_write;
-            map->serialize   = &AxROM_serialize;
-            map->deserialize = &AxROM_deserialize;
+            AxROM* axrom       = AxROM_build(cart);
+            map->obj           = axrom;
+            map->name          = "AxROM";
+            map->read          = &AxROM_read;
+            map->write         = &AxROM_write;
+            map->map_cpu_pages = &AxROM_map_cpu_pages;
+            map->serialize     = &AxROM_serialize;
+            map->deserialize   = &AxROM_deserialize;
             break;
         }
         case 9: {
-            MMC2* mmc2       = MMC2_build(cart);
-            map->obj         = mmc2;
-            map->name        = "MMC2";
-            map->read        = &MMC2_read;
-            map->write       = &MMC2_write;
-            map->serialize   = &MMC2_serialize;
-            map->deserialize = &MMC2_deserialize;
+            MMC2* mmc2         = MMC2_build(cart);
+            map->obj           = mmc2;
+            map->name          = "MMC2";
+            map->read          = &MMC2_read;
+            map->write         = &MMC2_write;
+            map->map_cpu_pages = &MMC2_map_cpu_pages;
+            map->serialize     = &MMC2_serialize;
+            map->deserialize   = &MMC2_deserialize;
             break;
         }
         case 10: {
-            MMC4* mmc4       = MMC4_build(cart);
-            map->obj         = mmc4;
-            map->name        = "MMC4";
-            map->read        = &MMC4_read;
-            map->write       = &MMC4_write;
-            map->serialize   = &MMC4_serialize;
-            map->deserialize = &MMC4_deserialize;
+            MMC4* mmc4         = MMC4_build(cart);
+            map->obj           = mmc4;
+            map->name          = "MMC4";
+            map->read          = &MMC4_read;
+            map->write         = &MMC4_write;
+            map->map_cpu_pages = &MMC4_map_cpu_pages;
+            map->serialize     = &MMC4_serialize;
+            map->deserialize   = &MMC4_deserialize;
             break;
         }
         case 71: {
-            Map071* map071   = Map071_build(cart);
-            map->obj         = map071;
-            map->name        = "Map071";
-            map->read        = &Map071_read;
-            map->write       = &Map071_write;
-            map->serialize   = &Map071_serialize;
-            map->deserialize = &Map071_deserialize;
+            Map071* map071     = Map071_build(cart);
+            map->obj           = map071;
+            map->name          = "Map071";
+            map->read          = &Map071_read;
+            map->write         = &Map071_write;
+            map->map_cpu_pages = &Map071_map_cpu_pages;
+            map->serialize     = &Map071_serialize;
+            map->deserialize   = &Map071_deserialize;
             break;
         }
         case 163: {
-            FC_001* fc_001   = FC_001_build(cart);
-            map->obj         = fc_001;
-            map->name        = "FC_001";
-            map->step        = &FC_001_step;
-            map->read        = &FC_001_read;
-            map->write       = &FC_001_write;
-            map->serialize   = &FC_001_serialize;
-            map->deserialize = &FC_001_deserialize;
+            FC_001* fc_001     = FC_001_build(cart);
+            map->obj           = fc_001;
+            map->name          = "FC_001";
+            map->step          = &FC_001_step;
+            map->step_cycle    = FC_001_STEP_CYCLE;
+            map->read          = &FC_001_read;
+            map->write         = &FC_001_write;
+            map->map_cpu_pages = &FC_001_map_cpu_pages;
+            map->serialize     = &FC_001_serialize;
+            map->deserialize   = &FC_001_deserialize;
             break;
         }
         default:
@@ -193,14 +213,49 @@ void mapper_step(Mapper* map, System* sys)
         map->step(map->obj, sys);
 }
 
-void mapper_serialize(Mapper* map, FILE* fout)
+void mapper_map_cpu_pages(Mapper* map, uint8_t** read_pages,
+                          uint8_t** write_pages)
 {
-    return map->serialize(map->obj, fout);
+    // Mappers without the hook are always accessed through the slow path
+    if (map->map_cpu_pages)
+        map->map_cpu_pages(map->obj, read_pages, write_pages);
 }
 
-void mapper_deserialize(Mapper* map, FILE* fin)
+void mapper_map_ppu_pages(Mapper* map, Ppu* ppu, uint8_t** read_pages,
+                          uint8_t** write_pages)
 {
-    map->deserialize(map->obj, fin);
+    for (int page = 0; page < 0x40; ++page) {
+        read_pages[page]  = NULL;
+        write_pages[page] = NULL;
+    }
+    if (map->map_ppu_pages)
+        map->map_ppu_pages(map->obj, read_pages, write_pages);
+
+    // the palettes (page 0x3F) are always accessed through the slow path
+    if (map->nametable_read || map->nametable_write)
+        return;
+    for (int page = 0x20; page < 0x3F; ++page) {
+        uint16_t off = mirror_address(ppu->sys->cart->mirror, page << 8);
+        read_pages[page]  = &ppu->nametable_data[off & 0x7ff];
+        write_pages[page] = &ppu->nametable_data[off & 0x7ff];
+    }
+}
+
+uint64_t mapper_irq_dots(Mapper* map, System* sys)
+{
+    if (!map->irq_dots)
+        return NO_EVENT;
+    return map->irq_dots(map->obj, sys);
+}
+
+void mapper_serialize(Mapper* map, Writer* w)
+{
+    return map->serialize(map->obj, w);
+}
+
+void mapper_deserialize(Mapper* map, Reader* r)
+{
+    map->deserialize(map->obj, r);
 }
 
 uint8_t mapper_nametable_read(Mapper* map, Ppu* ppu, uint16_t addr)
@@ -7,6 +7,8 @@
 struct Cartridge;
 struct System;
 struct Buffer;
+struct Writer;
+struct Reader;
 struct Ppu;
 
 typedef enum FetchingTarget {
@@ -18,6 +20,9 @@ typedef struct Mapper {
     void*       obj;
     const char* name;
     void (*step)(void* map, struct System* sys);
+    // if not 0, step() does something only at this PPU cycle of a scanline:
+    // the PPU can skip the other dots in which it has nothing to do
+    uint16_t step_cycle;
     void (*destroy)(void* map);
     uint8_t (*read)(void* map, uint16_t addr);
     void (*write)(void* map, uint16_t addr, uint8_t value);
@@ -25,8 +30,15 @@ typedef struct Mapper {
     void (*nametable_write)(void* map, struct Ppu* ppu, uint16_t addr,
                             uint8_t value);
     void (*notify_fetching)(void* map, struct Ppu* ppu, FetchingTarget ft);
-    void (*serialize)(void* map, FILE* fout);
-    void (*deserialize)(void* map, FILE* fin);
+    void (*map_cpu_pages)(void* map, uint8_t** read_pages,
+                          uint8_t** write_pages);
+    // same as map_cpu_pages() for the pattern tables [0x0000 -> 0x1FFF] of
+    // the PPU bus
+    void (*map_ppu_pages)(void* map, uint8_t** read_pages,
+                          uint8_t** write_pages);
+    uint64_t (*irq_dots)(void* map, struct System* sys);
+    void (*serialize)(void* map, struct Writer* w);
+    void (*deserialize)(void* map, struct Reader* r);
 } Mapper;
 
 Mapper* mapper_build(struct Cartridge* cart);
@@ -39,7 +51,17 @@ void    mapper_nametable_write(Mapper* map, struct Ppu* ppu, uint16_t addr,
 uint8_t mapper_read(Mapper* map, uint16_t addr);
 void    mapper_write(Mapper* map, uint16_t addr, uint8_t value);
 void    mapper_step(Mapper* map, struct System* sys);
-void    mapper_serialize(Mapper* map, FILE* fout);
-void    mapper_deserialize(Mapper* map, FILE* fin);
+void    mapper_map_cpu_pages(Mapper* map, uint8_t** read_pages,
+                             uint8_t** write_pages);
+// Map the pattern tables and, when the mapper does not handle them, the
+// nametables of the PPU bus [0x0000 -> 0x3EFF]
+void    mapper_map_ppu_pages(Mapper* map, struct Ppu* ppu, uint8_t** read_pages,
+                             uint8_t** write_pages);
+
+// Lower bound of the number of PPU dots before the mapper can trigger an IRQ
+// (NO_EVENT if it cannot)
+uint64_t mapper_irq_dots(Mapper* map, struct System* sys);
+void    mapper_serialize(Mapper* map, struct Writer* w);
+void    mapper_deserialize(Mapper* map, struct Reader* r);
 
 #endif
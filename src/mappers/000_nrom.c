@@ -3,7 +3,7 @@
 
 NROM* NROM_build(Cartridge* cart)
 {
-    NROM* map      = malloc_or_fail(sizeof(NROM));
+    NROM* map      = calloc_or_fail(sizeof(NROM));
     map->cart      = cart;
     map->prg_banks = cart->PRG_size / 0x4000;
     map->prg_bank1 = 0;
@@ -55,6 +55,30 @@ void NROM_write(void* _map, uint16_t addr, uint8_t value)
     }
 }
 
+void NROM_map_cpu_pages(void* _map, uint8_t** read_pages,
+                        uint8_t** write_pages)
+{
+    NROM*      map  = (NROM*)_map;
+    Cartridge* cart = map->cart;
+
+    map_pages(read_pages, 0x6000, 0x2000, cart->SRAM, 0, cart->SRAM_size);
+    map_pages(write_pages, 0x6000, 0x2000, cart->SRAM, 0, cart->SRAM_size);
+    map_pages(read_pages, 0x8000, 0x4000, cart->PRG,
+              (int64_t)map->prg_bank1 * 0x4000, cart->PRG_size);
+    map_pages(read_pages, 0xC000, 0x4000, cart->PRG,
+              (int64_t)map->prg_bank2 * 0x4000, cart->PRG_size);
+}
+
+void NROM_map_ppu_pages(void* _map, uint8_t** read_pages,
+                        uint8_t** write_pages)
+{
+    NROM*      map  = (NROM*)_map;
+    Cartridge* cart = map->cart;
+
+    map_pages(read_pages, 0x0000, 0x2000, cart->CHR, 0, cart->CHR_size);
+    map_pages(write_pages, 0x0000, 0x2000, cart->CHR, 0, cart->CHR_size);
+}
+
 static void NROM_postcheck(void* _map)
 {
     NROM* map = (NROM*)_map;
@@ -6,6 +6,8 @@
 
 struct Cartridge;
 struct System;
+struct Writer;
+struct Reader;
 
 typedef struct NROM {
     struct Cartridge* cart;
@@ -15,7 +17,11 @@ typedef struct NROM {
 NROM*   NROM_build(struct Cartridge* cart);
 uint8_t NROM_read(void* _map, uint16_t addr);
 void    NROM_write(void* _map, uint16_t addr, uint8_t value);
-void    NROM_serialize(void* _map, FILE* fout);
-void    NROM_deserialize(void* _map, FILE* fin);
+void    NROM_map_cpu_pages(void* _map, uint8_t** read_pages,
+                           uint8_t** write_pages);
+void    NROM_map_ppu_pages(void* _map, uint8_t** read_pages,
+                           uint8_t** write_pages);
+void    NROM_serialize(void* _map, struct Writer* w);
+void    NROM_deserialize(void* _map, struct Reader* r);
 
 #endif
@@ -176,5 +176,19 @@ void MMC1_write(void* _map, uint16_t addr, uint8_t value)
             addr, value);
 }
 
+void MMC1_map_cpu_pages(void* _map, uint8_t** read_pages,
+                        uint8_t** write_pages)
+{
+    MMC1*      map  = (MMC1*)_map;
+    Cartridge* cart = map->cart;
+
+    map_pages(read_pages, 0x6000, 0x2000, cart->SRAM, 0, cart->SRAM_size);
+    map_pages(write_pages, 0x6000, 0x2000, cart->SRAM, 0, cart->SRAM_size);
+    map_pages(read_pages, 0x8000, 0x4000, cart->PRG, map->prg_offsets[0],
+              cart->PRG_size);
+    map_pages(read_pages, 0xC000, 0x4000, cart->PRG, map->prg_offsets[1],
+              cart->PRG_size);
+}
+
 GEN_SERIALIZER(MMC1)
 GEN_DESERIALIZER(MMC1)
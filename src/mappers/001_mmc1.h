@@ -6,6 +6,8 @@
 
 struct Cartridge;
 struct System;
+struct Writer;
+struct Reader;
 
 typedef struct MMC1 {
     struct Cartridge* cart;
@@ -23,7 +25,9 @@ typedef struct MMC1 {
 MMC1*   MMC1_build(struct Cartridge* cart);
 uint8_t MMC1_read(void* _map, uint16_t addr);
 void    MMC1_write(void* _map, uint16_t addr, uint8_t value);
-void    MMC1_serialize(void* _map, FILE* fout);
-void    MMC1_deserialize(void* _map, FILE* fin);
+void    MMC1_map_cpu_pages(void* _map, uint8_t** read_pages,
+                           uint8_t** write_pages);
+void    MMC1_serialize(void* _map, struct Writer* w);
+void    MMC1_deserialize(void* _map, struct Reader* r);
 
 #endif
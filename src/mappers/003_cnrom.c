@@ -71,5 +71,18 @@ void CNROM_write(void* _map, uint16_t addr, uint8_t value)
     warning("unexpected write @ 0x%04x in CNROM mapper [0x%02x]", addr, value);
 }
 
+void CNROM_map_cpu_pages(void* _map, uint8_t** read_pages,
+                         uint8_t** write_pages)
+{
+    CNROM*     map  = (CNROM*)_map;
+    Cartridge* cart = map->cart;
+
+    map_pages(read_pages, 0x6000, 0x2000, cart->SRAM, 0, cart->SRAM_size);
+    map_pages(write_pages, 0x6000, 0x2000, cart->SRAM, 0, cart->SRAM_size);
+    map_pages(read_pages, 0x8000, 0x4000, cart->PRG, 0, cart->PRG_size);
+    map_pages(read_pages, 0xC000, 0x4000, cart->PRG,
+              CNROM_calc_prg_bank_offset(map, -1), cart->PRG_size);
+}
+
 GEN_SERIALIZER(CNROM)
 GEN_DESERIALIZER(CNROM)
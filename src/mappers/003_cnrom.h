@@ -6,6 +6,8 @@
 
 struct Cartridge;
 struct System;
+struct Writer;
+struct Reader;
 
 typedef struct CNROM {
     struct Cartridge* cart;
@@ -15,7 +17,9 @@ typedef struct CNROM {
 CNROM*  CNROM_build(struct Cartridge* cart);
 uint8_t CNROM_read(void* _map, uint16_t addr);
 void    CNROM_write(void* _map, uint16_t addr, uint8_t value);
-void    CNROM_serialize(void* _map, FILE* fout);
-void    CNROM_deserialize(void* _map, FILE* fin);
+void    CNROM_map_cpu_pages(void* _map, uint8_t** read_pages,
+                            uint8_t** write_pages);
+void    CNROM_serialize(void* _map, struct Writer* w);
+void    CNROM_deserialize(void* _map, struct Reader* r);
 
 #endif
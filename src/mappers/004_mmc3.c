@@ -111,7 +111,7 @@ void MMC3_step(void* _map, System* sys)
 {
     MMC3* map = (MMC3*)_map;
 
-    if (sys->ppu->cycle != 280)
+    if (sys->ppu->cycle != MMC3_STEP_CYCLE)
         return;
     if (sys->ppu->scanline >= 240 && sys->ppu->scanline <= 260)
         return;
@@ -177,5 +177,65 @@ void MMC3_write(void* _map, uint16_t addr, uint8_t value)
             addr, value);
 }
 
+uint64_t MMC3_irq_dots(void* _map, System* sys)
+{
+    MMC3* map = (MMC3*)_map;
+    Ppu*  ppu = sys->ppu;
+
+    if (!map->irq_enable)
+        return NO_EVENT;
+    if (!ppu->mask_flags.show_background && !ppu->mask_flags.show_sprites)
+        return NO_EVENT;
+    if (map->irq_counter == 0 && map->reload == 0)
+        return NO_EVENT;
+
+    // The counter is clocked at dot 280 (MMC3_STEP_CYCLE) of every rendering
+    // scanline, the IRQ is triggered when it goes from 1 to 0
+    uint32_t clocks =
+        map->irq_counter == 0 ? (uint32_t)map->reload + 1 : map->irq_counter;
+    uint16_t scanline =
+        ppu->cycle < MMC3_STEP_CYCLE ? ppu->scanline : ppu->scanline + 1;
+    if (scanline >= 240 && scanline <= 260)
+        scanline = 261;
+    else if (scanline > 261)
+        scanline = 0;
+
+    // a scanline is at least 340 dots long (odd frames skip one)
+    return ppu_dots_until(ppu, scanline, MMC3_STEP_CYCLE) +
+           (uint64_t)(clocks - 1) * 340;
+}
+
+void MMC3_map_cpu_pages(void* _map, uint8_t** read_pages,
+                        uint8_t** write_pages)
+{
+    MMC3*      map  = (MMC3*)_map;
+    Cartridge* cart = map->cart;
+
+    map_pages(read_pages, 0x6000, 0x2000, cart->SRAM, 0, cart->SRAM_size);
+    map_pages(write_pages, 0x6000, 0x2000, cart->SRAM, 0, cart->SRAM_size);
+    map_pages(read_pages, 0x8000, 0x2000, cart->PRG, map->prg_offsets[0],
+              cart->PRG_size);
+    map_pages(read_pages, 0xA000, 0x2000, cart->PRG, map->prg_offsets[1],
+              cart->PRG_size);
+    map_pages(read_pages, 0xC000, 0x2000, cart->PRG, map->prg_offsets[2],
+              cart->PRG_size);
+    map_pages(read_pages, 0xE000, 0x2000, cart->PRG, map->prg_offsets[3],
+              cart->PRG_size);
+}
+
+void MMC3_map_ppu_pages(void* _map, uint8_t** read_pages,
+                        uint8_t** write_pages)
+{
+    MMC3*      map  = (MMC3*)_map;
+    Cartridge* cart = map->cart;
+
+    for (int bank = 0; bank < 8; ++bank) {
+        map_pages(read_pages, bank * 0x400, 0x400, cart->CHR,
+                  map->chr_offsets[bank], cart->CHR_size);
+        map_pages(write_pages, bank * 0x400, 0x400, cart->CHR,
+                  map->chr_offsets[bank], cart->CHR_size);
+    }
+}
+
 GEN_SERIALIZER(MMC3)
 GEN_DESERIALIZER(MMC3)
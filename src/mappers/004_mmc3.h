@@ -6,6 +6,11 @@
 
 struct Cartridge;
 struct System;
+struct Writer;
+struct Reader;
+
+// the IRQ counter is clocked at this dot of the rendering scanlines
+#define MMC3_STEP_CYCLE 280
 
 typedef struct MMC3 {
     struct Cartridge* cart;
@@ -20,11 +25,16 @@ typedef struct MMC3 {
     uint8_t           irq_enable;
 } MMC3;
 
-MMC3*   MMC3_build(struct Cartridge* cart);
-uint8_t MMC3_read(void* _map, uint16_t addr);
-void    MMC3_write(void* _map, uint16_t addr, uint8_t value);
-void    MMC3_step(void* _map, struct System* sys);
-void    MMC3_serialize(void* _map, FILE* fout);
-void    MMC3_deserialize(void* _map, FILE* fin);
+MMC3*    MMC3_build(struct Cartridge* cart);
+uint8_t  MMC3_read(void* _map, uint16_t addr);
+void     MMC3_write(void* _map, uint16_t addr, uint8_t value);
+void     MMC3_step(void* _map, struct System* sys);
+uint64_t MMC3_irq_dots(void* _map, struct System* sys);
+void     MMC3_map_cpu_pages(void* _map, uint8_t** read_pages,
+                            uint8_t** write_pages);
+void     MMC3_map_ppu_pages(void* _map, uint8_t** read_pages,
+                            uint8_t** write_pages);
+void     MMC3_serialize(void* _map, struct Writer* w);
+void     MMC3_deserialize(void* _map, struct Reader* r);
 
 #endif
@@ -391,6 +391,19 @@ void MMC5_step(void* _map, System* sys)
     }
 }
 
+uint64_t MMC5_irq_dots(void* _map, System* sys)
+{
+    MMC5* map = (MMC5*)_map;
+    Ppu*  ppu = sys->ppu;
+
+    if (!map->irq_enable || map->irq_target == 0 || map->irq_target >= 240)
+        return NO_EVENT;
+    // MMC5_step() keeps triggering the IRQ for the whole target scanline
+    if (ppu->scanline == map->irq_target)
+        return 0;
+    return ppu_dots_until(ppu, map->irq_target, 0);
+}
+
 void MMC5_notify_fetching(void* _map, Ppu* ppu, FetchingTarget ft)
 {
     MMC5* map = (MMC5*)_map;
@@ -7,6 +7,8 @@
 enum FetchingTarget;
 struct Cartridge;
 struct System;
+struct Writer;
+struct Reader;
 struct Ppu;
 
 typedef struct MMC5 {
@@ -42,7 +44,9 @@ void    MMC5_nametable_write(void* _map, struct Ppu* ppu, uint16_t addr,
 uint8_t MMC5_read(void* _map, uint16_t addr);
 void    MMC5_write(void* _map, uint16_t addr, uint8_t value);
 void    MMC5_step(void* _map, struct System* sys);
-void    MMC5_serialize(void* _map, FILE* fout);
-void    MMC5_deserialize(void* _map, FILE* fin);
+void    MMC5_serialize(void* _map, struct Writer* w);
+void    MMC5_deserialize(void* _map, struct Reader* r);
+
+uint64_t MMC5_irq_dots(void* _map, struct System* sys);
 
 #endif
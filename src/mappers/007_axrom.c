@@ -51,5 +51,17 @@ void AxROM_write(void* _map, uint16_t addr, uint8_t value)
     warning("unexpected write @ 0x%04x in AxROM mapper [0x%02x]", addr, value);
 }
 
+void AxROM_map_cpu_pages(void* _map, uint8_t** read_pages,
+                         uint8_t** write_pages)
+{
+    AxROM*     map  = (AxROM*)_map;
+    Cartridge* cart = map->cart;
+
+    map_pages(read_pages, 0x6000, 0x2000, cart->SRAM, 0, cart->SRAM_size);
+    map_pages(write_pages, 0x6000, 0x2000, cart->SRAM, 0, cart->SRAM_size);
+    map_pages(read_pages, 0x8000, 0x8000, cart->PRG,
+              (int64_t)map->prg_bank * 0x8000, cart->PRG_size);
+}
+
 GEN_SERIALIZER(AxROM)
 GEN_DESERIALIZER(AxROM)
@@ -6,6 +6,8 @@
 
 struct Cartridge;
 struct System;
+struct Writer;
+struct Reader;
 
 typedef struct AxROM {
     struct Cartridge* cart;
@@ -15,7 +17,9 @@ typedef struct AxROM {
 AxROM*  AxROM_build(struct Cartridge* cart);
 uint8_t AxROM_read(void* _map, uint16_t addr);
 void    AxROM_write(void* _map, uint16_t addr, uint8_t value);
-void    AxROM_serialize(void* _map, FILE* fout);
-void    AxROM_deserialize(void* _map, FILE* fin);
+void    AxROM_map_cpu_pages(void* _map, uint8_t** read_pages,
+                            uint8_t** write_pages);
+void    AxROM_serialize(void* _map, struct Writer* w);
+void    AxROM_deserialize(void* _map, struct Reader* r);
 
 #endif
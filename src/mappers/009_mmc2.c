@@ -117,5 +117,23 @@ void MMC2_write(void* _map, uint16_t addr, uint8_t value)
     warning("unexpected write @ 0x%04x in MMC2 mapper [0x%02x]", addr, value);
 }
 
+void MMC2_map_cpu_pages(void* _map, uint8_t** read_pages,
+                        uint8_t** write_pages)
+{
+    MMC2*      map  = (MMC2*)_map;
+    Cartridge* cart = map->cart;
+
+    map_pages(read_pages, 0x6000, 0x2000, cart->SRAM, 0, cart->SRAM_size);
+    map_pages(write_pages, 0x6000, 0x2000, cart->SRAM, 0, cart->SRAM_size);
+    map_pages(read_pages, 0x8000, 0x2000, cart->PRG,
+              MMC2_calc_prg_bank_offset(map, map->prg_bank), cart->PRG_size);
+    map_pages(read_pages, 0xA000, 0x2000, cart->PRG,
+              MMC2_calc_prg_bank_offset(map, -3), cart->PRG_size);
+    map_pages(read_pages, 0xC000, 0x2000, cart->PRG,
+              MMC2_calc_prg_bank_offset(map, -2), cart->PRG_size);
+    map_pages(read_pages, 0xE000, 0x2000, cart->PRG,
+              MMC2_calc_prg_bank_offset(map, -1), cart->PRG_size);
+}
+
 GEN_SERIALIZER(MMC2)
 GEN_DESERIALIZER(MMC2)
@@ -6,6 +6,8 @@
 
 struct Cartridge;
 struct System;
+struct Writer;
+struct Reader;
 
 typedef struct MMC2 {
     struct Cartridge* cart;
@@ -17,7 +19,9 @@ typedef struct MMC2 {
 MMC2*   MMC2_build(struct Cartridge* cart);
 uint8_t MMC2_read(void* _map, uint16_t addr);
 void    MMC2_write(void* _map, uint16_t addr, uint8_t value);
-void    MMC2_serialize(void* _map, FILE* fout);
-void    MMC2_deserialize(void* _map, FILE* fin);
+void    MMC2_map_cpu_pages(void* _map, uint8_t** read_pages,
+                           uint8_t** write_pages);
+void    MMC2_serialize(void* _map, struct Writer* w);
+void    MMC2_deserialize(void* _map, struct Reader* r);
 
 #endif
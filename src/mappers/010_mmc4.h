@@ -6,6 +6,8 @@
 
 struct Cartridge;
 struct System;
+struct Writer;
+struct Reader;
 
 typedef struct MMC4 {
     struct Cartridge* cart;
@@ -17,7 +19,9 @@ typedef struct MMC4 {
 MMC4*   MMC4_build(struct Cartridge* cart);
 uint8_t MMC4_read(void* _map, uint16_t addr);
 void    MMC4_write(void* _map, uint16_t addr, uint8_t value);
-void    MMC4_serialize(void* _map, FILE* fout);
-void    MMC4_deserialize(void* _map, FILE* fin);
+void    MMC4_map_cpu_pages(void* _map, uint8_t** read_pages,
+                           uint8_t** write_pages);
+void    MMC4_serialize(void* _map, struct Writer* w);
+void    MMC4_deserialize(void* _map, struct Reader* r);
 
 #endif
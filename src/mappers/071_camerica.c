@@ -3,7 +3,7 @@
 
 Map071* Map071_build(Cartridge* cart)
 {
-    Map071* map   = malloc_or_fail(sizeof(Map071));
+    Map071* map   = calloc_or_fail(sizeof(Map071));
     map->cart     = cart;
     map->prg_bank = 0;
     return map;
@@ -70,5 +70,19 @@ void Map071_write(void* _map, uint16_t addr, uint8_t value)
     warning("unexpected write @ 0x%04x in Map071 mapper [0x%02x]", addr, value);
 }
 
+void Map071_map_cpu_pages(void* _map, uint8_t** read_pages,
+                          uint8_t** write_pages)
+{
+    Map071*    map  = (Map071*)_map;
+    Cartridge* cart = map->cart;
+
+    map_pages(read_pages, 0x6000, 0x2000, cart->SRAM, 0, cart->SRAM_size);
+    map_pages(write_pages, 0x6000, 0x2000, cart->SRAM, 0, cart->SRAM_size);
+    map_pages(read_pages, 0x8000, 0x4000, cart->PRG,
+              Map071_calc_prg_bank_offset(map, map->prg_bank), cart->PRG_size);
+    map_pages(read_pages, 0xC000, 0x4000, cart->PRG,
+              Map071_calc_prg_bank_offset(map, -1), cart->PRG_size);
+}
+
 GEN_SERIALIZER(Map071)
 GEN_DESERIALIZER(Map071)
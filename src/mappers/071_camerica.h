@@ -6,6 +6,8 @@
 
 struct Cartridge;
 struct System;
+struct Writer;
+struct Reader;
 
 typedef struct Map071 {
     struct Cartridge* cart;
@@ -15,7 +17,9 @@ typedef struct Map071 {
 Map071* Map071_build(struct Cartridge* cart);
 uint8_t Map071_read(void* _map, uint16_t addr);
 void    Map071_write(void* _map, uint16_t addr, uint8_t value);
-void    Map071_serialize(void* _map, FILE* fout);
-void    Map071_deserialize(void* _map, FILE* fin);
+void    Map071_map_cpu_pages(void* _map, uint8_t** read_pages,
+                             uint8_t** write_pages);
+void    Map071_serialize(void* _map, struct Writer* w);
+void    Map071_deserialize(void* _map, struct Reader* r);
 
 #endif
@@ -126,7 +126,7 @@ void FC_001_step(void* _map, System* sys)
     FC_001* map = (FC_001*)_map;
     Ppu*    ppu = sys->ppu;
 
-    if (sys->ppu->cycle != 280)
+    if (sys->ppu->cycle != FC_001_STEP_CYCLE)
         return;
     if (!ppu->mask_flags.show_background && !ppu->mask_flags.show_sprites)
         return;
@@ -142,5 +142,17 @@ void FC_001_step(void* _map, System* sys)
     }
 }
 
+void FC_001_map_cpu_pages(void* _map, uint8_t** read_pages,
+                          uint8_t** write_pages)
+{
+    FC_001*    map  = (FC_001*)_map;
+    Cartridge* cart = map->cart;
+
+    map_pages(read_pages, 0x6000, 0x2000, cart->SRAM, 0, cart->SRAM_size);
+    map_pages(write_pages, 0x6000, 0x2000, cart->SRAM, 0, cart->SRAM_size);
+    map_pages(read_pages, 0x8000, 0x8000, cart->PRG, map->bank_prg,
+              cart->PRG_size);
+}
+
 GEN_SERIALIZER(FC_001)
 GEN_DESERIALIZER(FC_001)
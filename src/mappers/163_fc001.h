@@ -6,6 +6,11 @@
 
 struct Cartridge;
 struct System;
+struct Writer;
+struct Reader;
+
+// the CHR banks are switched at this dot of scanlines 127 and 239
+#define FC_001_STEP_CYCLE 280
 
 typedef struct FC_001 {
     struct Cartridge* cart;
@@ -19,7 +24,9 @@ FC_001* FC_001_build(struct Cartridge* cart);
 uint8_t FC_001_read(void* _map, uint16_t addr);
 void    FC_001_write(void* _map, uint16_t addr, uint8_t value);
 void    FC_001_step(void* _map, struct System* sys);
-void    FC_001_serialize(void* _map, FILE* fout);
-void    FC_001_deserialize(void* _map, FILE* fin);
+void    FC_001_map_cpu_pages(void* _map, uint8_t** read_pages,
+                             uint8_t** write_pages);
+void    FC_001_serialize(void* _map, struct Writer* w);
+void    FC_001_deserialize(void* _map, struct Reader* r);
 
 #endif
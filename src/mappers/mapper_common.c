@@ -35,3 +35,15 @@ int32_t calc_ram_bank_offset(Cartridge* cart, int32_t idx, uint32_t bank_size)
         off += cart->SRAM_size;
     return off;
 }
+
+void map_pages(uint8_t** pages, uint16_t addr, uint32_t size, uint8_t* buf,
+               int64_t off, uint32_t buf_size)
+{
+    for (uint32_t i = 0; i < size; i += 0x100) {
+        int64_t page_off = off + i;
+        if (page_off < 0 || page_off + 0x100 > buf_size)
+            pages[(addr + i) >> 8] = NULL;
+        else
+            pages[(addr + i) >> 8] = buf + page_off;
+    }
+}
@@ -8,6 +8,7 @@
 #include "../ppu.h"
 #include "../system.h"
 #include "../memory.h"
+#include "../stream.h"
 #include "../6502_cpu.h"
 
 #include <assert.h>
@@ -21,24 +22,24 @@
 
 static void __attribute__((unused)) do_nothing_fun(void* v) { (void)v; }
 
+// The pointer to the cartridge is written as NULL, so that the state does not
+// depend on where the cartridge has been allocated (see system_hash())
 #define GEN_SERIALIZER(TYPE)                                                   \
-    void TYPE##_serialize(void* _map, FILE* fout)                              \
+    void TYPE##_serialize(void* _map, Writer* w)                               \
     {                                                                          \
-        Buffer res = {.buffer = (uint8_t*)_map, .size = sizeof(TYPE)};         \
-        dump_buffer(&res, fout);                                               \
+        TYPE tmp;                                                              \
+        memcpy(&tmp, _map, sizeof(TYPE));                                      \
+        tmp.cart = NULL;                                                       \
+        write_section(w, &tmp, sizeof(TYPE));                                  \
     }
 #define GEN_DESERIALIZER_WITH_POSTCHECK(TYPE, post_check_fun)                  \
-    void TYPE##_deserialize(void* _map, FILE* fin)                             \
+    void TYPE##_deserialize(void* _map, Reader* r)                             \
     {                                                                          \
-        Buffer buf = read_buffer(fin);                                         \
-        if (buf.size != sizeof(TYPE))                                          \
-            panic(#TYPE "_deserialize(): invalid buffer");                     \
         TYPE* map      = (TYPE*)_map;                                          \
         void* tmp_cart = map->cart;                                            \
-        memcpy(map, buf.buffer, buf.size);                                     \
+        read_section(r, map, sizeof(TYPE), #TYPE "_deserialize()");            \
         map->cart = tmp_cart;                                                  \
         post_check_fun((void*)map);                                            \
-        free_or_fail(buf.buffer);                                              \
     }
 #define GEN_DESERIALIZER(TYPE)                                                 \
     GEN_DESERIALIZER_WITH_POSTCHECK(TYPE, do_nothing_fun)
@@ -47,4 +48,9 @@ int32_t calc_prg_bank_offset(Cartridge* cart, int32_t idx, uint32_t bank_size);
 int32_t calc_chr_bank_offset(Cartridge* cart, int32_t idx, uint32_t bank_size);
 int32_t calc_ram_bank_offset(Cartridge* cart, int32_t idx, uint32_t bank_size);
 
+// Map the CPU range [addr, addr + size) to buf[off]. Pages that are not
+// entirely within buf are left to the slow path (and to its bounds checks)
+void map_pages(uint8_t** pages, uint16_t addr, uint32_t size, uint8_t* buf,
+               int64_t off, uint32_t buf_size);
+
 #endif
@@ -15,6 +15,7 @@ typedef struct InternalMemory {
 
 typedef struct InternalStandaloneMemory {
     uint8_t* buf;
+    uint8_t* pages[256];
 } InternalStandaloneMemory;
 
 static InternalMemory* internal_memory_build(System* sys)
@@ -35,6 +36,8 @@ static InternalStandaloneMemory* _standalone_memory_build()
     InternalStandaloneMemory* res =
         malloc_or_fail(sizeof(InternalStandaloneMemory));
     res->buf = malloc_or_fail(0x10000);
+    for (int page = 0; page < 256; ++page)
+        res->pages[page] = res->buf + (page << 8);
     return res;
 }
 
@@ -45,11 +48,10 @@ static void standalone_memory_destroy(void* _mem)
     free_or_fail(mem);
 }
 
-static uint8_t cpu_memory_read(void* _mem, uint16_t addr)
+static uint8_t cpu_bus_read(InternalMemory* mem, uint16_t addr)
 {
-    InternalMemory* mem = (InternalMemory*)_mem;
-    Ppu*            ppu = mem->sys->ppu;
-    Apu*            apu = mem->sys->apu;
+    Ppu* ppu = mem->sys->ppu;
+    Apu* apu = mem->sys->apu;
 
     if (addr < 0x2000) {
         return mem->sys->RAM[addr % 0x800];
@@ -80,11 +82,10 @@ static uint8_t cpu_memory_read(void* _mem, uint16_t addr)
     panic("Invalid read @ 0x%04x", addr);
 }
 
-static void cpu_memory_write(void* _mem, uint16_t addr, uint8_t value)
+static void cpu_bus_write(InternalMemory* mem, uint16_t addr, uint8_t value)
 {
-    InternalMemory* mem = (InternalMemory*)_mem;
-    Ppu*            ppu = mem->sys->ppu;
-    Apu*            apu = mem->sys->apu;
+    Ppu* ppu = mem->sys->ppu;
+    Apu* apu = mem->sys->apu;
 
     if (addr < 0x2000) {
         mem->sys->RAM[addr % 0x800] = value;
@@ -122,12 +123,62 @@ static void cpu_memory_write(void* _mem, uint16_t addr, uint8_t value)
     }
     if (addr >= 0x4020) {
         mapper_write(mem->sys->mapper, addr, value);
+        // the write may have switched banks, but no mapper has registers in
+        // the cartridge RAM [0x6000 -> 0x7FFF]
+        if (addr < 0x6000 || addr >= 0x8000) {
+            system_map_cpu_pages(mem->sys);
+            system_map_ppu_pages(mem->sys);
+        }
         return;
     }
 
     panic("Invalid write @ 0x%04x [0x%02x]", addr, value);
 }
 
+// The device whose state an access to "addr" depends on. The mapper is
+// stepped together with the PPU, its registers need the PPU to be in sync
+static Device cpu_bus_device(uint16_t addr)
+{
+    if (addr < 0x2000 || addr == 0x4016)
+        return DEVICE_NONE;
+    if (addr < 0x4000 || addr == 0x4014 || addr >= 0x4020)
+        return DEVICE_PPU;
+    if (addr <= 0x4017)
+        return DEVICE_APU;
+    return DEVICE_NONE;
+}
+
+static uint8_t cpu_memory_read(void* _mem, uint16_t addr)
+{
+    InternalMemory* mem = (InternalMemory*)_mem;
+
+    // RAM, PRG, SRAM and the controllers do not depend on the state of the
+    // other devices
+    if (addr < 0x2000 || addr >= 0x6000 || addr == 0x4016 || addr == 0x4017)
+        return cpu_bus_read(mem, addr);
+
+    Device dev = cpu_bus_device(addr);
+    scheduler_sync(mem->sys, dev);
+    uint8_t value = cpu_bus_read(mem, addr);
+    scheduler_update(mem->sys, dev);
+    return value;
+}
+
+static void cpu_memory_write(void* _mem, uint16_t addr, uint8_t value)
+{
+    InternalMemory* mem = (InternalMemory*)_mem;
+
+    Device dev = cpu_bus_device(addr);
+    if (dev == DEVICE_NONE) {
+        cpu_bus_write(mem, addr, value);
+        return;
+    }
+
+    scheduler_sync(mem->sys, dev);
+    cpu_bus_write(mem, addr, value);
+    scheduler_update(mem->sys, dev);
+}
+
 static uint8_t read_palette(Ppu* ppu, uint16_t addr)
 {
     if (addr >= 16 && addr % 4 == 0)
@@ -200,33 +251,41 @@ static void standalone_memory_write(void* _mem, uint16_t addr, uint8_t value)
 
 Memory* cpu_memory_build(struct System* sys)
 {
-    Memory* mem  = malloc_or_fail(sizeof(Memory));
-    mem->read    = &cpu_memory_read;
-    mem->write   = &cpu_memory_write;
-    mem->destroy = &internal_memory_destroy;
-    mem->obj     = internal_memory_build(sys);
+    Memory* mem      = malloc_or_fail(sizeof(Memory));
+    mem->read        = &cpu_memory_read;
+    mem->write       = &cpu_memory_write;
+    mem->destroy     = &internal_memory_destroy;
+    mem->obj         = internal_memory_build(sys);
+    mem->read_pages  = sys->cpu_read_pages;
+    mem->write_pages = sys->cpu_write_pages;
 
     return mem;
 }
 
 Memory* ppu_memory_build(struct System* sys)
 {
-    Memory* mem  = malloc_or_fail(sizeof(Memory));
-    mem->read    = &ppu_memory_read;
-    mem->write   = &ppu_memory_write;
-    mem->destroy = &internal_memory_destroy;
-    mem->obj     = internal_memory_build(sys);
+    Memory* mem      = malloc_or_fail(sizeof(Memory));
+    mem->read        = &ppu_memory_read;
+    mem->write       = &ppu_memory_write;
+    mem->destroy     = &internal_memory_destroy;
+    mem->obj         = internal_memory_build(sys);
+    mem->read_pages  = sys->ppu_read_pages;
+    mem->write_pages = sys->ppu_write_pages;
 
     return mem;
 }
 
 Memory* standalone_memory_build()
 {
-    Memory* mem  = malloc_or_fail(sizeof(Memory));
-    mem->read    = &standalone_memory_read;
-    mem->write   = &standalone_memory_write;
-    mem->destroy = &standalone_memory_destroy;
-    mem->obj     = _standalone_memory_build();
+    InternalStandaloneMemory* obj = _standalone_memory_build();
+
+    Memory* mem      = malloc_or_fail(sizeof(Memory));
+    mem->read        = &standalone_memory_read;
+    mem->write       = &standalone_memory_write;
+    mem->destroy     = &standalone_memory_destroy;
+    mem->obj         = obj;
+    mem->read_pages  = obj->pages;
+    mem->write_pages = obj->pages;
 
     return mem;
 }
@@ -236,13 +295,3 @@ void memory_destroy(Memory* mem)
     mem->destroy(mem->obj);
     free_or_fail(mem);
 }
-
-uint8_t memory_read(Memory* mem, uint16_t addr)
-{
-    return mem->read(mem->obj, addr);
-}
-
-void memory_write(Memory* mem, uint16_t addr, uint8_t value)
-{
-    mem->write(mem->obj, addr, value);
-}
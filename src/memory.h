@@ -10,14 +10,34 @@ typedef struct Memory {
     void (*destroy)(void*);
     uint8_t (*read)(void*, uint16_t);
     void (*write)(void*, uint16_t, uint8_t);
+
+    // One entry per 256-byte page: a non NULL entry points to the memory
+    // backing the page, a NULL entry sends the access to read/write
+    uint8_t** read_pages;
+    uint8_t** write_pages;
 } Memory;
 
 Memory* cpu_memory_build(struct System* sys);
 Memory* ppu_memory_build(struct System* sys);
 Memory* standalone_memory_build();
 
-void    memory_destroy(Memory* mem);
-uint8_t memory_read(Memory* mem, uint16_t addr);
-void    memory_write(Memory* mem, uint16_t addr, uint8_t value);
+void memory_destroy(Memory* mem);
+
+static inline uint8_t memory_read(Memory* mem, uint16_t addr)
+{
+    uint8_t* page = mem->read_pages[addr >> 8];
+    if (page)
+        return page[addr & 0xFF];
+    return mem->read(mem->obj, addr);
+}
+
+static inline void memory_write(Memory* mem, uint16_t addr, uint8_t value)
+{
+    uint8_t* page = mem->write_pages[addr >> 8];
+    if (page)
+        page[addr & 0xFF] = value;
+    else
+        mem->write(mem->obj, addr, value);
+}
 
 #endif
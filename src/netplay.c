@@ -0,0 +1,1036 @@
+#include "netplay.h"
+#include "rollback.h"
+#include "cartridge.h"
+#include "hash.h"
+#include "rle.h"
+#include "alloc.h"
+#include "logging.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#ifdef __MINGW32__
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/select.h>
+#include <arpa/inet.h>
+#endif
+
+#define NETPLAY_MAGIC      "borzNES"
+#define NETPLAY_REDUNDANCY 32
+#define FRAME_US           16639
+#define RESEND_US          FRAME_US
+#define TIMEOUT_US         5000000ull
+#define CONNECT_TIMEOUT_US 30000000ull
+#define HANDSHAKE_RETRY_US 100000ull
+#define PING_COUNT         20
+#define PING_TIMEOUT_US    500000ull
+#define DISCONNECT_COPIES  3
+#define NO_ECHO            0xFFFFFFFFu
+#define MAX_RTT_US         10000000u
+// the input delay is checked every DELAY_CHECK_US, it is lowered only if
+// DELAY_LOWER_CHECKS checks in a row agree (a stall is worse than a frame of
+// delay). A change is applied DELAY_MARGIN frames after the peer should have
+// received it
+#define DELAY_CHECK_US     2000000ull
+#define DELAY_LOWER_CHECKS 3
+#define DELAY_MIN_SAMPLES  32
+#define DELAY_MARGIN       30
+
+// The chunks of a state are sent a few at a time, once per frame, without
+// going too far ahead of the acks. If the acks do not move for a while, the
+// host sends again from the first chunk not acknowledged
+#define STATE_CHUNKS_PER_SEND 4
+#define STATE_WINDOW          32
+#define STATE_RESEND_US       200000ull
+
+// The packets, the integers are big endian:
+//   HELLO       type, magic (7 bytes)
+//   PING, PONG  type, timestamp (64 bit), the pong echoes the ping
+//   START       type, input delay (32 bit)
+//   START_ACK   type
+//   INPUT       type, advantage (8 bit, signed), count (8 bit), ack (32 bit),
+//               first frame (32 bit), timestamp (32 bit, microseconds),
+//               echoed timestamp (32 bit), time it has been held (32 bit,
+//               NO_ECHO if nothing has been received yet), input delay
+//               (8 bit), next input delay (8 bit), its frame (32 bit),
+//               "count" inputs
+//   DISCONNECT  type
+//   HASH        type, epoch (8 bit), frame (32 bit), hash of the state at the
+//               end of the frame (64 bit), hash of every HashComponent (64
+//               bit each)
+//   STATE       type, transfer id (32 bit), frame (32 bit), size of the state
+//               (32 bit), size of the encoded state (32 bit), hash of the ROM
+//               (64 bit), chunk number (32 bit), the chunk (NETPLAY_CHUNK
+//               bytes, or less if it is the last one)
+//   STATE_ACK   type, transfer id (32 bit), chunks received in order (32
+//               bit), status (8 bit, see StateStatus)
+typedef enum PacketType {
+    PACKET_HELLO      = 1,
+    PACKET_PING       = 2,
+    PACKET_PONG       = 3,
+    PACKET_START      = 4,
+    PACKET_START_ACK  = 5,
+    PACKET_INPUT      = 6,
+    PACKET_DISCONNECT = 7,
+    PACKET_HASH       = 8,
+    PACKET_STATE      = 9,
+    PACKET_STATE_ACK  = 10
+} PacketType;
+
+typedef enum StateStatus {
+    STATE_RECEIVING = 0,
+    STATE_APPLIED   = 1,
+    STATE_TOO_OLD   = 2 // it cannot be loaded anymore, the host sends a new one
+} StateStatus;
+
+#define HELLO_SIZE   (1 + sizeof(NETPLAY_MAGIC) - 1)
+#define PING_SIZE    9
+#define START_SIZE   5
+#define INPUT_HEADER 29
+#define HASH_SIZE    (6 + 8 * (1 + HASH_COMPONENTS))
+#define STATE_HEADER 29
+#define STATE_ACK    10
+
+static void put_u32(uint8_t* p, uint32_t v)
+{
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+static uint32_t get_u32(const uint8_t* p)
+{
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 |
+           p[3];
+}
+
+static void put_u64(uint8_t* p, uint64_t v)
+{
+    put_u32(p, v >> 32);
+    put_u32(p + 4, (uint32_t)v);
+}
+
+static uint64_t get_u64(const uint8_t* p)
+{
+    return (uint64_t)get_u32(p) << 32 | get_u32(p + 4);
+}
+
+static uint64_t now_us()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000ull + ts.tv_nsec / 1000;
+}
+
+static uint64_t next_rand(NetPeer* np)
+{
+    // xorshift64*
+    np->rand_state ^= np->rand_state >> 12;
+    np->rand_state ^= np->rand_state << 25;
+    np->rand_state ^= np->rand_state >> 27;
+    return np->rand_state * 0x2545F4914F6CDD1Dull;
+}
+
+static void set_nonblocking(int fd)
+{
+#ifdef __MINGW32__
+    u_long mode = 1;
+    if (ioctlsocket(fd, FIONBIO, &mode) != 0)
+        panic("cannot make the socket non-blocking");
+#else
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0)
+        panic("cannot make the socket non-blocking");
+#endif
+}
+
+static void close_socket(int fd)
+{
+#ifdef __MINGW32__
+    closesocket(fd);
+#else
+    close(fd);
+#endif
+}
+
+static int open_socket()
+{
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (fd < 0)
+        panic("cannot create the socket");
+    return fd;
+}
+
+// 1 if a packet can be read within "timeout_us"
+static int wait_readable(int fd, uint64_t timeout_us)
+{
+    fd_set fds;
+    FD_ZERO(&fds);
+    FD_SET(fd, &fds);
+    struct timeval timeout = {.tv_sec  = timeout_us / 1000000,
+                              .tv_usec = timeout_us % 1000000};
+
+    int ready = select(fd + 1, &fds, NULL, NULL, &timeout);
+    if (ready < 0 && errno != EINTR)
+        panic("wait_readable(): select failed [%s]", strerror(errno));
+    return ready > 0;
+}
+
+// UDP: a failed send is a lost packet, the protocol recovers from it
+static void send_raw(NetPeer* np, const uint8_t* data, uint32_t size)
+{
+    send(np->fd, (const char*)data, size, 0);
+    np->packets_sent++;
+}
+
+// The size of the packet, -1 if there are none
+static int64_t recv_raw(NetPeer* np, uint8_t* buf)
+{
+    for (;;) {
+        int64_t r = recv(np->fd, (char*)buf, NETPLAY_MAX_PACKET, 0);
+        if (r >= 0) {
+            np->packets_received++;
+            np->last_recv_us = now_us();
+            return r;
+        }
+        // the other errors (e.g. the peer is not there yet) are like a
+        // packet that did not arrive
+        if (errno != EINTR)
+            return -1;
+    }
+}
+
+static void flush_delayed(NetPeer* np)
+{
+    uint64_t now = now_us();
+    for (uint32_t i = 0; i < np->delayed_count; ++i) {
+        DelayedPacket* p = &np->delayed[i];
+        if (p->due_us > now)
+            continue;
+
+        send_raw(np, p->data, p->size);
+        *p = np->delayed[--np->delayed_count];
+        i--;
+    }
+}
+
+static void send_packet(NetPeer* np, const uint8_t* data, uint32_t size)
+{
+    NetImpairment* imp = &np->impairment;
+    if (imp->latency_us == 0 && imp->jitter_us == 0 && imp->loss <= 0) {
+        send_raw(np, data, size);
+        return;
+    }
+
+    if ((next_rand(np) >> 11) * (1.0 / (1ull << 53)) < imp->loss ||
+        np->delayed_count == NETPLAY_DELAYED) {
+        np->packets_dropped++;
+        return;
+    }
+
+    // with jitter, the packets can be reordered
+    uint64_t       jitter = next_rand(np) % ((uint64_t)imp->jitter_us + 1);
+    DelayedPacket* p      = &np->delayed[np->delayed_count++];
+    p->due_us             = now_us() + imp->latency_us + jitter;
+    p->size               = size;
+    memcpy(p->data, data, size);
+    flush_delayed(np);
+}
+
+// The first frame with an input is the input delay, on both sides
+static void begin(NetPeer* np, uint32_t input_delay)
+{
+    np->local_first   = input_delay;
+    np->local_next    = input_delay;
+    np->remote_next   = input_delay;
+    np->input_delay   = input_delay;
+    np->connected     = 1;
+    np->last_send_us  = now_us();
+    np->last_recv_us  = now_us();
+    np->last_check_us = now_us();
+    // the peer may not have the same save file
+    np->send_state = np->is_host;
+}
+
+NetPeer* netplay_build(int fd, uint32_t input_delay, int is_host)
+{
+    set_nonblocking(fd);
+
+    NetPeer* np    = calloc_or_fail(sizeof(NetPeer));
+    np->fd         = fd;
+    np->is_host    = is_host;
+    np->rand_state = (now_us() ^ ((uint64_t)fd << 32)) | 1;
+    strcpy(np->peer_name, "?");
+    begin(np, input_delay);
+    return np;
+}
+
+void netplay_destroy(NetPeer* np)
+{
+    free_or_fail(np->transfer.state);
+    free_or_fail(np->transfer.encoded);
+    free_or_fail(np->transfer.received);
+    close_socket(np->fd);
+    free_or_fail(np);
+}
+
+NetPeer* netplay_accept(int port)
+{
+    int fd = open_socket();
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family      = AF_INET;
+    addr.sin_addr.s_addr = INADDR_ANY;
+    addr.sin_port        = htons(port);
+    if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0)
+        panic("cannot bind the socket on port %d", port);
+
+    uint8_t   buf[NETPLAY_MAX_PACKET];
+    socklen_t addr_len;
+    for (;;) {
+        addr_len = sizeof(addr);
+        int64_t size =
+            recvfrom(fd, (char*)buf, sizeof(buf), 0, (struct sockaddr*)&addr,
+                     &addr_len);
+        if (size == HELLO_SIZE && buf[0] == PACKET_HELLO &&
+            memcmp(buf + 1, NETPLAY_MAGIC, HELLO_SIZE - 1) == 0)
+            break;
+    }
+
+    // from now on, only the packets of the peer are received
+    if (connect(fd, (struct sockaddr*)&addr, addr_len) < 0)
+        panic("cannot connect the socket to the peer");
+
+    NetPeer* np = netplay_build(fd, 0, 1);
+    snprintf(np->peer_name, sizeof(np->peer_name), "%s",
+             inet_ntoa(addr.sin_addr));
+    return np;
+}
+
+NetPeer* netplay_connect(const char* ip, int port)
+{
+    int fd = open_socket();
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family      = AF_INET;
+    addr.sin_addr.s_addr = inet_addr(ip);
+    addr.sin_port        = htons(port);
+    if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0)
+        panic("cannot connect the socket to %s", ip);
+
+    NetPeer* np = netplay_build(fd, 0, 0);
+    snprintf(np->peer_name, sizeof(np->peer_name), "%s", ip);
+
+    uint8_t hello[HELLO_SIZE];
+    hello[0] = PACKET_HELLO;
+    memcpy(hello + 1, NETPLAY_MAGIC, HELLO_SIZE - 1);
+
+    // the host answers with a ping (see netplay_estimate_rtt())
+    uint64_t start = now_us();
+    do {
+        if (now_us() - start > CONNECT_TIMEOUT_US)
+            panic("%s is not answering, is the host running?", ip);
+        send_raw(np, hello, sizeof(hello));
+    } while (!wait_readable(fd, HANDSHAKE_RETRY_US));
+
+    return np;
+}
+
+uint64_t netplay_estimate_rtt(NetPeer* np)
+{
+    uint64_t total = 0, samples = 0;
+    uint8_t  buf[NETPLAY_MAX_PACKET];
+
+    for (int i = 0; i < PING_COUNT; ++i) {
+        uint64_t sent = now_us();
+        buf[0]        = PACKET_PING;
+        put_u64(buf + 1, sent);
+        send_raw(np, buf, PING_SIZE);
+
+        // the pongs of the previous pings (if late) are ignored
+        while (now_us() - sent < PING_TIMEOUT_US &&
+               wait_readable(np->fd, PING_TIMEOUT_US - (now_us() - sent))) {
+            int64_t size = recv_raw(np, buf);
+            if (size == PING_SIZE && buf[0] == PACKET_PONG &&
+                get_u64(buf + 1) == sent) {
+                total += now_us() - sent;
+                samples++;
+                break;
+            }
+        }
+    }
+    if (samples == 0)
+        panic("netplay_estimate_rtt(): the peer is not answering");
+    return total / samples;
+}
+
+void netplay_start(NetPeer* np, uint32_t input_delay)
+{
+    uint8_t buf[NETPLAY_MAX_PACKET];
+    uint8_t start[START_SIZE];
+    start[0] = PACKET_START;
+    put_u32(start + 1, input_delay);
+
+    uint64_t first_try = now_us();
+    for (;;) {
+        if (now_us() - first_try > TIMEOUT_US)
+            panic("netplay_start(): the peer is not answering");
+
+        send_raw(np, start, sizeof(start));
+        if (!wait_readable(np->fd, HANDSHAKE_RETRY_US))
+            continue;
+
+        // if the ack is lost the first inputs tell us that the peer started
+        int64_t size = recv_raw(np, buf);
+        if (size > 0 && (buf[0] == PACKET_START_ACK || buf[0] == PACKET_INPUT))
+            break;
+    }
+    begin(np, input_delay);
+}
+
+uint32_t netplay_wait_start(NetPeer* np)
+{
+    uint8_t buf[NETPLAY_MAX_PACKET];
+    for (;;) {
+        if (!wait_readable(np->fd, TIMEOUT_US))
+            panic("netplay_wait_start(): the host is not answering");
+
+        int64_t size = recv_raw(np, buf);
+        if (size == PING_SIZE && buf[0] == PACKET_PING) {
+            buf[0] = PACKET_PONG;
+            send_raw(np, buf, PING_SIZE);
+        } else if (size == START_SIZE && buf[0] == PACKET_START) {
+            uint32_t input_delay = get_u32(buf + 1);
+            uint8_t  ack         = PACKET_START_ACK;
+            send_raw(np, &ack, 1);
+            begin(np, input_delay);
+            return input_delay;
+        }
+    }
+}
+
+uint32_t netplay_input_delay(uint64_t rtt_us)
+{
+    uint64_t delay = rtt_us / 2 / FRAME_US;
+    return delay > NETPLAY_MAX_INPUT_DELAY ? NETPLAY_MAX_INPUT_DELAY
+                                           : (uint32_t)delay;
+}
+
+static void send_inputs(NetPeer* np)
+{
+    // the oldest ones first, the peer cannot go on without them
+    uint32_t count = np->local_next - np->local_first;
+    if (count > NETPLAY_REDUNDANCY)
+        count = NETPLAY_REDUNDANCY;
+
+    uint64_t now  = now_us();
+    uint32_t held = NO_ECHO;
+    if (np->has_echo)
+        held = (uint32_t)(now - np->echo_recv_us);
+
+    uint8_t packet[NETPLAY_MAX_PACKET];
+    packet[0] = PACKET_INPUT;
+    packet[1] = (uint8_t)np->advantage;
+    packet[2] = count;
+    put_u32(packet + 3, np->remote_next);
+    put_u32(packet + 7, np->local_first);
+    put_u32(packet + 11, (uint32_t)now);
+    put_u32(packet + 15, np->echo_stamp);
+    put_u32(packet + 19, held);
+    packet[23] = np->input_delay;
+    packet[24] = np->next_delay;
+    put_u32(packet + 25, np->delay_frame);
+    for (uint32_t i = 0; i < count; ++i)
+        packet[INPUT_HEADER + i] =
+            np->inputs[(np->local_first + i) % NETPLAY_INPUTS].state;
+
+    send_packet(np, packet, INPUT_HEADER + count);
+    np->last_send_us = now;
+}
+
+static void compare_hashes(NetPeer* np, uint32_t frame)
+{
+    NetHash* local  = &np->local_hashes[frame % NETPLAY_HASHES];
+    NetHash* remote = &np->remote_hashes[frame % NETPLAY_HASHES];
+    // nothing is compared before the first state sent by the host is loaded
+    if (np->epoch == 0 || local->tag != frame + 1 || remote->tag != frame + 1 ||
+        local->epoch != np->epoch || remote->epoch != np->epoch)
+        return;
+
+    np->hashes_compared++;
+    if (local->hash.total == remote->hash.total ||
+        (np->desynced && frame >= np->desync_frame))
+        return;
+
+    // the packets can be reordered, keep the first frame
+    np->desynced          = 1;
+    np->desync_frame      = frame;
+    np->desync_components = 0;
+    for (int c = 0; c < HASH_COMPONENTS; ++c)
+        if (local->hash.components[c] != remote->hash.components[c])
+            np->desync_components |= 1u << c;
+}
+
+static void send_hashes(NetPeer* np, Rollback* rb)
+{
+    // too old, the peer cannot compare them anymore
+    if (rb->frame - np->hash_next > NETPLAY_HASHES)
+        np->hash_next = rb->frame - NETPLAY_HASHES;
+
+    SystemHash hash;
+    for (; rollback_final_hash(rb, np->hash_next, &hash); np->hash_next++) {
+        uint32_t frame = np->hash_next;
+        NetHash* local = &np->local_hashes[frame % NETPLAY_HASHES];
+        local->hash    = hash;
+        local->tag     = frame + 1;
+        local->epoch   = np->epoch;
+
+        uint8_t packet[HASH_SIZE];
+        packet[0] = PACKET_HASH;
+        packet[1] = np->epoch;
+        put_u32(packet + 2, frame);
+        put_u64(packet + 6, hash.total);
+        for (int c = 0; c < HASH_COMPONENTS; ++c)
+            put_u64(packet + 14 + 8 * c, hash.components[c]);
+        send_packet(np, packet, HASH_SIZE);
+
+        compare_hashes(np, frame);
+    }
+}
+
+static void receive_hash(NetPeer* np, const uint8_t* packet)
+{
+    uint32_t frame  = get_u32(packet + 2);
+    NetHash* remote = &np->remote_hashes[frame % NETPLAY_HASHES];
+    if (remote->tag > frame + 1)
+        // a late packet, the slot is used by a newer frame
+        return;
+
+    remote->tag        = frame + 1;
+    remote->epoch      = packet[1];
+    remote->hash.total = get_u64(packet + 6);
+    for (int c = 0; c < HASH_COMPONENTS; ++c)
+        remote->hash.components[c] = get_u64(packet + 14 + 8 * c);
+
+    compare_hashes(np, frame);
+}
+
+static uint64_t rom_hash(System* sys)
+{
+    Cartridge* cart = sys->cart;
+    Hasher     h;
+    hasher_init(&h, 0);
+    hasher_update(&h, cart->PRG, cart->PRG_size);
+    if (!cart->CHR_RAM)
+        hasher_update(&h, cart->CHR, cart->CHR_size);
+    return hasher_final(&h);
+}
+
+// 0 is the epoch before the first state
+static uint8_t next_epoch(uint8_t epoch)
+{
+    return epoch == UINT8_MAX ? 1 : epoch + 1;
+}
+
+static uint32_t chunk_count(NetTransfer* t)
+{
+    return (t->encoded_size + NETPLAY_CHUNK - 1) / NETPLAY_CHUNK;
+}
+
+// The buffers are allocated at the first transfer, the size of the state
+// does not change
+static void alloc_transfer(NetTransfer* t, uint32_t state_size)
+{
+    if (t->state != NULL)
+        return;
+
+    uint64_t max_encoded = rle_bound(state_size);
+    t->state_size        = state_size;
+    t->state             = malloc_or_fail(state_size);
+    t->encoded           = malloc_or_fail(max_encoded);
+    t->received =
+        malloc_or_fail((max_encoded + NETPLAY_CHUNK - 1) / NETPLAY_CHUNK);
+}
+
+static void begin_transfer(NetPeer* np, Rollback* rb)
+{
+    NetTransfer* t = &np->transfer;
+    alloc_transfer(t, rb->state_size);
+    if (!rollback_save_final_state(rb, t->state, &t->frame))
+        // after the next frame
+        return;
+
+    t->encoded_size = rle_encode(t->state, t->state_size, t->encoded);
+    t->rom_hash     = rom_hash(rb->sys);
+    t->id++;
+    t->acked       = 0;
+    t->next        = 0;
+    t->last_ack_us = now_us();
+    t->active      = 1;
+    np->send_state = 0;
+}
+
+static void send_chunk(NetPeer* np, uint32_t chunk)
+{
+    NetTransfer* t      = &np->transfer;
+    uint32_t     offset = chunk * NETPLAY_CHUNK;
+    uint32_t     size   = t->encoded_size - offset;
+    if (size > NETPLAY_CHUNK)
+        size = NETPLAY_CHUNK;
+
+    uint8_t packet[NETPLAY_MAX_PACKET];
+    packet[0] = PACKET_STATE;
+    put_u32(packet + 1, t->id);
+    put_u32(packet + 5, t->frame);
+    put_u32(packet + 9, t->state_size);
+    put_u32(packet + 13, t->encoded_size);
+    put_u64(packet + 17, t->rom_hash);
+    put_u32(packet + 25, chunk);
+    memcpy(packet + STATE_HEADER, t->encoded + offset, size);
+    send_packet(np, packet, STATE_HEADER + size);
+}
+
+static void send_state(NetPeer* np, Rollback* rb)
+{
+    NetTransfer* t = &np->transfer;
+    if (!t->active && (np->send_state || np->desynced))
+        begin_transfer(np, rb);
+    if (!t->active)
+        return;
+
+    uint32_t chunks = chunk_count(t);
+    uint64_t now    = now_us();
+    if (now - t->last_ack_us > STATE_RESEND_US) {
+        // if everything has been acked, the ack of the load has been lost:
+        // a chunk makes the peer send it again
+        t->next        = t->acked < chunks ? t->acked : chunks - 1;
+        t->last_ack_us = now;
+    }
+    for (int i = 0; i < STATE_CHUNKS_PER_SEND; ++i) {
+        if (t->next >= chunks || t->next >= t->acked + STATE_WINDOW)
+            break;
+        send_chunk(np, t->next++);
+    }
+}
+
+static void send_state_ack(NetPeer* np, StateStatus status)
+{
+    uint8_t packet[STATE_ACK];
+    packet[0] = PACKET_STATE_ACK;
+    put_u32(packet + 1, np->transfer.id);
+    put_u32(packet + 5, np->transfer.acked);
+    packet[9] = status;
+    send_packet(np, packet, STATE_ACK);
+}
+
+// The peer loads the state at the start of its frame, from then on the
+// hashes are compared again
+static void load_state(NetPeer* np, Rollback* rb)
+{
+    NetTransfer* t = &np->transfer;
+    if (!t->complete || rb->frame < t->frame)
+        return;
+
+    t->complete = 0;
+    if (!rollback_load_state(rb, t->frame, t->state)) {
+        send_state_ack(np, STATE_TOO_OLD);
+        return;
+    }
+    t->applied   = 1;
+    np->epoch    = next_epoch(np->epoch);
+    np->desynced = 0;
+    np->resyncs++;
+    send_state_ack(np, STATE_APPLIED);
+}
+
+static void receive_state(NetPeer* np, Rollback* rb, const uint8_t* packet,
+                          int64_t size)
+{
+    NetTransfer* t  = &np->transfer;
+    uint32_t     id = get_u32(packet + 1);
+    if (np->is_host || id < t->id)
+        return;
+    if (id == t->id && !t->active) {
+        // our ack has been lost
+        send_state_ack(np, t->applied ? STATE_APPLIED : STATE_RECEIVING);
+        return;
+    }
+
+    if (id > t->id) {
+        uint32_t state_size   = get_u32(packet + 9);
+        uint32_t encoded_size = get_u32(packet + 13);
+        if (t->rom_hash == 0)
+            t->rom_hash = rom_hash(rb->sys);
+        if (get_u64(packet + 17) != t->rom_hash) {
+            warning("the host is running a different ROM");
+            np->wrong_rom = 1;
+            return;
+        }
+        if (state_size != rb->state_size) {
+            // the states of the two builds have different formats
+            warning("the host is running another version of borzNES");
+            np->wrong_rom = 1;
+            return;
+        }
+        if (encoded_size == 0 || encoded_size > rle_bound(state_size))
+            return;
+
+        alloc_transfer(t, state_size);
+        t->id           = id;
+        t->frame        = get_u32(packet + 5);
+        t->encoded_size = encoded_size;
+        t->acked        = 0;
+        t->active       = 1;
+        t->complete     = 0;
+        t->applied      = 0;
+        memset(t->received, 0, chunk_count(t));
+    }
+
+    uint32_t chunk    = get_u32(packet + 25);
+    uint32_t chunks   = chunk_count(t);
+    uint32_t offset   = chunk * NETPLAY_CHUNK;
+    uint32_t expected = 0;
+    if (chunk < chunks) {
+        expected = t->encoded_size - offset;
+        if (expected > NETPLAY_CHUNK)
+            expected = NETPLAY_CHUNK;
+    }
+    if (expected == 0 || size != STATE_HEADER + expected)
+        return;
+
+    memcpy(t->encoded + offset, packet + STATE_HEADER, expected);
+    t->received[chunk] = 1;
+    while (t->acked < chunks && t->received[t->acked])
+        t->acked++;
+
+    if (t->acked < chunks) {
+        send_state_ack(np, STATE_RECEIVING);
+        return;
+    }
+
+    t->active = 0;
+    if (!rle_decode(t->encoded, t->encoded_size, t->state, t->state_size,
+                    0)) {
+        send_state_ack(np, STATE_TOO_OLD);
+        return;
+    }
+    if (!system_check_state_mem(rb->sys, t->state, t->state_size)) {
+        // it would make system_load_state_mem() panic
+        warning("the host has sent a state that cannot be loaded (corrupted, "
+                "or saved by another version of borzNES)");
+        np->wrong_rom = 1;
+        return;
+    }
+    t->complete = 1;
+    send_state_ack(np, STATE_RECEIVING);
+    load_state(np, rb);
+}
+
+static void receive_state_ack(NetPeer* np, const uint8_t* packet)
+{
+    NetTransfer* t = &np->transfer;
+    if (!np->is_host || !t->active || get_u32(packet + 1) != t->id)
+        return;
+
+    uint32_t acked = get_u32(packet + 5);
+    if (acked > t->acked && acked <= chunk_count(t)) {
+        t->acked       = acked;
+        t->last_ack_us = now_us();
+        if (t->next < acked)
+            t->next = acked;
+    }
+
+    switch (packet[9]) {
+        case STATE_APPLIED:
+            t->active    = 0;
+            np->epoch    = next_epoch(np->epoch);
+            np->desynced = 0;
+            np->resyncs++;
+            break;
+        case STATE_TOO_OLD:
+            t->active      = 0;
+            np->send_state = 1;
+            break;
+        default:
+            break;
+    }
+}
+
+void netplay_send_inputs(NetPeer* np, Rollback* rb)
+{
+    if (rb->local_frame - np->local_first > NETPLAY_INPUTS)
+        panic("netplay_send_inputs(): too many inputs not acknowledged");
+
+    for (; np->local_next < rb->local_frame; np->local_next++)
+        np->inputs[np->local_next % NETPLAY_INPUTS] =
+            rollback_local_input(rb, np->local_next);
+
+    int32_t advantage = rollback_local_advantage(rb);
+    if (advantage > INT8_MAX)
+        advantage = INT8_MAX;
+    if (advantage < INT8_MIN)
+        advantage = INT8_MIN;
+
+    np->advantage = advantage;
+    send_inputs(np);
+    send_hashes(np, rb);
+    if (np->is_host)
+        send_state(np, rb);
+}
+
+static void add_rtt_sample(NetPeer* np, uint32_t rtt)
+{
+    if (np->rtt_count == 0) {
+        np->rtt_us    = rtt;
+        np->jitter_us = rtt / 2.0;
+    } else {
+        double err = rtt - np->rtt_us;
+        np->rtt_us += err / 8;
+        np->jitter_us += ((err < 0 ? -err : err) - np->jitter_us) / 4;
+    }
+    np->rtt_samples[np->rtt_count++ % NETPLAY_RTT_WINDOW] = rtt;
+}
+
+static void receive_timestamps(NetPeer* np, const uint8_t* packet)
+{
+    uint32_t stamp = get_u32(packet + 11);
+    uint32_t echo  = get_u32(packet + 15);
+    uint32_t held  = get_u32(packet + 19);
+
+    np->echo_stamp   = stamp;
+    np->echo_recv_us = np->last_recv_us;
+    np->has_echo     = 1;
+
+    if (held == NO_ECHO || (np->rtt_count > 0 && echo == np->last_echo))
+        return;
+
+    // the timestamps are ours, the arithmetic wraps around
+    uint32_t elapsed = (uint32_t)np->last_recv_us - echo;
+    if (held > elapsed || elapsed - held > MAX_RTT_US)
+        return;
+
+    np->last_echo = echo;
+    add_rtt_sample(np, elapsed - held);
+}
+
+static void receive_delay(NetPeer* np, Rollback* rb, const uint8_t* packet)
+{
+    // the one of a new packet, like the advantage
+    rb->remote_delay = packet[23];
+
+    // the host decides
+    uint32_t delay_frame = get_u32(packet + 25);
+    if (!np->is_host && delay_frame > np->delay_frame &&
+        packet[24] <= NETPLAY_DELAY_LIMIT) {
+        np->next_delay  = packet[24];
+        np->delay_frame = delay_frame;
+    }
+}
+
+static void receive_inputs(NetPeer* np, Rollback* rb, const uint8_t* packet,
+                           int64_t size)
+{
+    uint32_t count = packet[2];
+    if (size != INPUT_HEADER + count)
+        return;
+
+    uint32_t ack   = get_u32(packet + 3);
+    uint32_t first = get_u32(packet + 7);
+
+    // a stray or malformed packet, its inputs do not fit in the ring
+    uint64_t end   = (uint64_t)first + count;
+    uint64_t limit = (uint64_t)rb->frame + ROLLBACK_INPUTS / 2;
+    if (end < rb->confirmed || end > limit)
+        return;
+
+    // the packets can be reordered, the acks only go forward
+    if (ack > np->local_first && ack <= np->local_next)
+        np->local_first = ack;
+
+    receive_timestamps(np, packet);
+    if (first + count > np->remote_next) {
+        // a packet with new inputs is also the newest time sync data
+        rollback_add_remote_advantage(rb, (int8_t)packet[1]);
+        receive_delay(np, rb, packet);
+    }
+
+    for (uint32_t i = 0; i < count; ++i) {
+        ControllerState input;
+        input.state = packet[INPUT_HEADER + i];
+        rollback_add_remote_input(rb, first + i, input);
+    }
+    if (first <= np->remote_next && first + count > np->remote_next)
+        np->remote_next = first + count;
+}
+
+static int compare_u32(const void* a, const void* b)
+{
+    uint32_t x = *(const uint32_t*)a;
+    uint32_t y = *(const uint32_t*)b;
+    return (x > y) - (x < y);
+}
+
+uint64_t netplay_rtt_percentile(NetPeer* np, uint32_t percentile)
+{
+    uint32_t count = NETPLAY_RTT_WINDOW;
+    if (np->rtt_count < NETPLAY_RTT_WINDOW)
+        count = (uint32_t)np->rtt_count;
+    if (count == 0)
+        return 0;
+
+    uint32_t sorted[NETPLAY_RTT_WINDOW];
+    memcpy(sorted, np->rtt_samples, count * sizeof(uint32_t));
+    qsort(sorted, count, sizeof(uint32_t), compare_u32);
+
+    uint32_t i = count * percentile / 100;
+    return sorted[i < count ? i : count - 1];
+}
+
+// The delay that hides the usual latency, without stalls on the slow packets:
+// the input of frame f arrives one way latency after the peer has run the
+// frame f - delay, the rest must fit in the rollback window
+static uint32_t target_delay(NetPeer* np, Rollback* rb)
+{
+    uint32_t delay = netplay_input_delay(netplay_rtt_percentile(np, 50));
+    uint64_t slow  = netplay_rtt_percentile(np, 99) / 2;
+    uint32_t late  = (uint32_t)((slow + FRAME_US - 1) / FRAME_US);
+    if (late >= rb->max_frames + delay)
+        delay = late - rb->max_frames + 1;
+    return delay > NETPLAY_DELAY_LIMIT ? NETPLAY_DELAY_LIMIT : delay;
+}
+
+static void decide_delay(NetPeer* np, Rollback* rb)
+{
+    uint64_t now = now_us();
+    if (np->delay_frame > np->applied_frame ||
+        np->rtt_count < DELAY_MIN_SAMPLES ||
+        now - np->last_check_us < DELAY_CHECK_US)
+        return;
+    np->last_check_us = now;
+
+    uint32_t target = target_delay(np, rb);
+    if (target < np->input_delay &&
+        ++np->lower_checks < DELAY_LOWER_CHECKS)
+        return;
+    np->lower_checks = 0;
+    if (target == np->input_delay)
+        return;
+
+    // a frame at a time, the peer must know it before the frame
+    np->next_delay  = target > np->input_delay ? np->input_delay + 1
+                                               : np->input_delay - 1;
+    np->delay_frame = rb->frame + (uint32_t)(np->rtt_us / FRAME_US) +
+                      DELAY_MARGIN;
+}
+
+static void apply_delay(NetPeer* np, Rollback* rb)
+{
+    // if the change arrived late, the delays differ for a few frames
+    if (np->delay_frame <= np->applied_frame || rb->frame < np->delay_frame)
+        return;
+
+    rollback_set_input_delay(rb, np->next_delay);
+    np->input_delay   = np->next_delay;
+    np->applied_frame = np->delay_frame;
+    np->delay_changes++;
+}
+
+int netplay_poll(NetPeer* np, Rollback* rb)
+{
+    if (!np->connected)
+        return 0;
+
+    flush_delayed(np);
+
+    uint8_t packet[NETPLAY_MAX_PACKET];
+    int64_t size;
+    while ((size = recv_raw(np, packet)) >= 0) {
+        if (size == 0)
+            continue;
+
+        switch (packet[0]) {
+            case PACKET_INPUT:
+                if (size >= INPUT_HEADER)
+                    receive_inputs(np, rb, packet, size);
+                break;
+            case PACKET_PING:
+                // a late one of the handshake
+                if (size == PING_SIZE) {
+                    packet[0] = PACKET_PONG;
+                    send_packet(np, packet, PING_SIZE);
+                }
+                break;
+            case PACKET_START: {
+                // our ack was lost
+                uint8_t ack = PACKET_START_ACK;
+                send_packet(np, &ack, 1);
+                break;
+            }
+            case PACKET_HASH:
+                if (size == HASH_SIZE)
+                    receive_hash(np, packet);
+                break;
+            case PACKET_STATE:
+                if (size > STATE_HEADER)
+                    receive_state(np, rb, packet, size);
+                if (np->wrong_rom) {
+                    netplay_disconnect(np);
+                    return 0;
+                }
+                break;
+            case PACKET_STATE_ACK:
+                if (size == STATE_ACK)
+                    receive_state_ack(np, packet);
+                break;
+            case PACKET_DISCONNECT:
+                np->connected = 0;
+                return 0;
+            default:
+                break;
+        }
+    }
+
+    if (np->is_host)
+        decide_delay(np, rb);
+    apply_delay(np, rb);
+    if (!np->is_host)
+        load_state(np, rb);
+
+    uint64_t now = now_us();
+    if (now - np->last_recv_us > TIMEOUT_US) {
+        np->connected = 0;
+        return 0;
+    }
+    // nothing new for a frame: the peer may be waiting for our inputs
+    if (now - np->last_send_us >= RESEND_US)
+        send_inputs(np);
+    return 1;
+}
+
+void netplay_disconnect(NetPeer* np)
+{
+    if (!np->connected)
+        return;
+
+    // no acks, a few copies are sent in case some are lost
+    uint8_t packet = PACKET_DISCONNECT;
+    for (int i = 0; i < DISCONNECT_COPIES; ++i)
+        send_raw(np, &packet, 1);
+    np->connected = 0;
+}
+
+void netplay_set_impairment(NetPeer* np, NetImpairment impairment)
+{
+    np->impairment = impairment;
+}
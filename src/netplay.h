@@ -0,0 +1,188 @@
+#ifndef NETPLAY_H
+#define NETPLAY_H
+
+#include "system.h"
+
+#include <stdint.h>
+
+struct Rollback;
+
+// frames that can be run ahead of the remote input (about 200 ms) and the
+// maximum delay of the local input (see netplay_input_delay()). The delay can
+// grow up to NETPLAY_DELAY_LIMIT if the latency would not fit in the rollback
+// window otherwise
+#define NETPLAY_ROLLBACK_FRAMES 12
+#define NETPLAY_MAX_INPUT_DELAY 2
+#define NETPLAY_DELAY_LIMIT     8
+
+// local inputs kept until the peer acknowledges them
+#define NETPLAY_INPUTS 128
+// bytes of a state in a packet, and the biggest datagram (a chunk of a state
+// with its header). Less than the usual MTU, the datagrams are not fragmented
+#define NETPLAY_CHUNK      1024
+#define NETPLAY_MAX_PACKET (NETPLAY_CHUNK + 32)
+// the packets queued by the impairment layer (see NetImpairment)
+#define NETPLAY_DELAYED 256
+// round-trip time samples the percentiles are computed on (about 2 s)
+#define NETPLAY_RTT_WINDOW 128
+// state hashes kept until the one of the peer arrives (see NetPeer)
+#define NETPLAY_HASHES 128
+
+// Simulated network conditions, applied to the packets we send. They are
+// used to test the protocol on the loopback interface
+typedef struct NetImpairment {
+    uint32_t latency_us;
+    uint32_t jitter_us; // added to the latency, uniformly distributed
+    double   loss;      // probability of dropping a packet
+} NetImpairment;
+
+typedef struct NetHash {
+    SystemHash hash;
+    uint32_t   tag;   // frame + 1
+    uint8_t    epoch; // see NetPeer::epoch
+} NetHash;
+
+// A save state sent by the host, in chunks of NETPLAY_CHUNK bytes. The state
+// is the one at the start of "frame", once the host has every input before
+// it: the peer loads it at the start of that frame, or it runs again the
+// frames it has run since then (see rollback_load_state())
+typedef struct NetTransfer {
+    uint32_t id; // 0 if there have been none
+    uint32_t frame;
+    uint32_t state_size;
+    uint32_t encoded_size; // see rle_encode()
+    uint64_t rom_hash;     // PRG and CHR-ROM, the peer checks it
+    uint8_t* state;
+    uint8_t* encoded;
+    uint8_t* received; // peer: a flag per chunk
+
+    uint32_t acked;       // every chunk before it has been received
+    uint32_t next;        // host: next chunk to send
+    uint64_t last_ack_us; // host: when acked has moved
+    uint8_t  active;      // host: sending, peer: receiving
+    uint8_t  complete;    // peer: received and decoded, not loaded yet
+    uint8_t  applied;     // peer: loaded
+} NetTransfer;
+
+typedef struct DelayedPacket {
+    uint64_t due_us;
+    uint32_t size;
+    uint8_t  data[NETPLAY_MAX_PACKET];
+} DelayedPacket;
+
+// Input exchange over UDP. Every packet carries the oldest local inputs the
+// peer has not acknowledged yet, and the number of remote frames received so
+// far (the ack): a lost packet is not retransmitted, its inputs are in the
+// next ones. The packet is sent again if nothing new is sent for a frame
+// (e.g. while waiting for the peer), that is also the keepalive.
+// Every packet echoes the timestamp of the last one received, with the time it
+// has been held: the round-trip time is measured continuously. The host uses
+// it to adapt the input delay, the change is sent with the inputs and it is
+// applied by both peers at the same frame.
+// The hash of the state at the end of every confirmed frame is sent too, in a
+// packet of its own: if the peers have run the same frame differently, the
+// first frame that differs and the components of the state that differ are
+// recorded. The host sends its state (see NetTransfer) at the start, so that
+// the peer does not need the same save file, and after a desync
+typedef struct NetPeer {
+    int     fd;            // connected to the peer
+    char    peer_name[32]; // its address
+    uint8_t is_host;
+
+    ControllerState inputs[NETPLAY_INPUTS]; // ring, by frame number
+    uint32_t        local_first; // oldest input not acknowledged
+    uint32_t        local_next;  // next local frame
+    uint32_t        remote_next; // every remote input before it is received
+    int8_t          advantage;   // see rollback_local_advantage()
+
+    uint64_t last_send_us;
+    uint64_t last_recv_us;
+    uint8_t  connected;
+
+    // round-trip time: smoothed like TCP does (RFC 6298), the jitter is the
+    // mean deviation. The last samples are kept for the percentiles
+    uint32_t echo_stamp;   // timestamp of the last packet received
+    uint64_t echo_recv_us; // when it has been received
+    uint8_t  has_echo;
+    uint32_t last_echo; // the one of the last sample, a resent packet echoes
+                        // the same timestamp
+    double   rtt_us;
+    double   jitter_us;
+    uint32_t rtt_samples[NETPLAY_RTT_WINDOW]; // ring, in microseconds
+    uint64_t rtt_count;
+
+    // input delay: the current one and the last change decided by the host,
+    // applied from the start of delay_frame
+    uint32_t input_delay;
+    uint32_t next_delay;
+    uint32_t delay_frame;   // 0 if the host has never changed it
+    uint32_t applied_frame; // delay_frame, once applied
+    uint32_t lower_checks;  // checks in a row that wanted a lower delay
+    uint64_t last_check_us;
+    uint64_t delay_changes;
+
+    // desync detection
+    NetHash  local_hashes[NETPLAY_HASHES];  // ring, by frame number
+    NetHash  remote_hashes[NETPLAY_HASHES]; // ring, by frame number
+    uint32_t hash_next; // next local frame whose hash is sent
+    uint64_t hashes_compared;
+    uint8_t  desynced;
+    uint32_t desync_frame;      // the first one that differs
+    uint32_t desync_components; // bit mask of HashComponent
+
+    // state transfer. The epoch counts the states loaded by the peer, the
+    // hashes computed before the last one are not compared
+    NetTransfer transfer;
+    uint8_t     send_state; // host: a transfer is needed
+    uint8_t     epoch;
+    uint8_t     wrong_rom; // another ROM or build, or a corrupted state
+    uint64_t    resyncs;
+
+    NetImpairment impairment;
+    DelayedPacket delayed[NETPLAY_DELAYED]; // unordered
+    uint32_t      delayed_count;
+    uint64_t      rand_state;
+
+    uint64_t packets_sent;
+    uint64_t packets_received;
+    uint64_t packets_dropped; // by the impairment layer
+} NetPeer;
+
+// The host waits for the peer on "port", the other side connects to it. Both
+// return once the two peers can talk to each other
+NetPeer* netplay_accept(int port);
+NetPeer* netplay_connect(const char* ip, int port);
+// A peer on a UDP socket that is already connected, without handshake: the
+// input delay at the start is the same on both sides, only the host changes
+// it
+NetPeer* netplay_build(int fd, uint32_t input_delay, int is_host);
+void     netplay_destroy(NetPeer* np);
+
+// Handshake, after accept/connect. The host measures the round-trip time (in
+// microseconds) and decides the input delay, the peer waits for it
+uint64_t netplay_estimate_rtt(NetPeer* np);
+void     netplay_start(NetPeer* np, uint32_t input_delay);
+uint32_t netplay_wait_start(NetPeer* np);
+
+// The input delay for a round-trip time: about the one way latency, up to
+// NETPLAY_MAX_INPUT_DELAY frames. The rest of the latency is hidden by the
+// rollback
+uint32_t netplay_input_delay(uint64_t rtt_us);
+
+// Sends the local inputs added to rb since the last call, once per frame. rb
+// provides the time synchronization data too
+void netplay_send_inputs(NetPeer* np, struct Rollback* rb);
+// Receives the pending packets, the remote inputs go to rb, and applies the
+// changes of the input delay. It returns 0 if the peer has disconnected or it
+// has not been heard for a while
+int  netplay_poll(NetPeer* np, struct Rollback* rb);
+// Tells the peer we are leaving
+void netplay_disconnect(NetPeer* np);
+
+// The round-trip time (in microseconds) below which are "percentile" % of the
+// last samples, 0 if there are none
+uint64_t netplay_rtt_percentile(NetPeer* np, uint32_t percentile);
+
+void netplay_set_impairment(NetPeer* np, NetImpairment impairment);
+
+#endif
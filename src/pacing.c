@@ -0,0 +1,96 @@
+#include "pacing.h"
+#include "alloc.h"
+
+#include <time.h>
+#include <errno.h>
+
+// weight of the last measure of the audio queue in Pacer::queued_avg
+#define QUEUED_SMOOTHING 0.1
+
+uint64_t pacer_now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+Pacer* pacer_build(uint32_t sample_rate, uint64_t target_us)
+{
+    Pacer* p         = calloc_or_fail(sizeof(Pacer));
+    p->target_queued = (uint32_t)(sample_rate * target_us / 1000000);
+    if (p->target_queued == 0)
+        p->target_queued = 1;
+    p->queued_avg = p->target_queued;
+    p->ratio      = 1.0;
+    return p;
+}
+
+void pacer_destroy(Pacer* p) { free_or_fail(p); }
+
+static void sleep_until(uint64_t deadline_ns)
+{
+#ifdef __linux__
+    // absolute: a signal or a late wakeup does not move the deadline
+    struct timespec ts = {.tv_sec  = deadline_ns / 1000000000ull,
+                          .tv_nsec = deadline_ns % 1000000000ull};
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+        ;
+#else
+    uint64_t now = pacer_now_ns();
+    if (deadline_ns <= now)
+        return;
+    uint64_t        delta = deadline_ns - now;
+    struct timespec ts    = {.tv_sec  = delta / 1000000000ull,
+                             .tv_nsec = delta % 1000000000ull};
+    nanosleep(&ts, NULL);
+#endif
+}
+
+void pacer_wait(Pacer* p)
+{
+    uint64_t now = pacer_now_ns();
+    if (p->next_frame_ns == 0) {
+        p->next_frame_ns = now;
+        return;
+    }
+    if (p->next_frame_ns <= now)
+        return;
+
+    sleep_until(p->next_frame_ns);
+    p->slept_ns += pacer_now_ns() - now;
+}
+
+void pacer_frame_done(Pacer* p, uint64_t frame_ns)
+{
+    uint64_t now = pacer_now_ns();
+
+    p->frames++;
+    p->next_frame_ns += frame_ns;
+    if (p->next_frame_ns + frame_ns < now) {
+        // e.g. the window has been dragged: start again from now
+        p->late_frames++;
+        p->next_frame_ns = now;
+    }
+}
+
+double pacer_update_rate(Pacer* p, uint32_t queued)
+{
+    if (queued == 0) {
+        p->refills++;
+        p->queued_avg = p->target_queued;
+        p->ratio      = 1.0;
+        return p->ratio;
+    }
+
+    // proportional: the further the queue is from the target, the more the
+    // sample rate moves, up to PACING_MAX_ADJUST (below the pitch change that
+    // can be heard)
+    p->queued_avg += QUEUED_SMOOTHING * ((double)queued - p->queued_avg);
+    double error = (p->target_queued - p->queued_avg) / p->target_queued;
+    if (error > 1.0)
+        error = 1.0;
+    else if (error < -1.0)
+        error = -1.0;
+    p->ratio = 1.0 + PACING_MAX_ADJUST * error;
+    return p->ratio;
+}
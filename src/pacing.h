@@ -0,0 +1,48 @@
+#ifndef PACING_H
+#define PACING_H
+
+#include <stdint.h>
+
+// the controller never moves the sample rate more than this from nominal
+#define PACING_MAX_ADJUST 0.005
+
+// Runs the frames at the pace of the emulated machine: every frame has an
+// absolute deadline on CLOCK_MONOTONIC, the next one is the previous deadline
+// plus the emulated length of the frame, so the errors of the sleeps do not
+// add up. The time between the frames is spent sleeping.
+//
+// The audio device has a clock of its own, that drifts from CLOCK_MONOTONIC:
+// the APU is told to generate slightly more or fewer samples (at most
+// PACING_MAX_ADJUST) to keep the audio queue at a few milliseconds, instead of
+// letting it grow (latency) or run dry (crackle)
+typedef struct Pacer {
+    uint64_t next_frame_ns; // deadline of the next frame, 0 before the first
+    uint32_t target_queued; // samples queued at the start of every frame
+    double   queued_avg;    // smoothed, the device takes samples in blocks
+    double   ratio;         // see apu_set_rate_adjust()
+
+    uint64_t frames;
+    uint64_t late_frames; // the deadline had passed by more than a frame
+    uint64_t refills;     // the audio queue was empty at the start of a frame
+    uint64_t slept_ns;
+} Pacer;
+
+// "target_us": depth of the audio queue to aim for at the start of a frame
+Pacer*   pacer_build(uint32_t sample_rate, uint64_t target_us);
+void     pacer_destroy(Pacer* p);
+uint64_t pacer_now_ns();
+
+// Sleeps until the deadline of the next frame
+void   pacer_wait(Pacer* p);
+// Moves the deadline by the length of the frame that has just run (or of the
+// pause between two frames), a frame that is late by more than its length
+// does not make the next ones run back to back
+void   pacer_frame_done(Pacer* p, uint64_t frame_ns);
+// The rate adjustment for the samples queued now, to be called at the start
+// of every frame while the audio is playing. If the queue is empty (at the
+// start, after a pause or a late frame) the caller refills it with
+// target_queued samples of silence: the controller is too slow (on purpose)
+// to bring it back to the target without running dry again
+double pacer_update_rate(Pacer* p, uint32_t queued);
+
+#endif
@@ -4,8 +4,9 @@
 #include "memory.h"
 #include "alloc.h"
 #include "logging.h"
-#include "game_window.h"
+#include "video_sink.h"
 #include "mapper.h"
+#include "stream.h"
 
 #include <assert.h>
 #include <stdio.h>
@@ -13,9 +14,26 @@
 
 #define SKIP_BORDER_PIXELS 0
 #define PRINT_PPU_STATE    0
+#define SCANLINE_RENDERER  1
+
+// shorter runs of visible dots are drawn one dot at a time, setting up
+// render_dots() costs more
+#define MIN_RENDER_DOTS 16
 
 #define IS_PIXEL_TRANSPARENT(p) ((p) % 4 == 0)
 
+#define NMI_DELAY  13
+#define FRAME_DOTS (262 * 341)
+
+// the components that are not emphasized are multiplied by this (per mille)
+#define EMPHASIS_ATTENUATION 816
+
+// Each bit of a pattern plane byte expanded to a 4 bit pixel, leftmost pixel
+// in the most significant nibble. The second table holds the horizontally
+// flipped variants. A tile row is decoded with two lookups (see
+// decode_pattern()), in the same format of Ppu::tile_data
+static uint32_t pattern_planes[2][256];
+
 uint32_t palette_colors[] = {
     PACK_RGB(84, 84, 84),    // 0x00
     PACK_RGB(0, 30, 116),    // 0x01
@@ -83,12 +101,74 @@ uint32_t palette_colors[] = {
     PACK_RGB(0, 0, 0),       // 0x3f
 };
 
+uint32_t palette_index_colors[PALETTE_INDICES];
+
+static uint32_t attenuate(uint32_t component)
+{
+    return component * EMPHASIS_ATTENUATION / 1000;
+}
+
+static void init_palette_index_colors()
+{
+    for (uint32_t i = 0; i < PALETTE_INDICES; ++i) {
+        uint32_t rgb = palette_colors[i % 64];
+        uint32_t r   = COLOR_R(rgb);
+        uint32_t g   = COLOR_G(rgb);
+        uint32_t b   = COLOR_B(rgb);
+
+        uint32_t emphasis = i >> 6;
+        if (emphasis & 1) { // red
+            g = attenuate(g);
+            b = attenuate(b);
+        }
+        if (emphasis & 2) { // green
+            r = attenuate(r);
+            b = attenuate(b);
+        }
+        if (emphasis & 4) { // blue
+            r = attenuate(r);
+            g = attenuate(g);
+        }
+        palette_index_colors[i] = PACK_RGB(r, g, b);
+    }
+}
+
+static void init_pattern_planes()
+{
+    for (uint32_t byte = 0; byte < 256; ++byte) {
+        uint32_t plane = 0, flipped = 0;
+        for (uint32_t i = 0; i < 8; ++i) {
+            uint32_t bit = (byte >> i) & 1;
+            plane |= bit << (i * 4);
+            flipped |= bit << ((7 - i) * 4);
+        }
+        pattern_planes[0][byte] = plane;
+        pattern_planes[1][byte] = flipped;
+    }
+}
+
+static inline uint32_t decode_pattern(uint8_t low_tile_byte,
+                                      uint8_t high_tile_byte, int flip)
+{
+    return pattern_planes[flip][low_tile_byte] |
+           pattern_planes[flip][high_tile_byte] << 1;
+}
+
 Ppu* ppu_build(System* sys)
 {
-    Ppu* ppu = calloc_or_fail(sizeof(Ppu));
-    ppu->sys = sys;
-    ppu->gw  = NULL;
-    ppu->mem = ppu_memory_build(sys);
+    static int tables_ready = 0;
+    if (!tables_ready) {
+        init_pattern_planes();
+        init_palette_index_colors();
+        tables_ready = 1;
+    }
+
+    Ppu* ppu         = calloc_or_fail(sizeof(Ppu));
+    ppu->sys         = sys;
+    ppu->video       = NULL;
+    ppu->mem         = ppu_memory_build(sys);
+    ppu->framebuffer = calloc_or_fail(FRAME_WIDTH * FRAME_HEIGHT *
+                                      sizeof(ppu->framebuffer[0]));
 
     ppu_reset(ppu);
     return ppu;
@@ -97,10 +177,14 @@ Ppu* ppu_build(System* sys)
 void ppu_destroy(Ppu* ppu)
 {
     memory_destroy(ppu->mem);
+    free_or_fail(ppu->framebuffer);
     free_or_fail(ppu);
 }
 
-void ppu_set_game_window(Ppu* ppu, GameWindow* gw) { ppu->gw = gw; }
+void ppu_set_video_sink(Ppu* ppu, VideoSink* video)
+{
+    ppu->video = video;
+}
 
 static void write_PPUCTRL(Ppu*, uint8_t);
 static void write_PPUMASK(Ppu*, uint8_t);
@@ -117,7 +201,7 @@ void ppu_reset(Ppu* ppu)
     write_OAMADDR(ppu, 0);
 }
 
-static void increment_x(Ppu* ppu)
+static inline void increment_x(Ppu* ppu)
 {
     if ((ppu->v & 0x001F) == 31) { // if coarse X == 31
         ppu->v &= 0xFFE0;          // coarse X = 0
@@ -153,7 +237,7 @@ static void updated_nmi(Ppu* ppu)
         (ppu->status_flags.in_vblank) && (ppu->ctrl_flags.trigger_nmi);
     if (trigger_nmi && !ppu->nmi_prev) {
         // Fixes Bomberman II
-        ppu->nmi_delay = 13;
+        ppu->nmi_delay = NMI_DELAY;
     }
     ppu->nmi_prev = trigger_nmi;
 }
@@ -170,6 +254,16 @@ static void copy_y(Ppu* ppu)
     ppu->v = (ppu->v & 0x841F) | (ppu->t & 0x7BE0);
 }
 
+// palette index of the color at "addr" in the palette memory, as it is
+// displayed with the current PPUMASK
+static inline uint16_t palette_index(Ppu* ppu, uint16_t addr)
+{
+    uint16_t color = memory_read(ppu->mem, addr) % 64;
+    if (ppu->mask_flags.grayscale)
+        color &= 0x30;
+    return color | (ppu->mask_flags.flags & 0xE0) << 1;
+}
+
 static void render_pixel(Ppu* ppu)
 {
     int x = ppu->cycle - 1;
@@ -254,17 +348,31 @@ static void render_pixel(Ppu* ppu)
     if (y < 10 || y >= 230)
         return;
 #endif
-    uint32_t rgb = palette_colors[memory_read(ppu->mem, 0x3F00u + color) % 64];
-    if (ppu->gw)
-        gamewindow_set_pixel(ppu->gw, x, y, rgb);
+    ppu->framebuffer[y * FRAME_WIDTH + x] = palette_index(ppu, 0x3F00u + color);
+}
+
+static void convert_frame(Ppu* ppu)
+{
+    const uint16_t* indices = ppu->framebuffer;
+    uint32_t*       out     = ppu->video->framebuffer;
+
+    for (int i = 0; i < FRAME_WIDTH * FRAME_HEIGHT; i += 4) {
+        out[i]     = palette_index_colors[indices[i]];
+        out[i + 1] = palette_index_colors[indices[i + 1]];
+        out[i + 2] = palette_index_colors[indices[i + 2]];
+        out[i + 3] = palette_index_colors[indices[i + 3]];
+    }
 }
 
 static void set_vertical_blank(Ppu* ppu)
 {
     ppu->status_flags.in_vblank = 1;
     updated_nmi(ppu);
-    if (ppu->gw)
-        gamewindow_draw(ppu->gw);
+    if (ppu->video) {
+        convert_frame(ppu);
+        if (ppu->video->frame_ready)
+            ppu->video->frame_ready(ppu->video->obj, ppu->video->framebuffer);
+    }
 }
 
 static void clear_vertical_blank(Ppu* ppu)
@@ -301,28 +409,60 @@ static uint32_t fetch_sprite_pattern(Ppu* ppu, uint8_t sprite_id, uint8_t row)
         addr = (uint16_t)0x1000 * table + (uint16_t)tile * 16 + (uint16_t)row;
     }
 
-    uint8_t a              = (attributes & 3) << 2;
-    uint8_t low_tile_byte  = memory_read(ppu->mem, addr);
-    uint8_t high_tile_byte = memory_read(ppu->mem, addr + 8);
+    uint32_t a              = (attributes & 3) << 2;
+    uint8_t  low_tile_byte  = memory_read(ppu->mem, addr);
+    uint8_t  high_tile_byte = memory_read(ppu->mem, addr + 8);
 
-    uint32_t data = 0;
-    for (uint8_t i = 0; i < 8; ++i) {
-        uint8_t p1, p2;
-        if (attributes & 0x40) {
-            p1 = (low_tile_byte & 1);
-            p2 = (high_tile_byte & 1) << 1;
-            low_tile_byte >>= 1;
-            high_tile_byte >>= 1;
-        } else {
-            p1 = (low_tile_byte & 0x80) >> 7;
-            p2 = (high_tile_byte & 0x80) >> 6;
-            low_tile_byte <<= 1;
-            high_tile_byte <<= 1;
+    // the palette bits are replicated in every pixel
+    return decode_pattern(low_tile_byte, high_tile_byte,
+                          (attributes & 0x40) != 0) |
+           a * 0x11111111u;
+}
+
+static inline void fetch_background(Ppu* ppu)
+{
+    switch (ppu->cycle % 8) {
+        case 0: {
+            uint32_t a = ppu->attribute_table_byte;
+            ppu->tile_data |= decode_pattern(ppu->low_tile_byte,
+                                             ppu->high_tile_byte, 0) |
+                              a * 0x11111111u;
+            // both planes have been shifted out
+            ppu->low_tile_byte  = 0;
+            ppu->high_tile_byte = 0;
+            break;
+        }
+        case 1: {
+            uint16_t addr        = 0x2000 | (ppu->v & 0x0FFF);
+            ppu->name_table_byte = memory_read(ppu->mem, addr);
+            break;
+        }
+        case 3: {
+            uint16_t addr = 0x23C0 | (ppu->v & 0x0C00) |
+                            ((ppu->v >> 4) & 0x38) |
+                            ((ppu->v >> 2) & 0x07);
+            uint16_t shift = ((ppu->v >> 4) & 4) | (ppu->v & 2);
+            ppu->attribute_table_byte =
+                ((memory_read(ppu->mem, addr) >> shift) & 3) << 2;
+            break;
+        }
+        case 5: {
+            uint16_t fine_y = (ppu->v >> 12) & 7;
+            uint16_t addr   = ppu->name_table_byte * 16 + fine_y;
+            if (ppu->ctrl_flags.background_table)
+                addr += 0x1000;
+            ppu->low_tile_byte = memory_read(ppu->mem, addr);
+            break;
+        }
+        case 7: {
+            uint16_t fine_y = (ppu->v >> 12) & 7;
+            uint16_t addr   = ppu->name_table_byte * 16 + fine_y;
+            if (ppu->ctrl_flags.background_table)
+                addr += 0x1000;
+            ppu->high_tile_byte = memory_read(ppu->mem, addr + 8);
+            break;
         }
-        data <<= 4;
-        data |= (uint32_t)(a | p1 | p2);
     }
-    return data;
 }
 
 static void update_cycle(Ppu* ppu)
@@ -385,52 +525,7 @@ void ppu_step(Ppu* ppu)
             mapper_notify_fetching(ppu->sys->mapper, ppu, FETCHING_BACKGROUND);
 
             ppu->tile_data <<= 4;
-            switch (ppu->cycle % 8) {
-                case 0: {
-                    uint32_t data = 0;
-                    for (uint8_t i = 0; i < 8; ++i) {
-                        uint8_t a  = ppu->attribute_table_byte;
-                        uint8_t p1 = (ppu->low_tile_byte & 0x80) >> 7;
-                        uint8_t p2 = (ppu->high_tile_byte & 0x80) >> 6;
-                        ppu->low_tile_byte <<= 1;
-                        ppu->high_tile_byte <<= 1;
-                        data <<= 4;
-                        data |= (uint32_t)(a | p1 | p2);
-                    }
-                    ppu->tile_data |= data;
-                    break;
-                }
-                case 1: {
-                    uint16_t addr        = 0x2000 | (ppu->v & 0x0FFF);
-                    ppu->name_table_byte = memory_read(ppu->mem, addr);
-                    break;
-                }
-                case 3: {
-                    uint16_t addr = 0x23C0 | (ppu->v & 0x0C00) |
-                                    ((ppu->v >> 4) & 0x38) |
-                                    ((ppu->v >> 2) & 0x07);
-                    uint16_t shift = ((ppu->v >> 4) & 4) | (ppu->v & 2);
-                    ppu->attribute_table_byte =
-                        ((memory_read(ppu->mem, addr) >> shift) & 3) << 2;
-                    break;
-                }
-                case 5: {
-                    uint16_t fine_y = (ppu->v >> 12) & 7;
-                    uint16_t addr   = ppu->name_table_byte * 16 + fine_y;
-                    if (ppu->ctrl_flags.background_table)
-                        addr += 0x1000;
-                    ppu->low_tile_byte = memory_read(ppu->mem, addr);
-                    break;
-                }
-                case 7: {
-                    uint16_t fine_y = (ppu->v >> 12) & 7;
-                    uint16_t addr   = ppu->name_table_byte * 16 + fine_y;
-                    if (ppu->ctrl_flags.background_table)
-                        addr += 0x1000;
-                    ppu->high_tile_byte = memory_read(ppu->mem, addr + 8);
-                    break;
-                }
-            }
+            fetch_background(ppu);
         }
         if (pre_line && ppu->cycle >= 280 && ppu->cycle <= 304) {
             copy_y(ppu);
@@ -497,6 +592,237 @@ void ppu_step(Ppu* ppu)
     }
 }
 
+#if SCANLINE_RENDERER
+// Draws the next "count" visible dots (1 to 256) of the current scanline at
+// once, with the same result of calling ppu_step() and mapper_step() for each
+// of them. It is correct only if nothing outside the PPU reads or changes its
+// state until the last of them: the registers, the palette and the fine X
+// scroll are constant, the sprites of the line have already been evaluated
+static void render_dots(Ppu* ppu, Mapper* map, int count)
+{
+    int       x;
+    int       y    = ppu->scanline;
+    int       end  = ppu->cycle + count;
+    uint16_t* line = &ppu->framebuffer[y * FRAME_WIDTH];
+
+    int show_bg      = ppu->mask_flags.show_background;
+    int show_sprites = ppu->mask_flags.show_sprites;
+    // the mappers that step at a given cycle do it after the visible dots
+    int step_mapper  = map->step && (map->step_cycle == 0 ||
+                                    map->step_cycle <= FRAME_WIDTH);
+
+    if (!show_bg && !show_sprites) {
+        // no fetches and no scrolling, v does not change
+        uint8_t color = 0;
+        if (ppu->v >= 0x3F00 && ppu->v <= 0x3FFF)
+            color = memory_read(ppu->mem, ppu->v);
+        uint16_t index = palette_index(ppu, 0x3F00u + color);
+
+        for (x = ppu->cycle; x < end; ++x) {
+            ppu->cycle = x + 1;
+            line[x]    = index;
+            if (step_mapper)
+                mapper_step(map, ppu->sys);
+        }
+        return;
+    }
+
+    uint16_t colors[32];
+    for (x = 0; x < 32; ++x)
+        colors[x] = palette_index(ppu, 0x3F00u + x);
+
+    // sprite layer of the line, the sprite with the lowest index wins
+    uint8_t sprite_pixels[FRAME_WIDTH] = {0};
+    uint8_t sprite_ids[FRAME_WIDTH];
+    if (show_sprites) {
+        for (int i = ppu->sprite_count - 1; i >= 0; --i) {
+            for (int off = 0; off < 8; ++off) {
+                x = ppu->sprites[i].position + off;
+                if (x >= FRAME_WIDTH)
+                    break;
+
+                uint8_t pixel =
+                    (ppu->sprites[i].pattern >> ((7 - off) * 4)) & 0x0F;
+                if (IS_PIXEL_TRANSPARENT(pixel))
+                    continue;
+                sprite_pixels[x] = pixel;
+                sprite_ids[x]    = i;
+            }
+        }
+    }
+
+    // the sprite-0 hit rules of render_pixel() that do not depend on the
+    // pixels
+    int zero_hit_left = ppu->mask_flags.show_left_sprites &&
+                        ppu->mask_flags.show_left_background;
+    int zero_hit      = show_bg && show_sprites;
+    int bg_shift      = (7 - ppu->x) * 4;
+
+    mapper_notify_fetching(map, ppu, FETCHING_BACKGROUND);
+    for (x = ppu->cycle; x < end; ++x) {
+        ppu->cycle = x + 1;
+
+        uint8_t bg_pixel = 0;
+        if (show_bg)
+            bg_pixel = ((uint32_t)(ppu->tile_data >> 32) >> bg_shift) & 0x0F;
+        uint8_t sprite_pixel = sprite_pixels[x];
+
+        if (x < 8 && !ppu->mask_flags.show_left_background)
+            bg_pixel = 0;
+        if (x < 8 && !ppu->mask_flags.show_left_sprites)
+            sprite_pixel = 0;
+
+        uint8_t color;
+        if (IS_PIXEL_TRANSPARENT(sprite_pixel)) {
+            color = IS_PIXEL_TRANSPARENT(bg_pixel) ? 0 : bg_pixel;
+        } else if (IS_PIXEL_TRANSPARENT(bg_pixel)) {
+            color = sprite_pixel | 0x10;
+        } else {
+            Sprite* sprite = &ppu->sprites[sprite_ids[x]];
+            if (sprite->index == 0 && zero_hit && (x > 7 || zero_hit_left) &&
+                x != 255)
+                ppu->status_flags.sprite_zero_hit = 1;
+
+            color = sprite->priority == 0 ? sprite_pixel | 0x10 : bg_pixel;
+        }
+
+#if SKIP_BORDER_PIXELS
+        int skip = x < 10 || x >= 246 || y < 10 || y >= 230;
+#else
+        int skip = 0;
+#endif
+        if (!skip)
+            line[x] = colors[color];
+
+        ppu->tile_data <<= 4;
+        fetch_background(ppu);
+        if (ppu->cycle % 8 == 0)
+            increment_x(ppu);
+        if (ppu->cycle == 256)
+            increment_y(ppu);
+        if (step_mapper)
+            mapper_step(map, ppu->sys);
+    }
+}
+#endif
+
+// The number of dots from the next one on in which ppu_step() would only move
+// to the next dot, and the mapper does not step: nothing is drawn or
+// fetched, no flag changes. They stay in the current scanline
+static uint16_t idle_dots(Ppu* ppu, Mapper* map)
+{
+    uint16_t first = ppu->cycle + 1;
+    uint16_t last  = 340;
+    uint16_t line  = ppu->scanline;
+
+    if (ppu->nmi_delay > 0 || first > 340)
+        return 0;
+    if (map->step && map->step_cycle == 0)
+        // it steps on every dot
+        return 0;
+
+    if (line >= 240 && line <= 260) {
+        // post-render and vertical blank, the flag is set at dot 1 of 241
+        if (line == 241 && first <= 1)
+            return 0;
+    } else if (!ppu->mask_flags.show_background &&
+               !ppu->mask_flags.show_sprites) {
+        // the visible dots are drawn, the flags are cleared at dot 1 of the
+        // pre-render line
+        if (first <= (line == 261 ? 1 : FRAME_WIDTH))
+            return 0;
+    } else if (first >= 258 && first <= 320) {
+        // between the sprite evaluation (257) and the fetches of the next
+        // line (321), the pre-render line copies the vertical scroll
+        if (line == 261) {
+            if (first >= 280 && first <= 304)
+                return 0;
+            last = first < 280 ? 279 : 320;
+        } else {
+            last = 320;
+        }
+    } else if (first >= 337) {
+        // the odd frames skip the last dot of the pre-render line
+        if (line == 261)
+            last = 339;
+    } else {
+        return 0;
+    }
+
+    if (map->step && map->step_cycle >= first && map->step_cycle <= last)
+        last = map->step_cycle - 1;
+    return last >= first ? last - first + 1 : 0;
+}
+
+void ppu_run(Ppu* ppu, uint64_t dots)
+{
+    Mapper* map = ppu->sys->mapper;
+
+    if (ppu->sys->sync_mode == SYNC_LOCKSTEP) {
+        // the reference the shortcuts below are checked against (frame_hash)
+        for (; dots > 0; --dots) {
+            ppu_step(ppu);
+            mapper_step(map, ppu->sys);
+        }
+        return;
+    }
+
+    while (dots > 0) {
+#if SCANLINE_RENDERER
+        // The caller does not touch the PPU until the end of the run: the
+        // visible dots in it are drawn at once. The mid-line effects (e.g.,
+        // the CPU writes a register, switches a bank or polls the status in
+        // the middle of the line) split the line in several runs
+        if (ppu->scanline < 240 && ppu->cycle < FRAME_WIDTH &&
+            ppu->nmi_delay == 0) {
+            uint64_t count = FRAME_WIDTH - ppu->cycle;
+            if (count > dots)
+                count = dots;
+            if (count >= MIN_RENDER_DOTS) {
+                render_dots(ppu, map, (int)count);
+                dots -= count;
+                continue;
+            }
+        }
+#endif
+        uint64_t idle = idle_dots(ppu, map);
+        if (idle > 0) {
+            if (idle > dots)
+                idle = dots;
+            ppu->cycle += idle;
+            dots -= idle;
+            continue;
+        }
+        ppu_step(ppu);
+        mapper_step(map, ppu->sys);
+        dots--;
+    }
+}
+
+uint64_t ppu_dots_until(Ppu* ppu, uint16_t scanline, uint16_t cycle)
+{
+    int64_t cur    = (int64_t)ppu->scanline * 341 + ppu->cycle;
+    int64_t target = (int64_t)scanline * 341 + cycle;
+    int64_t dots   = (target - cur + FRAME_DOTS) % FRAME_DOTS;
+    if (dots == 0)
+        dots = FRAME_DOTS;
+
+    // crossing the end of the frame we could skip the last dot (odd frames)
+    if (target <= cur)
+        dots--;
+    return dots;
+}
+
+uint64_t ppu_nmi_dots(Ppu* ppu)
+{
+    if (ppu->nmi_delay > 0)
+        return ppu->nmi_delay;
+    if (!ppu->ctrl_flags.trigger_nmi)
+        // only a write to PPUCTRL can change this
+        return NO_EVENT;
+    return ppu_dots_until(ppu, 241, 1) + NMI_DELAY;
+}
+
 static uint8_t read_PPUSTATUS(Ppu* ppu)
 {
     /*
@@ -795,27 +1121,29 @@ const char* ppu_tostring_short(Ppu* ppu)
     return res;
 }
 
-void ppu_serialize(Ppu* ppu, FILE* ofile)
+void ppu_serialize(Ppu* ppu, Writer* w)
 {
-    Buffer res = {.buffer = (uint8_t*)ppu, .size = sizeof(Ppu)};
-    dump_buffer(&res, ofile);
+    // without the pointers, see cpu_serialize()
+    Ppu tmp         = *ppu;
+    tmp.mem         = NULL;
+    tmp.sys         = NULL;
+    tmp.video       = NULL;
+    tmp.framebuffer = NULL;
+    write_section(w, &tmp, sizeof(Ppu));
 }
 
-void ppu_deserialize(Ppu* ppu, FILE* ifile)
+void ppu_deserialize(Ppu* ppu, Reader* r)
 {
-    Buffer buf = read_buffer(ifile);
-    if (buf.size != sizeof(Ppu))
-        panic("ppu_deserialize(): invalid buffer");
-
-    void* tmp_sys = ppu->sys;
-    void* tmp_mem = ppu->mem;
-    void* tmp_gw  = ppu->gw;
-
-    memcpy(ppu, buf.buffer, buf.size);
-    ppu->sys = tmp_sys;
-    ppu->mem = tmp_mem;
-    ppu->gw  = tmp_gw;
-    free_or_fail(buf.buffer);
+    void* tmp_sys         = ppu->sys;
+    void* tmp_mem         = ppu->mem;
+    void* tmp_video       = ppu->video;
+    void* tmp_framebuffer = ppu->framebuffer;
+
+    read_section(r, ppu, sizeof(Ppu), "ppu_deserialize()");
+    ppu->sys         = tmp_sys;
+    ppu->mem         = tmp_mem;
+    ppu->video       = tmp_video;
+    ppu->framebuffer = tmp_framebuffer;
 
     ppu->x &= 0x07;
 
@@ -6,10 +6,16 @@
 
 #define MAX_SPRITES 8
 
-struct GameWindow;
+// The PPU renders palette indices: the NES color (bits 0-5) and the color
+// emphasis bits of PPUMASK (bits 6-8)
+#define PALETTE_INDICES 512
+
+struct VideoSink;
 struct System;
 struct Memory;
 struct Buffer;
+struct Writer;
+struct Reader;
 
 typedef struct PpuStatusFlags {
     union {
@@ -61,9 +67,12 @@ typedef struct Sprite {
 } Sprite;
 
 typedef struct Ppu {
-    struct Memory*     mem;
-    struct System*     sys;
-    struct GameWindow* gw;
+    struct Memory*    mem;
+    struct System*    sys;
+    struct VideoSink* video;
+    // FRAME_WIDTH * FRAME_HEIGHT palette indices of the current frame,
+    // converted to ARGB in the video sink at the start of the vertical blank
+    uint16_t* framebuffer;
 
     uint8_t palette_data[32];
     uint8_t nametable_data[2048];
@@ -86,6 +95,7 @@ typedef struct Ppu {
     uint32_t frame;
     uint16_t cycle;    // 0-340
     uint16_t scanline; // 0-261
+    uint64_t clock;    // master clock (see Cpu::ticks) it has been stepped to
 
     uint8_t sprite_count;
     Sprite  sprites[MAX_SPRITES];
@@ -102,21 +112,34 @@ typedef struct Ppu {
 } Ppu;
 
 extern uint32_t palette_colors[64];
+// ARGB color (PACK_RGB()) of every palette index
+extern uint32_t palette_index_colors[PALETTE_INDICES];
 
 Ppu* ppu_build(struct System* sys);
 void ppu_destroy(Ppu* ppu);
 
-void    ppu_set_game_window(Ppu* ppu, struct GameWindow* gw);
+void    ppu_set_video_sink(Ppu* ppu, struct VideoSink* video);
 void    ppu_step(Ppu* ppu);
 uint8_t ppu_read_register(Ppu* ppu, uint16_t addr);
 void    ppu_write_register(Ppu* ppu, uint16_t addr, uint8_t value);
 
 void ppu_reset(Ppu* ppu);
 
+// Steps the PPU and the mapper "dots" times. The visible part of a scanline
+// is drawn at once when it is entirely in the run, the caller must not look
+// at the PPU state before the end of it
+void ppu_run(Ppu* ppu, uint64_t dots);
+
+// Scheduling helpers, both return a lower bound of the number of ppu_step()
+// calls: before the PPU is at the given scanline/cycle, and before it can
+// trigger an NMI (NO_EVENT if it cannot)
+uint64_t ppu_dots_until(Ppu* ppu, uint16_t scanline, uint16_t cycle);
+uint64_t ppu_nmi_dots(Ppu* ppu);
+
 const char* ppu_tostring(Ppu* ppu);
 const char* ppu_tostring_short(Ppu* ppu);
 
-void ppu_serialize(Ppu* ppu, FILE* ofile);
-void ppu_deserialize(Ppu* ppu, FILE* ifile);
+void ppu_serialize(Ppu* ppu, struct Writer* w);
+void ppu_deserialize(Ppu* ppu, struct Reader* r);
 
 #endif
@@ -0,0 +1,221 @@
+#include "rewind.h"
+#include "system.h"
+#include "rle.h"
+#include "alloc.h"
+#include "logging.h"
+
+#include <string.h>
+
+#define INITIAL_ENTRIES 256
+
+static void xor_buffers(uint8_t* dst, const uint8_t* src, uint64_t size)
+{
+    uint64_t i = 0;
+    for (; i + 8 <= size; i += 8) {
+        uint64_t a, b;
+        memcpy(&a, dst + i, sizeof(a));
+        memcpy(&b, src + i, sizeof(b));
+        a ^= b;
+        memcpy(dst + i, &a, sizeof(a));
+    }
+    for (; i < size; ++i)
+        dst[i] ^= src[i];
+}
+
+Rewind* rewind_build(System* sys, uint64_t memory_cap,
+                     uint32_t keyframe_interval)
+{
+    Rewind* rw     = calloc_or_fail(sizeof(Rewind));
+    rw->sys        = sys;
+    rw->state_size = system_state_size(sys);
+
+    // the biggest encoded state must fit
+    if (memory_cap < rle_bound(rw->state_size))
+        panic("rewind_build(): memory cap too small, at least %llu bytes",
+              (unsigned long long)rle_bound(rw->state_size));
+    if (keyframe_interval == 0)
+        keyframe_interval = 1;
+
+    rw->state             = malloc_or_fail(rw->state_size);
+    rw->encoded           = malloc_or_fail(rle_bound(rw->state_size));
+    rw->keyframe          = malloc_or_fail(rw->state_size);
+    rw->keyframe_interval = keyframe_interval;
+    rw->arena             = malloc_or_fail(memory_cap);
+    rw->arena_size        = memory_cap;
+    rw->entries_capacity  = INITIAL_ENTRIES;
+    rw->entries = malloc_or_fail(INITIAL_ENTRIES * sizeof(RewindEntry));
+    rw->next_id = 1;
+    return rw;
+}
+
+void rewind_destroy(Rewind* rw)
+{
+    free_or_fail(rw->state);
+    free_or_fail(rw->encoded);
+    free_or_fail(rw->keyframe);
+    free_or_fail(rw->arena);
+    free_or_fail(rw->entries);
+    free_or_fail(rw);
+}
+
+static RewindEntry* entry_at(Rewind* rw, uint32_t i)
+{
+    return &rw->entries[(rw->first + i) % rw->entries_capacity];
+}
+
+static uint32_t group_start(Rewind* rw, uint32_t i)
+{
+    // the oldest entry is always a keyframe
+    while (!entry_at(rw, i)->keyframe)
+        i--;
+    return i;
+}
+
+static void drop_oldest_group(Rewind* rw)
+{
+    do {
+        rw->first = (rw->first + 1) % rw->entries_capacity;
+        rw->count--;
+    } while (rw->count > 0 && !entry_at(rw, 0)->keyframe);
+
+    if (rw->count == 0) {
+        rw->keyframe_id    = 0;
+        rw->since_keyframe = 0;
+    }
+}
+
+static uint64_t reserve(Rewind* rw, uint64_t size)
+{
+    // the entries are stored one after the other in the arena, from the
+    // oldest to the newest, wrapping at its end
+    if (rw->head + size > rw->arena_size) {
+        // the entries after head are the oldest ones
+        while (rw->count > 0 && entry_at(rw, 0)->offset >= rw->head)
+            drop_oldest_group(rw);
+        rw->head = 0;
+    }
+    while (rw->count > 0) {
+        RewindEntry* oldest = entry_at(rw, 0);
+        if (oldest->offset >= rw->head + size ||
+            oldest->offset + oldest->size <= rw->head)
+            break;
+        drop_oldest_group(rw);
+    }
+
+    uint64_t offset = rw->head;
+    rw->head += size;
+    return offset;
+}
+
+static RewindEntry* append_entry(Rewind* rw)
+{
+    if (rw->count == rw->entries_capacity) {
+        uint32_t     capacity = rw->entries_capacity * 2;
+        RewindEntry* entries  = malloc_or_fail(capacity * sizeof(RewindEntry));
+        for (uint32_t i = 0; i < rw->count; ++i)
+            entries[i] = *entry_at(rw, i);
+
+        free_or_fail(rw->entries);
+        rw->entries          = entries;
+        rw->entries_capacity = capacity;
+        rw->first            = 0;
+    }
+    rw->count++;
+    return entry_at(rw, rw->count - 1);
+}
+
+static void load_keyframe(Rewind* rw, RewindEntry* e)
+{
+    if (rw->keyframe_id == e->id)
+        return;
+
+    if (!rle_decode(rw->arena + e->offset, e->size, rw->keyframe,
+                    rw->state_size, 0))
+        panic("rewind: corrupted keyframe");
+    rw->keyframe_id = e->id;
+}
+
+void rewind_push(Rewind* rw)
+{
+    if (system_save_state_mem(rw->sys, rw->state, rw->state_size) !=
+        rw->state_size)
+        panic("rewind_push(): the size of the state has changed");
+
+    int keyframe =
+        rw->count == 0 || rw->since_keyframe >= rw->keyframe_interval;
+    if (!keyframe) {
+        load_keyframe(rw, entry_at(rw, group_start(rw, rw->count - 1)));
+        xor_buffers(rw->state, rw->keyframe, rw->state_size);
+    }
+
+    uint64_t size   = rle_encode(rw->state, rw->state_size, rw->encoded);
+    uint64_t offset = reserve(rw, size);
+    if (!keyframe && rw->count == 0) {
+        // the keyframe of the delta has just been dropped
+        xor_buffers(rw->state, rw->keyframe, rw->state_size);
+        keyframe = 1;
+        size     = rle_encode(rw->state, rw->state_size, rw->encoded);
+        rw->head = offset;
+        offset   = reserve(rw, size);
+    }
+    memcpy(rw->arena + offset, rw->encoded, size);
+
+    RewindEntry* e = append_entry(rw);
+    e->id          = rw->next_id++;
+    e->offset      = offset;
+    e->size        = (uint32_t)size;
+    e->keyframe    = keyframe;
+
+    if (keyframe) {
+        memcpy(rw->keyframe, rw->state, rw->state_size);
+        rw->keyframe_id    = e->id;
+        rw->since_keyframe = 1;
+    } else {
+        rw->since_keyframe++;
+    }
+}
+
+int rewind_pop(Rewind* rw)
+{
+    if (rw->count == 0)
+        return 0;
+
+    uint32_t     last = rw->count - 1;
+    RewindEntry* e    = entry_at(rw, last);
+    load_keyframe(rw, entry_at(rw, group_start(rw, last)));
+    if (e->keyframe) {
+        system_load_state_mem(rw->sys, rw->keyframe, rw->state_size);
+    } else {
+        memcpy(rw->state, rw->keyframe, rw->state_size);
+        if (!rle_decode(rw->arena + e->offset, e->size, rw->state,
+                        rw->state_size, 1))
+            panic("rewind: corrupted entry");
+        system_load_state_mem(rw->sys, rw->state, rw->state_size);
+    }
+
+    // its space is reused by the next entry
+    rw->head = e->offset;
+    rw->count--;
+    if (e->keyframe)
+        rw->keyframe_id = 0;
+    rw->since_keyframe =
+        rw->count > 0 ? rw->count - group_start(rw, rw->count - 1) : 0;
+    return 1;
+}
+
+void rewind_clear(Rewind* rw)
+{
+    rw->head           = 0;
+    rw->first          = 0;
+    rw->count          = 0;
+    rw->keyframe_id    = 0;
+    rw->since_keyframe = 0;
+}
+
+uint64_t rewind_memory_used(Rewind* rw)
+{
+    uint64_t used = 0;
+    for (uint32_t i = 0; i < rw->count; ++i)
+        used += entry_at(rw, i)->size;
+    return used;
+}
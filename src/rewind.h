@@ -0,0 +1,54 @@
+#ifndef REWIND_H
+#define REWIND_H
+
+#include <stdint.h>
+
+struct System;
+
+typedef struct RewindEntry {
+    uint64_t id;
+    uint64_t offset; // in Rewind::arena
+    uint32_t size;
+    uint32_t keyframe;
+} RewindEntry;
+
+// In-memory history of save states, from the newest one backwards. Every
+// "keyframe_interval" states a keyframe is stored, the other states are
+// stored as the XOR with their keyframe. Both are run-length encoded (most of
+// the state does not change between frames) in a ring of "memory_cap" bytes:
+// the oldest states are dropped when it is full
+typedef struct Rewind {
+    struct System* sys;
+    uint64_t       state_size;
+    uint8_t*       state;          // scratch, a whole state
+    uint8_t*       encoded;        // scratch, an encoded state
+    uint8_t*       keyframe;       // decoded keyframe of the newest entries
+    uint64_t       keyframe_id;    // id of the entry in keyframe, 0 if none
+    uint32_t       keyframe_interval;
+    uint32_t       since_keyframe; // entries pushed since the last keyframe
+
+    uint8_t* arena;
+    uint64_t arena_size;
+    uint64_t head; // where the next entry is stored
+
+    RewindEntry* entries; // ring, from the oldest to the newest
+    uint32_t     entries_capacity;
+    uint32_t     first;
+    uint32_t     count;
+    uint64_t     next_id;
+} Rewind;
+
+Rewind* rewind_build(struct System* sys, uint64_t memory_cap,
+                     uint32_t keyframe_interval);
+void    rewind_destroy(Rewind* rw);
+
+// Stores the current state of the system
+void rewind_push(Rewind* rw);
+// Restores the newest state and removes it, 0 if there are no states
+int  rewind_pop(Rewind* rw);
+void rewind_clear(Rewind* rw);
+
+// Bytes used by the stored states
+uint64_t rewind_memory_used(Rewind* rw);
+
+#endif
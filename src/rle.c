@@ -0,0 +1,113 @@
+#include "rle.h"
+
+#include <string.h>
+
+#define MAX_VARINT 10
+// shorter runs of zeros are kept in the literals, a new (zeros, literals) pair
+// would take more space
+#define MIN_ZERO_RUN 4
+
+static uint64_t put_varint(uint8_t* dst, uint64_t v)
+{
+    uint64_t n = 0;
+    while (v >= 0x80) {
+        dst[n++] = (uint8_t)v | 0x80;
+        v >>= 7;
+    }
+    dst[n++] = (uint8_t)v;
+    return n;
+}
+
+// 0 if the varint is truncated or too long
+static int get_varint(const uint8_t** src, const uint8_t* end, uint64_t* v)
+{
+    int shift = 0;
+    *v        = 0;
+    while (*src < end && shift < 7 * MAX_VARINT) {
+        uint8_t b = *(*src)++;
+        *v |= (uint64_t)(b & 0x7F) << shift;
+        shift += 7;
+        if (!(b & 0x80))
+            return 1;
+    }
+    return 0;
+}
+
+uint64_t rle_bound(uint64_t size)
+{
+    return size + (size / (MIN_ZERO_RUN + 1) + 2) * 2 * MAX_VARINT;
+}
+
+static uint64_t zero_run(const uint8_t* src, uint64_t i, uint64_t size)
+{
+    uint64_t start = i;
+    for (; i + 8 <= size; i += 8) {
+        uint64_t word;
+        memcpy(&word, src + i, sizeof(word));
+        if (word != 0)
+            break;
+    }
+    while (i < size && src[i] == 0)
+        i++;
+    return i - start;
+}
+
+uint64_t rle_encode(const uint8_t* src, uint64_t size, uint8_t* dst)
+{
+    uint64_t i = 0, out = 0;
+    while (i < size) {
+        uint64_t zeros = zero_run(src, i, size);
+        i += zeros;
+
+        // the literals end at the next run of at least MIN_ZERO_RUN zeros
+        uint64_t literals = i;
+        while (i < size) {
+            if (src[i] != 0) {
+                i++;
+                continue;
+            }
+            uint64_t run = 0;
+            while (i + run < size && run < MIN_ZERO_RUN && src[i + run] == 0)
+                run++;
+            if (run == MIN_ZERO_RUN || i + run == size)
+                break;
+            i += run;
+        }
+
+        out += put_varint(dst + out, zeros);
+        out += put_varint(dst + out, i - literals);
+        memcpy(dst + out, src + literals, i - literals);
+        out += i - literals;
+    }
+    return out;
+}
+
+int rle_decode(const uint8_t* src, uint64_t src_size, uint8_t* dst,
+               uint64_t dst_size, int xor)
+{
+    const uint8_t* end  = src + src_size;
+    uint64_t       left = dst_size;
+    while (src < end) {
+        uint64_t zeros, literals;
+        if (!get_varint(&src, end, &zeros) || zeros > left)
+            return 0;
+        if (!xor)
+            memset(dst, 0, zeros);
+        dst += zeros;
+        left -= zeros;
+
+        if (!get_varint(&src, end, &literals) || literals > left ||
+            literals > (uint64_t)(end - src))
+            return 0;
+        if (xor) {
+            for (uint64_t i = 0; i < literals; ++i)
+                dst[i] ^= src[i];
+        } else {
+            memcpy(dst, src, literals);
+        }
+        dst += literals;
+        left -= literals;
+        src += literals;
+    }
+    return left == 0;
+}
@@ -0,0 +1,18 @@
+#ifndef RLE_H
+#define RLE_H
+
+#include <stdint.h>
+
+// Run-length encoding of mostly zero data (e.g. save states, or the XOR of
+// two of them): a sequence of (zeros, literals) pairs, the two lengths are
+// LEB128 varints followed by the literal bytes
+
+// The biggest encoding of "size" bytes, the size of the output buffer
+uint64_t rle_bound(uint64_t size);
+uint64_t rle_encode(const uint8_t* src, uint64_t size, uint8_t* dst);
+// Decodes src in dst, or XORs the decoded data with dst. It returns 0 if src
+// is malformed or it does not decode to exactly dst_size bytes
+int      rle_decode(const uint8_t* src, uint64_t src_size, uint8_t* dst,
+                    uint64_t dst_size, int xor);
+
+#endif
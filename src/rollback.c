@@ -0,0 +1,276 @@
+#include "rollback.h"
+#include "ppu.h"
+#include "apu.h"
+#include "alloc.h"
+#include "logging.h"
+
+#include <string.h>
+
+Rollback* rollback_build(System* sys, ControllerNum local_player,
+                         uint32_t input_delay, uint32_t max_frames)
+{
+    if (max_frames == 0)
+        max_frames = 1;
+    // the inputs of the frames that can be rolled back and of the frames the
+    // peer can be ahead of us must fit in the ring
+    if (2 * (max_frames + input_delay) >= ROLLBACK_INPUTS)
+        panic("rollback_build(): too many frames (%u + %u)", max_frames,
+              input_delay);
+
+    Rollback* rb     = calloc_or_fail(sizeof(Rollback));
+    rb->sys          = sys;
+    rb->local_player = local_player;
+    rb->input_delay  = input_delay;
+    rb->remote_delay = input_delay;
+    rb->max_frames   = max_frames;
+    rb->state_size   = system_state_size(sys);
+
+    rb->states = malloc_or_fail(max_frames * sizeof(uint8_t*));
+    for (uint32_t i = 0; i < max_frames; ++i)
+        rb->states[i] = malloc_or_fail(rb->state_size);
+
+    // no input during the first frames, on both sides
+    for (uint32_t f = 0; f < input_delay; ++f)
+        rb->inputs[f].tag = f + 1;
+    rb->local_frame  = input_delay;
+    rb->confirmed    = input_delay;
+    rb->remote_frame = input_delay;
+    return rb;
+}
+
+void rollback_destroy(Rollback* rb)
+{
+    for (uint32_t i = 0; i < rb->max_frames; ++i)
+        free_or_fail(rb->states[i]);
+    free_or_fail(rb->states);
+    free_or_fail(rb);
+}
+
+static RollbackInput* input_at(Rollback* rb, uint32_t frame)
+{
+    return &rb->inputs[frame % ROLLBACK_INPUTS];
+}
+
+static int remote_known(Rollback* rb, uint32_t frame)
+{
+    return input_at(rb, frame)->tag == frame + 1;
+}
+
+void rollback_add_local_input(Rollback* rb, ControllerState input)
+{
+    while (rb->local_frame <= rb->frame + rb->input_delay)
+        input_at(rb, rb->local_frame++)->local = input;
+}
+
+ControllerState rollback_local_input(Rollback* rb, uint32_t frame)
+{
+    if (frame >= rb->local_frame || rb->local_frame - frame > ROLLBACK_INPUTS)
+        panic("rollback_local_input(): frame %u is not in the ring", frame);
+    return input_at(rb, frame)->local;
+}
+
+void rollback_confirmed_inputs(Rollback* rb, uint32_t frame,
+                               ControllerState* p1, ControllerState* p2)
+{
+    if (frame >= rb->confirmed || frame >= rb->frame ||
+        rb->frame - frame > ROLLBACK_INPUTS / 2)
+        panic("rollback_confirmed_inputs(): frame %u is not available", frame);
+
+    RollbackInput* in = input_at(rb, frame);
+    *p1               = rb->local_player == P1 ? in->local : in->remote;
+    *p2               = rb->local_player == P1 ? in->remote : in->local;
+}
+
+int rollback_final_hash(Rollback* rb, uint32_t frame, SystemHash* hash)
+{
+    // a pending rollback runs again the frames from rollback_to on
+    if (frame >= rb->confirmed || frame >= rb->frame ||
+        (rb->rollback_pending && frame >= rb->rollback_to))
+        return 0;
+
+    RollbackHash* h = &rb->hashes[frame % ROLLBACK_INPUTS];
+    if (h->tag != frame + 1)
+        return 0;
+    *hash = h->hash;
+    return 1;
+}
+
+void rollback_set_input_delay(Rollback* rb, uint32_t input_delay)
+{
+    if (2 * (rb->max_frames + input_delay) >= ROLLBACK_INPUTS)
+        panic("rollback_set_input_delay(): the delay is too big (%u)",
+              input_delay);
+    rb->input_delay = input_delay;
+}
+
+void rollback_add_remote_input(Rollback* rb, uint32_t frame,
+                               ControllerState input)
+{
+    if (frame < rb->confirmed || remote_known(rb, frame))
+        return;
+    if (frame >= rb->frame + ROLLBACK_INPUTS / 2)
+        panic("rollback_add_remote_input(): frame %u is too far ahead", frame);
+
+    RollbackInput* in = input_at(rb, frame);
+    if (frame < rb->frame && frame >= rb->base_frame &&
+        in->remote.state != input.state) {
+        // the frame has been run with a wrong prediction
+        if (!rb->rollback_pending || frame < rb->rollback_to)
+            rb->rollback_to = frame;
+        rb->rollback_pending = 1;
+    }
+    in->remote = input;
+    in->tag    = frame + 1;
+
+    if (frame + 1 > rb->remote_frame)
+        rb->remote_frame = frame + 1;
+    while (remote_known(rb, rb->confirmed))
+        rb->confirmed++;
+}
+
+int rollback_can_advance(Rollback* rb)
+{
+    // the state of the oldest frame that is not confirmed must still be
+    // there when the frame is run
+    return rb->frame < rb->confirmed + rb->max_frames;
+}
+
+static void set_inputs(Rollback* rb, uint32_t frame)
+{
+    RollbackInput* in = input_at(rb, frame);
+    if (!remote_known(rb, frame)) {
+        // the newest input that is known for sure
+        ControllerState prediction = {0};
+        if (rb->confirmed > 0)
+            prediction = input_at(rb, rb->confirmed - 1)->remote;
+        in->remote = prediction;
+    }
+
+    ControllerNum remote_player = rb->local_player == P1 ? P2 : P1;
+    system_update_controller(rb->sys, rb->local_player, in->local);
+    system_update_controller(rb->sys, remote_player, in->remote);
+}
+
+static RunSummary run_frame(Rollback* rb, uint32_t frame)
+{
+    uint8_t* state = rb->states[frame % rb->max_frames];
+    if (system_save_state_mem(rb->sys, state, rb->state_size) !=
+        rb->state_size)
+        panic("rollback: the size of the state has changed");
+
+    set_inputs(rb, frame);
+    RunSummary res = system_run_frame(rb->sys);
+
+    RollbackHash* h = &rb->hashes[frame % ROLLBACK_INPUTS];
+    h->hash         = system_hash(rb->sys);
+    h->tag          = frame + 1;
+    return res;
+}
+
+// Loads "state" as the one at the start of "from" and runs the frames up to
+// the current one
+static void resimulate(Rollback* rb, uint32_t from, const uint8_t* state)
+{
+    System*           sys   = rb->sys;
+    struct VideoSink* video = sys->ppu->video;
+    struct AudioSink* audio = sys->apu->sink;
+
+    // the frames have already been shown and played
+    sys->ppu->video = NULL;
+    sys->apu->sink  = NULL;
+
+    system_load_state_mem(sys, state, rb->state_size);
+    for (uint32_t f = from; f < rb->frame; ++f)
+        run_frame(rb, f);
+
+    sys->ppu->video = video;
+    sys->apu->sink  = audio;
+
+    rb->rollbacks++;
+    rb->resimulated_frames += rb->frame - from;
+    rb->rollback_pending = 0;
+}
+
+int rollback_save_final_state(Rollback* rb, uint8_t* state, uint32_t* frame)
+{
+    if (rb->rollback_pending)
+        return 0;
+
+    // rollback_can_advance() keeps the state of "confirmed" in the ring
+    uint32_t f = rb->confirmed < rb->frame ? rb->confirmed : rb->frame;
+    if (f == rb->frame) {
+        if (system_save_state_mem(rb->sys, state, rb->state_size) !=
+            rb->state_size)
+            panic("rollback: the size of the state has changed");
+    } else {
+        memcpy(state, rb->states[f % rb->max_frames], rb->state_size);
+    }
+    *frame = f;
+    return 1;
+}
+
+int rollback_load_state(Rollback* rb, uint32_t frame, const uint8_t* state)
+{
+    // the inputs of the frames to run again must be in the ring
+    if (frame > rb->frame || rb->frame - frame > ROLLBACK_INPUTS / 2)
+        return 0;
+
+    rb->base_frame = frame;
+    if (frame == rb->frame) {
+        system_load_state_mem(rb->sys, state, rb->state_size);
+        rb->rollback_pending = 0;
+    } else {
+        resimulate(rb, frame, state);
+    }
+    return 1;
+}
+
+RunSummary rollback_advance(Rollback* rb)
+{
+    if (rb->frame >= rb->local_frame)
+        panic("rollback_advance(): missing local input");
+    if (!rollback_can_advance(rb))
+        panic("rollback_advance(): too far ahead of the remote input");
+
+    if (rb->rollback_pending)
+        resimulate(rb, rb->rollback_to,
+                   rb->states[rb->rollback_to % rb->max_frames]);
+
+    rb->local_advantages[rb->local_samples++ % ROLLBACK_ADVANTAGE_WINDOW] =
+        rollback_local_advantage(rb);
+    return run_frame(rb, rb->frame++);
+}
+
+int32_t rollback_local_advantage(Rollback* rb)
+{
+    // the peer sends the input of frame f while it is running the frame
+    // f - remote_delay
+    return (int32_t)rb->frame - (int32_t)(rb->remote_frame - rb->remote_delay);
+}
+
+void rollback_add_remote_advantage(Rollback* rb, int32_t advantage)
+{
+    rb->remote_advantages[rb->remote_samples++ % ROLLBACK_ADVANTAGE_WINDOW] =
+        advantage;
+}
+
+static double average(const int32_t* samples, uint32_t count)
+{
+    if (count > ROLLBACK_ADVANTAGE_WINDOW)
+        count = ROLLBACK_ADVANTAGE_WINDOW;
+    if (count == 0)
+        return 0;
+
+    int64_t sum = 0;
+    for (uint32_t i = 0; i < count; ++i)
+        sum += samples[i];
+    return (double)sum / count;
+}
+
+int32_t rollback_frames_ahead(Rollback* rb)
+{
+    // both sides see the other behind by the latency
+    double local  = average(rb->local_advantages, rb->local_samples);
+    double remote = average(rb->remote_advantages, rb->remote_samples);
+    return (int32_t)((local - remote) / 2);
+}
@@ -0,0 +1,120 @@
+#ifndef ROLLBACK_H
+#define ROLLBACK_H
+
+#include "system.h"
+
+#include <stdint.h>
+
+// frames of remote input kept, they can arrive ahead of the local frame
+#define ROLLBACK_INPUTS 128
+// samples of the frame advantages averaged by rollback_frames_ahead()
+#define ROLLBACK_ADVANTAGE_WINDOW 32
+
+typedef struct RollbackHash {
+    SystemHash hash; // of the state at the end of the frame
+    uint32_t   tag;  // frame + 1
+} RollbackHash;
+
+typedef struct RollbackInput {
+    ControllerState local;
+    ControllerState remote; // predicted, if it has not been received
+    uint32_t        tag;    // frame + 1, if remote has been received
+} RollbackInput;
+
+// GGPO-style rollback between two peers. The remote input of the frames that
+// have not been received yet is predicted (the last received one is
+// repeated), and the state at the start of every frame that is not confirmed
+// is kept in memory. When an input arrives that does not match its
+// prediction, the state of that frame is restored and the frames up to the
+// current one are run again, without video and audio output
+typedef struct Rollback {
+    System*       sys;
+    ControllerNum local_player;
+    uint32_t      input_delay;  // frames between the sampling of the local
+                                // input and the frame it is used in
+    uint32_t      remote_delay; // the one of the peer, as far as we know
+    uint32_t      max_frames;   // frames that can be run ahead of the remote
+                                // input
+
+    uint64_t  state_size;
+    uint8_t** states; // ring of max_frames states, by frame number
+
+    RollbackInput inputs[ROLLBACK_INPUTS]; // ring, by frame number
+    uint32_t      frame;        // next frame to run
+    uint32_t      local_frame;  // next frame of local input
+    uint32_t      confirmed;    // every remote input before it is known
+    uint32_t      remote_frame; // newest remote input received + 1
+    uint32_t      rollback_to;  // first mispredicted frame, if rollback_pending
+    uint8_t       rollback_pending;
+    uint32_t      base_frame; // the frames before the last state loaded with
+                              // rollback_load_state() are never run again
+
+    RollbackHash hashes[ROLLBACK_INPUTS]; // ring, by frame number
+
+    // time synchronization (see rollback_frames_ahead()), the last local
+    // advantages and the ones received from the peer
+    int32_t  local_advantages[ROLLBACK_ADVANTAGE_WINDOW];
+    int32_t  remote_advantages[ROLLBACK_ADVANTAGE_WINDOW];
+    uint32_t local_samples;
+    uint32_t remote_samples;
+
+    uint64_t rollbacks;
+    uint64_t resimulated_frames;
+} Rollback;
+
+Rollback* rollback_build(System* sys, ControllerNum local_player,
+                         uint32_t input_delay, uint32_t max_frames);
+void      rollback_destroy(Rollback* rb);
+
+// Stores the local input of frame + input_delay. If the delay has grown the
+// input is repeated to fill the gap, if it has shrunk (the frame has an input
+// already) it is dropped. It must be called once before every
+// rollback_advance()
+void            rollback_add_local_input(Rollback* rb, ControllerState input);
+ControllerState rollback_local_input(Rollback* rb, uint32_t frame);
+// Inputs that have already been received are ignored
+void            rollback_add_remote_input(Rollback* rb, uint32_t frame,
+                                          ControllerState input);
+
+// The inputs of a frame that has been run and confirmed, for the spectators
+// (see spectator.h)
+void rollback_confirmed_inputs(Rollback* rb, uint32_t frame,
+                               ControllerState* p1, ControllerState* p2);
+
+// The hash of the state at the end of a frame (see system_hash()), once the
+// frame has been run with the right inputs: the peer must have the same one.
+// It returns 0 if the frame is not confirmed yet or it is too old
+int rollback_final_hash(Rollback* rb, uint32_t frame, SystemHash* hash);
+
+// The newest state every input before which is confirmed, i.e. the one at
+// the start of min(confirmed, frame): it is saved in "state" (state_size
+// bytes) and its frame in "frame". It returns 0 while a rollback is pending
+int rollback_save_final_state(Rollback* rb, uint8_t* state, uint32_t* frame);
+// Replaces the state at the start of "frame" (e.g. with the one of the peer)
+// and runs again the frames up to the current one, like a rollback. The
+// state already includes the inputs before "frame", a late one of them does
+// not cause a rollback. It returns 0 if the frame has not been run yet or its
+// inputs are too old
+int rollback_load_state(Rollback* rb, uint32_t frame, const uint8_t* state);
+
+// The new delay is used from the next local input on. Change it one frame at
+// a time, a single input is repeated or dropped
+void rollback_set_input_delay(Rollback* rb, uint32_t input_delay);
+
+// The next frame is not too far ahead of the remote input
+int        rollback_can_advance(Rollback* rb);
+// Runs the next frame, after fixing the mispredicted ones
+RunSummary rollback_advance(Rollback* rb);
+
+// Time synchronization: how many frames we are ahead of the remote frame
+// (as far as we know, i.e. including the latency), to be sent to the peer
+// that adds it with rollback_add_remote_advantage().
+// rollback_frames_ahead() is how many frames we are ahead of the peer, net of
+// the latency and averaged over the last frames: if it is positive we should
+// wait, or the peer will have to roll back every frame. The effect of a wait
+// is seen after a round trip, do not check it more often
+int32_t rollback_local_advantage(Rollback* rb);
+void    rollback_add_remote_advantage(Rollback* rb, int32_t advantage);
+int32_t rollback_frames_ahead(Rollback* rb);
+
+#endif
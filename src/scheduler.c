@@ -0,0 +1,130 @@
+#include "scheduler.h"
+#include "system.h"
+#include "6502_cpu.h"
+#include "mapper.h"
+#include "ppu.h"
+#include "apu.h"
+
+static void set_event(Scheduler* sched, EventKind kind, uint64_t clock,
+                      uint64_t cycles)
+{
+    if (cycles == NO_EVENT)
+        sched->events[kind] = NO_EVENT;
+    else
+        sched->events[kind] = clock + cycles;
+}
+
+static uint64_t dots_to_cycles(uint64_t dots)
+{
+    // the PPU runs 3 dots per CPU cycle, the event happens during the cycle
+    // that contains its dot
+    if (dots == NO_EVENT)
+        return NO_EVENT;
+    return (dots + 2) / 3;
+}
+
+static void advance_ppu(System* sys, uint64_t cycles)
+{
+    Ppu* ppu = sys->ppu;
+
+    ppu_run(ppu, 3ul * cycles);
+    ppu->clock += cycles;
+}
+
+static void advance_apu(System* sys, uint64_t cycles)
+{
+    Apu* apu = sys->apu;
+
+    if (sys->sync_mode == SYNC_LOCKSTEP) {
+        // the reference, every cycle is stepped
+        for (uint64_t i = 0; i < cycles; ++i)
+            apu_step(apu);
+    } else {
+        apu_run(apu, cycles);
+    }
+    apu->clock += cycles;
+}
+
+void scheduler_advance(System* sys, uint64_t cycles)
+{
+    sys->sched.syncing = 1;
+    advance_ppu(sys, cycles);
+    advance_apu(sys, cycles);
+    sys->sched.syncing = 0;
+}
+
+void scheduler_sync(System* sys, Device devices)
+{
+    // the DMC and the OAM DMA read the memory while the devices are being
+    // stepped: those reads must not try to sync again
+    if (sys->sync_mode != SYNC_EVENTS || sys->sched.syncing)
+        return;
+
+    uint64_t ticks = sys->cpu->ticks;
+
+    sys->sched.syncing = 1;
+    // same order as scheduler_advance(), the interrupts are raised in the
+    // order lockstep would raise them
+    if ((devices & DEVICE_PPU) && ticks > sys->ppu->clock)
+        advance_ppu(sys, ticks - sys->ppu->clock);
+    if ((devices & DEVICE_APU) && ticks > sys->apu->clock)
+        advance_apu(sys, ticks - sys->apu->clock);
+    sys->sched.syncing = 0;
+}
+
+void scheduler_sync_due(System* sys)
+{
+    if (sys->sync_mode != SYNC_EVENTS)
+        return;
+
+    Scheduler* sched   = &sys->sched;
+    uint64_t   ticks   = sys->cpu->ticks;
+    Device     devices = DEVICE_NONE;
+
+    if (sched->events[EVENT_FRAME_END] <= ticks)
+        devices = DEVICE_ALL;
+    if (sched->events[EVENT_PPU_NMI] <= ticks ||
+        sched->events[EVENT_MAPPER_IRQ] <= ticks)
+        devices |= DEVICE_PPU;
+    if (sched->events[EVENT_APU_FRAME] <= ticks ||
+        sched->events[EVENT_APU_DMC] <= ticks)
+        devices |= DEVICE_APU;
+
+    if (devices == DEVICE_NONE)
+        return;
+
+    scheduler_sync(sys, devices);
+    scheduler_update(sys, devices);
+}
+
+void scheduler_update(System* sys, Device devices)
+{
+    if (sys->sync_mode != SYNC_EVENTS)
+        return;
+
+    Scheduler* sched = &sys->sched;
+    Ppu*       ppu   = sys->ppu;
+    Apu*       apu   = sys->apu;
+
+    // the events of a device are relative to the clock it has been caught up
+    // to, the ones of the devices that are lagging behind are still valid
+    if (devices & DEVICE_PPU) {
+        set_event(sched, EVENT_PPU_NMI, ppu->clock,
+                  dots_to_cycles(ppu_nmi_dots(ppu)));
+        set_event(sched, EVENT_FRAME_END, ppu->clock,
+                  dots_to_cycles(ppu_dots_until(ppu, 0, 0)));
+        set_event(sched, EVENT_MAPPER_IRQ, ppu->clock,
+                  dots_to_cycles(mapper_irq_dots(sys->mapper, sys)));
+    }
+    if (devices & DEVICE_APU) {
+        set_event(sched, EVENT_APU_FRAME, apu->clock,
+                  apu_frame_irq_cycles(apu));
+        set_event(sched, EVENT_APU_DMC, apu->clock, apu_dmc_cycles(apu));
+    }
+
+    uint64_t deadline = sched->limit;
+    for (int i = 0; i < EVENT_COUNT; ++i)
+        if (sched->events[i] < deadline)
+            deadline = sched->events[i];
+    sys->cpu->deadline = deadline;
+}
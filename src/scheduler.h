@@ -0,0 +1,65 @@
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include <stdint.h>
+
+#define NO_EVENT UINT64_MAX
+
+struct System;
+
+typedef enum SyncMode {
+    // every device is stepped after every CPU instruction
+    SYNC_LOCKSTEP = 0,
+    // the CPU runs uninterrupted until the next event, every device is
+    // caught up lazily: when the CPU accesses it, when one of its events is
+    // due and at the end of the frame
+    SYNC_EVENTS = 1
+} SyncMode;
+
+// The devices that can lag behind the CPU. The mapper is stepped together
+// with the PPU, as it observes its scanline and cycle
+typedef enum Device {
+    DEVICE_NONE = 0,
+    DEVICE_PPU  = 1,
+    DEVICE_APU  = 2,
+    DEVICE_ALL  = DEVICE_PPU | DEVICE_APU
+} Device;
+
+// Events the CPU must stop at, because a device could affect it. Stall cycles
+// (OAM and DMC DMA) need no event: the CPU consumes them in bulk (see
+// cpu_run_threaded()) and stops at the deadline like for any other batch
+typedef enum EventKind {
+    EVENT_PPU_NMI    = 0,
+    EVENT_FRAME_END  = 1,
+    EVENT_MAPPER_IRQ = 2,
+    EVENT_APU_FRAME  = 3,
+    EVENT_APU_DMC    = 4,
+    EVENT_COUNT
+} EventKind;
+
+typedef struct Scheduler {
+    // master clock (see Cpu::ticks) at which every event is due, NO_EVENT if
+    // it is not going to happen without a CPU access. The times are lower
+    // bounds: stopping early is harmless, stopping late is not
+    uint64_t events[EVENT_COUNT];
+    // the end of the current batch
+    uint64_t limit;
+    uint8_t  syncing;
+} Scheduler;
+
+// Step the PPU, the mapper and the APU forward by "cycles" CPU cycles
+void scheduler_advance(struct System* sys, uint64_t cycles);
+
+// Catch the given devices up to the CPU (SYNC_EVENTS only)
+void scheduler_sync(struct System* sys, Device devices);
+
+// Catch up the devices whose events are due, and all of them at the end of
+// the frame (SYNC_EVENTS only)
+void scheduler_sync_due(struct System* sys);
+
+// Recompute the events of the given devices and the CPU deadline
+// (SYNC_EVENTS only). It must be called every time the devices could have
+// changed their plans, i.e. after every CPU access to them
+void scheduler_update(struct System* sys, Device devices);
+
+#endif
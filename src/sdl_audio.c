@@ -0,0 +1,178 @@
+#include "sdl_audio.h"
+#include "audio_sink.h"
+#include "alloc.h"
+#include "logging.h"
+
+#include <SDL2/SDL.h>
+#include <stdatomic.h>
+#include <string.h>
+
+// the ring holds at least this fraction of a second of samples
+#define RING_SECONDS_DIV 4
+
+// The samples go through a single-producer single-consumer ring: the
+// emulation thread writes them, the callback of SDL reads them on the audio
+// thread. The emulation thread never takes the audio lock of SDL, and the
+// latency is bounded by the size of the ring
+typedef struct SdlAudioSink {
+    SDL_AudioDeviceID dev;
+    SDL_AudioSpec     spec;
+
+    float*   ring;
+    uint32_t mask; // capacity - 1, the capacity is a power of two
+    _Alignas(64) _Atomic uint64_t head; // samples queued so far
+    _Alignas(64) _Atomic uint64_t tail; // samples played so far
+
+    // audio thread only, or while the device is paused
+    float last; // repeated when the ring runs dry, a jump to zero clicks
+    _Atomic uint64_t underruns;
+
+    // emulation thread only
+    uint64_t overruns;
+} SdlAudioSink;
+
+static void copy_from_ring(SdlAudioSink* sink, float* out, uint64_t from,
+                           uint32_t count)
+{
+    uint32_t start = from & sink->mask;
+    uint32_t first = sink->mask + 1 - start;
+    if (first > count)
+        first = count;
+    memcpy(out, sink->ring + start, first * sizeof(float));
+    memcpy(out + first, sink->ring, (count - first) * sizeof(float));
+}
+
+static void copy_to_ring(SdlAudioSink* sink, uint64_t to, const float* samples,
+                         uint32_t count)
+{
+    uint32_t start = to & sink->mask;
+    uint32_t first = sink->mask + 1 - start;
+    if (first > count)
+        first = count;
+    memcpy(sink->ring + start, samples, first * sizeof(float));
+    memcpy(sink->ring, samples + first, (count - first) * sizeof(float));
+}
+
+// Called by SDL on the audio thread
+static void sdl_audio_callback(void* userdata, Uint8* stream, int len)
+{
+    SdlAudioSink* sink  = (SdlAudioSink*)userdata;
+    float*        out   = (float*)stream;
+    uint32_t      count = len / sizeof(float);
+
+    uint64_t tail  = atomic_load_explicit(&sink->tail, memory_order_relaxed);
+    uint64_t head  = atomic_load_explicit(&sink->head, memory_order_acquire);
+    uint32_t avail = head - tail;
+    if (avail > count)
+        avail = count;
+
+    copy_from_ring(sink, out, tail, avail);
+    atomic_store_explicit(&sink->tail, tail + avail, memory_order_release);
+
+    if (avail > 0)
+        sink->last = out[avail - 1];
+    if (avail < count) {
+        for (uint32_t i = avail; i < count; ++i)
+            out[i] = sink->last;
+        atomic_fetch_add_explicit(&sink->underruns, 1, memory_order_relaxed);
+    }
+}
+
+static void sdl_audio_queue(void* _sink, const void* frames, uint32_t count)
+{
+    SdlAudioSink* sink    = (SdlAudioSink*)_sink;
+    const float*  samples = (const float*)frames;
+
+    uint64_t head = atomic_load_explicit(&sink->head, memory_order_relaxed);
+    uint64_t tail = atomic_load_explicit(&sink->tail, memory_order_acquire);
+    uint32_t room = sink->mask + 1 - (uint32_t)(head - tail);
+    if (count > room) {
+        // the newest samples are dropped, the ones in the ring are already
+        // late
+        sink->overruns += count - room;
+        count = room;
+    }
+
+    copy_to_ring(sink, head, samples, count);
+    atomic_store_explicit(&sink->head, head + count, memory_order_release);
+}
+
+static uint32_t sdl_audio_queued(void* _sink)
+{
+    SdlAudioSink* sink = (SdlAudioSink*)_sink;
+
+    uint64_t head = atomic_load_explicit(&sink->head, memory_order_relaxed);
+    uint64_t tail = atomic_load_explicit(&sink->tail, memory_order_acquire);
+    return head - tail;
+}
+
+static void sdl_audio_pause(void* _sink, int paused)
+{
+    SdlAudioSink* sink = (SdlAudioSink*)_sink;
+
+    SDL_PauseAudioDevice(sink->dev, paused);
+    if (paused) {
+        // once SDL_PauseAudioDevice() returns the callback is not running
+        // and it is not called again: the ring can be emptied from here
+        atomic_store_explicit(&sink->tail, atomic_load(&sink->head),
+                              memory_order_release);
+        sink->last = 0;
+    }
+}
+
+static void sdl_audio_stats(void* _sink, AudioSinkStats* stats)
+{
+    SdlAudioSink* sink = (SdlAudioSink*)_sink;
+
+    stats->underruns = atomic_load(&sink->underruns);
+    stats->overruns  = sink->overruns;
+}
+
+static void sdl_audio_destroy(void* _sink)
+{
+    SdlAudioSink* sink = (SdlAudioSink*)_sink;
+
+    SDL_CloseAudioDevice(sink->dev);
+    free_or_fail(sink->ring);
+    free_or_fail(sink);
+}
+
+AudioSink* sdl_audio_sink_build()
+{
+    if (!SDL_WasInit(SDL_INIT_AUDIO))
+        panic("you must init SDL Audio first");
+
+    SdlAudioSink* sink = calloc_or_fail(sizeof(SdlAudioSink));
+
+    SDL_AudioSpec want;
+    SDL_zero(want);
+    want.freq     = AUDIO_SAMPLE_RATE;
+    want.format   = AUDIO_F32;
+    want.channels = 1;
+    // a small device buffer: the frontends keep a few milliseconds queued on
+    // top of it
+    want.samples  = 512;
+    want.callback = &sdl_audio_callback;
+    want.userdata = sink;
+
+    // the device starts paused, the callback does not run before the ring
+    // is allocated
+    sink->dev = SDL_OpenAudioDevice(NULL, 0, &want, &sink->spec, 0);
+
+    uint32_t capacity = 1;
+    while (capacity < sink->spec.freq / RING_SECONDS_DIV)
+        capacity <<= 1;
+    sink->ring = calloc_or_fail(capacity * sizeof(float));
+    sink->mask = capacity - 1;
+
+    AudioSink* res   = malloc_or_fail(sizeof(AudioSink));
+    res->obj         = sink;
+    res->sample_rate = sink->spec.freq;
+    res->format      = AUDIO_SINK_MONO_F32;
+    res->queue       = &sdl_audio_queue;
+    res->queued      = &sdl_audio_queued;
+    res->pause       = &sdl_audio_pause;
+    res->destroy     = &sdl_audio_destroy;
+    res->stats       = &sdl_audio_stats;
+    return res;
+}
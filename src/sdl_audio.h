@@ -0,0 +1,10 @@
+#ifndef SDL_AUDIO_H
+#define SDL_AUDIO_H
+
+struct AudioSink;
+
+// Plays the samples on the default SDL audio device. SDL Audio must be
+// initialized
+struct AudioSink* sdl_audio_sink_build();
+
+#endif
@@ -0,0 +1,524 @@
+#include "spectator.h"
+#include "rollback.h"
+#include "rle.h"
+#include "alloc.h"
+#include "logging.h"
+
+#include <string.h>
+#include <errno.h>
+
+#ifdef __MINGW32__
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/select.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#endif
+
+#ifdef __linux__
+#include <sys/epoll.h>
+#endif
+
+#define LISTEN_BACKLOG   16
+#define MAX_EVENTS       16
+#define RECV_CHUNK       (64 * 1024)
+#define INITIAL_CAPACITY 4
+
+// a broken connection is reported by send(), not by SIGPIPE
+#ifdef MSG_NOSIGNAL
+#define SEND_FLAGS MSG_NOSIGNAL
+#else
+#define SEND_FLAGS 0
+#endif
+
+static void put_u32(uint8_t* p, uint32_t v)
+{
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+static uint32_t get_u32(const uint8_t* p)
+{
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 |
+           p[3];
+}
+
+static void set_nonblocking(int fd)
+{
+#ifdef __MINGW32__
+    u_long mode = 1;
+    if (ioctlsocket(fd, FIONBIO, &mode) != 0)
+        panic("cannot make the socket non-blocking");
+#else
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0)
+        panic("cannot make the socket non-blocking");
+#endif
+}
+
+static void close_socket(int fd)
+{
+#ifdef __MINGW32__
+    closesocket(fd);
+#else
+    close(fd);
+#endif
+}
+
+SpectatorServer* spectator_server_build(System* sys, int port)
+{
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0)
+        panic("cannot create the spectator socket");
+
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, (const char*)&one, sizeof(one));
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family      = AF_INET;
+    addr.sin_addr.s_addr = INADDR_ANY;
+    addr.sin_port        = htons(port);
+    socklen_t len        = sizeof(addr);
+    if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 ||
+        listen(fd, LISTEN_BACKLOG) < 0 ||
+        getsockname(fd, (struct sockaddr*)&addr, &len) < 0)
+        panic("cannot listen for spectators on port %d", port);
+    set_nonblocking(fd);
+
+    SpectatorServer* srv = calloc_or_fail(sizeof(SpectatorServer));
+    srv->listen_fd       = fd;
+    srv->port            = ntohs(addr.sin_port);
+    srv->capacity        = INITIAL_CAPACITY;
+    srv->spectators      = malloc_or_fail(INITIAL_CAPACITY * sizeof(Spectator));
+    srv->state_size      = system_state_size(sys);
+    srv->state           = malloc_or_fail(srv->state_size);
+    srv->encoded =
+        malloc_or_fail(SPECTATOR_HEADER + rle_bound(srv->state_size));
+
+#ifdef __linux__
+    srv->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (srv->epoll_fd < 0)
+        panic("spectator_server_build(): epoll_create1 failed [%s]",
+              strerror(errno));
+
+    struct epoll_event ev = {.events = EPOLLIN, .data.fd = fd};
+    if (epoll_ctl(srv->epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0)
+        panic("spectator_server_build(): epoll_ctl failed [%s]",
+              strerror(errno));
+#endif
+    return srv;
+}
+
+static void drop_spectator(SpectatorServer* srv, uint32_t i)
+{
+    Spectator* s = &srv->spectators[i];
+
+#ifdef __linux__
+    epoll_ctl(srv->epoll_fd, EPOLL_CTL_DEL, s->fd, NULL);
+#endif
+    // the data that is still queued is dropped
+    close_socket(s->fd);
+    free_or_fail(s->queue);
+
+    srv->spectators[i] = srv->spectators[--srv->count];
+}
+
+void spectator_server_destroy(SpectatorServer* srv)
+{
+    while (srv->count > 0)
+        drop_spectator(srv, srv->count - 1);
+
+#ifdef __linux__
+    close(srv->epoll_fd);
+#endif
+    close_socket(srv->listen_fd);
+    free_or_fail(srv->spectators);
+    free_or_fail(srv->state);
+    free_or_fail(srv->encoded);
+    free_or_fail(srv);
+}
+
+// Asks the epoll set to report when the socket becomes writable, only while
+// something is queued (a writable socket would wake it up every time)
+static int wait_writable(SpectatorServer* srv, Spectator* s, uint8_t waiting)
+{
+    if (s->waiting == waiting)
+        return 1;
+    s->waiting = waiting;
+
+#ifdef __linux__
+    struct epoll_event ev = {.events  = EPOLLIN | EPOLLRDHUP,
+                             .data.fd = s->fd};
+    if (waiting)
+        ev.events |= EPOLLOUT;
+    if (epoll_ctl(srv->epoll_fd, EPOLL_CTL_MOD, s->fd, &ev) < 0)
+        return 0;
+#else
+    (void)srv;
+#endif
+    return 1;
+}
+
+// Sends as much of the queue as the socket takes, it returns 0 if the socket
+// is broken
+static int flush_spectator(SpectatorServer* srv, Spectator* s)
+{
+    while (s->queue_pos < s->queue_size) {
+        int64_t r = send(s->fd, (const char*)s->queue + s->queue_pos,
+                         s->queue_size - s->queue_pos, SEND_FLAGS);
+        if (r > 0)
+            s->queue_pos += r;
+        else if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return wait_writable(srv, s, 1);
+        else if (r == 0 || errno != EINTR)
+            return 0;
+    }
+    s->queue_pos  = 0;
+    s->queue_size = 0;
+    return wait_writable(srv, s, 0);
+}
+
+// Queues "size" bytes and sends what the socket takes, it never blocks. It
+// returns 0 if the spectator is too far behind or its socket is broken
+static int send_to_spectator(SpectatorServer* srv, Spectator* s,
+                             const void* data, uint64_t size)
+{
+    if (s->queue_size - s->queue_pos + size > s->max_queued)
+        return 0;
+
+    // the data that has been sent is dropped
+    memmove(s->queue, s->queue + s->queue_pos, s->queue_size - s->queue_pos);
+    s->queue_size -= s->queue_pos;
+    s->queue_pos = 0;
+
+    if (s->queue_capacity < s->queue_size + size) {
+        while (s->queue_capacity < s->queue_size + size)
+            s->queue_capacity *= 2;
+        s->queue = realloc_or_fail(s->queue, s->queue_capacity);
+    }
+    memcpy(s->queue + s->queue_size, data, size);
+    s->queue_size += size;
+
+    // a send is already pending, the socket is full
+    if (s->waiting)
+        return 1;
+    return flush_spectator(srv, s);
+}
+
+static void broadcast_inputs(SpectatorServer* srv, Rollback* rb,
+                             uint32_t last)
+{
+    uint8_t pairs[2 * ROLLBACK_INPUTS];
+
+    while (srv->next_frame < last) {
+        uint32_t count = last - srv->next_frame;
+        if (count > ROLLBACK_INPUTS)
+            count = ROLLBACK_INPUTS;
+
+        for (uint32_t i = 0; i < count; ++i) {
+            ControllerState p1, p2;
+            rollback_confirmed_inputs(rb, srv->next_frame + i, &p1, &p2);
+            pairs[2 * i]     = p1.state;
+            pairs[2 * i + 1] = p2.state;
+        }
+        for (uint32_t i = 0; i < srv->count; ++i)
+            if (!send_to_spectator(srv, &srv->spectators[i], pairs,
+                                   2 * count)) {
+                drop_spectator(srv, i--);
+                srv->dropped++;
+            }
+        srv->next_frame += count;
+    }
+}
+
+// The state at the start of next_frame: it is either the current one or one
+// of the states kept by the rollback, every input before it is confirmed
+static uint64_t encode_state(SpectatorServer* srv, Rollback* rb)
+{
+    uint32_t frame = srv->next_frame;
+    if (frame == rb->frame) {
+        if (system_save_state_mem(rb->sys, srv->state, srv->state_size) !=
+            srv->state_size)
+            panic("spectator: the size of the state has changed");
+    } else {
+        memcpy(srv->state, rb->states[frame % rb->max_frames],
+               srv->state_size);
+    }
+
+    uint8_t* header = srv->encoded;
+    memcpy(header, SPECTATOR_MAGIC, 8);
+    put_u32(header + 8, frame);
+    put_u32(header + 12, (uint32_t)srv->state_size);
+    uint64_t size = rle_encode(srv->state, srv->state_size,
+                               srv->encoded + SPECTATOR_HEADER);
+    put_u32(header + 16, (uint32_t)size);
+    return SPECTATOR_HEADER + size;
+}
+
+static void accept_spectators(SpectatorServer* srv, Rollback* rb)
+{
+    uint64_t encoded_size = 0;
+    for (;;) {
+        int fd = accept(srv->listen_fd, NULL, NULL);
+        if (fd < 0)
+            break;
+        set_nonblocking(fd);
+
+        // the inputs of a frame are sent as soon as they are confirmed
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, (const char*)&one,
+                   sizeof(one));
+
+        // the same state for everyone that joins now
+        if (encoded_size == 0)
+            encoded_size = encode_state(srv, rb);
+
+        if (srv->count == srv->capacity) {
+            srv->capacity *= 2;
+            srv->spectators = realloc_or_fail(
+                srv->spectators, srv->capacity * sizeof(Spectator));
+        }
+        Spectator* s      = &srv->spectators[srv->count++];
+        s->fd             = fd;
+        s->queue_pos      = 0;
+        s->queue_size     = 0;
+        s->queue_capacity = encoded_size;
+        s->queue          = malloc_or_fail(encoded_size);
+        s->max_queued     = encoded_size + SPECTATOR_MAX_BACKLOG;
+        s->waiting        = 0;
+        srv->joined++;
+
+#ifdef __linux__
+        struct epoll_event ev = {.events  = EPOLLIN | EPOLLRDHUP,
+                                 .data.fd = fd};
+        if (epoll_ctl(srv->epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+            drop_spectator(srv, srv->count - 1);
+            continue;
+        }
+#endif
+        if (!send_to_spectator(srv, s, srv->encoded, encoded_size))
+            drop_spectator(srv, srv->count - 1);
+    }
+}
+
+static int find_spectator(SpectatorServer* srv, int fd)
+{
+    for (uint32_t i = 0; i < srv->count; ++i)
+        if (srv->spectators[i].fd == fd)
+            return i;
+    return -1;
+}
+
+// The spectators do not send anything: a readable socket is closed. A
+// writable one takes more of the queue
+static void check_spectator(SpectatorServer* srv, int fd, int readable,
+                            int writable)
+{
+    int i = find_spectator(srv, fd);
+    if (i < 0)
+        return;
+
+    if (readable) {
+        char    buf[64];
+        int64_t r = recv(fd, buf, sizeof(buf), 0);
+        if (r == 0 || (r < 0 && errno != EAGAIN && errno != EWOULDBLOCK &&
+                       errno != EINTR)) {
+            drop_spectator(srv, i);
+            return;
+        }
+    }
+    if (writable && !flush_spectator(srv, &srv->spectators[i]))
+        drop_spectator(srv, i);
+}
+
+void spectator_server_update(SpectatorServer* srv, Rollback* rb)
+{
+    uint32_t last = rb->confirmed < rb->frame ? rb->confirmed : rb->frame;
+    if (last > srv->next_frame)
+        broadcast_inputs(srv, rb, last);
+
+    // the states after a misprediction are fixed by the next
+    // rollback_advance(), the new spectators can wait
+    int can_join = !rb->rollback_pending;
+
+#ifdef __linux__
+    struct epoll_event events[MAX_EVENTS];
+    int                n;
+    do {
+        n = epoll_wait(srv->epoll_fd, events, MAX_EVENTS, 0);
+        for (int i = 0; i < n; ++i) {
+            uint32_t ev = events[i].events;
+            if (events[i].data.fd == srv->listen_fd) {
+                if (can_join)
+                    accept_spectators(srv, rb);
+            } else {
+                check_spectator(
+                    srv, events[i].data.fd,
+                    (ev & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) != 0,
+                    (ev & EPOLLOUT) != 0);
+            }
+        }
+    } while (n == MAX_EVENTS);
+#else
+    fd_set read_fds, write_fds;
+    FD_ZERO(&read_fds);
+    FD_ZERO(&write_fds);
+    FD_SET(srv->listen_fd, &read_fds);
+    int max_fd = srv->listen_fd;
+    for (uint32_t i = 0; i < srv->count; ++i) {
+        FD_SET(srv->spectators[i].fd, &read_fds);
+        if (srv->spectators[i].waiting)
+            FD_SET(srv->spectators[i].fd, &write_fds);
+        if (srv->spectators[i].fd > max_fd)
+            max_fd = srv->spectators[i].fd;
+    }
+
+    struct timeval timeout = {0};
+    if (select(max_fd + 1, &read_fds, &write_fds, NULL, &timeout) <= 0)
+        return;
+    for (int i = srv->count - 1; i >= 0; --i) {
+        int fd = srv->spectators[i].fd;
+        if (FD_ISSET(fd, &read_fds) || FD_ISSET(fd, &write_fds))
+            check_spectator(srv, fd, FD_ISSET(fd, &read_fds),
+                            FD_ISSET(fd, &write_fds));
+    }
+    if (can_join && FD_ISSET(srv->listen_fd, &read_fds))
+        accept_spectators(srv, rb);
+#endif
+}
+
+SpectatorClient* spectator_connect(const char* ip, int port)
+{
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0)
+        panic("cannot create the socket");
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family      = AF_INET;
+    addr.sin_addr.s_addr = inet_addr(ip);
+    addr.sin_port        = htons(port);
+    if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0)
+        panic("cannot connect to %s:%d, is the host running?", ip, port);
+    set_nonblocking(fd);
+
+    SpectatorClient* c = calloc_or_fail(sizeof(SpectatorClient));
+    c->fd              = fd;
+    c->buf_capacity    = RECV_CHUNK;
+    c->buf             = malloc_or_fail(RECV_CHUNK);
+    return c;
+}
+
+void spectator_client_destroy(SpectatorClient* c)
+{
+    close_socket(c->fd);
+    free_or_fail(c->buf);
+    free_or_fail(c);
+}
+
+int spectator_client_poll(SpectatorClient* c)
+{
+    if (c->closed)
+        return 0;
+
+    // the consumed data is dropped
+    memmove(c->buf, c->buf + c->buf_pos, c->buf_size - c->buf_pos);
+    c->buf_size -= c->buf_pos;
+    c->buf_pos = 0;
+
+    for (;;) {
+        if (c->buf_capacity - c->buf_size < RECV_CHUNK) {
+            c->buf_capacity *= 2;
+            c->buf = realloc_or_fail(c->buf, c->buf_capacity);
+        }
+
+        int64_t r = recv(c->fd, (char*)c->buf + c->buf_size,
+                         c->buf_capacity - c->buf_size, 0);
+        if (r > 0) {
+            c->buf_size += r;
+        } else if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            // nothing else for now
+            return 1;
+        } else if (r == 0 || errno != EINTR) {
+            c->closed = 1;
+            return 0;
+        }
+    }
+}
+
+// The host has sent something that cannot be used: the connection is dropped
+static int client_error(SpectatorClient* c, const char* msg)
+{
+    warning("spectator: %s", msg);
+    c->closed  = 1;
+    c->buf_pos = c->buf_size;
+    return 0;
+}
+
+int spectator_client_load_state(SpectatorClient* c, System* sys)
+{
+    if (c->has_state)
+        return 1;
+
+    uint64_t       available = c->buf_size - c->buf_pos;
+    const uint8_t* header    = c->buf + c->buf_pos;
+    if (available < SPECTATOR_HEADER)
+        return 0;
+    if (memcmp(header, SPECTATOR_MAGIC, 8) != 0)
+        return client_error(c, "the host is not a borzNES spectator server");
+
+    uint32_t frame        = get_u32(header + 8);
+    uint64_t state_size   = get_u32(header + 12);
+    uint64_t encoded_size = get_u32(header + 16);
+    if (state_size != system_state_size(sys))
+        return client_error(c, "the host is running a different game, or "
+                               "another version of borzNES");
+    if (encoded_size > rle_bound(state_size))
+        return client_error(c, "the state sent by the host is corrupted");
+    if (available < SPECTATOR_HEADER + encoded_size)
+        return 0;
+
+    uint8_t* state = malloc_or_fail(state_size);
+    int      ok    = rle_decode(header + SPECTATOR_HEADER, encoded_size, state,
+                                state_size, 0);
+    if (ok)
+        ok = system_check_state_mem(sys, state, state_size);
+    if (ok)
+        system_load_state_mem(sys, state, state_size);
+    free_or_fail(state);
+    if (!ok)
+        return client_error(c, "the state sent by the host is corrupted");
+
+    c->buf_pos += SPECTATOR_HEADER + encoded_size;
+    c->frame     = frame;
+    c->has_state = 1;
+    return 1;
+}
+
+int spectator_client_next_inputs(SpectatorClient* c, ControllerState* p1,
+                                 ControllerState* p2)
+{
+    if (!c->has_state || c->buf_size - c->buf_pos < 2)
+        return 0;
+
+    p1->state = c->buf[c->buf_pos];
+    p2->state = c->buf[c->buf_pos + 1];
+    c->buf_pos += 2;
+    c->frame++;
+    return 1;
+}
+
+uint32_t spectator_client_buffered(SpectatorClient* c)
+{
+    if (!c->has_state)
+        return 0;
+    return (uint32_t)((c->buf_size - c->buf_pos) / 2);
+}
@@ -0,0 +1,96 @@
+#ifndef SPECTATOR_H
+#define SPECTATOR_H
+
+#include "system.h"
+
+#include <stdint.h>
+
+struct Rollback;
+
+#define SPECTATOR_MAGIC "borzSPEC"
+
+// The stream sent to a spectator over TCP, the integers are big endian:
+//   magic (8 bytes), first frame (32 bit), size of the state (32 bit), size
+//   of the encoded state (32 bit), the state at the start of the first frame
+//   encoded with rle_encode() (it includes the SRAM)
+// then, for every frame from the first one on, the inputs of P1 and P2 (a
+// ControllerState each), as soon as they are confirmed
+#define SPECTATOR_HEADER 20
+
+// a spectator is dropped when more than this is waiting to be sent to it, on
+// top of the state it has been sent when it joined (bytes)
+#define SPECTATOR_MAX_BACKLOG (256 * 1024)
+
+typedef struct Spectator {
+    int      fd;
+    uint8_t* queue;     // not sent yet
+    uint64_t queue_pos; // first byte not sent
+    uint64_t queue_size;
+    uint64_t queue_capacity;
+    uint64_t max_queued;
+    uint8_t  waiting; // for the socket to be writable
+} Spectator;
+
+// Host side. The spectators never send anything: they cannot slow down the
+// players. Their sockets are non-blocking, every frame they cost a send() of
+// the new inputs to each of them. What a socket does not take is queued, and
+// sent when the socket becomes writable again. A spectator that cannot keep
+// up is dropped
+typedef struct SpectatorServer {
+    int listen_fd;
+    int port;
+#ifdef __linux__
+    int epoll_fd;
+#endif
+
+    Spectator* spectators;
+    uint32_t   count;
+    uint32_t   capacity;
+
+    uint32_t next_frame; // the inputs before it have been sent to everyone
+    uint64_t state_size;
+    uint8_t* state;
+    uint8_t* encoded;
+
+    uint64_t joined;
+    uint64_t dropped; // too slow
+} SpectatorServer;
+
+// Listens on "port" (0: any port, see SpectatorServer::port)
+SpectatorServer* spectator_server_build(System* sys, int port);
+void             spectator_server_destroy(SpectatorServer* srv);
+// Sends the inputs confirmed since the last call, then accepts the new
+// spectators and drops the ones that have left. It never blocks, call it at
+// least once per frame (e.g. after every rollback_advance())
+void             spectator_server_update(SpectatorServer* srv,
+                                         struct Rollback*  rb);
+
+// Spectator side
+typedef struct SpectatorClient {
+    int      fd;
+    uint8_t* buf;     // received
+    uint64_t buf_pos; // first byte not consumed
+    uint64_t buf_size;
+    uint64_t buf_capacity;
+    uint8_t  has_state;
+    uint8_t  closed;
+    uint32_t frame; // next frame to run
+} SpectatorClient;
+
+SpectatorClient* spectator_connect(const char* ip, int port);
+void             spectator_client_destroy(SpectatorClient* c);
+// Receives what the host has sent, it never blocks. It returns 0 once the
+// host has closed the connection (the data received so far can still be
+// used)
+int              spectator_client_poll(SpectatorClient* c);
+// Loads the state sent by the host in sys, once it has been received (it
+// returns 0 until then). A state that cannot be loaded closes the connection
+int              spectator_client_load_state(SpectatorClient* c, System* sys);
+// The inputs of the next frame, 0 if they have not been received yet
+int              spectator_client_next_inputs(SpectatorClient* c,
+                                              ControllerState* p1,
+                                              ControllerState* p2);
+// Frames received and not run yet
+uint32_t         spectator_client_buffered(SpectatorClient* c);
+
+#endif
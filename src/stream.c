@@ -0,0 +1,181 @@
+#include "stream.h"
+#include "alloc.h"
+#include "logging.h"
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+// Memory writers
+static void buffer_write(Writer* w, const void* data, uint64_t size)
+{
+    if (w->size + size <= w->capacity)
+        memcpy(w->buffer + w->size, data, size);
+    else
+        w->overflow = 1;
+    w->size += size;
+}
+
+static void growable_write(Writer* w, const void* data, uint64_t size)
+{
+    if (w->size + size > w->capacity) {
+        uint64_t capacity = w->capacity * 2;
+        if (capacity < w->size + size)
+            capacity = w->size + size;
+
+        w->buffer   = realloc_or_fail(w->buffer, capacity);
+        w->capacity = capacity;
+    }
+    memcpy(w->buffer + w->size, data, size);
+    w->size += size;
+}
+
+Writer writer_from_buffer(uint8_t* buf, uint64_t capacity)
+{
+    Writer w   = {0};
+    w.buffer   = buf;
+    w.capacity = capacity;
+    w.write    = &buffer_write;
+    return w;
+}
+
+Writer writer_growable(uint64_t capacity)
+{
+    if (capacity == 0)
+        capacity = 1;
+
+    Writer w   = {0};
+    w.buffer   = malloc_or_fail(capacity);
+    w.capacity = capacity;
+    w.growable = 1;
+    w.write    = &growable_write;
+    return w;
+}
+
+void writer_free(Writer* w)
+{
+    if (w->growable)
+        free_or_fail(w->buffer);
+    w->buffer   = NULL;
+    w->capacity = 0;
+    w->size     = 0;
+}
+
+// File writers
+static void file_write(Writer* w, const void* data, uint64_t size)
+{
+    if (fwrite(data, 1, size, (FILE*)w->obj) != size)
+        panic("unable to write to the file");
+    w->size += size;
+}
+
+static void fd_write(Writer* w, const void* data, uint64_t size)
+{
+    int            fd  = (int)(intptr_t)w->obj;
+    const uint8_t* buf = (const uint8_t*)data;
+    uint64_t       off = 0;
+
+    while (off < size) {
+        ssize_t n = write(fd, buf + off, size - off);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            panic("unable to write to the file descriptor %d", fd);
+        off += n;
+    }
+    w->size += size;
+}
+
+Writer writer_from_file(FILE* f)
+{
+    Writer w = {0};
+    w.obj    = f;
+    w.write  = &file_write;
+    return w;
+}
+
+Writer writer_from_fd(int fd)
+{
+    Writer w = {0};
+    w.obj    = (void*)(intptr_t)fd;
+    w.write  = &fd_write;
+    return w;
+}
+
+// Readers
+static void buffer_read(Reader* r, void* data, uint64_t size)
+{
+    if (size > r->size - r->pos)
+        panic("unable to read %llu bytes, the buffer is too small",
+              (unsigned long long)size);
+
+    memcpy(data, r->buffer + r->pos, size);
+    r->pos += size;
+}
+
+static void file_read(Reader* r, void* data, uint64_t size)
+{
+    if (fread(data, 1, size, (FILE*)r->obj) != size)
+        panic("unable to read from the file");
+    r->pos += size;
+}
+
+static void fd_read(Reader* r, void* data, uint64_t size)
+{
+    int      fd  = (int)(intptr_t)r->obj;
+    uint8_t* buf = (uint8_t*)data;
+    uint64_t off = 0;
+
+    while (off < size) {
+        ssize_t n = read(fd, buf + off, size - off);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            panic("unable to read from the file descriptor %d", fd);
+        off += n;
+    }
+    r->pos += size;
+}
+
+Reader reader_from_buffer(const uint8_t* buf, uint64_t size)
+{
+    Reader r = {0};
+    r.buffer = buf;
+    r.size   = size;
+    r.read   = &buffer_read;
+    return r;
+}
+
+Reader reader_from_file(FILE* f)
+{
+    Reader r = {0};
+    r.obj    = f;
+    r.read   = &file_read;
+    return r;
+}
+
+Reader reader_from_fd(int fd)
+{
+    Reader r = {0};
+    r.obj    = (void*)(intptr_t)fd;
+    r.read   = &fd_read;
+    return r;
+}
+
+// Sections
+void write_section(Writer* w, const void* data, uint64_t size)
+{
+    writer_write(w, &size, sizeof(size));
+    writer_write(w, data, size);
+}
+
+void read_section(Reader* r, void* data, uint64_t size, const char* what)
+{
+    uint64_t section_size;
+    reader_read(r, &section_size, sizeof(section_size));
+    if (section_size != size)
+        panic("%s: invalid section (%llu bytes, expected %llu)", what,
+              (unsigned long long)section_size, (unsigned long long)size);
+
+    reader_read(r, data, size);
+}
@@ -0,0 +1,58 @@
+#ifndef STREAM_H
+#define STREAM_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+// Destination of the save states. The writers are values, they can live on
+// the stack: the memory writer does not allocate anything
+typedef struct Writer {
+    void*    obj;      // FILE* or file descriptor (file writers)
+    uint8_t* buffer;   // memory writers
+    uint64_t capacity; // size of buffer
+    uint64_t size;     // bytes written (memory writers: even if not stored)
+    int      growable; // buffer is owned by the writer and it grows
+    int      overflow; // a fixed buffer was too small
+    void (*write)(struct Writer* w, const void* data, uint64_t size);
+} Writer;
+
+// Source of the save states, it panics if the data ends too early
+typedef struct Reader {
+    void*          obj;
+    const uint8_t* buffer;
+    uint64_t       size;
+    uint64_t       pos;
+    void (*read)(struct Reader* r, void* data, uint64_t size);
+} Reader;
+
+// Writes in buf: the data beyond "capacity" bytes is dropped (and counted in
+// Writer::size, Writer::overflow is set). buf can be NULL with capacity 0
+Writer writer_from_buffer(uint8_t* buf, uint64_t capacity);
+// Writes in a buffer that grows as needed, release it with writer_free()
+Writer writer_growable(uint64_t capacity);
+Writer writer_from_file(FILE* f);
+Writer writer_from_fd(int fd);
+void   writer_free(Writer* w);
+
+Reader reader_from_buffer(const uint8_t* buf, uint64_t size);
+Reader reader_from_file(FILE* f);
+Reader reader_from_fd(int fd);
+
+static inline void writer_write(Writer* w, const void* data, uint64_t size)
+{
+    w->write(w, data, size);
+}
+
+static inline void reader_read(Reader* r, void* data, uint64_t size)
+{
+    r->read(r, data, size);
+}
+
+// The save states are a sequence of sections: the size (64 bit) followed by
+// the data
+void write_section(Writer* w, const void* data, uint64_t size);
+// Reads a section of exactly "size" bytes in data, "what" is used in the
+// error message
+void read_section(Reader* r, void* data, uint64_t size, const char* what);
+
+#endif
@@ -6,11 +6,25 @@
 #include "ppu.h"
 #include "apu.h"
 #include "logging.h"
+#include "stream.h"
+#include "hash.h"
 
 #include <stdio.h>
 #include <unistd.h>
 #include <string.h>
 
+// First section of every save state. Most of the devices are saved as their
+// raw structs: bump STATE_VERSION whenever a serialized struct (or the order
+// of the sections) changes, the old states are rejected with a clear message
+// instead of failing at the first section of a different size
+#define STATE_MAGIC   "borzNES"
+#define STATE_VERSION 1
+
+typedef struct StateHeader {
+    char     magic[8];
+    uint64_t version;
+} StateHeader;
+
 static char* get_state_path(const char* fpath)
 {
     size_t fpath_size = strlen(fpath);
@@ -38,7 +52,14 @@ System* system_build(const char* rom_path)
     sys->apu             = apu;
     sys->cpu_freq        = CPU_1X_FREQ;
     sys->state_save_path = get_state_path(rom_path);
+#ifdef DEFAULT_SYNC_LOCKSTEP
+    sys->sync_mode = SYNC_LOCKSTEP;
+#else
+    sys->sync_mode = SYNC_EVENTS;
+#endif
 
+    system_map_cpu_pages(sys);
+    system_map_ppu_pages(sys);
     cpu_reset(cpu);
     ppu_reset(ppu);
     apu_unpause(apu);
@@ -56,28 +77,118 @@ void system_destroy(System* sys)
     free_or_fail(sys);
 }
 
-uint64_t system_step(System* sys)
+void system_map_cpu_pages(System* sys)
 {
-    uint64_t cpu_cycles = cpu_step(sys->cpu);
-    uint64_t ppu_cycles = 3ul * cpu_cycles;
-    uint64_t apu_cycles = cpu_cycles;
+    for (int page = 0; page < 256; ++page) {
+        // 2KB of RAM mirrored up to 0x1FFF
+        uint8_t* ram = page < 0x20 ? &sys->RAM[(page % 8) << 8] : NULL;
+        sys->cpu_read_pages[page]  = ram;
+        sys->cpu_write_pages[page] = ram;
+    }
+    mapper_map_cpu_pages(sys->mapper, sys->cpu_read_pages,
+                         sys->cpu_write_pages);
+}
 
-    for (uint64_t i = 0; i < ppu_cycles; ++i) {
-        ppu_step(sys->ppu);
-        mapper_step(sys->mapper, sys);
+void system_map_ppu_pages(System* sys)
+{
+    mapper_map_ppu_pages(sys->mapper, sys->ppu, sys->ppu_read_pages,
+                         sys->ppu_write_pages);
+    // the 16KB of the PPU bus are mirrored up to 0xFFFF
+    for (int page = 0x40; page < 256; ++page) {
+        sys->ppu_read_pages[page]  = sys->ppu_read_pages[page % 0x40];
+        sys->ppu_write_pages[page] = sys->ppu_write_pages[page % 0x40];
     }
+}
 
-    for (uint64_t i = 0; i < apu_cycles; ++i) {
-        apu_step(sys->apu);
+static uint64_t run_cpu(Cpu* cpu)
+{
+#ifdef CPU_REFERENCE_CORE
+    return cpu_run(cpu);
+#else
+    return cpu_run_threaded(cpu);
+#endif
+}
+
+static uint64_t step_cpu(Cpu* cpu)
+{
+#ifdef CPU_REFERENCE_CORE
+    return cpu_step(cpu);
+#else
+    return cpu_step_threaded(cpu);
+#endif
+}
+
+// Run until "limit" or the next event, whatever comes first
+static uint64_t system_run_until(System* sys, uint64_t limit)
+{
+    if (sys->sync_mode == SYNC_LOCKSTEP) {
+        uint64_t cpu_cycles = step_cpu(sys->cpu);
+        scheduler_advance(sys, cpu_cycles);
+        return cpu_cycles;
     }
+
+    sys->sched.limit = limit;
+    scheduler_update(sys, DEVICE_ALL);
+    uint64_t cpu_cycles = run_cpu(sys->cpu);
+    scheduler_sync_due(sys);
     return cpu_cycles;
 }
 
+uint64_t system_step(System* sys)
+{
+    return system_run_until(sys, NO_EVENT);
+}
+
+static void end_audio_frame(System* sys)
+{
+    if (sys->apu->sink == NULL)
+        return;
+    scheduler_sync(sys, DEVICE_APU);
+    apu_end_frame(sys->apu);
+}
+
+RunSummary system_run_frame(System* sys)
+{
+    Ppu*     ppu     = sys->ppu;
+    uint32_t frame   = ppu->frame;
+    uint64_t samples = sys->apu->samples;
+    uint64_t cycles  = 0;
+
+    // the end of the frame is an event: no batch goes past it
+    do {
+        cycles += system_run_until(sys, NO_EVENT);
+    } while (ppu->frame == frame);
+    end_audio_frame(sys);
+
+    RunSummary summary = {.cycles      = cycles,
+                          .samples     = sys->apu->samples - samples,
+                          .frame_ready = 1};
+    return summary;
+}
+
+RunSummary system_run_cycles(System* sys, uint64_t budget)
+{
+    Cpu*     cpu     = sys->cpu;
+    uint32_t frame   = sys->ppu->frame;
+    uint64_t samples = sys->apu->samples;
+    uint64_t start   = cpu->ticks;
+    uint64_t limit   = start + budget;
+
+    while (cpu->ticks < limit)
+        system_run_until(sys, limit);
+    end_audio_frame(sys);
+
+    RunSummary summary = {.cycles      = cpu->ticks - start,
+                          .samples     = sys->apu->samples - samples,
+                          .frame_ready = sys->ppu->frame != frame};
+    return summary;
+}
+
 void system_step_ms(System* sys, int64_t delta_time_ms)
 {
     int64_t cycles = (int64_t)(sys->cpu_freq * delta_time_ms / 1000000l);
-    while (cycles > 0)
-        cycles -= system_step(sys);
+    if (cycles > 0)
+        system_run_cycles(sys, cycles);
 }
 
 void system_update_controller(System* sys, ControllerNum num,
@@ -107,20 +218,68 @@ const char* system_tostring(System* sys)
     return res;
 }
 
+void system_serialize(System* sys, Writer* w)
+{
+    // the state of a lagging PPU would be stale
+    scheduler_sync(sys, DEVICE_ALL);
+
+    StateHeader header = {.magic = STATE_MAGIC, .version = STATE_VERSION};
+    write_section(w, &header, sizeof(header));
+    write_section(w, sys->RAM, sizeof(sys->RAM));
+    cartridge_serialize(sys->cart, w);
+    cpu_serialize(sys->cpu, w);
+    ppu_serialize(sys->ppu, w);
+    mapper_serialize(sys->mapper, w);
+    apu_serialize(sys->apu, w);
+    write_section(w, sys->controller_shift_reg,
+                  sizeof(sys->controller_shift_reg));
+}
+
+static void check_header(Reader* r)
+{
+    uint64_t    size;
+    StateHeader header;
+
+    reader_read(r, &size, sizeof(size));
+    if (size != sizeof(header))
+        panic("system_deserialize(): not a borzNES state, or saved by an "
+              "older version (before the format had a version)");
+    reader_read(r, &header, sizeof(header));
+    if (memcmp(header.magic, STATE_MAGIC, sizeof(header.magic)) != 0)
+        panic("system_deserialize(): not a borzNES state");
+    if (header.version != STATE_VERSION)
+        panic("system_deserialize(): the state has format %llu, this "
+              "version of borzNES reads format %d",
+              (unsigned long long)header.version, STATE_VERSION);
+}
+
+void system_deserialize(System* sys, Reader* r)
+{
+    check_header(r);
+    read_section(r, sys->RAM, sizeof(sys->RAM), "system_deserialize()");
+    cartridge_deserialize(sys->cart, r);
+    cpu_deserialize(sys->cpu, r);
+    ppu_deserialize(sys->ppu, r);
+    mapper_deserialize(sys->mapper, r);
+    apu_deserialize(sys->apu, r);
+    read_section(r, sys->controller_shift_reg,
+                 sizeof(sys->controller_shift_reg), "system_deserialize()");
+    system_map_cpu_pages(sys);
+    system_map_ppu_pages(sys);
+
+    // the devices were in sync when the state was saved
+    sys->ppu->clock = sys->cpu->ticks;
+    sys->apu->clock = sys->cpu->ticks;
+}
+
 void system_save_state(System* sys, const char* path)
 {
     FILE* fout = fopen(path, "wb");
     if (fout == NULL)
         panic("unable to open the file %s", path);
 
-    Buffer ram_state = {.buffer = (uint8_t*)&sys->RAM,
-                        .size   = sizeof(sys->RAM)};
-    dump_buffer(&ram_state, fout);
-
-    cartridge_serialize(sys->cart, fout);
-    cpu_serialize(sys->cpu, fout);
-    ppu_serialize(sys->ppu, fout);
-    mapper_serialize(sys->mapper, fout);
+    Writer w = writer_from_file(fout);
+    system_serialize(sys, &w);
 
     fclose(fout);
 }
@@ -135,16 +294,189 @@ void system_load_state(System* sys, const char* path)
     if (fin == NULL)
         panic("unable to open the file %s", path);
 
-    Buffer ram_state = read_buffer(fin);
-    if (ram_state.size != sizeof(sys->RAM))
-        panic("system_load_state(): invalid buffer");
-    memcpy(sys->RAM, ram_state.buffer, ram_state.size);
-    free_or_fail(ram_state.buffer);
-
-    cartridge_deserialize(sys->cart, fin);
-    cpu_deserialize(sys->cpu, fin);
-    ppu_deserialize(sys->ppu, fin);
-    mapper_deserialize(sys->mapper, fin);
+    Reader r = reader_from_file(fin);
+    system_deserialize(sys, &r);
 
     fclose(fin);
 }
+
+uint64_t system_state_size(System* sys)
+{
+    Writer w = writer_from_buffer(NULL, 0);
+    system_serialize(sys, &w);
+    return w.size;
+}
+
+uint64_t system_save_state_mem(System* sys, uint8_t* buf, uint64_t size)
+{
+    Writer w = writer_from_buffer(buf, size);
+    system_serialize(sys, &w);
+    return w.overflow ? 0 : w.size;
+}
+
+void system_load_state_mem(System* sys, const uint8_t* buf, uint64_t size)
+{
+    Reader r = reader_from_buffer(buf, size);
+    system_deserialize(sys, &r);
+}
+
+int system_check_state_mem(System* sys, const uint8_t* buf, uint64_t size)
+{
+    Writer own = writer_growable(size);
+    system_serialize(sys, &own);
+
+    // the states of the same game and format have the same sections, the
+    // first one is the header
+    int      ok  = own.size == size && size >= 8 + sizeof(StateHeader);
+    uint64_t pos = 0;
+    while (ok && pos < size) {
+        uint64_t expected, section_size;
+        memcpy(&expected, own.buffer + pos, sizeof(expected));
+        memcpy(&section_size, buf + pos, sizeof(section_size));
+        ok = section_size == expected;
+        pos += sizeof(expected) + expected;
+    }
+    if (ok) {
+        StateHeader header;
+        memcpy(&header, buf + 8, sizeof(header));
+        ok = memcmp(header.magic, STATE_MAGIC, sizeof(header.magic)) == 0 &&
+             header.version == STATE_VERSION;
+    }
+
+    writer_free(&own);
+    return ok;
+}
+
+// The registers of the CPU and of the PPU, without the pointers and the
+// values that depend on the host (e.g. Cpu::deadline)
+typedef struct CpuHashState {
+    uint64_t ticks;
+    uint64_t cycles;
+    uint32_t stall;
+    uint16_t PC;
+    uint8_t  SP, A, X, Y, flags;
+    uint8_t  interrupt;
+    uint8_t  controller_shift_reg[2];
+} CpuHashState;
+
+typedef struct PpuHashState {
+    uint64_t tile_data;
+    uint32_t frame;
+    int32_t  nmi_prev;
+    int32_t  nmi_delay;
+    uint16_t v, t;
+    uint16_t cycle, scanline;
+    uint8_t  x, w, f;
+    uint8_t  oam_addr;
+    uint8_t  name_table_byte;
+    uint8_t  attribute_table_byte;
+    uint8_t  low_tile_byte;
+    uint8_t  high_tile_byte;
+    uint8_t  status, ctrl, mask;
+    uint8_t  bus_content;
+    uint8_t  buffered_ppudata;
+} PpuHashState;
+
+static uint64_t hash_cpu(System* sys)
+{
+    Cpu*         cpu = sys->cpu;
+    CpuHashState s;
+    memset(&s, 0, sizeof(s));
+    s.ticks     = cpu->ticks;
+    s.cycles    = cpu->cycles;
+    s.stall     = cpu->stall;
+    s.PC        = cpu->PC;
+    s.SP        = cpu->SP;
+    s.A         = cpu->A;
+    s.X         = cpu->X;
+    s.Y         = cpu->Y;
+    s.flags     = cpu->flags;
+    s.interrupt = cpu->interrupt;
+    memcpy(s.controller_shift_reg, sys->controller_shift_reg,
+           sizeof(s.controller_shift_reg));
+    return hash64(&s, sizeof(s), HASH_CPU);
+}
+
+static uint64_t hash_ppu(Ppu* ppu)
+{
+    PpuHashState s;
+    memset(&s, 0, sizeof(s));
+    s.tile_data            = ppu->tile_data;
+    s.frame                = ppu->frame;
+    s.nmi_prev             = ppu->nmi_prev;
+    s.nmi_delay            = ppu->nmi_delay;
+    s.v                    = ppu->v;
+    s.t                    = ppu->t;
+    s.cycle                = ppu->cycle;
+    s.scanline             = ppu->scanline;
+    s.x                    = ppu->x;
+    s.w                    = ppu->w;
+    s.f                    = ppu->f;
+    s.oam_addr             = ppu->oam_addr;
+    s.name_table_byte      = ppu->name_table_byte;
+    s.attribute_table_byte = ppu->attribute_table_byte;
+    s.low_tile_byte        = ppu->low_tile_byte;
+    s.high_tile_byte       = ppu->high_tile_byte;
+    s.status               = ppu->status_flags.flags;
+    s.ctrl                 = ppu->ctrl_flags.flags;
+    s.mask                 = ppu->mask_flags.flags;
+    s.bus_content          = ppu->bus_content;
+    s.buffered_ppudata     = ppu->buffered_ppudata;
+
+    Hasher h;
+    hasher_init(&h, HASH_PPU);
+    hasher_update(&h, &s, sizeof(s));
+    hasher_update(&h, ppu->oam_data, sizeof(ppu->oam_data));
+    hasher_update(&h, ppu->nametable_data, sizeof(ppu->nametable_data));
+    hasher_update(&h, ppu->palette_data, sizeof(ppu->palette_data));
+    return hasher_final(&h);
+}
+
+SystemHash system_hash(System* sys)
+{
+    // like system_serialize(), a lagging PPU would be stale
+    scheduler_sync(sys, DEVICE_ALL);
+
+    Cartridge* cart = sys->cart;
+    SystemHash res;
+    memset(&res, 0, sizeof(res));
+    res.components[HASH_CPU] = hash_cpu(sys);
+    res.components[HASH_RAM] = hash64(sys->RAM, sizeof(sys->RAM), HASH_RAM);
+    res.components[HASH_PPU] = hash_ppu(sys->ppu);
+    if (cart->CHR_RAM)
+        res.components[HASH_CHR_RAM] =
+            hash64(cart->CHR, cart->CHR_size, HASH_CHR_RAM);
+    res.components[HASH_SRAM] = hash64(cart->SRAM, cart->SRAM_size, HASH_SRAM);
+
+    // the mapper registers, as they are saved in a state
+    Hasher h;
+    hasher_init(&h, HASH_MAPPER);
+    hasher_update(&h, &cart->mirror, sizeof(cart->mirror));
+    Writer w = writer_to_hasher(&h);
+    mapper_serialize(sys->mapper, &w);
+    res.components[HASH_MAPPER] = hasher_final(&h);
+
+    res.total = hash64(res.components, sizeof(res.components), 0);
+    return res;
+}
+
+const char* system_hash_component_name(HashComponent c)
+{
+    switch (c) {
+        case HASH_CPU:
+            return "CPU";
+        case HASH_RAM:
+            return "RAM";
+        case HASH_PPU:
+            return "PPU";
+        case HASH_MAPPER:
+            return "mapper";
+        case HASH_CHR_RAM:
+            return "CHR-RAM";
+        case HASH_SRAM:
+            return "SRAM";
+        default:
+            break;
+    }
+    return "unknown";
+}
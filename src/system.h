@@ -1,6 +1,8 @@
 #ifndef SYSTEM_H
 #define SYSTEM_H
 
+#include "scheduler.h"
+
 #include <stdint.h>
 
 #define CPU_1X_FREQ   1789773l
@@ -13,6 +15,8 @@ struct Apu;
 struct Cartridge;
 struct Mapper;
 struct Buffer;
+struct Writer;
+struct Reader;
 
 typedef enum { P1 = 0, P2 = 1 } ControllerNum;
 
@@ -34,6 +38,13 @@ typedef struct ControllerState {
     };
 } ControllerState;
 
+// What happened during system_run_frame() or system_run_cycles()
+typedef struct RunSummary {
+    uint64_t cycles;      // elapsed CPU cycles, stall cycles included
+    uint64_t samples;     // audio samples generated by the APU
+    uint8_t  frame_ready; // at least one frame was completed
+} RunSummary;
+
 typedef struct System {
     struct Cpu*       cpu;
     struct Ppu*       ppu;
@@ -45,14 +56,44 @@ typedef struct System {
     ControllerState   controller_state[2];
     uint8_t           controller_shift_reg[2];
     int64_t           cpu_freq;
+
+    // CPU bus page tables (see Memory), refreshed by system_map_cpu_pages()
+    uint8_t* cpu_read_pages[256];
+    uint8_t* cpu_write_pages[256];
+    // PPU bus page tables, refreshed by system_map_ppu_pages()
+    uint8_t* ppu_read_pages[256];
+    uint8_t* ppu_write_pages[256];
+
+    SyncMode  sync_mode;
+    Scheduler sched;
 } System;
 
 System* system_build(const char* rom_path);
 void    system_destroy(System* sys);
 
+// Rebuild the CPU page tables: RAM and the PRG/SRAM banks currently selected
+// by the mapper are accessed directly, everything else (I/O registers,
+// mapper registers, unmapped pages) goes through the slow path
+void system_map_cpu_pages(System* sys);
+
+// Rebuild the PPU page tables: the CHR banks currently selected by the mapper
+// and the nametables are accessed directly, the palettes and the mappers that
+// watch the PPU bus go through the slow path
+void system_map_ppu_pages(System* sys);
+
+// In SYNC_LOCKSTEP mode it executes one instruction, in SYNC_EVENTS mode it
+// runs until the next event. It returns the elapsed CPU cycles. In
+// SYNC_EVENTS mode the PPU and the APU can be left behind the CPU, they are
+// always in sync at the end of a frame
 uint64_t system_step(System* sys);
 void     system_step_ms(System* sys, int64_t delta_time);
 
+// Run until the end of the current frame, or for (at least) "budget" CPU
+// cycles. The last instruction is always completed, so the budget can be
+// exceeded by a few cycles
+RunSummary system_run_frame(System* sys);
+RunSummary system_run_cycles(System* sys, uint64_t budget);
+
 void    system_update_controller(System* sys, ControllerNum num,
                                  ControllerState state);
 void    system_load_controllers(System* sys);
@@ -65,4 +106,45 @@ const char* system_tostring(System* sys);
 void system_save_state(System* sys, const char* path);
 void system_load_state(System* sys, const char* path);
 
+// Save states on any stream (see stream.h). They start with the version of
+// the format, system_deserialize() panics on a state of another version
+void system_serialize(System* sys, struct Writer* w);
+void system_deserialize(System* sys, struct Reader* r);
+
+// In-memory save states, they do not allocate. system_save_state_mem()
+// returns the size of the state, or 0 if it does not fit in "size" bytes (see
+// system_state_size())
+uint64_t system_state_size(System* sys);
+uint64_t system_save_state_mem(System* sys, uint8_t* buf, uint64_t size);
+void     system_load_state_mem(System* sys, const uint8_t* buf, uint64_t size);
+// 1 if system_load_state_mem() can load the state in buf: it has the format of
+// this version and the sections of a state of the game of sys. Unlike
+// system_load_state_mem() it never panics, for the states received from the
+// network (it allocates a state of sys to compare with)
+int      system_check_state_mem(System* sys, const uint8_t* buf, uint64_t size);
+
+typedef enum HashComponent {
+    // registers, clock and the shift registers of the controllers
+    HASH_CPU = 0,
+    HASH_RAM,
+    // registers, OAM, nametables and palette
+    HASH_PPU,
+    HASH_MAPPER,
+    // 0 if the cartridge has CHR-ROM
+    HASH_CHR_RAM,
+    HASH_SRAM,
+    HASH_COMPONENTS
+} HashComponent;
+
+typedef struct SystemHash {
+    uint64_t total; // hash of the components
+    uint64_t components[HASH_COMPONENTS];
+} SystemHash;
+
+// Hash of the emulation state, it is the same on every machine for the same
+// ROM and inputs (the audio and the frame that has been drawn are not
+// included). It costs a few microseconds, it can be computed every frame
+SystemHash  system_hash(System* sys);
+const char* system_hash_component_name(HashComponent c);
+
 #endif
@@ -60,6 +60,8 @@ static System* mk_sys(const uint8_t* Data, size_t Size)
     sys->cpu_freq        = CPU_1X_FREQ;
     sys->state_save_path = NULL;
 
+    system_map_cpu_pages(sys);
+    system_map_ppu_pages(sys);
     cpu_reset(cpu);
     ppu_reset(ppu);
 
@@ -0,0 +1,57 @@
+#include <cifuzz/cifuzz.h>
+#include <assert.h>
+#include <string.h>
+
+#include "common.h"
+
+#include "../rle.h"
+
+// biggest decoded size tried, the first two bytes of the input pick it
+#define MAX_DST_SIZE 0x10000
+
+FUZZ_TEST_SETUP()
+{
+    // Perform any one-time setup required by the FUZZ_TEST function.
+}
+
+FUZZ_TEST(const uint8_t* data, size_t size)
+{
+    static uint8_t dst[MAX_DST_SIZE];
+    static uint8_t copy[MAX_DST_SIZE];
+
+    int result = setjmp(env);
+    if (result != 0)
+        return;
+
+    if (size < 2)
+        return;
+
+    // rle_decode() gets network data (state transfers): any input must be
+    // rejected or decoded without writing past dst_size bytes
+    uint64_t dst_size = (data[0] | (data[1] << 8)) % MAX_DST_SIZE;
+    int      xor      = data[0] & 1;
+    memset(dst, 0xAA, sizeof(dst));
+    memcpy(copy, dst, sizeof(copy));
+    int ok = rle_decode(data + 2, size - 2, dst, dst_size, xor);
+    if (ok && xor) {
+        // a second XOR with the same data gives back the original
+        int ok2 = rle_decode(data + 2, size - 2, dst, dst_size, xor);
+        assert(ok2);
+        (void)ok2;
+        assert(memcmp(dst, copy, dst_size) == 0);
+    }
+    assert(memcmp(dst + dst_size, copy + dst_size,
+                  sizeof(dst) - dst_size) == 0);
+
+    // the encoding of any data decodes to the same data
+    if (size - 2 > MAX_DST_SIZE)
+        return;
+    uint8_t* enc = malloc_or_fail(rle_bound(size - 2));
+    uint64_t n   = rle_encode(data + 2, size - 2, enc);
+    assert(n <= rle_bound(size - 2));
+    int ok3 = rle_decode(enc, n, dst, size - 2, 0);
+    assert(ok3);
+    (void)ok3;
+    assert(memcmp(dst, data + 2, size - 2) == 0);
+    free_or_fail(enc);
+}
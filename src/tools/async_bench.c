@@ -0,0 +1,185 @@
+#include "../async.h"
+#include "../logging.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <sched.h>
+
+#ifdef __MINGW32__
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#else
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#endif
+
+// Sends messages of random size through an AsyncContext on a TCP connection
+// over the loopback interface, the other end checks that they arrive intact
+// and in order. It prints how long async_send() takes and how many messages
+// each send() of the sender thread carries.
+
+#define DEFAULT_MESSAGES 1000000
+#define MAX_PAYLOAD      512
+#define HEADER_SIZE      6 // sequence number (32 bit), payload size (16 bit)
+
+typedef struct Reader {
+    int      fd;
+    uint32_t messages;
+    uint32_t received;
+    int      ok;
+} Reader;
+
+static uint64_t now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static uint32_t next_rand(uint32_t* state)
+{
+    // xorshift32
+    *state ^= *state << 13;
+    *state ^= *state >> 17;
+    *state ^= *state << 5;
+    return *state;
+}
+
+static uint32_t build_message(uint8_t* buf, uint32_t seq, uint32_t* rand)
+{
+    uint32_t len = next_rand(rand) % MAX_PAYLOAD;
+    buf[0]       = seq >> 24;
+    buf[1]       = seq >> 16;
+    buf[2]       = seq >> 8;
+    buf[3]       = seq;
+    buf[4]       = len >> 8;
+    buf[5]       = len;
+    for (uint32_t i = 0; i < len; ++i)
+        buf[HEADER_SIZE + i] = (uint8_t)(seq + i);
+    return HEADER_SIZE + len;
+}
+
+static void* reader_thread(void* _r)
+{
+    Reader* r = (Reader*)_r;
+    uint8_t buf[HEADER_SIZE + MAX_PAYLOAD];
+
+    r->ok = 1;
+    for (; r->received < r->messages; r->received++) {
+        sync_recv(r->fd, buf, HEADER_SIZE);
+        uint32_t seq = (uint32_t)buf[0] << 24 | (uint32_t)buf[1] << 16 |
+                       (uint32_t)buf[2] << 8 | buf[3];
+        uint32_t len = (uint32_t)buf[4] << 8 | buf[5];
+        if (seq != r->received || len >= MAX_PAYLOAD) {
+            r->ok = 0;
+            break;
+        }
+        if (len > 0)
+            sync_recv(r->fd, buf + HEADER_SIZE, len);
+        for (uint32_t i = 0; i < len; ++i)
+            if (buf[HEADER_SIZE + i] != (uint8_t)(seq + i))
+                r->ok = 0;
+    }
+    return NULL;
+}
+
+static void open_connection(int* out, int* in)
+{
+    int listener = socket(AF_INET, SOCK_STREAM, 0);
+    if (listener < 0)
+        panic("cannot create the socket");
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family      = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port        = 0;
+    socklen_t len        = sizeof(addr);
+    if (bind(listener, (struct sockaddr*)&addr, sizeof(addr)) < 0 ||
+        getsockname(listener, (struct sockaddr*)&addr, &len) < 0 ||
+        listen(listener, 1) < 0)
+        panic("cannot listen on the loopback interface");
+
+    *out = socket(AF_INET, SOCK_STREAM, 0);
+    if (*out < 0 || connect(*out, (struct sockaddr*)&addr, sizeof(addr)) < 0)
+        panic("cannot connect [%s]", strerror(errno));
+    *in = accept(listener, NULL, NULL);
+    if (*in < 0)
+        panic("cannot accept the connection");
+
+#ifdef __MINGW32__
+    closesocket(listener);
+#else
+    close(listener);
+#endif
+}
+
+int main(int argc, char const* argv[])
+{
+    uint32_t messages = DEFAULT_MESSAGES;
+    if (argc > 2 ||
+        (argc == 2 && (messages = strtoul(argv[1], NULL, 10)) == 0)) {
+        fprintf(stderr, "USAGE: %s [<messages>]\n", argv[0]);
+        return 1;
+    }
+
+#ifdef __MINGW32__
+    WSADATA wsaData;
+    WSAStartup(MAKEWORD(2, 2), &wsaData);
+#endif
+
+    int out, in;
+    open_connection(&out, &in);
+
+    Reader    reader = {.fd = in, .messages = messages};
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, &reader_thread, &reader) != 0)
+        panic("pthread_create failed");
+
+    AsyncContext* ac = async_init(out, 0);
+
+    uint8_t  buf[HEADER_SIZE + MAX_PAYLOAD];
+    uint32_t rand  = 0x2545F491u;
+    uint64_t bytes = 0, full = 0, worst_ns = 0, total_ns = 0;
+    uint64_t start = now_ns();
+    for (uint32_t seq = 0; seq < messages; ++seq) {
+        uint32_t size = build_message(buf, seq, &rand);
+        for (;;) {
+            uint64_t before = now_ns();
+            int      queued = async_send(ac, buf, size);
+            uint64_t dt     = now_ns() - before;
+            total_ns += dt;
+            if (dt > worst_ns)
+                worst_ns = dt;
+            if (queued)
+                break;
+            if (async_failed(ac))
+                panic("the connection is broken");
+            // the reader is too slow, like a peer on a slow network
+            full++;
+            sched_yield();
+        }
+        bytes += size;
+    }
+    pthread_join(thread, NULL);
+    double elapsed = (now_ns() - start) / 1e9;
+
+    uint64_t sends   = atomic_load(&ac->sends);
+    uint64_t wakeups = atomic_load(&ac->wakeups);
+    async_destroy(ac);
+
+    printf("%u messages, %.01lf MB in %.03lf s: %s\n", messages, bytes / 1e6,
+           elapsed, reader.ok ? "ok" : "CORRUPTED");
+    printf("async_send(): %.0lf ns on average, %llu ns at most, %llu times "
+           "the ring was full\n",
+           (double)total_ns / (messages + full), (unsigned long long)worst_ns,
+           (unsigned long long)full);
+    printf("send(): %llu calls, %.02lf messages per call, %llu wakeups\n",
+           (unsigned long long)sends, (double)messages / sends,
+           (unsigned long long)wakeups);
+    return reader.ok ? 0 : 1;
+}
@@ -5,77 +5,34 @@
 #include "../memory.h"
 #include "../ppu.h"
 #include "../apu.h"
+#include "../audio_sink.h"
+#include "../sdl_audio.h"
 #include "../config.h"
 #include "../input_handler.h"
-#include "../async.h"
+#include "../rewind.h"
+#include "../pacing.h"
+#include "../alloc.h"
 
-#include <sys/types.h>
-#include <sys/stat.h>
-#include <unistd.h>
+#include <stdio.h>
 
-#define DELTA_MS_TO_WAIT     5000
-#define SLEEP_BETWEEN_FRAMES 0
-#define REWIND_BUF_SIZE      100
+// depth of the audio queue at the start of a frame, on top of the buffer of
+// the audio device
+#define AUDIO_TARGET_US    20000
+#define FRAME_MICROSECONDS 16639
 
-#ifdef __MINGW32__
-#define REWIND_DIR "borznes_rewind_states"
-#else
-#define REWIND_DIR "/tmp/borznes_rewind_states"
-#endif
+// A state is saved every frame, REWIND_MEMORY_CAP bytes hold some minutes of
+// them (the size of a state depends on how much the game changes it)
+#define REWIND_MEMORY_CAP        (16u << 20)
+#define REWIND_KEYFRAME_INTERVAL 60
 
 typedef enum { NORMAL_MODE, DEBUG_MODE, REWIND_MODE } EmulationMode;
 
-static int  rewind_num_states = 0;
-static int  rewind_id         = 0;
-static char rewind_tmp_path[128];
-
 static void usage(const char* prog)
 {
     fprintf(stderr, "USAGE: %s <game.rom>\n", prog);
     exit(1);
 }
 
-void init_rewind()
-{
-    struct stat st = {0};
-    if (stat(REWIND_DIR, &st) == -1) {
-#ifdef __MINGW32__
-        mkdir(REWIND_DIR);
-#else
-        mkdir(REWIND_DIR, 0700);
-#endif
-    }
-}
-
-void save_rewind_state(System* sys)
-{
-    memset(rewind_tmp_path, 0, sizeof(rewind_tmp_path));
-
-    sprintf(rewind_tmp_path, REWIND_DIR "/%03u.sav", rewind_id);
-    system_save_state(sys, rewind_tmp_path);
-
-    rewind_id = (rewind_id + 1) % REWIND_BUF_SIZE;
-    if (rewind_num_states < REWIND_BUF_SIZE)
-        rewind_num_states++;
-}
-
-int load_rewind_state(System* sys)
-{
-    if (rewind_num_states == 0)
-        return 0;
-
-    memset(rewind_tmp_path, 0, sizeof(rewind_tmp_path));
-
-    if (--rewind_id < 0)
-        rewind_id = REWIND_BUF_SIZE - 1;
-    rewind_num_states--;
-
-    sprintf(rewind_tmp_path, REWIND_DIR "/%03u.sav", rewind_id);
-    system_load_state(sys, rewind_tmp_path);
-
-    return 1;
-}
-
 int main(int argc, char const* argv[])
 {
     if (argc < 2)
@@ -84,7 +41,9 @@ int main(int argc, char const* argv[])
     config_load(DEFAULT_CFG_NAME);
     SDL_Init(SDL_INIT_VIDEO | SDL_INIT_AUDIO | SDL_INIT_JOYSTICK);
 
-    System* sys = system_build(argv[1]);
+    System*    sys   = system_build(argv[1]);
+    AudioSink* audio = sdl_audio_sink_build();
+    apu_set_audio_sink(sys->apu, audio);
 
 #ifdef ENABLE_DEBUG_GW
     GameWindow* gw = rich_gw_build(sys);
@@ -92,31 +51,37 @@ int main(int argc, char const* argv[])
     GameWindow* gw = simple_gw_build(sys);
 #endif
 
-    init_rewind();
+    Rewind* rw = rewind_build(sys, REWIND_MEMORY_CAP, REWIND_KEYFRAME_INTERVAL);
     gamewindow_draw(gw);
 
     InputHandler* ih = input_handler_build();
 
-    EmulationMode mode = NORMAL_MODE;
-    long          start, end, last_rewind_timestamp = 0;
-    int           should_quit = 0, fast_freq = 0, slow_freq = 0, audio_on = 1,
-        should_draw            = 1;
-    uint64_t        ms_to_wait = 0;
+    Pacer* pacer   = pacer_build(audio->sample_rate, AUDIO_TARGET_US);
+    float* silence = calloc_or_fail(pacer->target_queued * sizeof(float));
+
+    EmulationMode   mode        = NORMAL_MODE;
+    int             should_quit = 0, fast_freq = 0, slow_freq = 0, audio_on = 1;
     ControllerState p1, p2;
     MiscKeys        mk = {0};
     p1.state           = 0;
     p2.state           = 0;
 
+#ifdef ENABLE_DEBUG_GW
+    SyncMode debug_sync = sys->sync_mode;
+#endif
+
+    // Sleep until the next frame is due, then handle the events received in
+    // the meantime and run it
     SDL_Event e;
+    uint64_t  start_ns = pacer_now_ns();
     while (!should_quit) {
-        if (window_poll_event(&e)) {
-            if (e.type == SDL_QUIT) {
-                break;
-            }
+        pacer_wait(pacer);
 
-            if (e.type == SDL_KEYDOWN && e.key.keysym.sym == SDLK_q) {
+        while (window_poll_event(&e)) {
+            if (e.type == SDL_QUIT ||
+                (e.type == SDL_KEYDOWN && e.key.keysym.sym == SDLK_q)) {
                 should_quit = 1;
-                continue;
+                break;
             }
 
 #ifdef ENABLE_DEBUG_GW
@@ -128,16 +93,20 @@ int main(int argc, char const* argv[])
                     }
                 } else if (e.key.keysym.sym == SDLK_o) {
                     if (mode == DEBUG_MODE) {
-                        uint32_t old_frame = sys->ppu->frame;
-                        while (sys->ppu->frame == old_frame)
-                            system_step(sys);
+                        system_run_frame(sys);
                         gamewindow_draw(gw);
                     }
                 } else if (e.key.keysym.sym == SDLK_d) {
-                    if (mode == NORMAL_MODE)
-                        mode = DEBUG_MODE;
-                    else if (mode == DEBUG_MODE)
-                        mode = NORMAL_MODE;
+                    // 'i' must execute a single instruction: the devices are
+                    // stepped in lockstep while debugging
+                    if (mode == NORMAL_MODE) {
+                        mode           = DEBUG_MODE;
+                        debug_sync     = sys->sync_mode;
+                        sys->sync_mode = SYNC_LOCKSTEP;
+                    } else if (mode == DEBUG_MODE) {
+                        mode           = NORMAL_MODE;
+                        sys->sync_mode = debug_sync;
+                    }
                 }
             }
 #endif
@@ -198,53 +167,49 @@ int main(int argc, char const* argv[])
             }
         }
 
-        if (mode == NORMAL_MODE) {
-            if (should_draw) {
-                uint64_t cycles    = 0;
-                uint32_t old_frame = sys->ppu->frame;
-                while (sys->ppu->frame == old_frame)
-                    cycles += system_step(sys);
-
-                should_draw = 0;
-                ms_to_wait  = 1000000ll * cycles / sys->cpu_freq;
-                if (ms_to_wait > DELTA_MS_TO_WAIT)
-                    ms_to_wait -= DELTA_MS_TO_WAIT;
-                else
-                    ms_to_wait = 0;
-            } else {
-                end = get_timestamp_microseconds();
-                if (end - start > ms_to_wait &&
-                    apu_get_queued(sys->apu) < sys->apu->spec.freq) {
-                    start       = end;
-                    should_draw = 1;
-                } else if (ms_to_wait > end - start &&
-                           ms_to_wait - (end - start) > 5000)
-                    if (SLEEP_BETWEEN_FRAMES)
-                        msleep(ms_to_wait / 1000 - 5);
-            }
+        if (should_quit)
+            break;
 
-            end = get_timestamp_microseconds();
-            if (end - last_rewind_timestamp > 500000) {
-                last_rewind_timestamp = end;
-                save_rewind_state(sys);
-            }
-        }
-
-        if (mode == REWIND_MODE) {
-            end = get_timestamp_microseconds();
-            if (end - last_rewind_timestamp > 500000) {
-                last_rewind_timestamp = end;
-                if (load_rewind_state(sys)) {
-                    int old_frame = sys->ppu->frame;
-                    while (sys->ppu->frame != old_frame + 2)
-                        system_step(sys);
-                }
+        // debug mode: the events are polled at the frame rate
+        uint64_t frame_ns = FRAME_MICROSECONDS * 1000ull;
+        if (mode == NORMAL_MODE) {
+            if (audio_on) {
+                uint32_t queued = apu_get_queued(sys->apu);
+                if (queued == 0)
+                    audio_sink_queue(audio, silence, pacer->target_queued);
+                apu_set_rate_adjust(sys->apu, pacer_update_rate(pacer, queued));
             }
+            RunSummary run = system_run_frame(sys);
+            rewind_push(rw);
+            frame_ns = 1000000000ull * run.cycles / sys->cpu_freq;
+        } else if (mode == REWIND_MODE) {
+            // run a frame from the previous state to draw it
+            if (rewind_pop(rw))
+                system_run_frame(sys);
         }
+        pacer_frame_done(pacer, frame_ns);
     }
 
+    uint64_t elapsed_ns = pacer_now_ns() - start_ns;
+    printf("frames: %llu (%llu late), asleep %.01lf%% of the time\n",
+           (unsigned long long)pacer->frames,
+           (unsigned long long)pacer->late_frames,
+           100.0 * pacer->slept_ns / (elapsed_ns ? elapsed_ns : 1));
+    printf("audio queue refilled %llu times, sample rate %+.03lf%%\n",
+           (unsigned long long)pacer->refills, (pacer->ratio - 1.0) * 100);
+
+    AudioSinkStats stats;
+    audio_sink_stats(audio, &stats);
+    printf("audio underruns: %llu, samples dropped: %llu\n",
+           (unsigned long long)stats.underruns,
+           (unsigned long long)stats.overruns);
+
+    free_or_fail(silence);
+    pacer_destroy(pacer);
+    rewind_destroy(rw);
     gamewindow_destroy(gw);
     system_destroy(sys);
+    audio_sink_destroy(audio);
     input_handler_destroy(ih);
     config_unload();
 
@@ -1,105 +1,229 @@
 #include "../game_window.h"
 #include "../window.h"
 #include "../system.h"
+#include "../cartridge.h"
 #include "../6502_cpu.h"
 #include "../memory.h"
 #include "../logging.h"
 #include "../ppu.h"
 #include "../apu.h"
-#include "../async.h"
+#include "../audio_sink.h"
+#include "../sdl_audio.h"
 #include "../config.h"
 #include "../input_handler.h"
+#include "../rollback.h"
+#include "../netplay.h"
+#include "../spectator.h"
+#include "../event_loop.h"
 
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
 #include <errno.h>
+#include <string.h>
 
 #ifdef __MINGW32__
 #include <winsock2.h>
-#else
-#include <netinet/tcp.h>
-#include <sys/socket.h>
-#include <arpa/inet.h>
 #endif
 
-#define DELTA_MS_TO_WAIT     5000
-#define SLEEP_BETWEEN_FRAMES 0
 #define BORZNES_DEFAULT_PORT 54000
+#define BORZNES_SPECTATE_PORT 54001
+#define FRAME_MICROSECONDS   16639
+
+// A peer that is ahead waits one frame at most once every TIME_SYNC_INTERVAL
+// frames: the effect of a wait is seen by the peer after a round trip
+#define TIME_SYNC_INTERVAL 60
+// frames between the updates of the stats in the title bar
+#define STATS_INTERVAL 60
+// a spectator that has more frames than this to run runs two frames at a
+// time, until it has caught up with the players
+#define SPECTATOR_CATCH_UP 6
+// The event watch of SDL wakes up the event loop when an event is queued,
+// but the window system hands its events to SDL only when they are polled:
+// while no frame is due (e.g. a stall) the window is polled this often
+// (microseconds). The frames poll it when a deadline is armed
+#define WINDOW_POLL_US 50000
+// where the event loop cannot be notified, the window is polled this often
+#define INPUT_POLL_US 1000
+// the next frame is tried again after this, when the audio queue is full
+#define AUDIO_RETRY_US 1000
+// the frame is delayed while the audio queue holds more than this (seconds)
+#define MAX_AUDIO_QUEUED 0.25
+
+static uint32_t input_delay      = 0;
+static uint8_t  desync_reported  = 0;
+static uint64_t resyncs_reported = 0;
+
+static const char* desync_components(NetPeer* np)
+{
+    static char res[128];
+    res[0] = 0;
+    for (int c = 0; c < HASH_COMPONENTS; ++c) {
+        if ((np->desync_components & (1u << c)) == 0)
+            continue;
+        if (res[0])
+            strcat(res, ", ");
+        strcat(res, system_hash_component_name(c));
+    }
+    return res;
+}
+
+static void update_stats(NetPeer* np, uint64_t stalls, uint64_t waited)
+{
+    if (np->resyncs != resyncs_reported) {
+        printf("game state synchronized at frame %u\n", np->transfer.frame);
+        resyncs_reported = np->resyncs;
+        desync_reported  = 0;
+    }
+    if (np->desynced && !desync_reported) {
+        // until the host sends its state, report only the first frame
+        warning("the game is out of sync since frame %u (%s)",
+                np->desync_frame, desync_components(np));
+        desync_reported = 1;
+    }
 
-typedef enum EmuState { DRAW_FRAME, WAIT_FOR_KEY, WAIT_UNTIL_READY } EmuState;
+    latency = (long)(np->rtt_us / 1000);
+    snprintf(title_info, sizeof(title_info),
+             "rtt p50/p99: %llu/%llu ms - delay: %u - stalls: %llu - "
+             "waited: %llu%s",
+             (unsigned long long)netplay_rtt_percentile(np, 50) / 1000,
+             (unsigned long long)netplay_rtt_percentile(np, 99) / 1000,
+             np->input_delay, (unsigned long long)stalls,
+             (unsigned long long)waited, np->desynced ? " - DESYNC" : "");
+}
 
-static int sync_frame_count = 2;
+static SDL_threadID main_thread;
 
-static void usage(const char* prog)
+// Called by SDL on the thread that queues the event
+static int notify_event(void* userdata, SDL_Event* e)
 {
-    fprintf(stderr,
-            "USAGE: %s <game.rom> [ <peer_ip> ]\n"
-            "   if <peer_ip> is not specified, listen on %d\n",
-            prog, BORZNES_DEFAULT_PORT);
-    exit(1);
+    (void)e;
+    // the main thread queues the events while it polls the window, it gets
+    // them in the same loop
+    if (SDL_ThreadID() != main_thread)
+        event_loop_notify((EventLoop*)userdata);
+    return 0;
 }
 
-static int open_p1_socket(int port)
+static EventLoop* build_event_loop(int fd)
 {
-    int fd = socket(AF_INET, SOCK_STREAM, 0);
-    if (fd < 0)
-        panic("cannot create p1 socket");
-
-    int flags = 1;
-    if (setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, (void*)&flags, sizeof(flags)) <
-        0)
-        panic("setsockopt failed");
-
-    struct sockaddr_in addr;
-    addr.sin_family      = AF_INET;
-    addr.sin_addr.s_addr = INADDR_ANY;
-    addr.sin_port        = htons(port);
+    EventLoop* loop = event_loop_build();
+    event_loop_add_fd(loop, fd);
+    if (event_loop_can_notify(loop)) {
+        main_thread = SDL_ThreadID();
+        SDL_AddEventWatch(&notify_event, loop);
+    }
+    return loop;
+}
 
-    if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0)
-        panic("cannot bind p1 socket");
+static void destroy_event_loop(EventLoop* loop)
+{
+    if (event_loop_can_notify(loop))
+        SDL_DelEventWatch(&notify_event, loop);
+    event_loop_destroy(loop);
+}
 
-    if (listen(fd, 1) < 0)
-        panic("cannot listen on p1 socket");
+// Sleeps until the next event: a packet, a frame deadline or an event of SDL
+static void wait_events(EventLoop* loop)
+{
+    uint64_t max_wait_us = INPUT_POLL_US;
+    if (event_loop_can_notify(loop))
+        max_wait_us =
+            loop->deadline_us != 0 ? EVENT_LOOP_FOREVER : WINDOW_POLL_US;
+    event_loop_wait(loop, max_wait_us);
+}
 
-    return fd;
+static void usage(const char* prog)
+{
+    fprintf(stderr,
+            "USAGE: %s <game.rom> [ <peer_ip> | -s <host_ip> ]\n"
+            "   if <peer_ip> is not specified, listen on %d (players) and "
+            "%d (spectators)\n"
+            "   -s: watch the game of <host_ip>\n",
+            prog, BORZNES_DEFAULT_PORT, BORZNES_SPECTATE_PORT);
+    exit(1);
 }
 
-static int open_p2_socket(const char* ip, int port)
+// Runs the game of the host with the inputs it sends, it never sends anything
+static void spectate(const char* rom, const char* ip)
 {
-    int fd = socket(AF_INET, SOCK_STREAM, 0);
-    if (fd < 0)
-        panic("cannot create p2 socket");
+    printf("Hello spectator! Trying to connect to %s\n", ip);
+    SpectatorClient* c = spectator_connect(ip, BORZNES_SPECTATE_PORT);
+    printf("connected!\n");
 
-    int flags = 1;
-    if (setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, (void*)&flags, sizeof(flags)) <
-        0)
-        panic("setsockopt failed");
+    SDL_Init(SDL_INIT_VIDEO | SDL_INIT_AUDIO | SDL_INIT_JOYSTICK);
 
-    struct sockaddr_in addr;
-    addr.sin_family      = AF_INET;
-    addr.sin_addr.s_addr = inet_addr(ip);
-    addr.sin_port        = htons(port);
-    uint32_t addr_len    = sizeof(addr);
+    InputHandler* ih    = input_handler_build();
+    System*       sys   = system_build(rom);
+    GameWindow*   gw    = simple_gw_build(sys);
+    AudioSink*    audio = sdl_audio_sink_build();
+    apu_set_audio_sink(sys->apu, audio);
+    cartridge_detach_sav(sys->cart);
 
-    if (connect(fd, (struct sockaddr*)&addr, addr_len) < 0)
-        panic("p1 server is not running");
+    EventLoop* loop = build_event_loop(c->fd);
 
-    return fd;
-}
+    uint64_t        next_frame = 0;
+    int             audio_on = 1, connected = 1, should_quit = 0;
+    ControllerState unused, p1, p2;
+    MiscKeys        keys = {0};
+    unused.state         = 0;
 
-static int estimate_latency(int fd)
-{
-    const int N     = 50;
-    long      start = get_timestamp_microseconds();
-    for (int i = 0; i < N; ++i) {
-        char a;
-        if (send(fd, "a", 1, 0) != 1)
-            panic("estimate_latency(): unable to write [i= %d]", i);
-        if (recv(fd, &a, 1, 0) != 1)
-            panic("estimate_latency(): unable to read [i=%d]", i);
+    SDL_Event e;
+    while (!should_quit) {
+        wait_events(loop);
+        while (window_poll_event(&e)) {
+            if (e.type == SDL_QUIT ||
+                (e.type == SDL_KEYDOWN && e.key.keysym.sym == SDLK_q)) {
+                should_quit = 1;
+                break;
+            }
+            input_handler_get_input(ih, e, &unused, NULL, &keys);
+            if (keys.mute) {
+                audio_on = !audio_on;
+                if (audio_on)
+                    apu_unpause(sys->apu);
+                else
+                    apu_pause(sys->apu);
+            }
+        }
+
+        if (connected && !spectator_client_poll(c))
+            connected = 0;
+        if (!spectator_client_load_state(c, sys)) {
+            if (!connected) {
+                warning("the host has closed the connection");
+                break;
+            }
+            continue;
+        }
+        if (!connected && spectator_client_buffered(c) == 0) {
+            printf("the host has left\n");
+            break;
+        }
+
+        uint64_t now = event_loop_now_us();
+        if (now < next_frame || spectator_client_buffered(c) == 0)
+            // the socket or the timer wakes us up
+            continue;
+
+        int frames = spectator_client_buffered(c) > SPECTATOR_CATCH_UP ? 2 : 1;
+        for (int i = 0; i < frames; ++i)
+            if (spectator_client_next_inputs(c, &p1, &p2)) {
+                system_update_controller(sys, P1, p1);
+                system_update_controller(sys, P2, p2);
+                system_run_frame(sys);
+            }
+        next_frame = now + FRAME_MICROSECONDS;
+        event_loop_set_deadline(loop, next_frame);
     }
-    return (get_timestamp_microseconds() - start) / N / 1000l;
+
+    destroy_event_loop(loop);
+    spectator_client_destroy(c);
+    gamewindow_destroy(gw);
+    system_destroy(sys);
+    audio_sink_destroy(audio);
+    input_handler_destroy(ih);
+    SDL_Quit();
 }
 
 int main(int argc, char const* argv[])
@@ -114,100 +238,98 @@ int main(int argc, char const* argv[])
 
     config_load(DEFAULT_CFG_NAME);
 
-    int is_p1;
-    int fd1 = -1, fd2 = -1;
+    if (argc == 4 && strcmp(argv[2], "-s") == 0) {
+        spectate(argv[1], argv[3]);
+#ifdef __MINGW32__
+        WSACleanup();
+#endif
+        config_unload();
+        return 0;
+    }
+    if (argc > 3)
+        usage(argv[0]);
+
+    int      is_p1;
+    NetPeer* np;
     if (argc == 2) {
         // player 1
         printf("Hello player 1! Waiting for player 2 to connect\n");
 
         is_p1 = 1;
-        fd2   = open_p1_socket(BORZNES_DEFAULT_PORT);
-
-        struct sockaddr_in client_addr;
-#ifdef __MINGW32__
-        int32_t client_addr_len;
-#else
-        uint32_t client_addr_len;
-#endif
-        client_addr_len = sizeof(client_addr);
-        if ((fd1 = accept(fd2, (struct sockaddr*)&client_addr,
-                          &client_addr_len)) < 0)
-            panic("accept error");
-
-        printf("player 2 connected from %s\n", inet_ntoa(client_addr.sin_addr));
+        np    = netplay_accept(BORZNES_DEFAULT_PORT);
+        printf("player 2 connected from %s\n", np->peer_name);
 
-        static char magic[8];
-        if (sync_recv(fd1, &magic, 7) != 7 ||
-            memcmp(magic, "borzNES", 7) != 0) {
-            panic("handshake failed (msg=\"%s\")", magic);
-        }
-
-        latency = estimate_latency(fd1);
+        uint64_t rtt = netplay_estimate_rtt(np);
+        latency      = rtt / 1000;
         printf("estimated latency: %ld ms\n", latency);
 
-        sync_frame_count = latency / (1000l / 60l) + 1;
-        if (sync_frame_count > 6) {
+        input_delay = netplay_input_delay(rtt);
+        if (rtt / 2 > (uint64_t)(NETPLAY_ROLLBACK_FRAMES + input_delay) *
+                          FRAME_MICROSECONDS)
             warning("the latency is too high, expect the emulator to be slow");
-            sync_frame_count = 6;
-        }
 
-        int be_sync_frame_count = htonl(sync_frame_count);
-        if (sync_send(fd1, &be_sync_frame_count, sizeof(be_sync_frame_count)) !=
-            sizeof(be_sync_frame_count)) {
-            panic("unable to send sync_frame_count");
-        }
-        printf("input sync every %u frame\n", sync_frame_count);
+        netplay_start(np, input_delay);
+        printf("input delay: %u frames\n", input_delay);
     } else {
         // player 2
         printf("Hello player 2! Trying to connect to %s\n", argv[2]);
 
         is_p1 = 0;
-        fd1   = open_p2_socket(argv[2], BORZNES_DEFAULT_PORT);
-        if (sync_send(fd1, "borzNES", 7) != 7)
-            panic("write failed");
+        np    = netplay_connect(argv[2], BORZNES_DEFAULT_PORT);
         printf("connected!\n");
 
-        latency = estimate_latency(fd1);
-        printf("estimated latency: %ld ms\n", latency);
-
-        int be_sync_frame_count;
-        if (sync_recv(fd1, &be_sync_frame_count, sizeof(be_sync_frame_count)) !=
-            sizeof(be_sync_frame_count)) {
-            panic("unable to recv sync_frame_count");
-        }
-        sync_frame_count = ntohl(be_sync_frame_count);
-        printf("input sync every %u frame\n", sync_frame_count);
+        input_delay = netplay_wait_start(np);
+        printf("input delay: %u frames\n", input_delay);
     }
 
     SDL_Init(SDL_INIT_VIDEO | SDL_INIT_AUDIO | SDL_INIT_JOYSTICK);
 
     InputHandler* ih    = input_handler_build();
-    AsyncContext* ac    = async_init();
     System*       sys   = system_build(argv[1]);
     GameWindow*   gw    = simple_gw_build(sys);
-    EmuState      state = DRAW_FRAME;
+    AudioSink*    audio = sdl_audio_sink_build();
+
+    apu_set_audio_sink(sys->apu, audio);
+
+    if (!is_p1)
+        // the game is the one of the host (its state is sent at the start),
+        // our save file is left alone
+        cartridge_detach_sav(sys->cart);
 
     gamewindow_draw(gw);
 
-    long            start, end, microseconds_to_wait = 0;
-    long            start_latency_calc;
-    int             should_quit = 0, sync_count = 0, audio_on = 1;
-    ControllerState p1, p2, freezed_p1;
+    Rollback* rb = rollback_build(sys, is_p1 ? P1 : P2, input_delay,
+                                  NETPLAY_ROLLBACK_FRAMES);
+
+    // the host streams the game to the spectators
+    SpectatorServer* spectators = NULL;
+    if (is_p1) {
+        spectators = spectator_server_build(sys, BORZNES_SPECTATE_PORT);
+        printf("spectators can connect on port %d\n", spectators->port);
+    }
+
+    EventLoop* loop = build_event_loop(np->fd);
+
+    uint64_t        next_frame = event_loop_now_us();
+    int             should_quit = 0, audio_on = 1, stalled = 0;
+    uint32_t        frames_since_wait = 0;
+    uint64_t        stalls = 0, frames_waited = 0;
+    ControllerState p1;
     MiscKeys        keys = {0};
     p1.state             = 0;
-    p2.state             = 0;
 
+    // Sleep until the next frame is due, a packet arrives or SDL queues an
+    // event. The frame runs as soon as the deadline expires, with the
+    // input of the events received so far
     SDL_Event e;
     while (!should_quit) {
-        if (state == DRAW_FRAME)
-            start = get_timestamp_microseconds();
+        wait_events(loop);
 
-        if (window_poll_event(&e)) {
-            if (e.type == SDL_QUIT) {
-                break;
-            } else if (e.type == SDL_KEYDOWN && e.key.keysym.sym == SDLK_q) {
+        while (window_poll_event(&e)) {
+            if (e.type == SDL_QUIT ||
+                (e.type == SDL_KEYDOWN && e.key.keysym.sym == SDLK_q)) {
                 should_quit = 1;
-                continue;
+                break;
             }
             input_handler_get_input(ih, e, &p1, NULL, &keys);
             if (keys.mute) {
@@ -218,72 +340,118 @@ int main(int argc, char const* argv[])
                     apu_pause(sys->apu);
             }
         }
+        if (should_quit)
+            break;
 
-        if (state == DRAW_FRAME) {
-            if (sync_count == 0) {
-                freezed_p1 = p1;
-                async_send(ac, fd1, &freezed_p1.state,
-                           sizeof(freezed_p1.state));
-                start_latency_calc = get_timestamp_microseconds();
-            }
+        if (!netplay_poll(np, rb)) {
+            if (!np->wrong_rom)
+                printf("player %d has left\n", is_p1 ? 2 : 1);
+            break;
+        }
 
-            if (++sync_count == sync_frame_count) {
-                sync_count = 0;
-                state      = WAIT_FOR_KEY;
-            } else {
-                state = WAIT_UNTIL_READY;
-            }
+        uint64_t now = event_loop_now_us();
+        if (now < next_frame)
+            continue;
+        if (apu_get_queued(sys->apu) >
+            sys->apu->sample_rate * MAX_AUDIO_QUEUED) {
+            // the audio device is slower than our clock
+            next_frame = now + AUDIO_RETRY_US;
+            event_loop_set_deadline(loop, next_frame);
+            continue;
+        }
 
-            uint64_t cycles    = 0;
-            uint32_t old_frame = sys->ppu->frame;
-            while (sys->ppu->frame == old_frame)
-                cycles += system_step(sys);
-
-            microseconds_to_wait = 1000000ll * cycles / sys->cpu_freq;
-            if (microseconds_to_wait > DELTA_MS_TO_WAIT)
-                microseconds_to_wait -= DELTA_MS_TO_WAIT;
-            else
-                microseconds_to_wait = 0;
-
-        } else if (state == WAIT_FOR_KEY) {
-            if (sync_recv(fd1, &p2.state, sizeof(p2.state)) != sizeof(p2.state))
-                panic("unable to read keys");
-            latency =
-                (get_timestamp_microseconds() - start_latency_calc) / 1000l;
-
-            system_update_controller(sys, is_p1 ? P1 : P2, freezed_p1);
-            system_update_controller(sys, is_p1 ? P2 : P1, p2);
-            state = WAIT_UNTIL_READY;
-        } else if (state == WAIT_UNTIL_READY) {
-            end = get_timestamp_microseconds();
-            if (end - start >= microseconds_to_wait &&
-                apu_get_queued(sys->apu) < sys->apu->spec.freq)
-                state = DRAW_FRAME;
-            else if (microseconds_to_wait > end - start &&
-                     microseconds_to_wait - (end - start) > 5000)
-                if (SLEEP_BETWEEN_FRAMES)
-                    msleep(microseconds_to_wait / 1000 - 5);
+        if (++frames_since_wait >= TIME_SYNC_INTERVAL &&
+            rollback_frames_ahead(rb) > 0) {
+            // skip a frame, the peer is behind
+            frames_since_wait = 0;
+            next_frame += FRAME_MICROSECONDS;
+            event_loop_set_deadline(loop, next_frame);
+            frames_waited++;
+            continue;
         }
+        if (!rollback_can_advance(rb)) {
+            // too far ahead of the peer to predict its input, its packets
+            // wake us up
+            if (!stalled)
+                stalls++;
+            stalled = 1;
+            continue;
+        }
+        stalled = 0;
+
+        rollback_add_local_input(rb, p1);
+        netplay_send_inputs(np, rb);
+
+        if (rb->frame % STATS_INTERVAL == 0)
+            update_stats(np, stalls, frames_waited);
+
+        RunSummary run = rollback_advance(rb);
+        if (spectators)
+            spectator_server_update(spectators, rb);
+
+        // a late frame (e.g. after a stall) moves the next ones, they are not
+        // run back to back to catch up
+        next_frame += 1000000ull * run.cycles / sys->cpu_freq;
+        now = event_loop_now_us();
+        if (next_frame < now)
+            next_frame = now;
+        event_loop_set_deadline(loop, next_frame);
     }
 
+    netplay_disconnect(np);
+
+    printf("frames: %u, wakeups: %llu (%llu deadlines, %llu packets, %llu "
+           "sdl events)\n",
+           rb->frame, (unsigned long long)loop->wakeups,
+           (unsigned long long)loop->deadline_wakeups,
+           (unsigned long long)loop->readable_wakeups,
+           (unsigned long long)loop->notified_wakeups);
+    printf("rollbacks: %llu (%llu frames run again)\n",
+           (unsigned long long)rb->rollbacks,
+           (unsigned long long)rb->resimulated_frames);
+    printf("stalls: %llu, frames waited: %llu\n", (unsigned long long)stalls,
+           (unsigned long long)frames_waited);
+    printf("rtt: %.01lf ms (jitter %.01lf ms), p50 %.01lf ms, p99 %.01lf ms\n",
+           np->rtt_us / 1000.0, np->jitter_us / 1000.0,
+           netplay_rtt_percentile(np, 50) / 1000.0,
+           netplay_rtt_percentile(np, 99) / 1000.0);
+    printf("input delay: %u frames (%llu changes)\n", np->input_delay,
+           (unsigned long long)np->delay_changes);
+    printf("packets: %llu sent, %llu received\n",
+           (unsigned long long)np->packets_sent,
+           (unsigned long long)np->packets_received);
+    if (np->desynced)
+        printf("out of sync since frame %u (%s), %llu frames compared\n",
+               np->desync_frame, desync_components(np),
+               (unsigned long long)np->hashes_compared);
+    else
+        printf("in sync, %llu frames compared\n",
+               (unsigned long long)np->hashes_compared);
+
+    AudioSinkStats stats;
+    audio_sink_stats(audio, &stats);
+    printf("audio underruns: %llu, samples dropped: %llu\n",
+           (unsigned long long)stats.underruns,
+           (unsigned long long)stats.overruns);
+
+    if (spectators) {
+        printf("spectators: %llu joined, %llu dropped (too slow)\n",
+               (unsigned long long)spectators->joined,
+               (unsigned long long)spectators->dropped);
+        spectator_server_destroy(spectators);
+    }
+    destroy_event_loop(loop);
+    netplay_destroy(np);
+    rollback_destroy(rb);
     gamewindow_destroy(gw);
     system_destroy(sys);
-    async_destroy(ac);
+    audio_sink_destroy(audio);
     input_handler_destroy(ih);
 
     SDL_Quit();
 
 #ifdef __MINGW32__
-    closesocket(fd1);
-    if (fd2 > 0) {
-        closesocket(fd2);
-    }
-
     WSACleanup();
-#else
-    close(fd1);
-    if (fd2 > 0)
-        close(fd2);
 #endif
 
     config_unload();
@@ -0,0 +1,166 @@
+#include "../6502_cpu.h"
+#include "../memory.h"
+#include "../logging.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/time.h>
+
+// Standalone benchmark of the two CPU cores. Both of them run the same
+// synthetic workload on a flat 64K memory: they are first diffed instruction
+// by instruction, then timed over the same number of cycles.
+
+#define PROGRAM_ADDR     0x8000u
+#define DEFAULT_CYCLES   200000000ull
+#define DIFF_INSTRUCTION 1000000ull
+
+static const uint8_t program[] = {
+    // reset:
+    0xa2, 0xff,       // LDX #$FF
+    0x9a,             // TXS
+    0xa9, 0x00,       // LDA #$00
+    0x85, 0x20,       // STA $20
+    0xa9, 0x03,       // LDA #$03
+    0x85, 0x21,       // STA $21
+    // loop:
+    0xa0, 0x00,       // LDY #$00
+    // inner:
+    0xb9, 0x00, 0x02, // LDA $0200,Y
+    0x18,             // CLC
+    0x65, 0x10,       // ADC $10
+    0x99, 0x00, 0x02, // STA $0200,Y
+    0x49, 0x5a,       // EOR #$5A
+    0x0a,             // ASL A
+    0x66, 0x11,       // ROR $11
+    0x85, 0x10,       // STA $10
+    0x20, 0x38, 0x80, // JSR sub
+    0xc8,             // INY
+    0xd0, 0xea,       // BNE inner
+    0xe6, 0x12,       // INC $12
+    0xb1, 0x20,       // LDA ($20),Y
+    0x38,             // SEC
+    0xe9, 0x03,       // SBC #$03
+    0x48,             // PHA
+    0x68,             // PLA
+    0xc9, 0x80,       // CMP #$80
+    0x90, 0x04,       // BCC skip
+    0x4a,             // LSR A
+    0x9d, 0x00, 0x03, // STA $0300,X
+    // skip:
+    0xca,             // DEX
+    0x4c, 0x0b, 0x80, // JMP loop
+    // sub:
+    0x24, 0x12,       // BIT $12
+    0x2a,             // ROL A
+    0x29, 0x7f,       // AND #$7F
+    0x05, 0x13,       // ORA $13
+    0x85, 0x13,       // STA $13
+    0x60,             // RTS
+};
+
+static void usage(const char* prog)
+{
+    fprintf(stderr, "USAGE: %s [<cycles>]\n", prog);
+    exit(1);
+}
+
+static long get_timestamp_microseconds()
+{
+    struct timeval te;
+    gettimeofday(&te, NULL);
+
+    return te.tv_sec * 1000000LL + te.tv_usec;
+}
+
+static Cpu* build_cpu()
+{
+    Cpu* cpu = cpu_standalone_build();
+    for (uint32_t addr = 0; addr < 0x10000; ++addr)
+        memory_write(cpu->mem, addr, 0);
+    for (uint32_t i = 0; i < sizeof(program); ++i)
+        memory_write(cpu->mem, PROGRAM_ADDR + i, program[i]);
+    memory_write(cpu->mem, 0xFFFC, PROGRAM_ADDR & 0xFF);
+    memory_write(cpu->mem, 0xFFFD, PROGRAM_ADDR >> 8);
+
+    cpu_reset(cpu);
+    return cpu;
+}
+
+static int same_state(Cpu* a, Cpu* b)
+{
+    return a->PC == b->PC && a->SP == b->SP && a->A == b->A && a->X == b->X &&
+           a->Y == b->Y && a->flags == b->flags && a->cycles == b->cycles &&
+           a->stall == b->stall && a->interrupt == b->interrupt &&
+           a->ticks == b->ticks;
+}
+
+static int same_memory(Cpu* a, Cpu* b)
+{
+    for (uint32_t addr = 0; addr < 0x10000; ++addr)
+        if (memory_read(a->mem, addr) != memory_read(b->mem, addr))
+            return 0;
+    return 1;
+}
+
+static void diff_cores()
+{
+    Cpu* ref = build_cpu();
+    Cpu* thr = build_cpu();
+
+    for (uint64_t i = 0; i < DIFF_INSTRUCTION; ++i) {
+        uint16_t pc = ref->PC;
+        if (cpu_step(ref) != cpu_step_threaded(thr) || !same_state(ref, thr))
+            panic("the cores diverged after %llu instructions @ 0x%04x\n"
+                  "reference: %s\nthreaded:  %s",
+                  (unsigned long long)i, pc, cpu_tostring_short(ref),
+                  cpu_tostring_short(thr));
+    }
+    if (!same_memory(ref, thr))
+        panic("the cores diverged (memory)");
+
+    printf("diff: %llu instructions, no divergence\n",
+           (unsigned long long)DIFF_INSTRUCTION);
+    cpu_destroy(ref);
+    cpu_destroy(thr);
+}
+
+int main(int argc, char const* argv[])
+{
+    if (argc > 2)
+        usage(argv[0]);
+
+    uint64_t cycles = DEFAULT_CYCLES;
+    if (argc == 2 && (cycles = strtoull(argv[1], NULL, 10)) == 0)
+        usage(argv[0]);
+
+    diff_cores();
+
+    Cpu*     ref          = build_cpu();
+    uint64_t instructions = 0;
+    long     start        = get_timestamp_microseconds();
+    while (ref->ticks < cycles) {
+        cpu_step(ref);
+        instructions++;
+    }
+    long ref_time = get_timestamp_microseconds() - start;
+
+    Cpu* thr      = build_cpu();
+    thr->deadline = cycles;
+    start         = get_timestamp_microseconds();
+    cpu_run_threaded(thr);
+    long thr_time = get_timestamp_microseconds() - start;
+
+    if (!same_state(ref, thr) || !same_memory(ref, thr))
+        panic("the cores diverged");
+
+    double ref_mips = (double)instructions / ref_time;
+    double thr_mips = (double)instructions / thr_time;
+    printf("%llu instructions, %llu cycles\n", (unsigned long long)instructions,
+           (unsigned long long)ref->cycles);
+    printf("reference: %.03lf MIPS\n", ref_mips);
+    printf("threaded:  %.03lf MIPS (x%.02lf)\n", thr_mips, thr_mips / ref_mips);
+
+    cpu_destroy(ref);
+    cpu_destroy(thr);
+    return 0;
+}
@@ -0,0 +1,216 @@
+#include "../system.h"
+#include "../ppu.h"
+#include "../video_sink.h"
+#include "../audio_sink.h"
+#include "../apu.h"
+#include "../hash.h"
+#include "../alloc.h"
+#include "../logging.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+// Runs a ROM in lockstep and with the lazy, event-driven synchronization and
+// compares the two runs frame by frame: the hash of every frame, of its audio
+// samples and of the state at the end of it (see system_hash()) must be the
+// same. Lockstep steps the APU every cycle (apu_step()), the other run skips
+// the cycles in which nothing can be heard (apu_run()). It prints the hash of
+// the final state and of the whole audio, to compare runs of different
+// builds, and how much computing system_hash() every frame costs. The speed
+// is also given without the time spent hashing (the frames, the samples and
+// the state), that is the same in the two runs.
+
+#define DEFAULT_FRAMES 600
+#define FNV_OFFSET     0xcbf29ce484222325ull
+#define FNV_PRIME      0x100000001b3ull
+
+typedef struct FrameHash {
+    uint64_t   frame_hash;
+    uint64_t   audio_hash;
+    SystemHash state_hash;
+} FrameHash;
+
+typedef struct HashSink {
+    uint32_t framebuffer[FRAME_WIDTH * FRAME_HEIGHT];
+    uint64_t hash;
+    uint64_t audio_hash; // of the samples of the current frame
+    uint64_t total_audio_hash;
+    long     time; // spent hashing the frames and the samples
+} HashSink;
+
+static void usage(const char* prog)
+{
+    fprintf(stderr, "USAGE: %s <game.rom> [<frames>]\n", prog);
+    exit(1);
+}
+
+static long get_timestamp_microseconds()
+{
+    struct timeval te;
+    gettimeofday(&te, NULL);
+
+    return te.tv_sec * 1000000LL + te.tv_usec;
+}
+
+static uint64_t fnv_update(uint64_t hash, uint64_t value, int nbytes)
+{
+    for (int i = 0; i < nbytes; ++i) {
+        hash ^= (value >> (i * 8)) & 0xFF;
+        hash *= FNV_PRIME;
+    }
+    return hash;
+}
+
+static void hash_frame(void* obj, const uint32_t* framebuffer)
+{
+    HashSink* sink  = (HashSink*)obj;
+    long      start = get_timestamp_microseconds();
+
+    // byte by byte, FNV would cost more than the emulation of the frame
+    sink->hash =
+        hash64(framebuffer, FRAME_WIDTH * FRAME_HEIGHT * sizeof(uint32_t), 0);
+    sink->time += get_timestamp_microseconds() - start;
+}
+
+static void hash_samples(void* obj, const void* frames, uint32_t count)
+{
+    HashSink*    sink    = (HashSink*)obj;
+    const float* samples = (const float*)frames;
+    long         start   = get_timestamp_microseconds();
+
+    for (uint32_t i = 0; i < count; ++i) {
+        uint32_t bits;
+        memcpy(&bits, &samples[i], sizeof(bits));
+        sink->audio_hash       = fnv_update(sink->audio_hash, bits, 4);
+        sink->total_audio_hash = fnv_update(sink->total_audio_hash, bits, 4);
+    }
+    sink->time += get_timestamp_microseconds() - start;
+}
+
+static uint32_t no_samples_queued(void* obj) { return 0; }
+static void     ignore_pause(void* obj, int paused) {}
+static void     ignore_destroy(void* obj) {}
+
+// It returns the elapsed time, "hash_time" is the part spent in system_hash()
+// and "sink_time" the part spent hashing the frames and the samples
+static long run(const char* rom, SyncMode mode, uint64_t frames,
+                FrameHash* hashes, long* hash_time, long* sink_time,
+                uint64_t* audio_hash)
+{
+    HashSink* sink  = calloc_or_fail(sizeof(HashSink));
+    VideoSink video = {.obj         = sink,
+                       .framebuffer = sink->framebuffer,
+                       .frame_ready = hash_frame};
+
+    AudioSink audio = {.obj         = sink,
+                       .sample_rate = AUDIO_SAMPLE_RATE,
+                       .format      = AUDIO_SINK_MONO_F32,
+                       .queue       = hash_samples,
+                       .queued      = no_samples_queued,
+                       .pause       = ignore_pause,
+                       .destroy     = ignore_destroy};
+    sink->total_audio_hash = FNV_OFFSET;
+
+    System* sys = system_build(rom);
+    ppu_set_video_sink(sys->ppu, &video);
+    apu_set_audio_sink(sys->apu, &audio);
+    sys->sync_mode = mode;
+
+    long start = get_timestamp_microseconds();
+    for (uint64_t i = 0; i < frames; ++i) {
+        sink->audio_hash = FNV_OFFSET;
+        system_run_frame(sys);
+        hashes[i].audio_hash = sink->audio_hash;
+
+        long hash_start      = get_timestamp_microseconds();
+        hashes[i].state_hash = system_hash(sys);
+        *hash_time += get_timestamp_microseconds() - hash_start;
+        hashes[i].frame_hash = sink->hash;
+    }
+    long elapsed = get_timestamp_microseconds() - start;
+    *audio_hash  = sink->total_audio_hash;
+    *sink_time   = sink->time;
+
+    system_destroy(sys);
+    free_or_fail(sink);
+    return elapsed;
+}
+
+int main(int argc, char const* argv[])
+{
+    if (argc < 2 || argc > 3)
+        usage(argv[0]);
+
+    uint64_t frames = DEFAULT_FRAMES;
+    if (argc == 3 && (frames = strtoull(argv[2], NULL, 10)) == 0)
+        usage(argv[0]);
+
+    FrameHash* lockstep = calloc_or_fail(frames * sizeof(FrameHash));
+    FrameHash* events   = calloc_or_fail(frames * sizeof(FrameHash));
+
+    long     lockstep_hash_time = 0, events_hash_time = 0;
+    long     lockstep_sink_time, events_sink_time;
+    uint64_t lockstep_audio, events_audio;
+    long     lockstep_time =
+        run(argv[1], SYNC_LOCKSTEP, frames, lockstep, &lockstep_hash_time,
+            &lockstep_sink_time, &lockstep_audio);
+    long events_time = run(argv[1], SYNC_EVENTS, frames, events,
+                           &events_hash_time, &events_sink_time, &events_audio);
+
+    int ret = 0;
+    for (uint64_t i = 0; i < frames && ret == 0; ++i) {
+        if (lockstep[i].frame_hash != events[i].frame_hash) {
+            printf("frame %llu differs: frame %016llx vs %016llx\n",
+                   (unsigned long long)i,
+                   (unsigned long long)lockstep[i].frame_hash,
+                   (unsigned long long)events[i].frame_hash);
+            ret = 1;
+        }
+        if (lockstep[i].audio_hash != events[i].audio_hash) {
+            printf("frame %llu differs: audio %016llx vs %016llx\n",
+                   (unsigned long long)i,
+                   (unsigned long long)lockstep[i].audio_hash,
+                   (unsigned long long)events[i].audio_hash);
+            ret = 1;
+        }
+        for (int c = 0; c < HASH_COMPONENTS; ++c) {
+            uint64_t expected = lockstep[i].state_hash.components[c];
+            uint64_t actual   = events[i].state_hash.components[c];
+            if (expected != actual) {
+                printf("frame %llu differs: %s %016llx vs %016llx\n",
+                       (unsigned long long)i, system_hash_component_name(c),
+                       (unsigned long long)expected,
+                       (unsigned long long)actual);
+                ret = 1;
+            }
+        }
+    }
+    if (ret == 0)
+        printf("%llu frames, no divergence, final state %016llx, audio "
+               "%016llx\n",
+               (unsigned long long)frames,
+               (unsigned long long)events[frames - 1].state_hash.total,
+               (unsigned long long)events_audio);
+
+    // without the hashes
+    long lockstep_emu = lockstep_time - lockstep_hash_time - lockstep_sink_time;
+    long events_emu   = events_time - events_hash_time - events_sink_time;
+
+    printf("lockstep: %.01lf fps, %.01lf fps without the hashes\n",
+           frames * 1000000.0 / lockstep_time,
+           frames * 1000000.0 / lockstep_emu);
+    printf("events:   %.01lf fps (x%.02lf), %.01lf fps without the hashes "
+           "(x%.02lf)\n",
+           frames * 1000000.0 / events_time,
+           (double)lockstep_time / events_time,
+           frames * 1000000.0 / events_emu, (double)lockstep_emu / events_emu);
+    printf("system_hash(): %.02lf us per frame, %.02lf%% of the events run\n",
+           (double)events_hash_time / frames,
+           events_hash_time * 100.0 / events_time);
+
+    free_or_fail(lockstep);
+    free_or_fail(events);
+    return ret;
+}
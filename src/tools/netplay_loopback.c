@@ -0,0 +1,351 @@
+#include "../system.h"
+#include "../rollback.h"
+#include "../netplay.h"
+#include "../spectator.h"
+#include "../logging.h"
+#include "../alloc.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#ifdef __MINGW32__
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#else
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#endif
+
+// Runs two netplay peers in the same process, over UDP on the loopback
+// interface, with the given latency, jitter and packet loss. The latency can
+// change halfway, to see the input delay adapt. Both peers run in real time
+// (60 fps) with a scripted input, at the end their states must be the same as
+// the ones of a local run with the inputs each frame has actually used. A
+// spectator of the first peer joins after a quarter of the frames, it must
+// end up in the same state too.
+
+#define DEFAULT_FRAMES 600
+#define FRAME_US       16639
+// a peer that is ahead waits one frame at most once every TIME_SYNC_INTERVAL
+// frames (see borznes_multi)
+#define TIME_SYNC_INTERVAL 60
+#define IDLE_US            500
+
+typedef struct Peer {
+    System*   sys;
+    Rollback* rb;
+    NetPeer*  np;
+    uint64_t  next_frame_us;
+    uint32_t  frames_since_wait;
+    uint64_t  stalls; // frames that could not be run on time
+    uint64_t  waits;  // frames skipped by the time synchronization
+    uint8_t   stalled;
+
+    ControllerState* inputs; // the local input of every frame
+
+    SpectatorServer* spectators; // only on the first peer
+} Peer;
+
+typedef struct Viewer {
+    System*          sys;
+    SpectatorClient* client;
+    uint32_t         first_frame;
+} Viewer;
+
+static void usage(const char* prog)
+{
+    fprintf(stderr,
+            "USAGE: %s <game.rom> [<frames> [<latency_ms> [<jitter_ms> "
+            "[<loss_%%> [<latency2_ms>]]]]]\n"
+            "   the latency is one way, it is applied in both directions. It "
+            "becomes\n"
+            "   latency2 after half of the frames\n",
+            prog);
+    exit(1);
+}
+
+static uint64_t now_us()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000ull + ts.tv_nsec / 1000;
+}
+
+static void sleep_us(uint64_t us)
+{
+    struct timespec ts = {.tv_sec  = us / 1000000,
+                          .tv_nsec = us % 1000000 * 1000};
+    nanosleep(&ts, NULL);
+}
+
+// Scripted input: a new combination of buttons every few frames, like a
+// player would
+static ControllerState scripted_input(ControllerNum player, uint32_t frame)
+{
+    uint32_t x = (frame / 8) * 2654435761u ^ (player == P1 ? 0 : 0x9E3779B9u);
+    x ^= x >> 13;
+    x *= 0x5BD1E995u;
+    x ^= x >> 15;
+
+    ControllerState state;
+    state.state = (uint8_t)x;
+    return state;
+}
+
+static void open_sockets(int* fd1, int* fd2)
+{
+    struct sockaddr_in addr[2];
+    int                fds[2];
+
+    for (int i = 0; i < 2; ++i) {
+        fds[i] = socket(AF_INET, SOCK_DGRAM, 0);
+        if (fds[i] < 0)
+            panic("cannot create the socket");
+
+        memset(&addr[i], 0, sizeof(addr[i]));
+        addr[i].sin_family      = AF_INET;
+        addr[i].sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        addr[i].sin_port        = 0;
+        socklen_t len           = sizeof(addr[i]);
+        if (bind(fds[i], (struct sockaddr*)&addr[i], sizeof(addr[i])) < 0 ||
+            getsockname(fds[i], (struct sockaddr*)&addr[i], &len) < 0)
+            panic("cannot bind the socket");
+    }
+    for (int i = 0; i < 2; ++i)
+        if (connect(fds[i], (struct sockaddr*)&addr[!i], sizeof(addr[!i])) < 0)
+            panic("cannot connect the socket");
+
+    *fd1 = fds[0];
+    *fd2 = fds[1];
+}
+
+// A peer is done when the state at the start of "frames" is final: every
+// input before it is known and there is nothing left to roll back
+static int is_done(Peer* p, uint32_t frames)
+{
+    Rollback* rb = p->rb;
+    return rb->frame > frames && rb->confirmed >= frames &&
+           !rb->rollback_pending;
+}
+
+static void run_peer(Peer* p, ControllerNum player, uint32_t frames)
+{
+    Rollback* rb = p->rb;
+    if (!netplay_poll(p->np, rb))
+        panic("peer %d: the other peer has disconnected", player + 1);
+    if (p->spectators)
+        spectator_server_update(p->spectators, rb);
+
+    // it keeps running after "frames", until the state is final
+    uint64_t now = now_us();
+    if (is_done(p, frames) || now < p->next_frame_us)
+        return;
+
+    if (++p->frames_since_wait >= TIME_SYNC_INTERVAL &&
+        rollback_frames_ahead(rb) > 0) {
+        p->frames_since_wait = 0;
+        p->next_frame_us += FRAME_US;
+        p->waits++;
+        return;
+    }
+    if (!rollback_can_advance(rb)) {
+        if (!p->stalled)
+            p->stalls++;
+        p->stalled = 1;
+        return;
+    }
+    p->stalled = 0;
+
+    // after a change of the input delay the input can be used for two frames,
+    // or for none
+    ControllerState input = scripted_input(player, rb->local_frame);
+    for (uint32_t f = rb->local_frame; f <= rb->frame + rb->input_delay; ++f)
+        if (f < frames)
+            p->inputs[f] = input;
+    rollback_add_local_input(rb, input);
+    netplay_send_inputs(p->np, rb);
+    rollback_advance(rb);
+
+    p->next_frame_us += FRAME_US;
+}
+
+// The spectator runs the frames as soon as it receives them
+static void run_viewer(Viewer* v, uint32_t frames)
+{
+    if (!spectator_client_poll(v->client))
+        panic("spectator: the host has closed the connection");
+    if (!spectator_client_load_state(v->client, v->sys))
+        return;
+    if (v->first_frame == UINT32_MAX)
+        v->first_frame = v->client->frame;
+
+    ControllerState p1, p2;
+    while (v->client->frame < frames &&
+           spectator_client_next_inputs(v->client, &p1, &p2)) {
+        system_update_controller(v->sys, P1, p1);
+        system_update_controller(v->sys, P2, p2);
+        system_run_frame(v->sys);
+    }
+}
+
+static int viewer_done(Viewer* v, uint32_t frames)
+{
+    return v->client && v->client->has_state && v->client->frame >= frames;
+}
+
+// The reference: the same inputs, without the network
+static void run_local(System* sys, uint32_t frames, Peer* peers)
+{
+    for (uint32_t f = 0; f < frames; ++f) {
+        system_update_controller(sys, P1, peers[0].inputs[f]);
+        system_update_controller(sys, P2, peers[1].inputs[f]);
+        system_run_frame(sys);
+    }
+}
+
+static int same_state(System* a, System* b)
+{
+    return system_hash(a).total == system_hash(b).total;
+}
+
+int main(int argc, char const* argv[])
+{
+    if (argc < 2 || argc > 7)
+        usage(argv[0]);
+
+    uint32_t      frames     = DEFAULT_FRAMES;
+    NetImpairment impairment = {0};
+    if (argc > 2 && (frames = strtoul(argv[2], NULL, 10)) == 0)
+        usage(argv[0]);
+    if (argc > 3)
+        impairment.latency_us = strtoul(argv[3], NULL, 10) * 1000;
+    if (argc > 4)
+        impairment.jitter_us = strtoul(argv[4], NULL, 10) * 1000;
+    if (argc > 5)
+        impairment.loss = strtod(argv[5], NULL) / 100.0;
+    NetImpairment second_half = impairment;
+    if (argc > 6)
+        second_half.latency_us = strtoul(argv[6], NULL, 10) * 1000;
+
+#ifdef __MINGW32__
+    WSADATA wsaData;
+    WSAStartup(MAKEWORD(2, 2), &wsaData);
+#endif
+
+    uint64_t rtt         = 2ull * impairment.latency_us + impairment.jitter_us;
+    uint32_t input_delay = netplay_input_delay(rtt);
+
+    int fd1, fd2;
+    open_sockets(&fd1, &fd2);
+
+    Peer peers[2];
+    int  fds[2] = {fd1, fd2};
+    for (int i = 0; i < 2; ++i) {
+        Peer* p = &peers[i];
+        memset(p, 0, sizeof(Peer));
+        p->sys = system_build(argv[1]);
+        p->rb  = rollback_build(p->sys, i == 0 ? P1 : P2, input_delay,
+                                NETPLAY_ROLLBACK_FRAMES);
+        p->np  = netplay_build(fds[i], input_delay, i == 0);
+        // no input in the first frames
+        p->inputs = calloc_or_fail(frames * sizeof(ControllerState));
+        netplay_set_impairment(p->np, impairment);
+    }
+
+    peers[0].spectators = spectator_server_build(peers[0].sys, 0);
+    Viewer viewer       = {.sys = system_build(argv[1]),
+                           .first_frame = UINT32_MAX};
+
+    uint64_t start         = now_us();
+    peers[0].next_frame_us = start;
+    peers[1].next_frame_us = start;
+    while (!is_done(&peers[0], frames) || !is_done(&peers[1], frames) ||
+           !viewer_done(&viewer, frames)) {
+        if (peers[0].rb->frame == frames / 2)
+            for (int i = 0; i < 2; ++i)
+                netplay_set_impairment(peers[i].np, second_half);
+        if (!viewer.client && peers[0].rb->frame >= frames / 4)
+            viewer.client =
+                spectator_connect("127.0.0.1", peers[0].spectators->port);
+
+        run_peer(&peers[0], P1, frames);
+        run_peer(&peers[1], P2, frames);
+        if (viewer.client)
+            run_viewer(&viewer, frames);
+        sleep_us(IDLE_US);
+    }
+    double elapsed = (now_us() - start) / 1000000.0;
+
+    printf("%u frames, latency %u ms (then %u ms), jitter %u ms, loss "
+           "%.01lf%%, input delay %u\n",
+           frames, impairment.latency_us / 1000, second_half.latency_us / 1000,
+           impairment.jitter_us / 1000, impairment.loss * 100.0, input_delay);
+    printf("elapsed %.02lf s (%.02lf s at 60 fps)\n", elapsed,
+           frames * FRAME_US / 1000000.0);
+
+    System* local = system_build(argv[1]);
+    run_local(local, frames, peers);
+
+    int ret = 0;
+    for (int i = 0; i < 2; ++i) {
+        Peer*     p  = &peers[i];
+        Rollback* rb = p->rb;
+        NetPeer*  np = p->np;
+
+        // the state at the start of "frames"
+        system_load_state_mem(p->sys, rb->states[frames % rb->max_frames],
+                              rb->state_size);
+        int same = same_state(p->sys, local);
+        if (!same || np->desynced)
+            ret = 1;
+
+        printf("peer %d: %s, rollbacks %llu (%llu frames), stalls %llu, "
+               "waits %llu, packets sent %llu, received %llu, dropped %llu\n",
+               i + 1, same ? "same state" : "DIFFERENT STATE",
+               (unsigned long long)rb->rollbacks,
+               (unsigned long long)rb->resimulated_frames,
+               (unsigned long long)p->stalls, (unsigned long long)p->waits,
+               (unsigned long long)np->packets_sent,
+               (unsigned long long)np->packets_received,
+               (unsigned long long)np->packets_dropped);
+        printf("        rtt %.01lf ms (jitter %.01lf ms), p50 %.01lf ms, p99 "
+               "%.01lf ms, input delay %u (%llu changes)\n",
+               np->rtt_us / 1000.0, np->jitter_us / 1000.0,
+               netplay_rtt_percentile(np, 50) / 1000.0,
+               netplay_rtt_percentile(np, 99) / 1000.0, np->input_delay,
+               (unsigned long long)np->delay_changes);
+        printf("        %llu state transfers, %llu state hashes compared, ",
+               (unsigned long long)np->resyncs,
+               (unsigned long long)np->hashes_compared);
+        if (!np->desynced)
+            printf("in sync\n");
+        else {
+            printf("DESYNC at frame %u:", np->desync_frame);
+            for (int c = 0; c < HASH_COMPONENTS; ++c)
+                if (np->desync_components & (1u << c))
+                    printf(" %s", system_hash_component_name(c));
+            printf("\n");
+        }
+    }
+
+    int same = same_state(viewer.sys, local);
+    if (!same)
+        ret = 1;
+    printf("spectator: %s, joined at frame %u\n",
+           same ? "same state" : "DIFFERENT STATE", viewer.first_frame);
+
+    spectator_client_destroy(viewer.client);
+    system_destroy(viewer.sys);
+    spectator_server_destroy(peers[0].spectators);
+    for (int i = 0; i < 2; ++i) {
+        netplay_disconnect(peers[i].np);
+        netplay_destroy(peers[i].np);
+        rollback_destroy(peers[i].rb);
+        system_destroy(peers[i].sys);
+        free_or_fail(peers[i].inputs);
+    }
+    system_destroy(local);
+    return ret;
+}
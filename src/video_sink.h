@@ -0,0 +1,31 @@
+#ifndef VIDEO_SINK_H
+#define VIDEO_SINK_H
+
+#include <stdint.h>
+
+#define FRAME_WIDTH  256
+#define FRAME_HEIGHT 240
+
+// The pixels are 32 bit ARGB words (SDL_PIXELFORMAT_ARGB8888, the texture
+// format the renderers of SDL support natively, they are uploaded as they are)
+#define PACK_RGBA(r, g, b, a)                                                  \
+    (((uint32_t)a << 24) | ((uint32_t)r << 16) | ((uint32_t)g << 8) | b)
+#define PACK_RGB(r, g, b)                                                      \
+    (0xFF000000u | ((uint32_t)r << 16) | ((uint32_t)g << 8) | b)
+#define COLOR_R(c) (((c) >> 16) & 0xFF)
+#define COLOR_G(c) (((c) >> 8) & 0xFF)
+#define COLOR_B(c) ((c)&0xFF)
+
+// Where the PPU renders its frames. The emulator core does not display them,
+// a frontend provides the sink
+typedef struct VideoSink {
+    void* obj;
+    // FRAME_WIDTH * FRAME_HEIGHT ARGB pixels, owned by the sink. The PPU
+    // converts the frame in it (see Ppu::framebuffer) once it is complete
+    uint32_t* framebuffer;
+    // called at the start of the vertical blank, once the frame is complete.
+    // It can be NULL
+    void (*frame_ready)(void* obj, const uint32_t* framebuffer);
+} VideoSink;
+
+#endif